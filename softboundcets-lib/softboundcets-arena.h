@@ -0,0 +1,135 @@
+//=== softboundcets-arena.h - registering arena memory with SoftBound+CETS--*- C -*===//
+// Copyright (c) 2014 Santosh Nagarakatte, Milo M. K. Martin. All rights reserved.
+
+// Developed by: Santosh Nagarakatte, Milo M.K. Martin,
+//               Jianzhou Zhao, Steve Zdancewic
+//               Department of Computer and Information Sciences,
+//               University of Pennsylvania
+//               http://www.cis.upenn.edu/acg/softbound/
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal with the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+//   1. Redistributions of source code must retain the above copyright notice,
+//      this list of conditions and the following disclaimers.
+
+//   2. Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimers in the
+//      documentation and/or other materials provided with the distribution.
+
+//   3. Neither the names of Santosh Nagarakatte, Milo M. K. Martin,
+//      Jianzhou Zhao, Steve Zdancewic, University of Pennsylvania, nor
+//      the names of its contributors may be used to endorse or promote
+//      products derived from this Software without specific prior
+//      written permission.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// WITH THE SOFTWARE.
+//===---------------------------------------------------------------------===//
+
+/* Interface for arena and pool allocators in programs compiled with
+   -fsoftboundcets. An arena takes one lock location and key from the
+   runtime. The objects it hands out carry the arena's key and lock and
+   bounds that cover only the object, so that an access through one of
+   them is checked against that object and fails once the arena is
+   reset or destroyed. Resetting writes a new key to the lock, whatever
+   the number of objects.
+
+     softboundcets_arena_t arena;
+     softboundcets_arena_init(&arena);
+     char* chunk = malloc(CHUNK_SIZE);
+     struct node* n = softboundcets_arena_stamp(&arena, chunk, sizeof(*n));
+     ...
+     softboundcets_arena_reset(&arena);     n is no longer valid
+     ...
+     softboundcets_arena_destroy(&arena);
+     free(chunk);
+
+   The memory itself remains the program's to manage. The pointer
+   passed to softboundcets_arena_stamp and the block passed to
+   softboundcets_arena_stamp_objects must lie within the bounds of the
+   pointer they are derived from, e.g. the chunk of the arena, so that
+   stamping never widens bounds.
+
+   Without -fsoftboundcets (__SOFTBOUNDCETS__ undefined) these compile
+   to inline functions that do nothing, and the program does not need
+   the runtime. */
+
+#ifndef __SOFTBOUNDCETS_ARENA_H__
+#define __SOFTBOUNDCETS_ARENA_H__
+
+#include <stddef.h>
+
+typedef struct softboundcets_arena {
+  void* lock;
+  size_t key;
+} softboundcets_arena_t;
+
+/* The runtime, which includes softboundcets.h first, defines these */
+#if defined(__SOFTBOUNDCETS__) || defined(__SOFTBOUNDCETS_H__)
+
+/* Takes a lock location and a key for the arena */
+void softboundcets_arena_init(softboundcets_arena_t* arena);
+
+/* Returns ptr with the bounds [ptr, ptr + size) and the key and lock
+   of the arena */
+void* softboundcets_arena_stamp(softboundcets_arena_t* arena, void* ptr,
+                                size_t size);
+
+/* Registers the n_objects objects of object_size bytes that start at
+   block: objects[i] is set to the i-th object, with its own bounds and
+   the key and lock of the arena, as softboundcets_arena_stamp would
+   return it. For pool allocators that carve a chunk into equal
+   objects at once */
+void softboundcets_arena_stamp_objects(softboundcets_arena_t* arena,
+                                       void* block, size_t object_size,
+                                       size_t n_objects, void** objects);
+
+/* Invalidates every pointer stamped so far with a single write to the
+   lock of the arena. Objects stamped later are valid */
+void softboundcets_arena_reset(softboundcets_arena_t* arena);
+
+/* Invalidates every pointer stamped with the arena and returns its
+   lock location to the runtime */
+void softboundcets_arena_destroy(softboundcets_arena_t* arena);
+
+#else
+
+static inline void softboundcets_arena_init(softboundcets_arena_t* arena){
+  arena->lock = NULL;
+  arena->key = 0;
+}
+
+static inline void* softboundcets_arena_stamp(softboundcets_arena_t* arena,
+                                              void* ptr, size_t size){
+  return ptr;
+}
+
+static inline void
+softboundcets_arena_stamp_objects(softboundcets_arena_t* arena,
+                                  void* block, size_t object_size,
+                                  size_t n_objects, void** objects){
+  size_t i;
+  for(i = 0; i < n_objects; i++){
+    objects[i] = (char*) block + i * object_size;
+  }
+}
+
+static inline void softboundcets_arena_reset(softboundcets_arena_t* arena){
+}
+
+static inline void softboundcets_arena_destroy(softboundcets_arena_t* arena){
+}
+
+#endif
+
+#endif
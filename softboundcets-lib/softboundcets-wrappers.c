@@ -75,6 +75,7 @@
 #include <pwd.h>
 #include <syslog.h>
 #include <setjmp.h>
+#include <pthread.h>
 #include <string.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -98,11 +99,16 @@
 #include <fcntl.h>
 #include <wctype.h>
 
+#if defined(__linux__)
+#include <malloc.h>
+#endif
+
 
 typedef size_t key_type;
 typedef void* lock_type;
 
 #include "softboundcets.h"
+#include "softboundcets-arena.h"
 
 typedef void(*sighandler_t)(int);
 typedef void(*void_func_ptr)(void);
@@ -1251,28 +1257,152 @@ __WEAK_INLINE char* softboundcets_rindex(char* s, int c){
   return ret_ptr;
 }
 
+/* Stores the metadata of the line buffer at *lineptr */
+__WEAK_INLINE void 
+__softboundcets_getdelim_metadata_store(char** lineptr, size_t size, 
+                                        size_t key, void* lock){
+
+#ifdef __SOFTBOUNDCETS_SPATIAL
+  __softboundcets_metadata_store(lineptr, *lineptr, *lineptr + size);
+#elif __SOFTBOUNDCETS_TEMPORAL
+  __softboundcets_metadata_store(lineptr, key, lock);
+#else
+  __softboundcets_metadata_store(lineptr, *lineptr, *lineptr + size, 
+                                 key, lock);
+#endif
+}
+
+#ifdef __SOFTBOUNDCETS_ALLOCATOR
+
+/* glibc getdelim grows *lineptr with its own realloc, which cannot
+   take an object of the allocator, so the line is read here and the
+   buffer grown with the allocator */
 __WEAK_INLINE ssize_t 
-softboundcets___getdelim(char **lineptr, size_t *n, int delim, FILE *stream){
-  
-  int metadata_prop = 1;
-  if(*lineptr == NULL){
-    metadata_prop = 0;
+__softboundcets_heap_getdelim(char** lineptr, size_t* n, int delim, 
+                              FILE* stream){
+
+  char* line = *lineptr;
+  size_t size = 0;
+  size_t length = 0;
+  void* base = NULL;
+  void* bound = NULL;
+  size_t key = 1;
+  void* lock = NULL;
+  ssize_t ret_val = 0;
+  int c;
+
+  if(line != NULL){
+    __softboundcets_metadata_load(lineptr, &base, &bound, &key, &lock);
+    /* only the part of the buffer within its bounds is written */
+    size = *n;
+    if((char*) bound < line + size)
+      size = (char*) bound > line ? (size_t)((char*) bound - line) : 0;
   }
 
-  ssize_t ret_val = getdelim(lineptr, n, delim, stream);
-  
-  if(metadata_prop){
-    __softboundcets_read_shadow_stack_metadata_store(lineptr, 1);
+  flockfile(stream);
+  for(;;){
+    if(length + 2 > size){
+      size_t new_size = size < 120 ? 120 : size * 2;
+      void* new_lock = NULL;
+      size_t new_key = 1;
+      char* new_line = __softboundcets_heap_allocate(new_size, &new_lock, &new_key);
+
+      if(new_line == NULL){
+        errno = ENOMEM;
+        ret_val = -1;
+        break;
+      }
+      if(line != NULL){
+        memcpy(new_line, line, length);
+        __softboundcets_heap_free(line, lock, key);
+      }
+      line = new_line;
+      size = new_size;
+      lock = new_lock;
+      key = new_key;
+    }
+
+    c = getc_unlocked(stream);
+    if(c == EOF)
+      break;
+    line[length++] = (char) c;
+    if(c == delim)
+      break;
   }
-  else{
-    __softboundcets_store_return_metadata(*lineptr, 
-                                          (*lineptr) + strlen(*lineptr),
-                                          1, __softboundcets_global_lock);
+  funlockfile(stream);
+
+  if(size > length)
+    line[length] = '\0';
+
+  *lineptr = line;
+  *n = size;
+  if(line != NULL)
+    __softboundcets_getdelim_metadata_store(lineptr, size, key, lock);
+
+  if(ret_val == 0)
+    ret_val = length != 0 ? (ssize_t) length : -1;
+  return ret_val;
+}
+
+#endif
+
+/* getdelim reallocates *lineptr with malloc and realloc. A buffer that
+   moved gets the metadata of a new object, as with strdup, and the
+   lock of the buffer it replaced is released */
+__WEAK_INLINE ssize_t 
+softboundcets_getdelim(char **lineptr, size_t *n, int delim, FILE *stream){
+
+  char* old_line = *lineptr;
+
+#ifdef __SOFTBOUNDCETS_ALLOCATOR
+  if(old_line == NULL || __softboundcets_heap_contains(old_line))
+    return __softboundcets_heap_getdelim(lineptr, n, delim, stream);
+#endif
+
+  size_t key = 1;
+  void* lock = __softboundcets_global_lock;
+
+#ifndef __SOFTBOUNDCETS_SPATIAL
+  if(old_line != NULL){
+#ifdef __SOFTBOUNDCETS_TEMPORAL
+    __softboundcets_metadata_load(lineptr, &key, &lock);
+#else
+    void* base;
+    void* bound;
+    __softboundcets_metadata_load(lineptr, &base, &bound, &key, &lock);
+#endif
   }
-  
+#endif
+
+  ssize_t ret_val = getdelim(lineptr, n, delim, stream);
+
+  if(*lineptr == NULL)
+    return ret_val;
+
+  if(*lineptr != old_line){
+#ifndef __SOFTBOUNDCETS_SPATIAL
+    if(old_line != NULL){
+      __softboundcets_check_remove_from_free_map(lock, key, old_line);
+      __softboundcets_memory_deallocation(lock, key);
+    }
+    __softboundcets_memory_allocation(*lineptr, &lock, &key);
+#endif
+  }
+
+  __softboundcets_getdelim_metadata_store(lineptr, *n, key, lock);
   return ret_val;
-  
+}
+
+__WEAK_INLINE ssize_t 
+softboundcets___getdelim(char **lineptr, size_t *n, int delim, FILE *stream){
+
+  return softboundcets_getdelim(lineptr, n, delim, stream);
+}
 
+__WEAK_INLINE ssize_t 
+softboundcets_getline(char **lineptr, size_t *n, FILE *stream){
+
+  return softboundcets_getdelim(lineptr, n, '\n', stream);
 }
 
 __WEAK_INLINE unsigned long int 
@@ -1577,6 +1707,106 @@ __WEAK_INLINE long softboundcets_atol(const char* nptr){
   return atol(nptr);
 }
 
+#ifdef __SOFTBOUNDCETS_ALLOCATOR
+
+/* A new object gets a new key and lock. Objects of other allocators
+   are reallocated with realloc */
+__WEAK_INLINE void* softboundcets_realloc(void* ptr, size_t size){
+
+  if(ptr != NULL && !__softboundcets_heap_contains(ptr)){
+    void* ret_ptr = realloc(ptr, size);
+    size_t ptr_key = __softboundcets_load_key_shadow_stack(1);
+    void* ptr_lock = __softboundcets_load_lock_shadow_stack(1);
+
+    __softboundcets_store_return_metadata(ret_ptr, (char*)(ret_ptr) + size, 
+                                          ptr_key, ptr_lock);
+    if(ret_ptr != ptr){
+      __softboundcets_check_remove_from_free_map(ptr_lock, ptr_key, ptr);
+      __softboundcets_add_to_free_map(ptr_lock, ret_ptr);
+      __softboundcets_copy_metadata(ret_ptr, ptr, size);
+    }
+    return ret_ptr;
+  }
+
+  size_t ptr_key = 1;
+  void* ptr_lock = NULL;
+  size_t usable_size = 0;
+
+  if(ptr != NULL){
+    ptr_key = __softboundcets_load_key_shadow_stack(1);
+    ptr_lock = __softboundcets_load_lock_shadow_stack(1);
+    usable_size = __softboundcets_heap_usable_size(ptr);
+
+    if(size <= usable_size){
+      __softboundcets_store_return_metadata(ptr, (char*)(ptr) + size, 
+                                            ptr_key, ptr_lock);
+      return ptr;
+    }
+  }
+
+  key_type ret_key = 1;
+  lock_type ret_lock = NULL;
+  void* ret_ptr = __softboundcets_heap_allocate(size, &ret_lock, &ret_key);
+  if(ret_ptr == NULL){
+    __softboundcets_store_null_return_metadata();
+    return NULL;
+  }
+
+  if(ptr != NULL){
+    memcpy(ret_ptr, ptr, usable_size);
+    __softboundcets_copy_metadata(ret_ptr, ptr, usable_size);
+    __softboundcets_heap_free(ptr, ptr_lock, ptr_key);
+  }
+
+  __softboundcets_store_return_metadata(ret_ptr, (char*)(ret_ptr) + size, 
+                                        ret_key, ret_lock);
+  return ret_ptr;
+}
+
+__WEAK_INLINE void* softboundcets_calloc(size_t nmemb, size_t size) {
+
+  key_type ptr_key = 1;
+  lock_type ptr_lock = NULL;
+
+  size_t length = nmemb * size;
+  if(size != 0 && length / size != nmemb){
+    __softboundcets_store_null_return_metadata();
+    return NULL;
+  }
+
+  void* ret_ptr = __softboundcets_heap_allocate(length, &ptr_lock, &ptr_key);
+  if(ret_ptr == NULL){
+    __softboundcets_store_null_return_metadata();
+    return NULL;
+  }
+
+  /* the pages of large objects are released when they are freed */
+  if(length < __SOFTBOUNDCETS_TRIE_RECLAIM_THRESHOLD)
+    memset(ret_ptr, 0, length);
+
+  __softboundcets_store_return_metadata(ret_ptr, (char*)(ret_ptr) + length, 
+                                        ptr_key, ptr_lock);
+  return ret_ptr;
+}
+
+__WEAK_INLINE void* softboundcets_malloc(size_t size) {
+
+  key_type ptr_key = 1;
+  lock_type ptr_lock = NULL;
+
+  char* ret_ptr = __softboundcets_heap_allocate(size, &ptr_lock, &ptr_key);
+  if(ret_ptr == NULL){
+    __softboundcets_store_null_return_metadata();
+    return NULL;
+  }
+
+  __softboundcets_store_return_metadata(ret_ptr, ret_ptr + size, 
+                                        ptr_key, ptr_lock);
+  return ret_ptr;
+}
+
+#else
+
 __WEAK_INLINE void* softboundcets_realloc(void* ptr, size_t size){
   
 #if 0
@@ -1603,8 +1833,8 @@ __WEAK_INLINE void* softboundcets_realloc(void* ptr, size_t size){
                                          (char*)(ret_ptr) + size, 
                                          ptr_key, ptr_lock);
    if(ret_ptr != ptr){
-     __softboundcets_check_remove_from_free_map(ptr_key, ptr);
-     __softboundcets_add_to_free_map(ptr_key, ret_ptr);
+     __softboundcets_check_remove_from_free_map(ptr_lock, ptr_key, ptr);
+     __softboundcets_add_to_free_map(ptr_lock, ret_ptr);
      __softboundcets_copy_metadata(ret_ptr, ptr, size);
    }
    
@@ -1634,7 +1864,7 @@ __WEAK_INLINE void* softboundcets_realloc(void* ptr, size_t size){
        __softboundcets_printf("calloc ptr=%p, ptr_key=%zx\n", 
                               ret_ptr, ptr_key);
 #endif
-       //       __softboundcets_add_to_free_map(ptr_key, ret_ptr);
+       //       __softboundcets_add_to_free_map(ptr_lock, ret_ptr);
      }
    }
    else{
@@ -1643,6 +1873,8 @@ __WEAK_INLINE void* softboundcets_realloc(void* ptr, size_t size){
    return ret_ptr;
  }
 
+#endif
+
 __WEAK_INLINE void* softboundcets_mmap(void* addr, size_t length, 
                                        int prot, int flags, int fd, 
                                        off_t offset){
@@ -1663,6 +1895,8 @@ __WEAK_INLINE void* softboundcets_mmap(void* addr, size_t length,
   return ret_ptr;
 }
  
+#ifndef __SOFTBOUNDCETS_ALLOCATOR
+
 __WEAK_INLINE void* softboundcets_malloc(size_t size) {
   
   key_type ptr_key=1;
@@ -1689,12 +1923,14 @@ __WEAK_INLINE void* softboundcets_malloc(size_t size) {
        __softboundcets_printf("malloc ptr=%p, ptr_key=%zx\n", 
                               ret_ptr, ptr_key);
 #endif
-       //      __softboundcets_add_to_free_map(ptr_key, ret_ptr);
+       //      __softboundcets_add_to_free_map(ptr_lock, ret_ptr);
     }
   }
   return ret_ptr;
 }
 
+#endif
+
 
 __WEAK_INLINE int softboundcets_putchar(int c) {
 
@@ -1744,19 +1980,28 @@ __WEAK_INLINE double softboundcets_drand48(){
 
 __WEAK_INLINE void softboundcets_free(void* ptr){
   /* more checks required to check if it is a malloced address */
+#ifdef __SOFTBOUNDCETS_ALLOCATOR
+  if(__softboundcets_heap_contains(ptr)){
+    void* ptr_lock = __softboundcets_load_lock_shadow_stack(1);
+    size_t ptr_key = __softboundcets_load_key_shadow_stack(1);
+    __softboundcets_heap_free(ptr, ptr_lock, ptr_key);
+    return;
+  }
+#endif
+
 #ifdef __SOFTBOUNDCETS_TEMPORAL 
   if(ptr != NULL){
     void* ptr_lock = __softboundcets_load_lock_shadow_stack(1);
     size_t ptr_key = __softboundcets_load_key_shadow_stack(1);
     
-    __softboundcets_memory_deallocation(ptr_lock, ptr_key);
-    
     if(__SOFTBOUNDCETS_FREE_MAP){
 #if 0
       __softboundcets_printf("free =%p, ptr_key=%zx\n", ptr, ptr_key);
 #endif
-      __softboundcets_check_remove_from_free_map(ptr_key, ptr);
+      __softboundcets_check_remove_from_free_map(ptr_lock, ptr_key, ptr);
     }
+
+    __softboundcets_memory_deallocation(ptr_lock, ptr_key);
   }  
 #endif  
 
@@ -1764,19 +2009,150 @@ __WEAK_INLINE void softboundcets_free(void* ptr){
   if(ptr != NULL){
     void* ptr_lock = __softboundcets_load_lock_shadow_stack(1);
     size_t ptr_key = __softboundcets_load_key_shadow_stack(1);
-    __softboundcets_memory_deallocation(ptr_lock, ptr_key);
      
     if(__SOFTBOUNDCETS_FREE_MAP){
 #if 0
       __softboundcets_printf("free =%p, ptr_key=%zx\n", ptr, ptr_key);
 #endif
-      __softboundcets_check_remove_from_free_map(ptr_key, ptr);
+      __softboundcets_check_remove_from_free_map(ptr_lock, ptr_key, ptr);
     }
+
+    __softboundcets_memory_deallocation(ptr_lock, ptr_key);
+  }
+#endif
+
+#if defined(__linux__)
+  if(ptr != NULL){
+    __softboundcets_trie_reclaim(ptr, malloc_usable_size(ptr));
   }
 #endif
    free(ptr);
 }
 
+/* Arena registration (softboundcets-arena.h). The arena is the first
+   pointer argument, the memory being stamped the second. Stamping
+   checks that the memory lies within the bounds of the pointer it is
+   derived from and that this pointer is live, so that it never widens
+   bounds or revives freed memory */
+
+__WEAK_INLINE void
+__softboundcets_arena_check_range(void* ptr, size_t size, int arg_no){
+
+#if defined(__SOFTBOUNDCETS_SPATIAL) || defined(__SOFTBOUNDCETS_SPATIAL_TEMPORAL)
+  char* base = (char*) __softboundcets_load_base_shadow_stack(arg_no);
+  char* bound = (char*) __softboundcets_load_bound_shadow_stack(arg_no);
+
+  if((char*) ptr < base || (char*) ptr > bound ||
+     size > (size_t)(bound - (char*) ptr)){
+    __softboundcets_printf("[arena_stamp] %p + %zx outside [%p, %p)\n",
+                           ptr, size, base, bound);
+    __softboundcets_abort();
+  }
+#endif
+
+#if defined(__SOFTBOUNDCETS_TEMPORAL) || defined(__SOFTBOUNDCETS_SPATIAL_TEMPORAL)
+  size_t key = __softboundcets_load_key_shadow_stack(arg_no);
+  size_t* lock = (size_t*) __softboundcets_load_lock_shadow_stack(arg_no);
+
+  if(lock == NULL || *lock != key){
+    __softboundcets_printf("[arena_stamp] %p is not live\n", ptr);
+    __softboundcets_abort();
+  }
+#endif
+}
+
+__WEAK_INLINE void softboundcets_arena_init(softboundcets_arena_t* arena){
+
+  size_t* lock = (size_t*) __softboundcets_allocate_lock_location();
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  size_t key = __softboundcets_packed_next_key(lock);
+#else
+  size_t key = __softboundcets_get_next_key();
+#endif
+  *lock = key;
+  arena->lock = lock;
+  arena->key = key;
+}
+
+__WEAK_INLINE void* softboundcets_arena_stamp(softboundcets_arena_t* arena,
+                                              void* ptr, size_t size){
+
+  __softboundcets_arena_check_range(ptr, size, 2);
+  __softboundcets_store_return_metadata(ptr, (char*) ptr + size,
+                                        arena->key, arena->lock);
+  return ptr;
+}
+
+__WEAK_INLINE void
+softboundcets_arena_stamp_objects(softboundcets_arena_t* arena, void* block,
+                                  size_t object_size, size_t n_objects,
+                                  void** objects){
+
+  if(object_size != 0 && n_objects > (size_t)-1 / object_size){
+    __softboundcets_printf("[arena_stamp] %zx objects of %zx bytes overflow\n",
+                           n_objects, object_size);
+    __softboundcets_abort();
+  }
+  if(n_objects > (size_t)-1 / sizeof(void*)){
+    __softboundcets_printf("[arena_stamp] %zx objects overflow\n", n_objects);
+    __softboundcets_abort();
+  }
+
+  __softboundcets_arena_check_range(block, object_size * n_objects, 2);
+  __softboundcets_arena_check_range(objects, sizeof(void*) * n_objects, 3);
+
+#ifndef __SOFTBOUNDCETS_SPATIAL
+  size_t key = arena->key;
+  void* lock = arena->lock;
+#endif
+  char* object = (char*) block;
+  size_t i;
+
+  for(i = 0; i < n_objects; i++, object += object_size){
+    objects[i] = object;
+#ifdef __SOFTBOUNDCETS_SPATIAL
+    __softboundcets_metadata_store(&objects[i], object, object + object_size);
+#elif __SOFTBOUNDCETS_TEMPORAL
+    __softboundcets_metadata_store(&objects[i], key, lock);
+#else
+    __softboundcets_metadata_store(&objects[i], object, object + object_size,
+                                   key, lock);
+#endif
+  }
+}
+
+__WEAK_INLINE void softboundcets_arena_reset(softboundcets_arena_t* arena){
+
+  size_t* lock = (size_t*) arena->lock;
+
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  /* the key of a lock location is derived from its generation, which
+     is bounded; move to a new location once it is exhausted */
+  size_t index = (size_t)(lock - __softboundcets_temporal_space_begin);
+  if(__softboundcets_lock_generations[index] >=
+     __SOFTBOUNDCETS_PACKED_MAX_GENERATION){
+    __softboundcets_memory_deallocation(lock, arena->key);
+    softboundcets_arena_init(arena);
+    return;
+  }
+  size_t key = __softboundcets_packed_next_key(lock);
+#else
+  size_t key = __softboundcets_get_next_key();
+#endif
+  *lock = key;
+  arena->key = key;
+}
+
+__WEAK_INLINE void softboundcets_arena_destroy(softboundcets_arena_t* arena){
+
+  if(arena->lock == NULL)
+    return;
+
+  __softboundcets_memory_deallocation(arena->lock, arena->key);
+  arena->lock = NULL;
+  arena->key = 0;
+}
+
 
 __WEAK_INLINE long int softboundcets_lrand48(){
   return lrand48();
@@ -1842,6 +2218,211 @@ __WEAK_INLINE int softboundcets_atexit(void_func_ptr function){
 
 }
 
+/* ////////////////////Thread Related Library Wrappers//////////////////// */
+
+#ifdef __SOFTBOUNDCETS_THREADS
+
+typedef struct {
+  void* (*start_routine)(void*);
+  void* arg;
+  size_t arg_metadata[__SOFTBOUNDCETS_METADATA_NUM_FIELDS];
+  int detached;
+} __softboundcets_thread_start_t;
+
+/* The metadata of the value a thread returns or passes to
+   pthread_exit, kept after the thread exits until a pthread_join
+   stores it for *retval. Threads created or detached as detached are
+   not recorded. The record of a thread that another thread detaches
+   while it runs is replaced by the next thread that exits with its
+   handle */
+typedef struct __softboundcets_thread_exit_s {
+  pthread_t thread;
+  size_t ret_metadata[__SOFTBOUNDCETS_METADATA_NUM_FIELDS];
+  struct __softboundcets_thread_exit_s* next;
+} __softboundcets_thread_exit_t;
+
+static __softboundcets_thread_exit_t* softboundcets_thread_exits = NULL;
+static pthread_mutex_t softboundcets_thread_exits_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __SOFTBOUNDCETS_THREAD_LOCAL int softboundcets_thread_detached = 0;
+
+static void softboundcets_thread_save_exit_metadata(size_t* ret_metadata){
+
+  pthread_t self = pthread_self();
+  __softboundcets_thread_exit_t* exit_record;
+
+  if(softboundcets_thread_detached)
+    return;
+
+  pthread_mutex_lock(&softboundcets_thread_exits_mutex);
+  for(exit_record = softboundcets_thread_exits; exit_record != NULL; 
+      exit_record = exit_record->next){
+    if(pthread_equal(exit_record->thread, self))
+      break;
+  }
+  if(exit_record == NULL){
+    exit_record = malloc(sizeof(__softboundcets_thread_exit_t));
+    if(exit_record != NULL){
+      exit_record->thread = self;
+      exit_record->next = softboundcets_thread_exits;
+      softboundcets_thread_exits = exit_record;
+    }
+  }
+  if(exit_record != NULL)
+    memcpy(exit_record->ret_metadata, ret_metadata, 
+           sizeof(exit_record->ret_metadata));
+  pthread_mutex_unlock(&softboundcets_thread_exits_mutex);
+}
+
+/* Sets up the per-thread state and passes the metadata of arg to the
+   start routine in its shadow stack frame */
+static void* softboundcets_thread_start(void* data){
+
+  __softboundcets_thread_start_t start = *((__softboundcets_thread_start_t*) data);
+  free(data);
+
+  __softboundcets_thread_init();
+  softboundcets_thread_detached = start.detached;
+
+  __softboundcets_allocate_shadow_stack_space(2);
+  memcpy(__softboundcets_shadow_stack_slot(1), 
+         start.arg_metadata, sizeof(start.arg_metadata));
+
+  void* ret_ptr = start.start_routine(start.arg);
+
+  softboundcets_thread_save_exit_metadata(__softboundcets_shadow_stack_slot(0));
+  __softboundcets_deallocate_shadow_stack_space(2);
+  __softboundcets_thread_exit();
+  return ret_ptr;
+}
+
+__WEAK_INLINE int 
+softboundcets_pthread_create(pthread_t* thread, const pthread_attr_t* attr, 
+                             void* (*start_routine)(void*), void* arg){
+
+  __softboundcets_thread_start_t* start = malloc(sizeof(__softboundcets_thread_start_t));
+  if(start == NULL)
+    return EAGAIN;
+
+  int detach_state = PTHREAD_CREATE_JOINABLE;
+  if(attr != NULL)
+    pthread_attr_getdetachstate(attr, &detach_state);
+
+  start->start_routine = start_routine;
+  start->arg = arg;
+  start->detached = detach_state == PTHREAD_CREATE_DETACHED;
+  /* arg is the fourth pointer argument */
+  memcpy(start->arg_metadata, __softboundcets_shadow_stack_slot(4), 
+         sizeof(start->arg_metadata));
+
+  int ret_val = pthread_create(thread, attr, softboundcets_thread_start, start);
+  if(ret_val != 0)
+    free(start);
+  return ret_val;
+}
+
+__WEAK__ void softboundcets_pthread_exit(void* retval){
+
+  /* retval is the first pointer argument */
+  softboundcets_thread_save_exit_metadata(__softboundcets_shadow_stack_slot(1));
+  __softboundcets_thread_exit();
+  pthread_exit(retval);
+}
+
+__WEAK_INLINE int softboundcets_pthread_detach(pthread_t thread){
+
+  __softboundcets_thread_exit_t** link;
+
+  int ret_val = pthread_detach(thread);
+  if(ret_val != 0)
+    return ret_val;
+
+  if(pthread_equal(thread, pthread_self())){
+    softboundcets_thread_detached = 1;
+    return ret_val;
+  }
+
+  /* the thread may have exited already */
+  pthread_mutex_lock(&softboundcets_thread_exits_mutex);
+  for(link = &softboundcets_thread_exits; *link != NULL; link = &(*link)->next){
+    __softboundcets_thread_exit_t* exit_record = *link;
+    if(pthread_equal(exit_record->thread, thread)){
+      *link = exit_record->next;
+      free(exit_record);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&softboundcets_thread_exits_mutex);
+  return ret_val;
+}
+
+/* Stores the metadata the thread exited with for *retval. A canceled
+   thread, or one that was not recorded, gives *retval no metadata */
+__WEAK_INLINE int softboundcets_pthread_join(pthread_t thread, void** retval){
+
+  size_t ret_metadata[__SOFTBOUNDCETS_METADATA_NUM_FIELDS];
+  __softboundcets_thread_exit_t** link;
+  int found = 0;
+
+  int ret_val = pthread_join(thread, retval);
+  if(ret_val != 0)
+    return ret_val;
+
+  pthread_mutex_lock(&softboundcets_thread_exits_mutex);
+  for(link = &softboundcets_thread_exits; *link != NULL; link = &(*link)->next){
+    __softboundcets_thread_exit_t* exit_record = *link;
+    if(pthread_equal(exit_record->thread, thread)){
+      memcpy(ret_metadata, exit_record->ret_metadata, sizeof(ret_metadata));
+      *link = exit_record->next;
+      free(exit_record);
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&softboundcets_thread_exits_mutex);
+
+  if(retval == NULL)
+    return ret_val;
+
+  if(!found || *retval == PTHREAD_CANCELED)
+    memset(ret_metadata, 0, sizeof(ret_metadata));
+
+#ifdef __SOFTBOUNDCETS_SPATIAL
+  __softboundcets_metadata_store(retval, (void*) ret_metadata[__BASE_INDEX], 
+                                 (void*) ret_metadata[__BOUND_INDEX]);
+#elif __SOFTBOUNDCETS_TEMPORAL
+  __softboundcets_metadata_store(retval, ret_metadata[__KEY_INDEX], 
+                                 (void*) ret_metadata[__LOCK_INDEX]);
+#else
+  __softboundcets_metadata_store(retval, (void*) ret_metadata[__BASE_INDEX], 
+                                 (void*) ret_metadata[__BOUND_INDEX], 
+                                 ret_metadata[__KEY_INDEX], 
+                                 (void*) ret_metadata[__LOCK_INDEX]);
+#endif
+  return ret_val;
+}
+
+#else
+
+__WEAK_INLINE int 
+softboundcets_pthread_create(pthread_t* thread, const pthread_attr_t* attr, 
+                             void* (*start_routine)(void*), void* arg){
+  return pthread_create(thread, attr, start_routine, arg);
+}
+
+__WEAK__ void softboundcets_pthread_exit(void* retval){
+  pthread_exit(retval);
+}
+
+__WEAK_INLINE int softboundcets_pthread_join(pthread_t thread, void** retval){
+  return pthread_join(thread, retval);
+}
+
+__WEAK_INLINE int softboundcets_pthread_detach(pthread_t thread){
+  return pthread_detach(thread);
+}
+
+#endif
+
 #ifdef _GNU_SOURCE
 __WEAK_INLINE char* softboundcets_strerror_r(int errnum, char* buf, 
                                              size_t buf_len) {
@@ -2060,11 +2641,16 @@ __WEAK_INLINE int const**  softboundcets___ctype_tolower_loc(void) {
 }
 #endif
 
-/* This is a custom implementation of qsort */
+/* This is a custom implementation of qsort. It is an introsort:
+ * quicksort with a median-of-three pivot, which switches to heapsort
+ * when the recursion gets too deep and leaves small partitions to
+ * insertion sort. Elements are exchanged along with the metadata of
+ * the pointers they contain.
+ */
 
 static int 
 compare_elements_helper(void* base, size_t element_size, 
-                        int idx1, int idx2, 
+                        size_t idx1, size_t idx2, 
                         int (*comparer)(const void*, const void*)){
   
   char* base_bytes = base;
@@ -2076,17 +2662,24 @@ compare_elements_helper(void* base, size_t element_size,
 
 static void 
 exchange_elements_helper(void* base, size_t element_size, 
-                         int idx1, int idx2){
+                         size_t idx1, size_t idx2){
 
   char* base_bytes = base;
   size_t i;
 
+  if(idx1 == idx2)
+    return;
+
   for (i=0; i < element_size; i++){
     char temp = base_bytes[idx1* element_size + i];
     base_bytes[idx1 * element_size + i] = base_bytes[idx2 * element_size + i];
     base_bytes[idx2 * element_size + i] = temp;
   }  
 
+  /* elements smaller than a pointer do not contain pointers */
+  if(element_size < sizeof(void*))
+    return;
+
   for(i=0; i < element_size; i+= 8){
     void* base_idx1;
     void* bound_idx1;
@@ -2145,22 +2738,155 @@ exchange_elements_helper(void* base, size_t element_size,
 
 #define MIN_QSORT_LIST_SIZE 32
 
+static void 
+insertion_sort_helper(void* base, size_t element_size, 
+                      size_t lo, size_t hi,
+                      int (*comparer)(const void*, const void*)){
+  size_t i, j;
+
+  for(i = lo + 1; i <= hi; i++){
+    for(j = i; j > lo; j--){
+      if(!element_less_than(j, j - 1)) break;
+      exchange_elements(j, j - 1);
+    }
+  }
+}
+
+static void
+sift_down_helper(void* base, size_t element_size, 
+                 size_t lo, size_t root, size_t num_elements,
+                 int (*comparer)(const void*, const void*)){
+
+  size_t child;
+
+  while((child = 2 * root + 1) < num_elements){
+    if(child + 1 < num_elements && 
+       element_less_than(lo + child, lo + child + 1)){
+      child++;
+    }
+    if(!element_less_than(lo + root, lo + child)) 
+      return;
+    exchange_elements(lo + root, lo + child);
+    root = child;
+  }
+}
+
+static void
+heap_sort_helper(void* base, size_t element_size, 
+                 size_t lo, size_t hi,
+                 int (*comparer)(const void*, const void*)){
+
+  size_t num_elements = hi - lo + 1;
+  size_t i;
+
+  for(i = num_elements / 2; i > 0; i--){
+    sift_down_helper(base, element_size, lo, i - 1, num_elements, comparer);
+  }
+
+  for(i = num_elements - 1; i > 0; i--){
+    exchange_elements(lo, lo + i);
+    sift_down_helper(base, element_size, lo, 0, i, comparer);
+  }
+}
+
+/* Partitions [lo, hi] around the median of the first, middle and
+ * last elements, and returns the final index of the pivot. Equal
+ * elements stop both scans, which keeps the partitions balanced when
+ * there are many duplicates.
+ */
+static size_t
+partition_helper(void* base, size_t element_size, 
+                 size_t lo, size_t hi,
+                 int (*comparer)(const void*, const void*)){
+
+  size_t mid = lo + (hi - lo) / 2;
+  size_t i, j;
+
+  if(element_less_than(mid, lo)) exchange_elements(mid, lo);
+  if(element_less_than(hi, lo)) exchange_elements(hi, lo);
+  if(element_less_than(hi, mid)) exchange_elements(hi, mid);
+
+  /* median at lo, the pivot stays there during the scans */
+  exchange_elements(lo, mid);
+
+  i = lo;
+  j = hi + 1;
+
+  while(1){
+    do { i++; } while(i <= hi && element_less_than(i, lo));
+    do { j--; } while(element_less_than(lo, j));
+    if(i >= j) break;
+    exchange_elements(i, j);
+  }
+  exchange_elements(lo, j);
+  return j;
+}
+
 __WEAK__ 
 void my_qsort(void* base, size_t num_elements, 
               size_t element_size, 
               int (*comparer)(const void*, const void*)){
 
-  size_t i;
+  size_t lo_stack[64];
+  size_t hi_stack[64];
+  int depth_stack[64];
+  int top = 0;
+  int depth_limit = 0;
+  size_t n;
 
-  for(i = 0; i < num_elements; i++){
-    int j;
-    for (j = i - 1; j >= 0; j--){      
-      if(element_less_than(j, j + 1)) break;
-      exchange_elements(j, j + 1);
-    }
+  if(num_elements < 2 || element_size == 0)
+    return;
+
+  for(n = num_elements; n > 1; n >>= 1){
+    depth_limit += 2;
   }
-  /* may be implement qsort here */
 
+  lo_stack[0] = 0;
+  hi_stack[0] = num_elements - 1;
+  depth_stack[0] = depth_limit;
+  top = 1;
+
+  /* The larger partition is pushed first so that the smaller one is
+   * sorted next, which bounds the stack to log2(num_elements)
+   * entries.
+   */
+  while(top > 0){
+    top--;
+    size_t lo = lo_stack[top];
+    size_t hi = hi_stack[top];
+    int depth = depth_stack[top];
+    
+    if(hi - lo + 1 <= MIN_QSORT_LIST_SIZE){
+      insertion_sort_helper(base, element_size, lo, hi, comparer);
+      continue;
+    }
+
+    if(depth == 0){
+      heap_sort_helper(base, element_size, lo, hi, comparer);
+      continue;
+    }
+
+    size_t p = partition_helper(base, element_size, lo, hi, comparer);
+    size_t left_size = p - lo;
+    size_t right_size = hi - p;
+
+    if(left_size > right_size){
+      if(left_size > 1){
+        lo_stack[top] = lo; hi_stack[top] = p - 1; depth_stack[top++] = depth - 1;
+      }
+      if(right_size > 1){
+        lo_stack[top] = p + 1; hi_stack[top] = hi; depth_stack[top++] = depth - 1;
+      }
+    }
+    else {
+      if(right_size > 1){
+        lo_stack[top] = p + 1; hi_stack[top] = hi; depth_stack[top++] = depth - 1;
+      }
+      if(left_size > 1){
+        lo_stack[top] = lo; hi_stack[top] = p - 1; depth_stack[top++] = depth - 1;
+      }
+    }
+  }
 }
 
 
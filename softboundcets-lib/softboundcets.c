@@ -53,27 +53,70 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <sys/mman.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#ifdef __SOFTBOUNDCETS_THREADS
+#include <pthread.h>
+#endif
 #if !defined(__FreeBSD__)
 #include <execinfo.h>
 #endif
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
 #include "softboundcets.h"
 
 __softboundcets_trie_entry_t** __softboundcets_trie_primary_table;
+#ifdef __SOFTBOUNDCETS_LINEAR_SHADOW
+__softboundcets_trie_entry_t* __softboundcets_linear_shadow = NULL;
+#endif
 
 size_t* __softboundcets_free_map_table = NULL;
-
-size_t* __softboundcets_shadow_stack_ptr = NULL;
-
-size_t* __softboundcets_lock_next_location = NULL;
-size_t* __softboundcets_lock_new_location = NULL;
-size_t __softboundcets_key_id_counter = 2;
+size_t* __softboundcets_metadata_seq_table = NULL;
+unsigned int* __softboundcets_lock_generations = NULL;
+
+__SOFTBOUNDCETS_THREAD_LOCAL size_t* __softboundcets_shadow_stack_ptr = NULL;
+
+__SOFTBOUNDCETS_THREAD_LOCAL size_t* __softboundcets_lock_next_location = NULL;
+__SOFTBOUNDCETS_THREAD_LOCAL size_t* __softboundcets_lock_new_location = NULL;
+__SOFTBOUNDCETS_THREAD_LOCAL size_t __softboundcets_key_id_counter = 2;
+
+#ifdef __SOFTBOUNDCETS_THREADS
+/* A thread takes a new batch of keys when its counter reaches the limit */
+__thread size_t __softboundcets_key_id_limit = 0;
+__thread size_t* __softboundcets_lock_new_location_end = NULL;
+/* lower bound on the length of the lock free list of the thread */
+__thread size_t __softboundcets_lock_free_count = 0;
+
+/* Shared state, only touched when a thread runs out of keys or lock
+   locations */
+size_t __softboundcets_key_id_batch = 2;
+size_t __softboundcets_lock_space_next = 0;
+size_t* __softboundcets_lock_overflow_list = NULL;
+#endif
 
 /* key 0 means not used, 1 is for  globals*/
 size_t __softboundcets_deref_check_count = 0;
 size_t* __softboundcets_global_lock = 0;
 
 size_t* __softboundcets_temporal_space_begin = 0;
-size_t* __softboundcets_stack_temporal_space_begin = NULL;
+size_t* __softboundcets_lock_space_end = NULL;
+
+/* Set from SOFTBOUNDCETS_OPTIONS by __softboundcets_init */
+size_t __softboundcets_n_temporal_entries = 0;
+size_t __softboundcets_n_stack_temporal_entries = 0;
+size_t __softboundcets_shadow_stack_entries = 0;
+#ifdef __SOFTBOUNDCETS_TRIE_HUGEPAGES
+int __softboundcets_huge_pages = 1;
+#else
+int __softboundcets_huge_pages = 0;
+#endif
+int __softboundcets_prefault = __SOFTBOUNDCETS_PREFAULT_NONE;
+static int softboundcets_grow_regions = 0;
+static int softboundcets_print_stats_enabled = 0;
+__SOFTBOUNDCETS_THREAD_LOCAL size_t* __softboundcets_stack_temporal_space_begin = NULL;
 
 void* malloc_address = NULL;
 
@@ -95,8 +138,691 @@ __SOFTBOUNDCETS_NORETURN void __softboundcets_abort()
   abort();
 }
 
+/* Streaming copies of metadata, selected by __softboundcets_init from
+   the features of the CPU */
+static void (*softboundcets_stream_copy)(char*, const char*, size_t) = NULL;
+
+#if defined(__x86_64__)
+
+#ifndef bit_AVX2
+#define bit_AVX2 0x00000020
+#endif
+
+/* Returns 1 if the CPU has AVX2 and the OS saves the ymm registers */
+static int softboundcets_cpu_has_avx2(void){
+
+  unsigned int eax, ebx, ecx, edx;
+  unsigned int xcr0_low, xcr0_high;
+
+  if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  if(!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    return 0;
+
+  __asm__ ("xgetbv" : "=a" (xcr0_low), "=d" (xcr0_high) : "c" (0));
+  if((xcr0_low & 6) != 6)
+    return 0;
+
+  if(__get_cpuid_max(0, NULL) < 7)
+    return 0;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & bit_AVX2) != 0;
+}
+
+/* Copies length bytes, a multiple of 128, to the 32 byte aligned dest
+   with non-temporal 32 byte stores. The moves are written in assembly
+   so that the runtime does not have to be built with -mavx2. */
+static void softboundcets_stream_copy_avx2(char* dest, const char* from, 
+                                           size_t length){
+  size_t i;
+  for(i = 0; i < length; i += 128){
+    __asm__ volatile ("vmovdqu (%1), %%ymm0\n\t"
+                      "vmovdqu 32(%1), %%ymm1\n\t"
+                      "vmovdqu 64(%1), %%ymm2\n\t"
+                      "vmovdqu 96(%1), %%ymm3\n\t"
+                      "vmovntdq %%ymm0, (%0)\n\t"
+                      "vmovntdq %%ymm1, 32(%0)\n\t"
+                      "vmovntdq %%ymm2, 64(%0)\n\t"
+                      "vmovntdq %%ymm3, 96(%0)\n\t"
+                      : 
+                      : "r" (dest + i), "r" (from + i)
+                      : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+  }
+  __asm__ volatile ("vzeroupper" ::: "memory");
+  _mm_sfence();
+}
+
+/* Copies length bytes, a multiple of 128, to the 32 byte aligned dest
+   with non-temporal 16 byte stores */
+static void softboundcets_stream_copy_sse2(char* dest, const char* from, 
+                                           size_t length){
+  size_t i;
+  for(i = 0; i < length; i += 128){
+    __m128i* dest_line = (__m128i*) (dest + i);
+    const __m128i* from_line = (const __m128i*) (from + i);
+    __m128i x0 = _mm_loadu_si128(from_line);
+    __m128i x1 = _mm_loadu_si128(from_line + 1);
+    __m128i x2 = _mm_loadu_si128(from_line + 2);
+    __m128i x3 = _mm_loadu_si128(from_line + 3);
+    __m128i x4 = _mm_loadu_si128(from_line + 4);
+    __m128i x5 = _mm_loadu_si128(from_line + 5);
+    __m128i x6 = _mm_loadu_si128(from_line + 6);
+    __m128i x7 = _mm_loadu_si128(from_line + 7);
+    _mm_stream_si128(dest_line, x0);
+    _mm_stream_si128(dest_line + 1, x1);
+    _mm_stream_si128(dest_line + 2, x2);
+    _mm_stream_si128(dest_line + 3, x3);
+    _mm_stream_si128(dest_line + 4, x4);
+    _mm_stream_si128(dest_line + 5, x5);
+    _mm_stream_si128(dest_line + 6, x6);
+    _mm_stream_si128(dest_line + 7, x7);
+  }
+  _mm_sfence();
+}
+
+#endif
+
+/* Copies length bytes of metadata from from to dest like memmove. Large
+   copies that do not overlap stream the destination past the cache,
+   as a copy of that much metadata is not read back soon. */
+void __softboundcets_metadata_move(void* dest, const void* from, size_t length){
+
+  char* dest_bytes = dest;
+  const char* from_bytes = from;
+
+  if(length < __SOFTBOUNDCETS_STREAMING_COPY_THRESHOLD ||
+     (dest_bytes < from_bytes + length && from_bytes < dest_bytes + length) ||
+     softboundcets_stream_copy == NULL){
+    memmove(dest, from, length);
+    return;
+  }
+
+  size_t head = ((32 - ((size_t) dest_bytes & 31)) & 31);
+  memcpy(dest_bytes, from_bytes, head);
+  dest_bytes += head;
+  from_bytes += head;
+  length -= head;
+
+  size_t body = length & ~((size_t) 127);
+  softboundcets_stream_copy(dest_bytes, from_bytes, body);
+  memcpy(dest_bytes + body, from_bytes + body, length - body);
+}
+
+/* Installs the table of metadata of the pointers in the initializers
+   of the globals of a module, which its global init function passes
+   instead of storing the metadata of each pointer. These pointers
+   have the key and lock of globals */
+void __softboundcets_install_global_metadata(__softboundcets_global_metadata_t* records, 
+                                             size_t n_records){
+
+  size_t i;
+  for(i = 0; i < n_records; i++){
+#ifdef __SOFTBOUNDCETS_SPATIAL
+    __softboundcets_metadata_store(records[i].addr_of_ptr, records[i].base, 
+                                   records[i].bound);
+#elif __SOFTBOUNDCETS_TEMPORAL
+    __softboundcets_metadata_store(records[i].addr_of_ptr, 1, 
+                                   __softboundcets_global_lock);
+#else
+    __softboundcets_metadata_store(records[i].addr_of_ptr, records[i].base, 
+                                   records[i].bound, 1, 
+                                   __softboundcets_global_lock);
+#endif
+  }
+}
+
+#ifdef __SOFTBOUNDCETS_ALLOCATOR
+
+char* __softboundcets_heap_begin = NULL;
+__SOFTBOUNDCETS_THREAD_LOCAL 
+__softboundcets_heap_cache_t __softboundcets_heap_cache[__SOFTBOUNDCETS_HEAP_N_CLASSES];
+
+#ifdef __SOFTBOUNDCETS_THREADS
+typedef pthread_mutex_t softboundcets_heap_mutex_t;
+#define softboundcets_heap_lock(mutex) pthread_mutex_lock(mutex)
+#define softboundcets_heap_unlock(mutex) pthread_mutex_unlock(mutex)
+#else
+typedef int softboundcets_heap_mutex_t;
+#define softboundcets_heap_lock(mutex) ((void) (mutex))
+#define softboundcets_heap_unlock(mutex) ((void) (mutex))
+#endif
+
+/* The slabs of a size class that have objects to hand out. Only the
+   first one is taken from, so only it becomes empty and leaves the
+   list */
+typedef struct {
+  __softboundcets_slab_t* partial;
+  softboundcets_heap_mutex_t mutex;
+} softboundcets_heap_class_t;
+
+static softboundcets_heap_class_t softboundcets_heap_classes[__SOFTBOUNDCETS_HEAP_N_CLASSES];
+
+static char* softboundcets_heap_slab_next = NULL;
+static char* softboundcets_heap_run_next = NULL;
+static __softboundcets_heap_run_t* softboundcets_heap_free_runs[__SOFTBOUNDCETS_HEAP_N_RUN_CLASSES];
+static softboundcets_heap_mutex_t softboundcets_heap_run_mutex;
+
+static void softboundcets_heap_init(void){
+
+  size_t length = __SOFTBOUNDCETS_HEAP_SLAB_REGION_SIZE + __SOFTBOUNDCETS_HEAP_RUN_REGION_SIZE;
+  size_t i;
+
+  /* the slabs are aligned to their size */
+  char* heap = mmap(0, length + __SOFTBOUNDCETS_HEAP_SLAB_SIZE, 
+                    PROT_READ| PROT_WRITE, 
+                    SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
+  assert(heap != (void*) -1);
+  heap = (char*) (((size_t) heap + __SOFTBOUNDCETS_HEAP_SLAB_SIZE - 1) & 
+                  ~(__SOFTBOUNDCETS_HEAP_SLAB_SIZE - 1));
+
+  softboundcets_heap_slab_next = heap;
+  softboundcets_heap_run_next = heap + __SOFTBOUNDCETS_HEAP_SLAB_REGION_SIZE;
+
+#ifdef __SOFTBOUNDCETS_THREADS
+  for(i = 0; i < __SOFTBOUNDCETS_HEAP_N_CLASSES; i++){
+    pthread_mutex_init(&softboundcets_heap_classes[i].mutex, NULL);
+  }
+  pthread_mutex_init(&softboundcets_heap_run_mutex, NULL);
+#else
+  (void) i;
+#endif
+
+  __softboundcets_heap_begin = heap;
+}
+
+/* Carves a new slab for size_class out of the region. The locks of its
+   objects follow the header, and the objects start at the next cache
+   line */
+static __softboundcets_slab_t* softboundcets_heap_new_slab(size_t size_class){
+
+#ifdef __SOFTBOUNDCETS_THREADS
+  char* slab_begin = __sync_fetch_and_add(&softboundcets_heap_slab_next, 
+                                          __SOFTBOUNDCETS_HEAP_SLAB_SIZE);
+#else
+  char* slab_begin = softboundcets_heap_slab_next;
+  softboundcets_heap_slab_next += __SOFTBOUNDCETS_HEAP_SLAB_SIZE;
+#endif
+
+  if(slab_begin + __SOFTBOUNDCETS_HEAP_SLAB_SIZE > 
+     __softboundcets_heap_begin + __SOFTBOUNDCETS_HEAP_SLAB_REGION_SIZE)
+    return NULL;
+
+  __softboundcets_slab_t* slab = (__softboundcets_slab_t*) slab_begin;
+  size_t object_size = __softboundcets_heap_class_size(size_class);
+  size_t header_size = offsetof(__softboundcets_slab_t, locks);
+  size_t n_objects = (__SOFTBOUNDCETS_HEAP_SLAB_SIZE - header_size) / (object_size + sizeof(size_t));
+  size_t objects_offset;
+
+  while(1){
+    objects_offset = (header_size + n_objects * sizeof(size_t) + 63) & ~((size_t) 63);
+    if(objects_offset + n_objects * object_size <= __SOFTBOUNDCETS_HEAP_SLAB_SIZE)
+      break;
+    n_objects--;
+  }
+
+  slab->object_size = object_size;
+  slab->reciprocal = ((size_t) 1 << 32) / object_size + 1;
+  slab->objects = slab_begin + objects_offset;
+  slab->n_objects = n_objects;
+  slab->n_fresh = 0;
+  slab->free_list = NULL;
+  slab->n_free = 0;
+  slab->next_partial = NULL;
+  slab->on_partial = 0;
+  return slab;
+}
+
+/* Fills the cache of size_class with up to
+   __SOFTBOUNDCETS_HEAP_BATCH_SIZE objects and returns one of them */
+void* __softboundcets_heap_refill(size_t size_class){
+
+  if(__softboundcets_heap_begin == NULL)
+    __softboundcets_init();
+
+  softboundcets_heap_class_t* heap_class = &softboundcets_heap_classes[size_class];
+  __softboundcets_heap_cache_t* cache = &__softboundcets_heap_cache[size_class];
+  size_t count = 0;
+
+  softboundcets_heap_lock(&heap_class->mutex);
+
+  if(heap_class->partial == NULL){
+    __softboundcets_slab_t* slab = softboundcets_heap_new_slab(size_class);
+    if(slab != NULL){
+      slab->on_partial = 1;
+      heap_class->partial = slab;
+    }
+  }
+
+  while(count < __SOFTBOUNDCETS_HEAP_BATCH_SIZE && heap_class->partial != NULL){
+    __softboundcets_slab_t* slab = heap_class->partial;
+    void* object;
+
+    if(slab->free_list != NULL){
+      object = slab->free_list;
+      slab->free_list = *((void**) object);
+      slab->n_free--;
+    }
+    else if(slab->n_fresh < slab->n_objects){
+      object = slab->objects + slab->n_fresh * slab->object_size;
+      slab->n_fresh++;
+    }
+    else{
+      heap_class->partial = slab->next_partial;
+      slab->on_partial = 0;
+      continue;
+    }
+
+    *((void**) object) = cache->objects;
+    cache->objects = object;
+    cache->count++;
+    count++;
+  }
+
+  softboundcets_heap_unlock(&heap_class->mutex);
+
+  void* ptr = cache->objects;
+  if(ptr != NULL){
+    cache->objects = *((void**) ptr);
+    cache->count--;
+  }
+  return ptr;
+}
+
+/* Returns count objects of the cache of size_class to their slabs. The
+   pages of a slab whose objects are all free again are released,
+   unless it is the slab the size class takes from */
+void __softboundcets_heap_flush(size_t size_class, size_t count){
+
+  softboundcets_heap_class_t* heap_class = &softboundcets_heap_classes[size_class];
+  __softboundcets_heap_cache_t* cache = &__softboundcets_heap_cache[size_class];
+
+  softboundcets_heap_lock(&heap_class->mutex);
+
+  while(count > 0 && cache->objects != NULL){
+    void* object = cache->objects;
+    cache->objects = *((void**) object);
+    cache->count--;
+    count--;
+
+    __softboundcets_slab_t* slab = __softboundcets_heap_slab(object);
+    *((void**) object) = slab->free_list;
+    slab->free_list = object;
+    slab->n_free++;
+
+    if(!slab->on_partial){
+      slab->next_partial = heap_class->partial;
+      heap_class->partial = slab;
+      slab->on_partial = 1;
+    }
+    else if(slab->n_free == slab->n_fresh && slab != heap_class->partial){
+      size_t objects_begin = ((size_t) slab->objects + __SOFTBOUNDCETS_HEAP_PAGE_SIZE - 1) & 
+        ~(__SOFTBOUNDCETS_HEAP_PAGE_SIZE - 1);
+      size_t objects_end = (size_t) slab + __SOFTBOUNDCETS_HEAP_SLAB_SIZE;
+      madvise((void*) objects_begin, objects_end - objects_begin, MADV_DONTNEED);
+      slab->free_list = NULL;
+      slab->n_free = 0;
+      slab->n_fresh = 0;
+    }
+  }
+
+  softboundcets_heap_unlock(&heap_class->mutex);
+}
+
+void __softboundcets_heap_flush_all(void){
+
+  size_t size_class;
+  for(size_class = 0; size_class < __SOFTBOUNDCETS_HEAP_N_CLASSES; size_class++){
+    if(__softboundcets_heap_cache[size_class].count != 0){
+      __softboundcets_heap_flush(size_class, __softboundcets_heap_cache[size_class].count);
+    }
+  }
+}
+
+/* Allocates a run of 2^n pages for an object of size bytes, which
+   starts after the page that holds the lock */
+void* __softboundcets_heap_allocate_run(size_t size, size_t** ptr_lock){
+
+  if(__softboundcets_heap_begin == NULL)
+    __softboundcets_init();
+
+  if(size > __SOFTBOUNDCETS_HEAP_RUN_REGION_SIZE)
+    return NULL;
+
+  size_t n_pages = (size + __SOFTBOUNDCETS_HEAP_PAGE_SIZE - 1) / __SOFTBOUNDCETS_HEAP_PAGE_SIZE + 1;
+  size_t run_class = 0;
+  while(((size_t) 1 << run_class) < n_pages){
+    run_class++;
+  }
+  if(run_class >= __SOFTBOUNDCETS_HEAP_N_RUN_CLASSES)
+    return NULL;
+
+  size_t run_length = __SOFTBOUNDCETS_HEAP_PAGE_SIZE << run_class;
+  __softboundcets_heap_run_t* run;
+
+  softboundcets_heap_lock(&softboundcets_heap_run_mutex);
+  run = softboundcets_heap_free_runs[run_class];
+  if(run != NULL){
+    softboundcets_heap_free_runs[run_class] = run->next;
+  }
+  else if(softboundcets_heap_run_next + run_length <= __softboundcets_heap_begin + 
+          __SOFTBOUNDCETS_HEAP_SLAB_REGION_SIZE + __SOFTBOUNDCETS_HEAP_RUN_REGION_SIZE){
+    run = (__softboundcets_heap_run_t*) softboundcets_heap_run_next;
+    softboundcets_heap_run_next += run_length;
+    run->run_class = run_class;
+  }
+  softboundcets_heap_unlock(&softboundcets_heap_run_mutex);
+
+  if(run == NULL)
+    return NULL;
+
+  run->size = size;
+  *ptr_lock = &run->lock;
+  return (char*) run + __SOFTBOUNDCETS_HEAP_PAGE_SIZE;
+}
+
+/* Frees the object of a run. Its pages and their metadata are
+   released once the run is large enough for that to pay off, so a
+   large object comes back zeroed */
+void __softboundcets_heap_free_run(void* ptr, void* ptr_lock, size_t ptr_key){
+
+  __softboundcets_heap_run_t* run = 
+    (__softboundcets_heap_run_t*) ((char*) ptr - __SOFTBOUNDCETS_HEAP_PAGE_SIZE);
+
+  if(((size_t) ptr & (__SOFTBOUNDCETS_HEAP_PAGE_SIZE - 1)) != 0 ||
+     (void*) &run->lock != ptr_lock || run->lock != ptr_key){
+#ifndef __NOSIM_CHECKS
+    if(__SOFTBOUNDCETS_DEBUG) {
+      __softboundcets_printf("[heap_free] invalid free ptr=%p, lock=%p, key=%zx\n", 
+                             ptr, ptr_lock, ptr_key);
+    }
+    __softboundcets_abort();
+#else
+    return;
+#endif
+  }
+  run->lock = 0;
+
+  size_t payload_length = (__SOFTBOUNDCETS_HEAP_PAGE_SIZE << run->run_class) - 
+    __SOFTBOUNDCETS_HEAP_PAGE_SIZE;
+  if(payload_length >= __SOFTBOUNDCETS_TRIE_RECLAIM_THRESHOLD){
+    __softboundcets_trie_reclaim(ptr, run->size);
+    madvise(ptr, payload_length, MADV_DONTNEED);
+  }
+
+  softboundcets_heap_lock(&softboundcets_heap_run_mutex);
+  run->next = softboundcets_heap_free_runs[run->run_class];
+  softboundcets_heap_free_runs[run->run_class] = run;
+  softboundcets_heap_unlock(&softboundcets_heap_run_mutex);
+}
+
+#endif
+
+/* SOFTBOUNDCETS_OPTIONS holds name=value pairs separated by ':' or
+   ',', e.g. SOFTBOUNDCETS_OPTIONS=temporal_entries=256m:grow=1. Sizes
+   take a k, m or g suffix.
+
+     temporal_entries        heap lock locations and free map entries
+     stack_temporal_entries  lock locations for the stack objects of a thread
+     shadow_stack_entries    words of the shadow stack of a thread
+     huge_pages=0|1          MADV_HUGEPAGE on trie tables and the lock space
+     prefault=none|stacks|all  populate the stack regions of each thread,
+                             or every region and trie table, when mapped
+     grow=0|1                commit the lock space and the free map as the
+                             locations are used instead of at startup
+     stats=0|1               print the statistics of the runtime at exit
+                             and when the process receives SIGUSR2 */
+
+/* Each entry takes a word in its region, so a size is rejected when
+   its suffix overflows or its region would take more than half the
+   address space, where the page rounding of the region overflows */
+static int softboundcets_parse_size(const char* value, size_t* size){
+
+  char* end;
+  unsigned long long number;
+  unsigned int shift = 0;
+
+  /* strtoull takes a sign and negates */
+  if(*value < '0' || *value > '9')
+    return 0;
+  number = strtoull(value, &end, 10);
+
+  switch(*end){
+  case 'k': case 'K': shift = 10; end++; break;
+  case 'm': case 'M': shift = 20; end++; break;
+  case 'g': case 'G': shift = 30; end++; break;
+  default: break;
+  }
+
+  if(*end != '\0' || number == 0 || 
+     number > (((size_t) -1 >> 1) / sizeof(size_t)) >> shift)
+    return 0;
+
+  *size = (size_t) number << shift;
+  return 1;
+}
+
+static int softboundcets_parse_option(const char* name, const char* value){
+
+  if(strcmp(name, "temporal_entries") == 0)
+    return softboundcets_parse_size(value, &__softboundcets_n_temporal_entries);
+
+  if(strcmp(name, "stack_temporal_entries") == 0)
+    return softboundcets_parse_size(value, &__softboundcets_n_stack_temporal_entries);
+
+  if(strcmp(name, "shadow_stack_entries") == 0)
+    return softboundcets_parse_size(value, &__softboundcets_shadow_stack_entries);
+
+  if(strcmp(name, "huge_pages") == 0 || strcmp(name, "grow") == 0 || 
+     strcmp(name, "stats") == 0){
+    if(strcmp(value, "0") != 0 && strcmp(value, "1") != 0)
+      return 0;
+    if(name[0] == 'h')
+      __softboundcets_huge_pages = value[0] == '1';
+    else if(name[0] == 'g')
+      softboundcets_grow_regions = value[0] == '1';
+    else
+      softboundcets_print_stats_enabled = value[0] == '1';
+    return 1;
+  }
+
+  if(strcmp(name, "prefault") == 0){
+    if(strcmp(value, "none") == 0)
+      __softboundcets_prefault = __SOFTBOUNDCETS_PREFAULT_NONE;
+    else if(strcmp(value, "stacks") == 0)
+      __softboundcets_prefault = __SOFTBOUNDCETS_PREFAULT_STACKS;
+    else if(strcmp(value, "all") == 0)
+      __softboundcets_prefault = __SOFTBOUNDCETS_PREFAULT_ALL;
+    else
+      return 0;
+    return 1;
+  }
+
+  return 0;
+}
+
+static void softboundcets_parse_options(void){
+
+  const char* options = getenv("SOFTBOUNDCETS_OPTIONS");
+  char option[256];
+
+  __softboundcets_n_temporal_entries = __SOFTBOUNDCETS_N_TEMPORAL_ENTRIES;
+  __softboundcets_n_stack_temporal_entries = __SOFTBOUNDCETS_N_STACK_TEMPORAL_ENTRIES;
+  __softboundcets_shadow_stack_entries = __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES;
+
+  if(options == NULL)
+    return;
+
+  while(*options != '\0'){
+    size_t length = strcspn(options, ":,");
+
+    if(length != 0){
+      char* value;
+
+      if(length >= sizeof(option)){
+        __softboundcets_printf("[options] option too long: %.*s\n", 
+                               (int) length, options);
+        __softboundcets_abort();
+      }
+      memcpy(option, options, length);
+      option[length] = '\0';
+
+      value = strchr(option, '=');
+      if(value != NULL)
+        *value++ = '\0';
+      if(value == NULL || !softboundcets_parse_option(option, value)){
+        __softboundcets_printf("[options] invalid option in SOFTBOUNDCETS_OPTIONS: %.*s\n", 
+                               (int) length, options);
+        __softboundcets_abort();
+      }
+    }
+
+    options += length;
+    if(*options != '\0')
+      options++;
+  }
+
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  /* packed keys hold the index of their lock location */
+  if(__softboundcets_n_temporal_entries > ((size_t) 1 << __SOFTBOUNDCETS_PACKED_LOCK_INDEX_BITS)){
+    __softboundcets_printf("[options] temporal_entries is at most %zu with packed metadata\n", 
+                           (size_t) 1 << __SOFTBOUNDCETS_PACKED_LOCK_INDEX_BITS);
+    __softboundcets_abort();
+  }
+#endif
+}
+
+/* A region of memory of the runtime, followed by a guard page so that
+   running off its end faults instead of overwriting what follows. The
+   first committed bytes are accessible, the rest is only reserved */
+typedef struct {
+  char* begin;
+  size_t length;
+  size_t committed;
+} softboundcets_region_t;
+
+static size_t softboundcets_page_size = 4096;
+
+static size_t softboundcets_page_round(size_t length){
+
+  return (length + softboundcets_page_size - 1) & ~(softboundcets_page_size - 1);
+}
+
+/* Makes the region accessible up to length bytes */
+static void softboundcets_region_commit(softboundcets_region_t* region, 
+                                        size_t length, int populate){
+
+  length = softboundcets_page_round(length);
+  if(length > region->length)
+    length = region->length;
+  if(length <= region->committed)
+    return;
+
+  char* begin = region->begin + region->committed;
+  size_t commit_length = length - region->committed;
+
+  if(mprotect(begin, commit_length, PROT_READ| PROT_WRITE) != 0){
+    __softboundcets_printf("[region] cannot commit %zu bytes of shadow memory\n", 
+                           commit_length);
+    __softboundcets_abort();
+  }
+
+#ifdef MADV_HUGEPAGE
+  if(__softboundcets_huge_pages && commit_length >= __SOFTBOUNDCETS_TRIE_HUGE_PAGE_SIZE)
+    madvise(begin, commit_length, MADV_HUGEPAGE);
+#endif
+
+  if(populate){
+    size_t offset;
+    for(offset = 0; offset < commit_length; offset += softboundcets_page_size){
+      ((volatile char*) begin)[offset] = 0;
+    }
+  }
+
+  region->committed = length;
+}
+
+/* Reserves a region of length bytes and commits commit bytes of it */
+static void* softboundcets_region_map(softboundcets_region_t* region, 
+                                      size_t length, size_t commit, 
+                                      int populate){
+
+  region->length = softboundcets_page_round(length);
+  region->committed = 0;
+  region->begin = mmap(0, region->length + softboundcets_page_size, PROT_NONE, 
+                       SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
+  assert(region->begin != (void*) -1);
+
+  softboundcets_region_commit(region, commit, populate);
+  return region->begin;
+}
+
+/* The lock space, with the free map and, with packed metadata, the
+   generations of the lock locations, which grow along with it */
+static softboundcets_region_t softboundcets_lock_space_region;
+static softboundcets_region_t softboundcets_free_map_region;
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+static softboundcets_region_t softboundcets_lock_generations_region;
+#endif
+
+#ifdef __SOFTBOUNDCETS_THREADS
+static pthread_mutex_t softboundcets_lock_space_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Bottom of the shadow stack of the thread, for the statistics */
+static __SOFTBOUNDCETS_THREAD_LOCAL size_t* softboundcets_shadow_stack_begin = NULL;
+
+/* Commits the lock space at least up to end, or aborts if end is past
+   the temporal_entries lock locations reserved */
+void __softboundcets_grow_lock_space(size_t* end){
+
+#ifdef __SOFTBOUNDCETS_THREADS
+  pthread_mutex_lock(&softboundcets_lock_space_mutex);
+#endif
+
+  size_t entries = (size_t)(end - __softboundcets_temporal_space_begin);
+
+  if(end > __softboundcets_lock_space_end){
+    if(entries > __softboundcets_n_temporal_entries){
+      __softboundcets_printf("[lock_allocate] out of lock locations, raise temporal_entries "
+                             "in SOFTBOUNDCETS_OPTIONS (%zu)\n", 
+                             __softboundcets_n_temporal_entries);
+      __softboundcets_abort();
+    }
+
+    size_t committed_entries = 
+      (size_t)(__softboundcets_lock_space_end - __softboundcets_temporal_space_begin);
+    committed_entries += __SOFTBOUNDCETS_LOCK_SPACE_COMMIT_ENTRIES;
+    if(committed_entries < entries)
+      committed_entries = entries;
+    if(committed_entries > __softboundcets_n_temporal_entries)
+      committed_entries = __softboundcets_n_temporal_entries;
+
+    int populate = __softboundcets_prefault == __SOFTBOUNDCETS_PREFAULT_ALL;
+    if(__SOFTBOUNDCETS_FREE_MAP){
+      softboundcets_region_commit(&softboundcets_free_map_region, 
+                                  committed_entries * sizeof(size_t), populate);
+    }
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+    softboundcets_region_commit(&softboundcets_lock_generations_region, 
+                                committed_entries * sizeof(unsigned int), populate);
+#endif
+    softboundcets_region_commit(&softboundcets_lock_space_region, 
+                                committed_entries * sizeof(size_t), populate);
+
+    /* published last, as the other threads read it without the mutex */
+    __softboundcets_lock_space_end = 
+      __softboundcets_temporal_space_begin + committed_entries;
+  }
+
+#ifdef __SOFTBOUNDCETS_THREADS
+  pthread_mutex_unlock(&softboundcets_lock_space_mutex);
+#endif
+}
+
 static int softboundcets_initialized = 0;
 
+static void softboundcets_print_stats_handler(int signal_number);
+
 __NO_INLINE void __softboundcets_stub(void) {
   return;
 }
@@ -115,55 +841,111 @@ void __softboundcets_init(void)
   
   assert(sizeof(__softboundcets_trie_entry_t) >= 16);
 
-  /* Allocating the temporal shadow space */
+#if defined(__x86_64__)
+  softboundcets_stream_copy = softboundcets_cpu_has_avx2() ? 
+    softboundcets_stream_copy_avx2 : softboundcets_stream_copy_sse2;
+#endif
 
-  size_t temporal_table_length = (__SOFTBOUNDCETS_N_TEMPORAL_ENTRIES)* sizeof(void*);
+  long page_size = sysconf(_SC_PAGESIZE);
+  if(page_size > 0)
+    softboundcets_page_size = (size_t) page_size;
+
+  softboundcets_parse_options();
+
+  /* Allocating the temporal shadow space. With grow, the lock space
+     and the free map are committed as the lock locations are used */
+
+  size_t n_temporal_entries = __softboundcets_n_temporal_entries;
+  size_t initial_entries = softboundcets_grow_regions ? 
+    __SOFTBOUNDCETS_LOCK_SPACE_COMMIT_ENTRIES : n_temporal_entries;
+  if(initial_entries > n_temporal_entries)
+    initial_entries = n_temporal_entries;
+  int populate_all = __softboundcets_prefault == __SOFTBOUNDCETS_PREFAULT_ALL;
+  int populate_stacks = __softboundcets_prefault != __SOFTBOUNDCETS_PREFAULT_NONE;
+
+  __softboundcets_temporal_space_begin = 
+    softboundcets_region_map(&softboundcets_lock_space_region, 
+                             n_temporal_entries * sizeof(void*), 
+                             initial_entries * sizeof(void*), populate_all);
+  __softboundcets_lock_space_end = 
+    __softboundcets_temporal_space_begin + initial_entries;
+
+  size_t* lock_space_begin = __softboundcets_temporal_space_begin;
+
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  /* Packed keys find the lock from its index in the temporal space:
+     index 0 stands for the null lock and key 1, the key of globals,
+     for the global lock at index 1 */
+  __softboundcets_lock_generations = 
+    softboundcets_region_map(&softboundcets_lock_generations_region, 
+                             n_temporal_entries * sizeof(unsigned int), 
+                             initial_entries * sizeof(unsigned int), populate_all);
+  lock_space_begin = __softboundcets_temporal_space_begin + 2;
+#endif
 
-  __softboundcets_lock_new_location = mmap(0, temporal_table_length, 
-                                           PROT_READ| PROT_WRITE,
-                                           SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
-  
-  assert(__softboundcets_lock_new_location != (void*) -1);
-  __softboundcets_temporal_space_begin = (size_t *)__softboundcets_lock_new_location;
+#ifdef __SOFTBOUNDCETS_THREADS
+  /* every thread, including this one, takes chunks of lock locations */
+  __softboundcets_lock_space_next = (size_t) lock_space_begin;
+#else
+  __softboundcets_lock_new_location = lock_space_begin;
+#endif
 
 
-  size_t stack_temporal_table_length = (__SOFTBOUNDCETS_N_STACK_TEMPORAL_ENTRIES) * sizeof(void*);
-  __softboundcets_stack_temporal_space_begin = mmap(0, stack_temporal_table_length, 
-                                                    PROT_READ| PROT_WRITE, 
-                                                    SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
-  assert(__softboundcets_stack_temporal_space_begin != (void*) -1);
+  softboundcets_region_t stack_temporal_region;
+  size_t stack_temporal_table_length = (__softboundcets_n_stack_temporal_entries) * sizeof(void*);
+  __softboundcets_stack_temporal_space_begin = 
+    softboundcets_region_map(&stack_temporal_region, stack_temporal_table_length, 
+                             stack_temporal_table_length, populate_stacks);
 
 
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  __softboundcets_global_lock = __softboundcets_temporal_space_begin + 1;
+#else
   size_t global_lock_size = (__SOFTBOUNDCETS_N_GLOBAL_LOCK_SIZE) * sizeof(void*);
   __softboundcets_global_lock = mmap(0, global_lock_size, 
                                      PROT_READ|PROT_WRITE, 
                                      SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
   assert(__softboundcets_global_lock != (void*) -1);
+#endif
   //  __softboundcets_global_lock =  __softboundcets_lock_new_location++;
   *((size_t*)__softboundcets_global_lock) = 1;
 
 
 
-  size_t shadow_stack_size = __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES * sizeof(size_t);
-  __softboundcets_shadow_stack_ptr = mmap(0, shadow_stack_size, 
-                                          PROT_READ|PROT_WRITE, 
-                                          SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
-  assert(__softboundcets_shadow_stack_ptr != (void*)-1);
-
-  *((size_t*)__softboundcets_shadow_stack_ptr) = 0; /* prev stack size */
-  size_t * current_size_shadow_stack_ptr =  __softboundcets_shadow_stack_ptr +1 ;
-  *(current_size_shadow_stack_ptr) = 0;
+  softboundcets_region_t shadow_stack_region;
+  size_t shadow_stack_size = __softboundcets_shadow_stack_entries * sizeof(size_t);
+  __softboundcets_shadow_stack_ptr = 
+    softboundcets_region_map(&shadow_stack_region, shadow_stack_size, 
+                             shadow_stack_size, populate_stacks);
+  softboundcets_shadow_stack_begin = __softboundcets_shadow_stack_ptr;
 
 
   if(__SOFTBOUNDCETS_FREE_MAP) {
-    size_t length_free_map = (__SOFTBOUNDCETS_N_FREE_MAP_ENTRIES) * sizeof(size_t);
-    __softboundcets_free_map_table = mmap(0, length_free_map, 
-                                          PROT_READ| PROT_WRITE, 
-                                          SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
-    assert(__softboundcets_free_map_table != (void*) -1);
+    __softboundcets_free_map_table = 
+      softboundcets_region_map(&softboundcets_free_map_region, 
+                               n_temporal_entries * sizeof(size_t), 
+                               initial_entries * sizeof(size_t), populate_all);
   }
 
 
+  size_t length_metadata_seq = (__SOFTBOUNDCETS_N_METADATA_SEQ_ENTRIES) * sizeof(size_t);
+  __softboundcets_metadata_seq_table = mmap(0, length_metadata_seq, 
+                                            PROT_READ| PROT_WRITE, 
+                                            SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
+  assert(__softboundcets_metadata_seq_table != (void*) -1);
+
+#ifdef __SOFTBOUNDCETS_ALLOCATOR
+  softboundcets_heap_init();
+#endif
+
+#ifdef __SOFTBOUNDCETS_LINEAR_SHADOW
+  /* only the pages of the entries that are written get memory */
+  size_t length_shadow = (__SOFTBOUNDCETS_LINEAR_SHADOW_ENTRIES) * sizeof(__softboundcets_trie_entry_t);
+  __softboundcets_linear_shadow = mmap(0, length_shadow, 
+                                       PROT_READ| PROT_WRITE, 
+                                       SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
+  assert(__softboundcets_linear_shadow != (void *)-1);
+#else
   size_t length_trie = (__SOFTBOUNDCETS_TRIE_PRIMARY_TABLE_ENTRIES) * sizeof(__softboundcets_trie_entry_t*);
   
   __softboundcets_trie_primary_table = mmap(0, length_trie, 
@@ -173,7 +955,473 @@ void __softboundcets_init(void)
   
   int* temp = malloc(1);
   __softboundcets_allocation_secondary_trie_allocate_range(0, (size_t)temp);
+#endif
 
+  if(softboundcets_print_stats_enabled){
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = softboundcets_print_stats_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, NULL);
+    atexit(__softboundcets_print_stats);
+  }
+}
+
+#ifdef __SOFTBOUNDCETS_THREADS
+
+void __softboundcets_refill_key_range(void){
+
+  size_t key_begin = __sync_fetch_and_add(&__softboundcets_key_id_batch, 
+                                          __SOFTBOUNDCETS_KEY_BATCH_SIZE);
+  __softboundcets_key_id_counter = key_begin;
+  __softboundcets_key_id_limit = key_begin + __SOFTBOUNDCETS_KEY_BATCH_SIZE;
+}
+
+/* Pushes the list of lock locations from first to last on the global
+   overflow list. Threads only push single lists and pop the entire
+   overflow list, so the compare and swap is not subject to ABA */
+static void softboundcets_push_lock_overflow(size_t* first, size_t* last){
+
+  size_t* head;
+  do {
+    head = __softboundcets_lock_overflow_list;
+    *((size_t**) last) = head;
+  } while(!__sync_bool_compare_and_swap(&__softboundcets_lock_overflow_list, 
+                                        head, first));
+}
+
+void __softboundcets_flush_lock_cache(size_t count){
+
+  size_t* first = __softboundcets_lock_next_location;
+  size_t* last = first;
+  size_t i;
+
+  assert(count != 0 && count <= __softboundcets_lock_free_count);
+
+  for(i = 1; i < count; i++){
+    last = *((size_t**) last);
+  }
+  __softboundcets_lock_next_location = *((size_t**) last);
+  __softboundcets_lock_free_count -= count;
+
+  softboundcets_push_lock_overflow(first, last);
+}
+
+void __softboundcets_refill_lock_cache(void){
+
+  /* Take the lock locations released by the other threads first */
+  size_t* overflow_list = __sync_lock_test_and_set(&__softboundcets_lock_overflow_list, NULL);
+  if(overflow_list != NULL){
+    __softboundcets_lock_next_location = overflow_list;
+    return;
+  }
+
+  size_t chunk_begin = __sync_fetch_and_add(&__softboundcets_lock_space_next, 
+                                            __SOFTBOUNDCETS_LOCK_CHUNK_ENTRIES * sizeof(size_t));
+  size_t* chunk_end = (size_t*) chunk_begin + __SOFTBOUNDCETS_LOCK_CHUNK_ENTRIES;
+  if(chunk_end > *((size_t* volatile*) &__softboundcets_lock_space_end))
+    __softboundcets_grow_lock_space(chunk_end);
+
+  __softboundcets_lock_new_location = (size_t*) chunk_begin;
+  __softboundcets_lock_new_location_end = chunk_end;
+}
+
+/* The regions of the threads that have exited. The shadow stack
+   region holds the link to the next spare region and the stack lock
+   region that goes with it */
+static pthread_mutex_t softboundcets_thread_region_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t* softboundcets_spare_thread_regions = NULL;
+
+static __thread size_t* softboundcets_thread_shadow_stack = NULL;
+static __thread size_t* softboundcets_thread_stack_temporal_space = NULL;
+
+void __softboundcets_thread_init(void){
+
+  size_t shadow_stack_size = __softboundcets_shadow_stack_entries * sizeof(size_t);
+  size_t stack_temporal_table_length = (__softboundcets_n_stack_temporal_entries) * sizeof(void*);
+
+  size_t* shadow_stack = NULL;
+  size_t* stack_temporal_space = NULL;
+
+  pthread_mutex_lock(&softboundcets_thread_region_mutex);
+  if(softboundcets_spare_thread_regions != NULL){
+    shadow_stack = softboundcets_spare_thread_regions;
+    softboundcets_spare_thread_regions = (size_t*) shadow_stack[0];
+    stack_temporal_space = (size_t*) shadow_stack[1];
+  }
+  pthread_mutex_unlock(&softboundcets_thread_region_mutex);
+
+  if(shadow_stack == NULL){
+    softboundcets_region_t shadow_stack_region;
+    softboundcets_region_t stack_temporal_region;
+    int populate = __softboundcets_prefault != __SOFTBOUNDCETS_PREFAULT_NONE;
+
+    shadow_stack = softboundcets_region_map(&shadow_stack_region, shadow_stack_size, 
+                                            shadow_stack_size, populate);
+    stack_temporal_space = 
+      softboundcets_region_map(&stack_temporal_region, stack_temporal_table_length, 
+                               stack_temporal_table_length, populate);
+  }
+
+  softboundcets_thread_shadow_stack = shadow_stack;
+  softboundcets_thread_stack_temporal_space = stack_temporal_space;
+
+  __softboundcets_shadow_stack_ptr = shadow_stack;
+  softboundcets_shadow_stack_begin = shadow_stack;
+
+  __softboundcets_stack_temporal_space_begin = stack_temporal_space;
+}
+
+void __softboundcets_thread_exit(void){
+
+  size_t* shadow_stack = softboundcets_thread_shadow_stack;
+
+  /* main thread, or a thread that has already been torn down */
+  if(shadow_stack == NULL)
+    return;
+
+#ifdef __SOFTBOUNDCETS_ALLOCATOR
+  __softboundcets_heap_flush_all();
+#endif
+
+  /* Return the rest of the current chunk along with the cached free
+     lock locations to the other threads */
+  while(__softboundcets_lock_new_location != __softboundcets_lock_new_location_end){
+    size_t* lock = __softboundcets_lock_new_location++;
+    *((size_t**) lock) = __softboundcets_lock_next_location;
+    __softboundcets_lock_next_location = lock;
+  }
+
+  if(__softboundcets_lock_next_location != NULL){
+    size_t* last = __softboundcets_lock_next_location;
+    while(*((size_t**) last) != NULL){
+      last = *((size_t**) last);
+    }
+    softboundcets_push_lock_overflow(__softboundcets_lock_next_location, last);
+    __softboundcets_lock_next_location = NULL;
+  }
+  __softboundcets_lock_free_count = 0;
+
+  /* Zeroing the stack locks makes the temporal checks on stale
+     pointers to the stack objects of this thread fail */
+  size_t shadow_stack_size = __softboundcets_shadow_stack_entries * sizeof(size_t);
+  size_t stack_temporal_table_length = (__softboundcets_n_stack_temporal_entries) * sizeof(void*);
+  madvise(softboundcets_thread_stack_temporal_space, stack_temporal_table_length, MADV_DONTNEED);
+  madvise(shadow_stack, shadow_stack_size, MADV_DONTNEED);
+
+  shadow_stack[1] = (size_t) softboundcets_thread_stack_temporal_space;
+
+  pthread_mutex_lock(&softboundcets_thread_region_mutex);
+  shadow_stack[0] = (size_t) softboundcets_spare_thread_regions;
+  softboundcets_spare_thread_regions = shadow_stack;
+  pthread_mutex_unlock(&softboundcets_thread_region_mutex);
+
+  softboundcets_thread_shadow_stack = NULL;
+  softboundcets_thread_stack_temporal_space = NULL;
+  softboundcets_shadow_stack_begin = NULL;
+  __softboundcets_shadow_stack_ptr = NULL;
+  __softboundcets_stack_temporal_space_begin = NULL;
+}
+
+#endif
+
+/* Statistics. The tables of the runtime are walked when the
+   statistics are asked for, reading only the pages that are in memory
+   so that the walk does not grow them, and nothing is counted on the
+   fast paths except the dereference checks with
+   -D__SOFTBOUNDCETS_STATS. Other threads keep changing the tables
+   during the walk, so their words are read with relaxed atomic loads
+   and the counts are a snapshot that may be slightly off */
+
+/* Visits the words of the resident pages of [words, words + n_words)
+   that are not zero. Adds the resident pages to *resident_pages and
+   returns the number of words visited */
+static size_t 
+softboundcets_scan_words(size_t* words, size_t n_words, size_t* resident_pages, 
+                         void (*visit)(size_t* word, __softboundcets_stats_t* stats),
+                         __softboundcets_stats_t* stats){
+
+  size_t words_per_page = softboundcets_page_size / sizeof(size_t);
+  size_t* page = (size_t*)((size_t) words & ~(softboundcets_page_size - 1));
+  size_t* end = words + n_words;
+  size_t n_visited = 0;
+  unsigned char residency[4096];
+
+  while(page < end){
+    size_t n_pages = ((size_t)(end - page) + words_per_page - 1) / words_per_page;
+    size_t i;
+
+    if(n_pages > sizeof(residency))
+      n_pages = sizeof(residency);
+
+    /* ENOMEM for a range that is not mapped */
+    if(mincore(page, n_pages * softboundcets_page_size, residency) != 0)
+      memset(residency, 0, n_pages);
+
+    for(i = 0; i < n_pages; i++, page += words_per_page){
+      size_t* word;
+      size_t* page_end = page + words_per_page;
+
+      if(!(residency[i] & 1))
+        continue;
+      if(resident_pages != NULL)
+        (*resident_pages)++;
+
+      for(word = page < words ? words : page; 
+          word < page_end && word < end; word++){
+        if(__atomic_load_n(word, __ATOMIC_RELAXED) != 0){
+          n_visited++;
+          if(visit != NULL)
+            visit(word, stats);
+        }
+      }
+    }
+  }
+  return n_visited;
+}
+
+#ifndef __SOFTBOUNDCETS_LINEAR_SHADOW
+
+static void softboundcets_stats_visit_leaf(size_t* entry, 
+                                           __softboundcets_stats_t* stats){
+
+  stats->trie_tables++;
+  softboundcets_scan_words((size_t*) __atomic_load_n(entry, __ATOMIC_RELAXED), 
+                           __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_LENGTH / sizeof(size_t), 
+                           &stats->trie_resident_pages, NULL, NULL);
+}
+
+#ifdef __SOFTBOUNDCETS_TRIE_THREE_LEVEL
+static void softboundcets_stats_visit_middle(size_t* entry, 
+                                             __softboundcets_stats_t* stats){
+
+  stats->trie_tables++;
+  softboundcets_scan_words((size_t*) __atomic_load_n(entry, __ATOMIC_RELAXED), 
+                           __SOFTBOUNDCETS_TRIE_MIDDLE_TABLE_ENTRIES, 
+                           &stats->trie_resident_pages, 
+                           softboundcets_stats_visit_leaf, stats);
+}
+#endif
+
+#endif
+
+/* Returns the number of words of the shadow stack below its highest
+   word that is not zero. Popping the shadow stack does not clear it,
+   so that is the deepest it went */
+static size_t softboundcets_shadow_stack_high_water(size_t* shadow_stack, 
+                                                    size_t n_entries){
+
+  /* the shadow stack starts on a page */
+  size_t* word = shadow_stack + n_entries;
+
+  while(word > shadow_stack){
+    size_t* page = (size_t*)(((size_t) word - 1) & ~(softboundcets_page_size - 1));
+    unsigned char residency = 0;
+
+    if(mincore(page, softboundcets_page_size, &residency) != 0 || !(residency & 1)){
+      word = page;
+      continue;
+    }
+    while(word > page){
+      word--;
+      if(*word != 0)
+        return (size_t)(word - shadow_stack) + 1;
+    }
+  }
+  return 0;
+}
+
+void __softboundcets_get_stats(__softboundcets_stats_t* stats){
+
+  memset(stats, 0, sizeof(*stats));
+  stats->page_size = softboundcets_page_size;
+  stats->deref_checks = __atomic_load_n(&__softboundcets_deref_check_count, 
+                                        __ATOMIC_RELAXED);
+
+  if(!softboundcets_initialized)
+    return;
+
+#ifndef __SOFTBOUNDCETS_LINEAR_SHADOW
+  /* the linear shadow has no tables to count */
+#ifdef __SOFTBOUNDCETS_TRIE_THREE_LEVEL
+  softboundcets_scan_words((size_t*) __softboundcets_trie_primary_table, 
+                           __SOFTBOUNDCETS_TRIE_PRIMARY_TABLE_ENTRIES, 
+                           &stats->trie_resident_pages, 
+                           softboundcets_stats_visit_middle, stats);
+#else
+  softboundcets_scan_words((size_t*) __softboundcets_trie_primary_table, 
+                           __SOFTBOUNDCETS_TRIE_PRIMARY_TABLE_ENTRIES, 
+                           &stats->trie_resident_pages, 
+                           softboundcets_stats_visit_leaf, stats);
+#endif
+#endif
+
+  size_t* lock_space_begin = __softboundcets_temporal_space_begin;
+  size_t* lock_space_end = *((size_t* volatile*) &__softboundcets_lock_space_end);
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  lock_space_begin += 2;
+#endif
+
+  stats->lock_locations_reserved = __softboundcets_n_temporal_entries;
+  stats->lock_locations_committed = 
+    (size_t)(lock_space_end - __softboundcets_temporal_space_begin);
+
+  /* With threads, the locations are taken from the lock space in
+     chunks, and the rest of the chunk of this thread is free */
+#ifdef __SOFTBOUNDCETS_THREADS
+  size_t* lock_space_next = (size_t*) *((volatile size_t*) &__softboundcets_lock_space_next);
+  if(lock_space_next > lock_space_end)
+    lock_space_next = lock_space_end;
+  stats->lock_locations_allocated = (size_t)(lock_space_next - lock_space_begin);
+  if(__softboundcets_lock_new_location != NULL)
+    stats->lock_locations_free = 
+      (size_t)(__softboundcets_lock_new_location_end - __softboundcets_lock_new_location);
+#else
+  stats->lock_locations_allocated = 
+    (size_t)(__softboundcets_lock_new_location - lock_space_begin);
+#endif
+
+  /* The links of the free list are in the lock locations, so the walk
+     stops at a link out of the lock space. The list is the one of this
+     thread, which SIGUSR2 may have interrupted while changing it */
+  size_t* lock = __softboundcets_lock_next_location;
+  while(lock >= lock_space_begin && lock < lock_space_end && 
+        stats->lock_locations_free < stats->lock_locations_allocated){
+    stats->lock_locations_free++;
+    lock = *((size_t**) lock);
+  }
+
+  if(__SOFTBOUNDCETS_FREE_MAP){
+    stats->free_map_entries = 
+      softboundcets_scan_words(__softboundcets_free_map_table, 
+                               stats->lock_locations_committed, 
+                               &stats->free_map_resident_pages, NULL, NULL);
+  }
+
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  /* each allocation of a lock location takes the next generation of
+     the location as its key */
+  size_t index;
+  for(index = 2; index < stats->lock_locations_committed; index++){
+    stats->keys_issued += __atomic_load_n(&__softboundcets_lock_generations[index], 
+                                          __ATOMIC_RELAXED);
+  }
+#elif defined(__SOFTBOUNDCETS_THREADS)
+  stats->keys_issued = __atomic_load_n(&__softboundcets_key_id_batch, 
+                                       __ATOMIC_RELAXED) - 2;
+#else
+  stats->keys_issued = __softboundcets_key_id_counter - 2;
+#endif
+
+  if(softboundcets_shadow_stack_begin != NULL){
+    stats->shadow_stack_entries = __softboundcets_shadow_stack_entries;
+    stats->shadow_stack_high_water = 
+      softboundcets_shadow_stack_high_water(softboundcets_shadow_stack_begin, 
+                                            __softboundcets_shadow_stack_entries);
+  }
+}
+
+static size_t softboundcets_stats_percent(size_t part, size_t whole){
+
+  return whole == 0 ? 0 : part * 100 / whole;
+}
+
+/* The statistics are printed from the SIGUSR2 handler, so they are
+   formatted here instead of with snprintf, which is not
+   async-signal-safe. Both append to [*out, end) and stop at end */
+static void softboundcets_stats_append_string(char** out, char* end, 
+                                              const char* string){
+
+  while(*string != '\0' && *out < end){
+    *(*out)++ = *string++;
+  }
+}
+
+static void softboundcets_stats_append_size(char** out, char* end, size_t value){
+
+  char digits[24];
+  char* digit = digits + sizeof(digits);
+
+  *--digit = '\0';
+  do {
+    *--digit = '0' + value % 10;
+    value /= 10;
+  } while(value != 0);
+  softboundcets_stats_append_string(out, end, digit);
+}
+
+/* Prints the statistics to stderr with write and without the stdio
+   locks, so that it can be called from the SIGUSR2 handler */
+void __softboundcets_print_stats(void){
+
+  __softboundcets_stats_t stats;
+  char buffer[2048];
+  char* out = buffer;
+  char* end = buffer + sizeof(buffer);
+  size_t page_kb;
+#ifdef __SOFTBOUNDCETS_THREADS
+  const char* this_thread = " in this thread";
+#else
+  const char* this_thread = "";
+#endif
+
+  __softboundcets_get_stats(&stats);
+  page_kb = stats.page_size >> 10;
+
+  softboundcets_stats_append_string(&out, end, "SoftBoundCETS statistics (pid ");
+  softboundcets_stats_append_size(&out, end, (size_t) getpid());
+  softboundcets_stats_append_string(&out, end, ")\n  trie tables               ");
+  softboundcets_stats_append_size(&out, end, stats.trie_tables);
+  softboundcets_stats_append_string(&out, end, ", ");
+  softboundcets_stats_append_size(&out, end, stats.trie_resident_pages * page_kb);
+  softboundcets_stats_append_string(&out, end, " KB resident\n  lock locations reserved   ");
+  softboundcets_stats_append_size(&out, end, stats.lock_locations_reserved);
+  softboundcets_stats_append_string(&out, end, ", ");
+  softboundcets_stats_append_size(&out, end, stats.lock_locations_committed);
+  softboundcets_stats_append_string(&out, end, " committed\n  lock locations in use     ");
+  softboundcets_stats_append_size(&out, end, 
+                                  stats.lock_locations_allocated - stats.lock_locations_free);
+  softboundcets_stats_append_string(&out, end, ", ");
+  softboundcets_stats_append_size(&out, end, stats.lock_locations_free);
+  softboundcets_stats_append_string(&out, end, " free");
+  softboundcets_stats_append_string(&out, end, this_thread);
+  softboundcets_stats_append_string(&out, end, "\n  free map entries          ");
+  softboundcets_stats_append_size(&out, end, stats.free_map_entries);
+  softboundcets_stats_append_string(&out, end, ", ");
+  softboundcets_stats_append_size(&out, end, stats.free_map_resident_pages * page_kb);
+  softboundcets_stats_append_string(&out, end, " KB resident\n  shadow stack high water   ");
+  softboundcets_stats_append_size(&out, end, stats.shadow_stack_high_water);
+  softboundcets_stats_append_string(&out, end, " of ");
+  softboundcets_stats_append_size(&out, end, stats.shadow_stack_entries);
+  softboundcets_stats_append_string(&out, end, " words (");
+  softboundcets_stats_append_size(&out, end, 
+                                  softboundcets_stats_percent(stats.shadow_stack_high_water, 
+                                                              stats.shadow_stack_entries));
+  softboundcets_stats_append_string(&out, end, "%)");
+  softboundcets_stats_append_string(&out, end, this_thread);
+  softboundcets_stats_append_string(&out, end, "\n  keys issued               ");
+  softboundcets_stats_append_size(&out, end, stats.keys_issued);
+  softboundcets_stats_append_string(&out, end, "\n  dereference checks        ");
+  softboundcets_stats_append_size(&out, end, stats.deref_checks);
+#ifndef __SOFTBOUNDCETS_STATS
+  softboundcets_stats_append_string(&out, end, 
+                                    " (not counted without -D__SOFTBOUNDCETS_STATS)");
+#endif
+  softboundcets_stats_append_string(&out, end, "\n");
+
+  if(write(2, buffer, out - buffer) < 0)
+    return;
+}
+
+static void softboundcets_print_stats_handler(int signal_number){
+
+  int saved_errno = errno;
+
+  (void) signal_number;
+  __softboundcets_print_stats();
+  errno = saved_errno;
 }
 
 static void softboundcets_init_ctype(){  
@@ -239,7 +1487,7 @@ int main(int argc, char **argv){
 
   __softboundcets_stack_memory_allocation(&argv_loc, &argv_key);
 
-#if defined(__linux__)
+#if defined(__linux__) && !defined(__SOFTBOUNDCETS_ALLOCATOR)
   mallopt(M_MMAP_MAX, 0);
 #endif
 
@@ -317,7 +1565,7 @@ int main(int argc, char **argv){
   
   //  printf("before calling program main\n");
   return_value = softboundcets_pseudo_main(argc, new_argv);
-  __softboundcets_deallocate_shadow_stack_space();
+  __softboundcets_deallocate_shadow_stack_space(2);
 
   __softboundcets_stack_memory_deallocation(argv_key);
 
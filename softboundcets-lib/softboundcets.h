@@ -114,6 +114,55 @@ typedef struct {
 
 } __softboundcets_trie_entry_t;
 
+/* With __SOFTBOUNDCETS_SPLIT_METADATA, the secondary tables are split
+ * in a spatial plane with the base and bound of every entry followed
+ * by a temporal plane with the key and lock of every entry, so that
+ * an access to one half of the metadata does not bring the other
+ * half in the cache. A slot is the part of an entry in the first
+ * plane.
+ */
+
+typedef struct {
+  void* base;
+  void* bound;
+} __softboundcets_spatial_entry_t;
+
+typedef struct {
+  size_t key;
+  void* lock;
+} __softboundcets_temporal_entry_t;
+
+/* With __SOFTBOUNDCETS_PACKED_METADATA, an entry packs the base, the
+ * size (bound - base) and the key in 16 bytes:
+ *
+ *   base_key: base (bits 0-47), key (bits 0-15) in bits 48-63
+ *   size_key: size (bits 0-31), key (bits 16-47) in bits 32-63
+ *
+ * The lock is not stored. The key of an object is made of the index
+ * of its lock location in the temporal space and of the number of
+ * times that location was handed out, so the lock is found from the
+ * key. Sizes of 4 GB and more are stored as an infinite bound.
+ */
+
+typedef struct {
+  size_t base_key;
+  size_t size_key;
+} __softboundcets_packed_entry_t;
+
+#ifdef __SOFTBOUNDCETS_SPLIT_METADATA
+#ifndef __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+#error "__SOFTBOUNDCETS_SPLIT_METADATA requires __SOFTBOUNDCETS_SPATIAL_TEMPORAL"
+#endif
+typedef __softboundcets_spatial_entry_t __softboundcets_trie_slot_t;
+#elif defined(__SOFTBOUNDCETS_PACKED_METADATA)
+#if !defined(__SOFTBOUNDCETS_SPATIAL_TEMPORAL) || __WORDSIZE == 32
+#error "__SOFTBOUNDCETS_PACKED_METADATA requires __SOFTBOUNDCETS_SPATIAL_TEMPORAL on 64 bit"
+#endif
+typedef __softboundcets_packed_entry_t __softboundcets_trie_slot_t;
+#else
+typedef __softboundcets_trie_entry_t __softboundcets_trie_slot_t;
+#endif
+
 
 #if defined(__APPLE__)
 #define SOFTBOUNDCETS_MMAP_FLAGS (MAP_ANON|MAP_NORESERVE|MAP_PRIVATE)
@@ -153,6 +202,17 @@ static const int __SOFTBOUNDCETS_FREE_MAP = 1;
 static const int __SOFTBOUNDCETS_FREE_MAP = 0;
 #endif
 
+/* With __SOFTBOUNDCETS_THREADS, the shadow stack, the stack lock
+ * region, the key counter and the lock free list are per thread. Keys
+ * and heap lock locations are handed out to the threads in batches,
+ * so the allocation fast path does not use any atomic operation.
+ */
+#ifdef __SOFTBOUNDCETS_THREADS
+#define __SOFTBOUNDCETS_THREAD_LOCAL __thread
+#else
+#define __SOFTBOUNDCETS_THREAD_LOCAL
+#endif
+
 
 
 // check if __WORDSIZE works with clang on both Linux and MacOSX
@@ -162,13 +222,7 @@ static const size_t __SOFTBOUNDCETS_N_TEMPORAL_ENTRIES = ((size_t) 4 * (size_t)
 static const size_t __SOFTBOUNDCETS_LOWER_ZERO_POINTER_BITS = 2;
 static const size_t __SOFTBOUNDCETS_N_STACK_TEMPORAL_ENTRIES = ((size_t) 1024 * (size_t) 64);
 static const size_t __SOFTBOUNDCETS_N_GLOBAL_LOCK_SIZE = ((size_t) 1024 * (size_t) 32);
-// 2^23 entries each will be 8 bytes each 
-static const size_t __SOFTBOUNDCETS_TRIE_PRIMARY_TABLE_ENTRIES = ((size_t) 8*(size_t) 1024 * (size_t) 1024);
 static const size_t __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES = ((size_t) 128 * (size_t) 32 );
-/* 256 Million simultaneous objects */
-static const size_t __SOFTBOUNDCETS_N_FREE_MAP_ENTRIES = ((size_t) 32 * (size_t) 1024* (size_t) 1024);
-// each secondary entry has 2^ 22 entries 
-static const size_t __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES = ((size_t) 4 * (size_t) 1024 * (size_t) 1024); 
 
 #else
 
@@ -178,18 +232,137 @@ static const size_t __SOFTBOUNDCETS_LOWER_ZERO_POINTER_BITS = 3;
 static const size_t __SOFTBOUNDCETS_N_STACK_TEMPORAL_ENTRIES = ((size_t) 1024 * (size_t) 64);
 static const size_t __SOFTBOUNDCETS_N_GLOBAL_LOCK_SIZE = ((size_t) 1024 * (size_t) 32);
 
-// 2^23 entries each will be 8 bytes each 
-static const size_t __SOFTBOUNDCETS_TRIE_PRIMARY_TABLE_ENTRIES = ((size_t) 8*(size_t) 1024 * (size_t) 1024);
-
 static const size_t __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES = ((size_t) 128 * (size_t) 32 );
 
-/* 256 Million simultaneous objects */
-static const size_t __SOFTBOUNDCETS_N_FREE_MAP_ENTRIES = ((size_t) 32 * (size_t) 1024* (size_t) 1024);
-// each secondary entry has 2^ 22 entries 
-static const size_t __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES = ((size_t) 4 * (size_t) 1024 * (size_t) 1024); 
 
 #endif
 
+/* The sizes above are the defaults of the temporal_entries,
+ * stack_temporal_entries and shadow_stack_entries options of
+ * SOFTBOUNDCETS_OPTIONS, which __softboundcets_init reads into
+ * __softboundcets_n_temporal_entries and the variables that follow
+ * it. With the grow option, the lock space and the free map are only
+ * reserved at that size and committed
+ * __SOFTBOUNDCETS_LOCK_SPACE_COMMIT_ENTRIES locations at a time.
+ */
+static const size_t __SOFTBOUNDCETS_LOCK_SPACE_COMMIT_ENTRIES = ((size_t) 64 * (size_t) 1024);
+
+enum { __SOFTBOUNDCETS_PREFAULT_NONE, __SOFTBOUNDCETS_PREFAULT_STACKS, 
+       __SOFTBOUNDCETS_PREFAULT_ALL };
+
+/* Trie geometry. Metadata is kept for every 8 byte slot of the 48 bit
+ * address space. By default, the primary table points to secondary
+ * tables of 2^22 entries (128 MB of metadata for 32 MB of memory).
+ *
+ * With __SOFTBOUNDCETS_TRIE_THREE_LEVEL, the primary table points to
+ * middle tables, which point to leaves of 2^__SOFTBOUNDCETS_TRIE_LEAF_BITS
+ * entries (128 KB of metadata for 32 KB of memory by default), so a
+ * sparse heap only maps the leaves it uses.
+ */
+#ifdef __SOFTBOUNDCETS_TRIE_THREE_LEVEL
+#ifndef __SOFTBOUNDCETS_TRIE_LEAF_BITS
+#define __SOFTBOUNDCETS_TRIE_LEAF_BITS 12
+#endif
+#if __SOFTBOUNDCETS_TRIE_LEAF_BITS >= 22
+#error "three level trie leaves must be smaller than 2^22 entries"
+#endif
+#define __SOFTBOUNDCETS_TRIE_MIDDLE_BITS (22 - __SOFTBOUNDCETS_TRIE_LEAF_BITS)
+#else
+#ifndef __SOFTBOUNDCETS_TRIE_LEAF_BITS
+#define __SOFTBOUNDCETS_TRIE_LEAF_BITS 22
+#endif
+#define __SOFTBOUNDCETS_TRIE_MIDDLE_BITS 0
+#endif
+
+#define __SOFTBOUNDCETS_TRIE_LEAF_SHIFT (3 + __SOFTBOUNDCETS_TRIE_LEAF_BITS)
+#define __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT (__SOFTBOUNDCETS_TRIE_LEAF_SHIFT + __SOFTBOUNDCETS_TRIE_MIDDLE_BITS)
+
+// 2^23 entries of 8 bytes each with the default geometry
+static const size_t __SOFTBOUNDCETS_TRIE_PRIMARY_TABLE_ENTRIES = ((size_t) 1 << (48 - __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT));
+static const size_t __SOFTBOUNDCETS_TRIE_MIDDLE_TABLE_ENTRIES = ((size_t) 1 << __SOFTBOUNDCETS_TRIE_MIDDLE_BITS);
+// each secondary table (leaf) has 2^22 entries with the default geometry
+static const size_t __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES = ((size_t) 1 << __SOFTBOUNDCETS_TRIE_LEAF_BITS);
+
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+/* a packed secondary table only has the slots */
+static const size_t __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_LENGTH = 
+  ((size_t) 1 << __SOFTBOUNDCETS_TRIE_LEAF_BITS) * sizeof(__softboundcets_trie_slot_t);
+#else
+static const size_t __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_LENGTH = 
+  ((size_t) 1 << __SOFTBOUNDCETS_TRIE_LEAF_BITS) * sizeof(__softboundcets_trie_entry_t);
+#endif
+
+/* With __SOFTBOUNDCETS_LINEAR_SHADOW, the metadata is kept in one
+ * region reserved with MAP_NORESERVE at startup instead of the trie,
+ * and the entry of the pointer at addr is
+ *
+ *   __softboundcets_linear_shadow[(addr >> 3) & (ENTRIES - 1)]
+ *
+ * which takes no dependent load and no NULL test. The pass computes it
+ * inline with -softboundcets_linear_shadow. Metadata for the whole 47
+ * bit user address space would not fit in it, so the region covers
+ * 2^__SOFTBOUNDCETS_LINEAR_SHADOW_BITS bytes (8 TB by default, with
+ * 32 TB of shadow), and addresses that differ only above these bits
+ * share entries. On Linux x86-64, the program and brk heap, a PIE
+ * image and the mmap area below the stack land in different parts of
+ * the window, and the region is a multiple of the window, so the
+ * mappings placed below it take the window offsets that are free
+ * below the libraries.
+ */
+#ifdef __SOFTBOUNDCETS_LINEAR_SHADOW
+#if !defined(__SOFTBOUNDCETS_SPATIAL_TEMPORAL) || __WORDSIZE == 32
+#error "__SOFTBOUNDCETS_LINEAR_SHADOW needs 64 bit spatial and temporal metadata"
+#endif
+#if defined(__SOFTBOUNDCETS_SPLIT_METADATA) || defined(__SOFTBOUNDCETS_PACKED_METADATA) || \
+  defined(__SOFTBOUNDCETS_TRIE_THREE_LEVEL) || defined(__SOFTBOUNDCETS_PREALLOCATE_TRIE)
+#error "__SOFTBOUNDCETS_LINEAR_SHADOW replaces the trie and its metadata layouts"
+#endif
+#ifndef __SOFTBOUNDCETS_LINEAR_SHADOW_BITS
+#define __SOFTBOUNDCETS_LINEAR_SHADOW_BITS 43
+#endif
+/* The region is __softboundcets_linear_shadow_<bits>, the name the
+   instrumentation uses with -softboundcets_linear_shadow_bits=<bits>,
+   so that a program instrumented for another window, or a runtime
+   built without the linear shadow, fails to link */
+#define __SOFTBOUNDCETS_LINEAR_SHADOW_NAME_(bits) __softboundcets_linear_shadow_##bits
+#define __SOFTBOUNDCETS_LINEAR_SHADOW_NAME(bits) __SOFTBOUNDCETS_LINEAR_SHADOW_NAME_(bits)
+#define __softboundcets_linear_shadow __SOFTBOUNDCETS_LINEAR_SHADOW_NAME(__SOFTBOUNDCETS_LINEAR_SHADOW_BITS)
+static const size_t __SOFTBOUNDCETS_LINEAR_SHADOW_ENTRIES = ((size_t) 1 << (__SOFTBOUNDCETS_LINEAR_SHADOW_BITS - 3));
+#endif
+
+/* Packed keys: the low bits index the lock location in the temporal
+   space, the high bits count the allocations of the location */
+static const size_t __SOFTBOUNDCETS_PACKED_LOCK_INDEX_BITS = 26;
+static const size_t __SOFTBOUNDCETS_PACKED_MAX_GENERATION = ((size_t) 1 << 22) - 1;
+static const size_t __SOFTBOUNDCETS_PACKED_ADDRESS_MASK = ((size_t) 1 << 48) - 1;
+static const size_t __SOFTBOUNDCETS_PACKED_INFINITE_SIZE = ((size_t) 1 << 32) - 1;
+
+/* Secondary tables that span whole huge pages are mapped with
+ * MAP_HUGETLB when __SOFTBOUNDCETS_TRIE_HUGETLB is defined, and
+ * marked with MADV_HUGEPAGE with the huge_pages option, which
+ * __SOFTBOUNDCETS_TRIE_HUGEPAGES turns on by default.
+ */
+static const size_t __SOFTBOUNDCETS_TRIE_HUGE_PAGE_SIZE = ((size_t) 2 * (size_t) 1024 * (size_t) 1024);
+
+/* Freeing an object of at least this many bytes releases the pages of
+   metadata that only describe it */
+static const size_t __SOFTBOUNDCETS_TRIE_RECLAIM_THRESHOLD = ((size_t) 64 * (size_t) 1024);
+
+/* Number of keys and heap lock locations handed to a thread at a time */
+static const size_t __SOFTBOUNDCETS_KEY_BATCH_SIZE = ((size_t) 64 * (size_t) 1024);
+static const size_t __SOFTBOUNDCETS_LOCK_CHUNK_ENTRIES = ((size_t) 4 * (size_t) 1024);
+/* A thread returns half of its free lock locations to the global
+   overflow list once it caches this many */
+static const size_t __SOFTBOUNDCETS_LOCK_CACHE_ENTRIES = ((size_t) 8 * (size_t) 1024);
+
+/* Metadata copies of at least this many bytes that do not overlap
+   use non-temporal stores, so that they do not evict the cache */
+static const size_t __SOFTBOUNDCETS_STREAMING_COPY_THRESHOLD = ((size_t) 256 * (size_t) 1024);
+
+/* Sequence locks guarding the metadata of the locations accessed by
+   atomic instructions, indexed by the address of the location */
+static const size_t __SOFTBOUNDCETS_N_METADATA_SEQ_ENTRIES = ((size_t) 4 * (size_t) 1024);
+
 #define __WEAK__ __attribute__((__weak__))
 
 #define __WEAK_INLINE __attribute__((__weak__,__always_inline__)) 
@@ -203,14 +376,68 @@ static const size_t __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES = ((size_t) 4 *
 #define __NO_INLINE __attribute__((__noinline__))
 
 extern __softboundcets_trie_entry_t** __softboundcets_trie_primary_table;
+#ifdef __SOFTBOUNDCETS_LINEAR_SHADOW
+extern __softboundcets_trie_entry_t* __softboundcets_linear_shadow;
+#endif
 
-extern size_t* __softboundcets_shadow_stack_ptr;
+extern __SOFTBOUNDCETS_THREAD_LOCAL size_t* __softboundcets_shadow_stack_ptr;
 extern size_t* __softboundcets_temporal_space_begin;
+/* end of the committed part of the lock space */
+extern size_t* __softboundcets_lock_space_end;
+extern size_t __softboundcets_n_temporal_entries;
+extern size_t __softboundcets_n_stack_temporal_entries;
+extern size_t __softboundcets_shadow_stack_entries;
+extern int __softboundcets_huge_pages;
+extern int __softboundcets_prefault;
+extern void __softboundcets_grow_lock_space(size_t* end);
+
+/* Cost of the runtime, as returned by __softboundcets_get_stats. The
+ * trie, free map and shadow stack figures are found by walking the
+ * tables, so collecting them costs nothing until asked for. With
+ * __SOFTBOUNDCETS_THREADS, the free lock locations and the shadow
+ * stack are those of the calling thread, and the locations and keys
+ * are counted in the chunks and batches the threads take. Dereference
+ * checks are only counted by a runtime built with
+ * -D__SOFTBOUNDCETS_STATS, and not when the instrumentation inlines
+ * them.
+ */
+typedef struct {
+  size_t trie_tables;              /* secondary and middle trie tables */
+  size_t trie_resident_pages;      /* pages of the trie in memory */
+  size_t lock_locations_reserved;  /* temporal_entries */
+  size_t lock_locations_committed;
+  size_t lock_locations_allocated; /* handed out of the lock space */
+  size_t lock_locations_free;      /* on the lock free list */
+  size_t free_map_entries;         /* live heap objects in the free map */
+  size_t free_map_resident_pages;
+  size_t shadow_stack_entries;     /* words of the shadow stack */
+  size_t shadow_stack_high_water;  /* words of it that were used */
+  size_t keys_issued;
+  size_t deref_checks;
+  size_t page_size;                /* of the resident page counts */
+} __softboundcets_stats_t;
+
+extern size_t __softboundcets_deref_check_count;
+
+/* the checks of all the threads add to the count */
+#if defined(__SOFTBOUNDCETS_STATS) && defined(__SOFTBOUNDCETS_THREADS)
+#define __SOFTBOUNDCETS_COUNT_DEREF_CHECK() \
+  __atomic_fetch_add(&__softboundcets_deref_check_count, 1, __ATOMIC_RELAXED)
+#elif defined(__SOFTBOUNDCETS_STATS)
+#define __SOFTBOUNDCETS_COUNT_DEREF_CHECK() __softboundcets_deref_check_count++
+#else
+#define __SOFTBOUNDCETS_COUNT_DEREF_CHECK()
+#endif
+
+void __softboundcets_get_stats(__softboundcets_stats_t* stats);
+void __softboundcets_print_stats(void);
 
-extern size_t* __softboundcets_stack_temporal_space_begin;
+extern __SOFTBOUNDCETS_THREAD_LOCAL size_t* __softboundcets_stack_temporal_space_begin;
 extern size_t* __softboundcets_free_map_table;
+extern size_t* __softboundcets_metadata_seq_table;
+extern unsigned int* __softboundcets_lock_generations;
 
-extern __SOFTBOUNDCETS_NORETURN void __softboundcets_abort();
+extern __SOFTBOUNDCETS_NORETURN void __softboundcets_abort(void);
 extern void __softboundcets_printf(const char* str, ...);
 extern size_t* __softboundcets_global_lock; 
 
@@ -219,55 +446,71 @@ void* __softboundcets_safe_malloc(size_t);
 void __softboundcets_safe_free(void*);
 
 void * __softboundcets_safe_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
+void __softboundcets_metadata_move(void* dest, const void* from, size_t length);
+
+/* Metadata of a pointer that a global is initialized with. The
+   instrumentation emits a table of these for each module */
+typedef struct {
+  void* addr_of_ptr;
+  void* base;
+  void* bound;
+} __softboundcets_global_metadata_t;
+
+void __softboundcets_install_global_metadata(__softboundcets_global_metadata_t* records, 
+                                             size_t n_records);
 __WEAK_INLINE void __softboundcets_allocation_secondary_trie_allocate(void* addr_of_ptr);
-__WEAK_INLINE void __softboundcets_add_to_free_map(size_t ptr_key, void* ptr) ;
+__WEAK_INLINE void __softboundcets_add_to_free_map(void* ptr_lock, void* ptr) ;
+__WEAK_INLINE void __softboundcets_memory_deallocation(void* ptr_lock, size_t ptr_key);
 
 /******************************************************************************/
 
-static __attribute__ ((__constructor__)) void __softboundcets_global_init();
-
 extern __NO_INLINE void __softboundcets_stub(void);
 
 extern void __softboundcets_init(void);
 
+/* The instrumentation defines __softboundcets_global_init in each
+   module, so the bitcode linked into the modules leaves it out */
+#ifndef __SOFTBOUNDCETS_RT_BITCODE
+
+static __attribute__ ((__constructor__)) void __softboundcets_global_init();
+
 void __softboundcets_global_init()
 {
   __softboundcets_init();
   __softboundcets_stub();
 }
 
+#endif
+
 
 /* Layout of the shadow stack
 
-  1) size of the previous stack frame
-  2) size of the current stack frame
-  3) base/bound/key/lock of each argument
+  The shadow stack grows upwards and shadow_stack_ptr points past the
+  innermost frame. A frame has one slot of
+  __SOFTBOUNDCETS_METADATA_NUM_FIELDS words for the returned pointer
+  and one for each pointer argument. Slot 0, the return, is right
+  below shadow_stack_ptr and slot n, the nth pointer argument, is n
+  slots further down, so the callee finds its slots at constant
+  offsets without knowing the size of the frame.
 
-  Allocation: read the current stack frames size, increment the
-  shadow_stack_ptr by current_size + 2, store the previous size into
-  the new prev value, calcuate the allocation size and store in the
-  new current stack size field; Deallocation: read the previous size,
-  and decrement the shadow_stack_ptr */
-  
-__WEAK_INLINE void __softboundcets_allocate_shadow_stack_space(int num_pointer_args){
- 
+  Allocation: add the frame size, which is a constant of the call
+  site, to shadow_stack_ptr; Deallocation: subtract it */
 
-  size_t* prev_stack_size_ptr = __softboundcets_shadow_stack_ptr + 1;
-  size_t prev_stack_size = *((size_t*)prev_stack_size_ptr);
+__WEAK_INLINE size_t* __softboundcets_shadow_stack_slot(int arg_no){
 
-  __softboundcets_shadow_stack_ptr = __softboundcets_shadow_stack_ptr + prev_stack_size + 2;
-  
-  *((size_t*) __softboundcets_shadow_stack_ptr) = prev_stack_size;
-  size_t* current_stack_size_ptr = __softboundcets_shadow_stack_ptr + 1;
+  return __softboundcets_shadow_stack_ptr - 
+    (arg_no + 1) * __SOFTBOUNDCETS_METADATA_NUM_FIELDS;
+}
   
-  ssize_t size = num_pointer_args * __SOFTBOUNDCETS_METADATA_NUM_FIELDS;
-  *((size_t*) current_stack_size_ptr) = size;
+__WEAK_INLINE void __softboundcets_allocate_shadow_stack_space(int num_pointer_args){
+ 
+  __softboundcets_shadow_stack_ptr += 
+    num_pointer_args * __SOFTBOUNDCETS_METADATA_NUM_FIELDS;
 }
    
 __WEAK_INLINE void* __softboundcets_load_base_shadow_stack(int arg_no){
   assert (arg_no >= 0 );
-  size_t count = 2 +  arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __BASE_INDEX ;
-  size_t* base_ptr = (__softboundcets_shadow_stack_ptr + count); 
+  size_t* base_ptr = __softboundcets_shadow_stack_slot(arg_no) + __BASE_INDEX;
   void* base = *((void**)base_ptr);
   return base;
 }
@@ -275,8 +518,7 @@ __WEAK_INLINE void* __softboundcets_load_base_shadow_stack(int arg_no){
 __WEAK_INLINE void* __softboundcets_load_bound_shadow_stack(int arg_no){
 
   assert (arg_no >= 0 );
-  size_t count = 2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS  + __BOUND_INDEX ;
-  size_t* bound_ptr = (__softboundcets_shadow_stack_ptr + count); 
+  size_t* bound_ptr = __softboundcets_shadow_stack_slot(arg_no) + __BOUND_INDEX;
 
   void* bound = *((void**)bound_ptr);
   return bound;
@@ -285,8 +527,7 @@ __WEAK_INLINE void* __softboundcets_load_bound_shadow_stack(int arg_no){
 __WEAK_INLINE size_t __softboundcets_load_key_shadow_stack(int arg_no){
 
   assert (arg_no >= 0 );
-  size_t count = 2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS  + __KEY_INDEX ;
-  size_t* key_ptr = (__softboundcets_shadow_stack_ptr + count); 
+  size_t* key_ptr = __softboundcets_shadow_stack_slot(arg_no) + __KEY_INDEX;
   size_t key = *key_ptr;
   return key;
 }
@@ -294,8 +535,7 @@ __WEAK_INLINE size_t __softboundcets_load_key_shadow_stack(int arg_no){
 __WEAK_INLINE void* __softboundcets_load_lock_shadow_stack(int arg_no){
 
   assert (arg_no >= 0 );
-  size_t count = 2 + arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __LOCK_INDEX;
-  size_t* lock_ptr = (__softboundcets_shadow_stack_ptr + count); 
+  size_t* lock_ptr = __softboundcets_shadow_stack_slot(arg_no) + __LOCK_INDEX;
   void* lock = *((void**)lock_ptr);
   return lock;
 }
@@ -303,8 +543,7 @@ __WEAK_INLINE void* __softboundcets_load_lock_shadow_stack(int arg_no){
 __WEAK_INLINE void __softboundcets_store_base_shadow_stack(void* base, int arg_no){
   
   assert(arg_no >= 0);
-  size_t count = 2 +  arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __BASE_INDEX ;
-  void** base_ptr = (void**)(__softboundcets_shadow_stack_ptr + count); 
+  void** base_ptr = (void**)(__softboundcets_shadow_stack_slot(arg_no) + __BASE_INDEX);
 
   *(base_ptr) = base;
 
@@ -313,16 +552,14 @@ __WEAK_INLINE void __softboundcets_store_base_shadow_stack(void* base, int arg_n
 __WEAK_INLINE void __softboundcets_store_bound_shadow_stack(void* bound, int arg_no){
 
   assert(arg_no >= 0);
-  size_t count = 2 +  arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __BOUND_INDEX ;
-  void** bound_ptr = (void**)(__softboundcets_shadow_stack_ptr + count); 
+  void** bound_ptr = (void**)(__softboundcets_shadow_stack_slot(arg_no) + __BOUND_INDEX);
 
   *(bound_ptr) = bound;
 }
 
 __WEAK_INLINE void __softboundcets_store_key_shadow_stack(size_t key, int arg_no){
   assert(arg_no >= 0);
-  size_t count = 2 +  arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __KEY_INDEX ;
-  size_t* key_ptr = (__softboundcets_shadow_stack_ptr + count); 
+  size_t* key_ptr = __softboundcets_shadow_stack_slot(arg_no) + __KEY_INDEX;
 
   *(key_ptr) = key;
 
@@ -331,34 +568,310 @@ __WEAK_INLINE void __softboundcets_store_key_shadow_stack(size_t key, int arg_no
 
 __WEAK_INLINE void __softboundcets_store_lock_shadow_stack(void* lock, int arg_no){
   assert(arg_no >= 0);
-  size_t count = 2 +  arg_no * __SOFTBOUNDCETS_METADATA_NUM_FIELDS + __LOCK_INDEX ;
-  void** lock_ptr = (void**)(__softboundcets_shadow_stack_ptr + count); 
+  void** lock_ptr = (void**)(__softboundcets_shadow_stack_slot(arg_no) + __LOCK_INDEX);
 
   *(lock_ptr) = lock;
 }
 
-__WEAK_INLINE void __softboundcets_deallocate_shadow_stack_space(){
+/* Stores all the metadata of a pointer argument with one call */
+
+__WEAK_INLINE void 
+__softboundcets_store_metadata_shadow_stack(void* base, void* bound, 
+                                            size_t key, void* lock, 
+                                            int arg_no){
+  assert(arg_no >= 0);
+  size_t* slot_ptr = __softboundcets_shadow_stack_slot(arg_no);
+
+#ifndef __SOFTBOUNDCETS_TEMPORAL
+  slot_ptr[__BASE_INDEX] = (size_t) base;
+  slot_ptr[__BOUND_INDEX] = (size_t) bound;
+#endif
 
-  size_t* reserved_space_ptr = __softboundcets_shadow_stack_ptr;
+#ifndef __SOFTBOUNDCETS_SPATIAL
+  slot_ptr[__KEY_INDEX] = key;
+  slot_ptr[__LOCK_INDEX] = (size_t) lock;
+#endif
+}
 
-  size_t read_value = *((size_t*) reserved_space_ptr);
+__WEAK_INLINE void __softboundcets_deallocate_shadow_stack_space(int num_pointer_args){
 
-  assert((read_value >=0 && read_value <= __SOFTBOUNDCETS_SHADOW_STACK_ENTRIES));
-                                                
-  __softboundcets_shadow_stack_ptr =  __softboundcets_shadow_stack_ptr - read_value - 2;
+  __softboundcets_shadow_stack_ptr -= 
+    num_pointer_args * __SOFTBOUNDCETS_METADATA_NUM_FIELDS;
 }
 
 __WEAK_INLINE __softboundcets_trie_entry_t* __softboundcets_trie_allocate(){
   
-  __softboundcets_trie_entry_t* secondary_entry;
-  size_t length = (__SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES) * sizeof(__softboundcets_trie_entry_t);
-  secondary_entry = __softboundcets_safe_mmap(0, length, PROT_READ| PROT_WRITE, 
-					      SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
+  __softboundcets_trie_entry_t* secondary_entry = NULL;
+  size_t length = __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_LENGTH;
+
+#if defined(__SOFTBOUNDCETS_TRIE_HUGETLB) && defined(MAP_HUGETLB)
+  if(length % __SOFTBOUNDCETS_TRIE_HUGE_PAGE_SIZE == 0){
+    secondary_entry = mmap(0, length, PROT_READ| PROT_WRITE, 
+                           SOFTBOUNDCETS_MMAP_FLAGS | MAP_HUGETLB, -1, 0);
+    /* no huge pages reserved, use normal pages */
+    if(secondary_entry == MAP_FAILED)
+      secondary_entry = NULL;
+  }
+#endif
+
+  if(secondary_entry == NULL){
+    int flags = SOFTBOUNDCETS_MMAP_FLAGS;
+#ifdef MAP_POPULATE
+    if(__softboundcets_prefault == __SOFTBOUNDCETS_PREFAULT_ALL)
+      flags |= MAP_POPULATE;
+#endif
+    secondary_entry = __softboundcets_safe_mmap(0, length, PROT_READ| PROT_WRITE, 
+                                                flags, -1, 0);
+#ifdef MADV_HUGEPAGE
+    if(__softboundcets_huge_pages && length >= __SOFTBOUNDCETS_TRIE_HUGE_PAGE_SIZE)
+      madvise(secondary_entry, length, MADV_HUGEPAGE);
+#endif
+  }
   //assert(secondary_entry != (void*)-1); 
   //printf("snd trie table %p %lx\n", secondary_entry, length);
   return secondary_entry;
 }
 
+/* Installs table in *slot unless another table is already there, and
+   returns the table installed. With threads, the first table installed
+   wins and the others are released */
+__WEAK_INLINE void* 
+__softboundcets_trie_install_table(void** slot, void* table, size_t length){
+
+#ifdef __SOFTBOUNDCETS_THREADS
+  void* installed_table = __sync_val_compare_and_swap(slot, NULL, table);
+  if(installed_table != NULL){
+    munmap(table, length);
+    return installed_table;
+  }
+#else
+  *slot = table;
+#endif
+  return table;
+}
+
+/* Allocates the table for primary_index, which is a secondary table
+   or, with the three level trie, a middle table, and installs it in
+   the primary table */
+__WEAK_INLINE void* 
+__softboundcets_trie_install(size_t primary_index){
+
+  void** slot = (void**) &__softboundcets_trie_primary_table[primary_index];
+
+#ifdef __SOFTBOUNDCETS_TRIE_THREE_LEVEL
+  size_t length = (__SOFTBOUNDCETS_TRIE_MIDDLE_TABLE_ENTRIES) * sizeof(__softboundcets_trie_entry_t*);
+  void* trie_middle_table = __softboundcets_safe_mmap(0, length, PROT_READ| PROT_WRITE, 
+                                                      SOFTBOUNDCETS_MMAP_FLAGS, -1, 0);
+  return __softboundcets_trie_install_table(slot, trie_middle_table, length);
+#else
+  size_t length = __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_LENGTH;
+  return __softboundcets_trie_install_table(slot, __softboundcets_trie_allocate(), length);
+#endif
+}
+
+#ifdef __SOFTBOUNDCETS_LINEAR_SHADOW
+
+/* Returns the entry of the pointer at addr_of_ptr in the linear
+   shadow region, which has an entry for every address */
+__WEAK_INLINE __softboundcets_trie_slot_t* 
+__softboundcets_linear_shadow_entry(size_t addr_of_ptr){
+
+  size_t index = ((addr_of_ptr >> 3) & (__SOFTBOUNDCETS_LINEAR_SHADOW_ENTRIES - 1));
+  return &__softboundcets_linear_shadow[index];
+}
+
+#endif
+
+/* Returns the trie entry holding the metadata of the pointer at
+   addr_of_ptr, or NULL if no metadata was ever stored in its
+   secondary table */
+__WEAK_INLINE __softboundcets_trie_slot_t* 
+__softboundcets_trie_lookup(size_t addr_of_ptr){
+
+#ifdef __SOFTBOUNDCETS_LINEAR_SHADOW
+  return __softboundcets_linear_shadow_entry(addr_of_ptr);
+#else
+  size_t primary_index = (addr_of_ptr >> __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT);
+  __softboundcets_trie_entry_t* trie_secondary_table;
+
+#ifdef __SOFTBOUNDCETS_TRIE_THREE_LEVEL
+  __softboundcets_trie_entry_t** trie_middle_table = 
+    (__softboundcets_trie_entry_t**) __softboundcets_trie_primary_table[primary_index];
+  if(trie_middle_table == NULL)
+    return NULL;
+
+  size_t middle_index = ((addr_of_ptr >> __SOFTBOUNDCETS_TRIE_LEAF_SHIFT) & 
+                         (__SOFTBOUNDCETS_TRIE_MIDDLE_TABLE_ENTRIES - 1));
+  trie_secondary_table = trie_middle_table[middle_index];
+#else
+  trie_secondary_table = __softboundcets_trie_primary_table[primary_index];
+#endif
+
+  if(trie_secondary_table == NULL)
+    return NULL;
+
+  size_t secondary_index = ((addr_of_ptr >> 3) & (__SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES - 1));
+  return &((__softboundcets_trie_slot_t*) trie_secondary_table)[secondary_index];
+#endif
+}
+
+/* Returns the trie entry for addr_of_ptr, allocating the tables on
+   the way when they do not exist yet */
+__WEAK_INLINE __softboundcets_trie_slot_t* 
+__softboundcets_trie_lookup_allocate(size_t addr_of_ptr){
+
+#ifdef __SOFTBOUNDCETS_LINEAR_SHADOW
+  return __softboundcets_linear_shadow_entry(addr_of_ptr);
+#else
+  size_t primary_index = (addr_of_ptr >> __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT);
+  __softboundcets_trie_entry_t* trie_secondary_table;
+
+#ifdef __SOFTBOUNDCETS_TRIE_THREE_LEVEL
+  __softboundcets_trie_entry_t** trie_middle_table = 
+    (__softboundcets_trie_entry_t**) __softboundcets_trie_primary_table[primary_index];
+  if(trie_middle_table == NULL){
+    trie_middle_table = __softboundcets_trie_install(primary_index);
+  }
+
+  size_t middle_index = ((addr_of_ptr >> __SOFTBOUNDCETS_TRIE_LEAF_SHIFT) & 
+                         (__SOFTBOUNDCETS_TRIE_MIDDLE_TABLE_ENTRIES - 1));
+  trie_secondary_table = trie_middle_table[middle_index];
+  if(trie_secondary_table == NULL){
+    size_t length = __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_LENGTH;
+    trie_secondary_table = 
+      __softboundcets_trie_install_table((void**) &trie_middle_table[middle_index], 
+                                         __softboundcets_trie_allocate(), length);
+  }
+#else
+  trie_secondary_table = __softboundcets_trie_primary_table[primary_index];
+
+  if(!__SOFTBOUNDCETS_PREALLOCATE_TRIE) {
+    if(trie_secondary_table == NULL){
+      trie_secondary_table =  __softboundcets_trie_install(primary_index);
+    }    
+    assert(trie_secondary_table != NULL);
+  }
+#endif
+
+  size_t secondary_index = ((addr_of_ptr >> 3) & (__SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES - 1));
+  return &((__softboundcets_trie_slot_t*) trie_secondary_table)[secondary_index];
+#endif
+}
+
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+
+__WEAK_INLINE void* __softboundcets_packed_key_lock(size_t key){
+
+  /* key 0 goes with a null lock */
+  if(key == 0)
+    return NULL;
+  return __softboundcets_temporal_space_begin + 
+    (key & (((size_t) 1 << __SOFTBOUNDCETS_PACKED_LOCK_INDEX_BITS) - 1));
+}
+
+__WEAK_INLINE void 
+__softboundcets_packed_store(__softboundcets_packed_entry_t* entry_ptr, 
+                             void* base, void* bound, size_t key, void* lock){
+
+  size_t size = 0;
+  if(bound > base){
+    size = (size_t)((char*) bound - (char*) base);
+    if(size > __SOFTBOUNDCETS_PACKED_INFINITE_SIZE)
+      size = __SOFTBOUNDCETS_PACKED_INFINITE_SIZE;
+  }
+
+  if(__SOFTBOUNDCETS_DEBUG && lock != __softboundcets_packed_key_lock(key)){
+    __softboundcets_printf("[packed_store] lock %p does not match key %zx\n", 
+                           lock, key);
+  }
+
+  entry_ptr->base_key = ((size_t) base & __SOFTBOUNDCETS_PACKED_ADDRESS_MASK) | (key << 48);
+  entry_ptr->size_key = size | ((key >> 16) << 32);
+}
+
+__WEAK_INLINE void* 
+__softboundcets_packed_base(__softboundcets_packed_entry_t* entry_ptr){
+  return (void*) (entry_ptr->base_key & __SOFTBOUNDCETS_PACKED_ADDRESS_MASK);
+}
+
+__WEAK_INLINE void* 
+__softboundcets_packed_bound(__softboundcets_packed_entry_t* entry_ptr){
+
+  size_t size = entry_ptr->size_key & __SOFTBOUNDCETS_PACKED_INFINITE_SIZE;
+  if(size == __SOFTBOUNDCETS_PACKED_INFINITE_SIZE)
+    return (void*) ((size_t) 1 << 48);
+  return (char*) __softboundcets_packed_base(entry_ptr) + size;
+}
+
+__WEAK_INLINE size_t 
+__softboundcets_packed_key(__softboundcets_packed_entry_t* entry_ptr){
+  return (entry_ptr->base_key >> 48) | ((entry_ptr->size_key >> 32) << 16);
+}
+
+#endif
+
+#if !defined(__SOFTBOUNDCETS_SPATIAL) && !defined(__SOFTBOUNDCETS_TEMPORAL) && \
+  !defined(__SOFTBOUNDCETS_PACKED_METADATA)
+
+/* Returns the key and lock of the entry whose slot is entry_ptr */
+__WEAK_INLINE __softboundcets_temporal_entry_t* 
+__softboundcets_trie_temporal_entry(__softboundcets_trie_slot_t* entry_ptr){
+
+#ifdef __SOFTBOUNDCETS_SPLIT_METADATA
+  return (__softboundcets_temporal_entry_t*) 
+    (entry_ptr + __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES);
+#else
+  return (__softboundcets_temporal_entry_t*) &entry_ptr->key;
+#endif
+}
+
+#endif
+
+/* Releases the whole pages of metadata in [metadata_begin, metadata_end) */
+__WEAK_INLINE void 
+__softboundcets_trie_release_pages(size_t metadata_begin, size_t metadata_end){
+
+  size_t page_size = (size_t) 4096;
+
+  metadata_begin = (metadata_begin + page_size - 1) & ~(page_size - 1);
+  metadata_end = metadata_end & ~(page_size - 1);
+  if(metadata_begin < metadata_end){
+    madvise((void*) metadata_begin, metadata_end - metadata_begin, MADV_DONTNEED);
+  }
+}
+
+/* Releases the pages of metadata that only describe the memory in
+   [addr, addr + size), which has been freed. The released pages read
+   back as null metadata. */
+__WEAK_INLINE void __softboundcets_trie_reclaim(void* addr, size_t size){
+
+  if(size < __SOFTBOUNDCETS_TRIE_RECLAIM_THRESHOLD)
+    return;
+
+  size_t ptr = (size_t) addr;
+  size_t ptr_end = ptr + size;
+
+  while(ptr < ptr_end){
+    size_t leaf_end = ((ptr >> __SOFTBOUNDCETS_TRIE_LEAF_SHIFT) + 1) << __SOFTBOUNDCETS_TRIE_LEAF_SHIFT;
+    size_t chunk_end = leaf_end < ptr_end ? leaf_end : ptr_end;
+
+    __softboundcets_trie_slot_t* entry_ptr = __softboundcets_trie_lookup(ptr);
+    if(entry_ptr != NULL){
+      size_t n_entries = ((chunk_end - ptr) >> 3);
+      size_t metadata_begin = (size_t) entry_ptr;
+
+      __softboundcets_trie_release_pages(metadata_begin, metadata_begin + 
+                                         n_entries * sizeof(__softboundcets_trie_slot_t));
+#ifdef __SOFTBOUNDCETS_SPLIT_METADATA
+      metadata_begin = (size_t) __softboundcets_trie_temporal_entry(entry_ptr);
+      __softboundcets_trie_release_pages(metadata_begin, metadata_begin + 
+                                         n_entries * sizeof(__softboundcets_temporal_entry_t));
+#endif
+    }
+    ptr = chunk_end;
+  }
+}
+
 #if 0
 
 //These are primary used to test and introspect  metadata during testing
@@ -391,119 +904,123 @@ __WEAK_INLINE void __softboundcets_introspect_metadata(void* ptr,
 	 ptr, base, bound, arg_no);
 }
 
-__METADATA_INLINE 
-void __softboundcets_copy_metadata(void* dest, void* from, 
-				   size_t size){
-  
-  //  printf("dest=%p, from=%p, size=%zx\n", dest, from, size);
-  
-  size_t dest_ptr = (size_t) dest;
-  size_t dest_ptr_end = dest_ptr + size;
-
-  size_t from_ptr = (size_t) from;
-  size_t from_ptr_end = from_ptr + size;
-
-
-  if(from_ptr % 8 != 0){
-    //printf("dest=%p, from=%p, size=%zx\n", dest, from, size);
-    return;
-    //    from_ptr = from_ptr %8;
-    //    dest_ptr = dest_ptr %8;
+/* Returns the number of entries from the entry of addr_of_ptr to the
+   end of its secondary table, or of the linear shadow window */
+__WEAK_INLINE size_t 
+__softboundcets_trie_entries_to_end(size_t addr_of_ptr){
 
-  }
-
-  //  printf("dest=%p, from=%p, size=%zx\n", dest, from, size);
-  __softboundcets_trie_entry_t* trie_secondary_table_dest_begin;
-  __softboundcets_trie_entry_t* trie_secondary_table_from_begin;
-  
-  size_t dest_primary_index_begin = (dest_ptr >> 25);
-  size_t dest_primary_index_end = (dest_ptr_end >> 25);
-
-  size_t from_primary_index_begin = (from_ptr >> 25);
-  size_t from_primary_index_end =  (from_ptr_end >> 25);
-
-
-  if((from_primary_index_begin != from_primary_index_end) || 
-     (dest_primary_index_begin != dest_primary_index_end)){
-
-    size_t from_sizet = from_ptr;
-    size_t dest_sizet = dest_ptr;
+#ifdef __SOFTBOUNDCETS_LINEAR_SHADOW
+  size_t n_entries = __SOFTBOUNDCETS_LINEAR_SHADOW_ENTRIES;
+#else
+  size_t n_entries = __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES;
+#endif
+  return n_entries - ((addr_of_ptr >> 3) & (n_entries - 1));
+}
 
-    size_t trie_size = size;
-    size_t index = 0;
+/* Returns the number of entries from the beginning of the secondary
+   table of addr_of_ptr up to and including its entry */
+__WEAK_INLINE size_t 
+__softboundcets_trie_entries_from_begin(size_t addr_of_ptr){
 
-    for(index=0; index < trie_size; index = index + 8){
-      
-      size_t temp_from_pindex = (from_sizet + index) >> 25;
-      size_t temp_to_pindex = (dest_sizet + index) >> 25;
+#ifdef __SOFTBOUNDCETS_LINEAR_SHADOW
+  size_t n_entries = __SOFTBOUNDCETS_LINEAR_SHADOW_ENTRIES;
+#else
+  size_t n_entries = __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES;
+#endif
+  return ((addr_of_ptr >> 3) & (n_entries - 1)) + 1;
+}
 
-      size_t dest_secondary_index = (((dest_sizet + index) >> 3) & 0x3fffff);
-      size_t from_secondary_index = (((from_sizet + index) >> 3) & 0x3fffff);
-      
-      __softboundcets_trie_entry_t* temp_from_strie = __softboundcets_trie_primary_table[temp_from_pindex];
+/* Copies n_entries entries of metadata from the entries of from_ptr
+   to the entries of dest_ptr, which are each within one secondary
+   table. A source without a secondary table has null metadata, which
+   only has to be written when the destination has a table. */
+__WEAK_INLINE void 
+__softboundcets_copy_metadata_segment(size_t dest_ptr, size_t from_ptr, 
+                                      size_t n_entries){
 
-      if(temp_from_strie == NULL){
-        temp_from_strie = __softboundcets_trie_allocate();
-        __softboundcets_trie_primary_table[temp_from_pindex] = temp_from_strie;
-      }
-     __softboundcets_trie_entry_t* temp_to_strie = __softboundcets_trie_primary_table[temp_to_pindex];
+  __softboundcets_trie_slot_t* from_entry_ptr = __softboundcets_trie_lookup(from_ptr);
+  __softboundcets_trie_slot_t* dest_entry_ptr;
 
-      if(temp_to_strie == NULL){
-        temp_to_strie = __softboundcets_trie_allocate();
-        __softboundcets_trie_primary_table[temp_to_pindex] = temp_to_strie;
-      }
+  if(from_entry_ptr == NULL){
+    dest_entry_ptr = __softboundcets_trie_lookup(dest_ptr);
+    if(dest_entry_ptr == NULL)
+      return;
 
-      void* dest_entry_ptr = &temp_to_strie[dest_secondary_index];
-      void* from_entry_ptr = &temp_from_strie[from_secondary_index];
-  
-#ifdef __SOFTBOUNDCETS_SPATIAL
-      memcpy(dest_entry_ptr, from_entry_ptr, 16);
-#elif __SOFTBOUNDCETS_TEMPORAL
-      memcpy(dest_entry_ptr, from_entry_ptr, 16);
-#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
-      memcpy(dest_entry_ptr, from_entry_ptr, 32);
-#else
-      memcpy(dest_entry_ptr, from_entry_ptr, 32);
+    memset(dest_entry_ptr, 0, n_entries * sizeof(__softboundcets_trie_slot_t));
+#ifdef __SOFTBOUNDCETS_SPLIT_METADATA
+    memset(__softboundcets_trie_temporal_entry(dest_entry_ptr), 0, 
+           n_entries * sizeof(__softboundcets_temporal_entry_t));
 #endif
-    }    
     return;
-
   }
-    
-  trie_secondary_table_dest_begin = __softboundcets_trie_primary_table[dest_primary_index_begin];
-  trie_secondary_table_from_begin = __softboundcets_trie_primary_table[from_primary_index_begin];
-  
-  if(trie_secondary_table_from_begin == NULL)
-    return;
 
-  if(trie_secondary_table_dest_begin == NULL){
-    trie_secondary_table_dest_begin = __softboundcets_trie_allocate();
-    __softboundcets_trie_primary_table[dest_primary_index_begin] = trie_secondary_table_dest_begin;
-  }
+  dest_entry_ptr = __softboundcets_trie_lookup_allocate(dest_ptr);
 
-  size_t dest_secondary_index = ((dest_ptr>> 3) & 0x3fffff);
-  size_t from_secondary_index = ((from_ptr>> 3) & 0x3fffff);
-  
-  assert(dest_secondary_index < __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES);
-  assert(from_secondary_index < __SOFTBOUNDCETS_TRIE_SECONDARY_TABLE_ENTRIES);
+  __softboundcets_metadata_move(dest_entry_ptr, from_entry_ptr, 
+                                n_entries * sizeof(__softboundcets_trie_slot_t));
+#ifdef __SOFTBOUNDCETS_SPLIT_METADATA
+  __softboundcets_metadata_move(__softboundcets_trie_temporal_entry(dest_entry_ptr), 
+                                __softboundcets_trie_temporal_entry(from_entry_ptr), 
+                                n_entries * sizeof(__softboundcets_temporal_entry_t));
+#endif
+}
 
-  void* dest_entry_ptr = &trie_secondary_table_dest_begin[dest_secondary_index];
-  void* from_entry_ptr = &trie_secondary_table_from_begin[from_secondary_index];
+/* Copies the metadata of the pointers in [from, from + size) to the
+   same offsets from dest, as memmove copies the pointers. The
+   metadata of the pointer at the 8 byte aligned address p is copied to
+   the entry of dest + (p - from), so a misaligned source or
+   destination keeps the metadata with the pointers it copies. The
+   range is copied one secondary table at a time, from the end when
+   the destination entries overlap the source entries after them. */
+__METADATA_INLINE 
+void __softboundcets_copy_metadata(void* dest, void* from, 
+				   size_t size){
   
-#ifdef __SOFTBOUNDCETS_SPATIAL
+  size_t dest_ptr = (size_t) dest;
+  size_t from_ptr = (size_t) from;
 
-  memcpy(dest_entry_ptr, from_entry_ptr, 16* (size>>3));
-#elif __SOFTBOUNDCETS_TEMPORAL
+  /* the first pointer in the source is at the next 8 byte boundary */
+  size_t skew = ((8 - (from_ptr & 7)) & 7);
+  if(size < skew + 8)
+    return;
 
-  memcpy(dest_entry_ptr, from_entry_ptr, 16* (size>>3));
-#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+  size_t n_entries = ((size - skew) >> 3);
+  from_ptr += skew;
+  dest_ptr += skew;
+
+  size_t from_index = (from_ptr >> 3);
+  size_t dest_index = (dest_ptr >> 3);
+
+  if(dest_index > from_index && dest_index - from_index < n_entries){
+    while(n_entries > 0){
+      size_t n = n_entries;
+      size_t from_entries = 
+        __softboundcets_trie_entries_from_begin(from_ptr + ((n_entries - 1) << 3));
+      size_t dest_entries = 
+        __softboundcets_trie_entries_from_begin(dest_ptr + ((n_entries - 1) << 3));
+
+      n = n < from_entries ? n : from_entries;
+      n = n < dest_entries ? n : dest_entries;
+      n_entries -= n;
+      __softboundcets_copy_metadata_segment(dest_ptr + (n_entries << 3), 
+                                            from_ptr + (n_entries << 3), n);
+    }
+    return;
+  }
 
-  memcpy(dest_entry_ptr, from_entry_ptr, 32* (size >> 3));
-#else
+  while(n_entries > 0){
+    size_t n = n_entries;
+    size_t from_entries = __softboundcets_trie_entries_to_end(from_ptr);
+    size_t dest_entries = __softboundcets_trie_entries_to_end(dest_ptr);
 
-  memcpy(dest_entry_ptr, from_entry_ptr, 32* (size>> 3));
-#endif
-  return;
+    n = n < from_entries ? n : from_entries;
+    n = n < dest_entries ? n : dest_entries;
+    __softboundcets_copy_metadata_segment(dest_ptr, from_ptr, n);
+
+    from_ptr += (n << 3);
+    dest_ptr += (n << 3);
+    n_entries -= n;
+  }
 }
 
 __WEAK_INLINE void 
@@ -537,6 +1054,7 @@ __softboundcets_spatial_load_dereference_check(void *base, void *bound,
                                                void *ptr, size_t size_of_type)
 {
 
+  __SOFTBOUNDCETS_COUNT_DEREF_CHECK();
 
   if ((ptr < base) || ((void*)((char*) ptr + size_of_type) > bound)) {
 
@@ -554,6 +1072,8 @@ __softboundcets_spatial_store_dereference_check(void *base,
                                                 void *ptr, 
                                                 size_t size_of_type)
 {
+
+  __SOFTBOUNDCETS_COUNT_DEREF_CHECK();
   
   if ((ptr < base) || ((void*)((char*)ptr + size_of_type) > bound)) {
     __softboundcets_printf("In Store Dereference Check, base=%p, bound=%p, ptr=%p, size_of_type=%zx, ptr+size=%p\n",
@@ -758,26 +1278,7 @@ __METADATA_INLINE void __softboundcets_metadata_store(void* addr_of_ptr,
 #endif 
 
   size_t ptr = (size_t) addr_of_ptr;
-  size_t primary_index;
-  __softboundcets_trie_entry_t* trie_secondary_table;
-  //  __softboundcets_trie_entry_t** trie_primary_table = __softboundcets_trie_primary_table;
-  
-  
-  primary_index = (ptr >> 25);
-  trie_secondary_table = __softboundcets_trie_primary_table[primary_index];
- 
- 
-  if(!__SOFTBOUNDCETS_PREALLOCATE_TRIE) {
-    if(trie_secondary_table == NULL){
-      trie_secondary_table =  __softboundcets_trie_allocate();
-      __softboundcets_trie_primary_table[primary_index] = trie_secondary_table;
-    }    
-    //    __softboundcetswithss_printf("addr_of_ptr=%zx, primary_index =%zx, trie_secondary_table=%p\n", addr_of_ptr, primary_index, trie_secondary_table);
-    assert(trie_secondary_table != NULL);
-  }
-  
-  size_t secondary_index = ((ptr >> 3) & 0x3fffff);
-  __softboundcets_trie_entry_t* entry_ptr =&trie_secondary_table[secondary_index];
+  __softboundcets_trie_slot_t* entry_ptr = __softboundcets_trie_lookup_allocate(ptr);
 
   if(__SOFTBOUNDCETS_DEBUG){
     //    printf("[metadata_store] base=%p, bound=%p, key=%zx, lock=%p\n", base, bound, key, lock);
@@ -797,11 +1298,17 @@ __METADATA_INLINE void __softboundcets_metadata_store(void* addr_of_ptr,
 
 
 #elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
-  
+
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  __softboundcets_packed_store(entry_ptr, base, bound, key, lock);
+#else  
   entry_ptr->base = base;
   entry_ptr->bound = bound;
-  entry_ptr->key = key;
-  entry_ptr->lock = lock;
+  __softboundcets_temporal_entry_t* temporal_entry_ptr = 
+    __softboundcets_trie_temporal_entry(entry_ptr);
+  temporal_entry_ptr->key = key;
+  temporal_entry_ptr->lock = lock;
+#endif
 
 #else
 
@@ -822,22 +1329,7 @@ __METADATA_INLINE void __softboundcets_metadata_store(void* addr_of_ptr,
 
 
     size_t ptr = (size_t) addr_of_ptr;
-    __softboundcets_trie_entry_t* trie_secondary_table;
-    size_t primary_index = ( ptr >> 25);
-    trie_secondary_table = __softboundcets_trie_primary_table[primary_index];
-
-#if 0
-    /* unnecessary control flow causes performance overhead */
-    /* this can cause segfaults with uninitialized pointer reads from memory */
-    if(trie_secondary_table == NULL){
-      trie_secondary_table = __softboundcets_trie_allocate();
-      __softboundcets_trie_primary_table[primary_index] = trie_secondary_table;
-    }
-
-#endif
-    
-    size_t secondary_index = ((ptr >> 3) & 0x3fffff);
-    __softboundcets_trie_entry_t* entry_ptr =&trie_secondary_table[secondary_index];
+    __softboundcets_trie_slot_t* entry_ptr = __softboundcets_trie_lookup_allocate(ptr);
 
     return (void*) entry_ptr;
     
@@ -845,30 +1337,46 @@ __METADATA_INLINE void __softboundcets_metadata_store(void* addr_of_ptr,
 
  __WEAK_INLINE void* __softboundcets_metadata_load_base(void* address){
       
-   __softboundcets_trie_entry_t* entry_ptr = (__softboundcets_trie_entry_t*)address;
+   __softboundcets_trie_slot_t* entry_ptr = (__softboundcets_trie_slot_t*)address;
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+   return __softboundcets_packed_base(entry_ptr);
+#else
    return entry_ptr->base;
+#endif
    
  }
 
  __WEAK_INLINE void* __softboundcets_metadata_load_bound(void* address){
 
-   __softboundcets_trie_entry_t* entry_ptr = (__softboundcets_trie_entry_t*)address;
+   __softboundcets_trie_slot_t* entry_ptr = (__softboundcets_trie_slot_t*)address;
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+   return __softboundcets_packed_bound(entry_ptr);
+#else
    return entry_ptr->bound;
+#endif
 
 
  }
 
  __WEAK_INLINE size_t __softboundcets_metadata_load_key(void* address){
 
-   __softboundcets_trie_entry_t* entry_ptr = (__softboundcets_trie_entry_t*)address;
-   return entry_ptr->key;
+   __softboundcets_trie_slot_t* entry_ptr = (__softboundcets_trie_slot_t*)address;
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+   return __softboundcets_packed_key(entry_ptr);
+#else
+   return __softboundcets_trie_temporal_entry(entry_ptr)->key;
+#endif
 
  }
 
  __WEAK_INLINE void* __softboundcets_metadata_load_lock(void* address){
 
-   __softboundcets_trie_entry_t* entry_ptr = (__softboundcets_trie_entry_t*)address;
-   return entry_ptr->lock;
+   __softboundcets_trie_slot_t* entry_ptr = (__softboundcets_trie_slot_t*)address;
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+   return __softboundcets_packed_key_lock(__softboundcets_packed_key(entry_ptr));
+#else
+   return __softboundcets_trie_temporal_entry(entry_ptr)->lock;
+#endif
 
  }
 
@@ -899,17 +1407,18 @@ __METADATA_INLINE void __softboundcets_metadata_load(void* addr_of_ptr, void** b
 #endif
 
   size_t ptr = (size_t) addr_of_ptr;
-  __softboundcets_trie_entry_t* trie_secondary_table;
-  //    __softboundcets_trie_entry_t** trie_primary_table = __softboundcets_trie_primary_table;
-    
-  //assert(__softboundcetswithss_trie_primary_table[primary_index] == trie_secondary_table);
-
-  size_t primary_index = ( ptr >> 25);
-  trie_secondary_table = __softboundcets_trie_primary_table[primary_index];
-
-
+  __softboundcets_trie_slot_t* entry_ptr = __softboundcets_trie_lookup(ptr);
+
+  /* the three level trie only preallocates the middle tables */
+#if defined(__SOFTBOUNDCETS_TRIE_THREE_LEVEL)
+  if(1) {
+#elif defined(__SOFTBOUNDCETS_LINEAR_SHADOW)
+  /* the linear shadow has an entry for every address */
+  if(0) {
+#else
   if(!__SOFTBOUNDCETS_PREALLOCATE_TRIE) {      
-    if(trie_secondary_table == NULL) {  
+#endif
+    if(entry_ptr == NULL) {  
 
 #ifdef __SOFTBOUNDCETS_SPATIAL
       *((void**) base) = 0;
@@ -936,8 +1445,6 @@ __METADATA_INLINE void __softboundcets_metadata_load(void* addr_of_ptr, void** b
   } /* PREALLOCATE_ENDS */
 
     /* MAIN SOFTBOUNDCETS LOAD WHICH RUNS ON THE NORMAL MACHINE */
-  size_t secondary_index = ((ptr >> 3) & 0x3fffff);
-  __softboundcets_trie_entry_t* entry_ptr = &trie_secondary_table[secondary_index];
     
 #ifdef __SOFTBOUNDCETS_SPATIAL
   *((void**) base) = entry_ptr->base;
@@ -949,10 +1456,20 @@ __METADATA_INLINE void __softboundcets_metadata_load(void* addr_of_ptr, void** b
 
 #elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
 
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  size_t packed_key = __softboundcets_packed_key(entry_ptr);
+  *((void**) base) = __softboundcets_packed_base(entry_ptr);
+  *((void**) bound) = __softboundcets_packed_bound(entry_ptr);
+  *((size_t*) key) = packed_key;
+  *((void**) lock) = __softboundcets_packed_key_lock(packed_key);
+#else
   *((void**) base) = entry_ptr->base;
   *((void**) bound) = entry_ptr->bound;
-  *((size_t*) key) = entry_ptr->key;
-  *((void**) lock) = (void*) entry_ptr->lock;
+  __softboundcets_temporal_entry_t* temporal_entry_ptr = 
+    __softboundcets_trie_temporal_entry(entry_ptr);
+  *((size_t*) key) = temporal_entry_ptr->key;
+  *((void**) lock) = (void*) temporal_entry_ptr->lock;
+#endif
       
 #else
   
@@ -966,9 +1483,208 @@ __METADATA_INLINE void __softboundcets_metadata_load(void* addr_of_ptr, void** b
 }
 /******************************************************************************/
 
-extern size_t __softboundcets_key_id_counter;
-extern size_t* __softboundcets_lock_next_location;
-extern size_t* __softboundcets_lock_new_location;
+/* The pass loads the metadata of a pointer loaded from memory with
+ * __softboundcets_metadata_load_spatial and
+ * __softboundcets_metadata_load_temporal, which return the two halves
+ * of the metadata by value in a pair of registers. Unlike
+ * __softboundcets_metadata_load, they do not need the metadata to be
+ * written to stack slots of the caller and read back.
+ */
+
+#if defined(__SOFTBOUNDCETS_SPATIAL) || defined(__SOFTBOUNDCETS_SPATIAL_TEMPORAL)
+
+__METADATA_INLINE __softboundcets_spatial_entry_t 
+__softboundcets_metadata_load_spatial(void* addr_of_ptr){
+
+  __softboundcets_spatial_entry_t metadata;
+  size_t ptr = (size_t) addr_of_ptr;
+  __softboundcets_trie_slot_t* entry_ptr = __softboundcets_trie_lookup(ptr);
+
+#if defined(__SOFTBOUNDCETS_TRIE_THREE_LEVEL)
+  if(1) {
+#elif defined(__SOFTBOUNDCETS_LINEAR_SHADOW)
+  /* the linear shadow has an entry for every address */
+  if(0) {
+#else
+  if(!__SOFTBOUNDCETS_PREALLOCATE_TRIE) {      
+#endif
+    if(entry_ptr == NULL) {
+      metadata.base = 0;
+      metadata.bound = 0;
+      return metadata;
+    }
+  }
+
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  metadata.base = __softboundcets_packed_base(entry_ptr);
+  metadata.bound = __softboundcets_packed_bound(entry_ptr);
+#else
+  metadata.base = entry_ptr->base;
+  metadata.bound = entry_ptr->bound;
+#endif
+  return metadata;
+}
+
+#endif
+
+#if defined(__SOFTBOUNDCETS_TEMPORAL) || defined(__SOFTBOUNDCETS_SPATIAL_TEMPORAL)
+
+__METADATA_INLINE __softboundcets_temporal_entry_t 
+__softboundcets_metadata_load_temporal(void* addr_of_ptr){
+
+  __softboundcets_temporal_entry_t metadata;
+  size_t ptr = (size_t) addr_of_ptr;
+  __softboundcets_trie_slot_t* entry_ptr = __softboundcets_trie_lookup(ptr);
+
+#if defined(__SOFTBOUNDCETS_TRIE_THREE_LEVEL)
+  if(1) {
+#elif defined(__SOFTBOUNDCETS_LINEAR_SHADOW)
+  /* the linear shadow has an entry for every address */
+  if(0) {
+#else
+  if(!__SOFTBOUNDCETS_PREALLOCATE_TRIE) {      
+#endif
+    if(entry_ptr == NULL) {
+      metadata.key = 0;
+      metadata.lock = 0;
+      return metadata;
+    }
+  }
+
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  metadata.key = __softboundcets_packed_key(entry_ptr);
+  metadata.lock = __softboundcets_packed_key_lock(metadata.key);
+#elif defined(__SOFTBOUNDCETS_SPATIAL_TEMPORAL)
+  metadata = *__softboundcets_trie_temporal_entry(entry_ptr);
+#else
+  metadata.key = entry_ptr->key;
+  metadata.lock = entry_ptr->lock;
+#endif
+  return metadata;
+}
+
+#endif
+
+/******************************************************************************/
+
+/* Atomic instructions that write a pointer update the pointer and its
+ * metadata between __softboundcets_metadata_lock and
+ * __softboundcets_metadata_unlock. Atomic loads of a pointer use
+ * __softboundcets_metadata_load_atomic, which retries until the
+ * pointer and the metadata it read were not updated in between, so
+ * they never observe a torn metadata entry or the metadata of another
+ * pointer.
+ */
+
+__WEAK_INLINE size_t* __softboundcets_metadata_seq(void* addr_of_ptr){
+
+  size_t index = ((size_t) addr_of_ptr >> 3) & (__SOFTBOUNDCETS_N_METADATA_SEQ_ENTRIES - 1);
+  return &__softboundcets_metadata_seq_table[index];
+}
+
+__WEAK_INLINE void __softboundcets_metadata_lock(void* addr_of_ptr){
+
+  size_t* seq = __softboundcets_metadata_seq(addr_of_ptr);
+  while(1){
+    size_t value = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    if(!(value & 1) && __sync_bool_compare_and_swap(seq, value, value + 1))
+      return;
+  }
+}
+
+__WEAK_INLINE void __softboundcets_metadata_unlock(void* addr_of_ptr){
+
+  size_t* seq = __softboundcets_metadata_seq(addr_of_ptr);
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef __SOFTBOUNDCETS_SPATIAL
+__WEAK_INLINE void* __softboundcets_metadata_load_atomic(void* addr_of_ptr, 
+                                                         void** base, 
+                                                         void** bound){
+#elif __SOFTBOUNDCETS_TEMPORAL
+__WEAK_INLINE void* __softboundcets_metadata_load_atomic(void* addr_of_ptr, 
+                                                         size_t* key, 
+                                                         void** lock){
+#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+__WEAK_INLINE void* __softboundcets_metadata_load_atomic(void* addr_of_ptr, 
+                                                         void** base, 
+                                                         void** bound, 
+                                                         size_t* key, 
+                                                         void** lock){
+#else
+__WEAK_INLINE void* __softboundcets_metadata_load_atomic(void* addr_of_ptr, 
+                                                         void** base, 
+                                                         void** bound, 
+                                                         size_t* key, 
+                                                         void** lock){
+#endif
+
+  size_t* seq = __softboundcets_metadata_seq(addr_of_ptr);
+  void* ptr;
+
+  while(1){
+    size_t begin = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    if(begin & 1)
+      continue;
+
+    ptr = __atomic_load_n((void**) addr_of_ptr, __ATOMIC_SEQ_CST);
+
+#ifdef __SOFTBOUNDCETS_SPATIAL
+    __softboundcets_metadata_load(addr_of_ptr, base, bound);
+#elif __SOFTBOUNDCETS_TEMPORAL
+    __softboundcets_metadata_load(addr_of_ptr, key, lock);
+#elif __SOFTBOUNDCETS_SPATIAL_TEMPORAL
+    __softboundcets_metadata_load(addr_of_ptr, base, bound, key, lock);
+#else
+    __softboundcets_metadata_load(addr_of_ptr, base, bound, key, lock);
+#endif
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(seq, __ATOMIC_RELAXED) == begin)
+      return ptr;
+  }
+}
+
+/******************************************************************************/
+
+extern __SOFTBOUNDCETS_THREAD_LOCAL size_t __softboundcets_key_id_counter;
+extern __SOFTBOUNDCETS_THREAD_LOCAL size_t* __softboundcets_lock_next_location;
+extern __SOFTBOUNDCETS_THREAD_LOCAL size_t* __softboundcets_lock_new_location;
+
+#ifdef __SOFTBOUNDCETS_THREADS
+extern __thread size_t __softboundcets_key_id_limit;
+extern __thread size_t* __softboundcets_lock_new_location_end;
+extern __thread size_t __softboundcets_lock_free_count;
+
+extern void __softboundcets_refill_key_range(void);
+extern void __softboundcets_refill_lock_cache(void);
+extern void __softboundcets_flush_lock_cache(size_t count);
+extern void __softboundcets_thread_init(void);
+extern void __softboundcets_thread_exit(void);
+#endif
+
+__WEAK_INLINE size_t __softboundcets_get_next_key(){
+
+#ifdef __SOFTBOUNDCETS_THREADS
+  if(__softboundcets_key_id_counter >= __softboundcets_key_id_limit)
+    __softboundcets_refill_key_range();
+#endif
+  return __softboundcets_key_id_counter++;
+}
+
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+/* Returns the key for a new allocation of the lock location. A
+   location is not handed out again once its count of allocations
+   reaches __SOFTBOUNDCETS_PACKED_MAX_GENERATION, so keys are never
+   reused */
+__WEAK_INLINE size_t __softboundcets_packed_next_key(size_t* lock){
+
+  size_t index = (size_t)(lock - __softboundcets_temporal_space_begin);
+  size_t generation = ++__softboundcets_lock_generations[index];
+  return (generation << __SOFTBOUNDCETS_PACKED_LOCK_INDEX_BITS) | index;
+}
+#endif
 
 #ifdef __SOFTBOUNDCETS_SPATIAL_TEMPORAL
 __WEAK_INLINE void 
@@ -996,7 +1712,7 @@ __softboundcets_temporal_load_dereference_check(void* pointer_lock,
 
 #endif
 
-
+  __SOFTBOUNDCETS_COUNT_DEREF_CHECK();
 
   size_t temp = *((size_t*)pointer_lock);
   
@@ -1030,6 +1746,8 @@ __softboundcets_temporal_store_dereference_check(void* pointer_lock,
     __softboundcets_abort();    
   }
 #endif
+
+  __SOFTBOUNDCETS_COUNT_DEREF_CHECK();
   
   size_t temp = *((size_t*)pointer_lock);
   
@@ -1051,8 +1769,13 @@ __WEAK_INLINE void __softboundcets_stack_memory_deallocation(size_t ptr_key){
   
 #ifndef __SOFTBOUNDCETS_CONSTANT_STACK_KEY_LOCK
 
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  /* stack objects take their lock locations from the temporal space */
+  __softboundcets_memory_deallocation(__softboundcets_packed_key_lock(ptr_key), ptr_key);
+#else
   __softboundcets_stack_temporal_space_begin--;
   *(__softboundcets_stack_temporal_space_begin) = 0;
+#endif
 
 #endif
 
@@ -1075,26 +1798,46 @@ __softboundcets_memory_deallocation(void* ptr_lock, size_t ptr_key) {
 #endif
   
   *((size_t*)ptr_lock) = 0;
+
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  size_t index = (size_t)((size_t*) ptr_lock - __softboundcets_temporal_space_begin);
+  if(__softboundcets_lock_generations[index] >= __SOFTBOUNDCETS_PACKED_MAX_GENERATION)
+    return;
+#endif
+
   *((void**) ptr_lock) = __softboundcets_lock_next_location;
   __softboundcets_lock_next_location = ptr_lock;
 
+#ifdef __SOFTBOUNDCETS_THREADS
+  __softboundcets_lock_free_count++;
+  if(__softboundcets_lock_free_count >= __SOFTBOUNDCETS_LOCK_CACHE_ENTRIES)
+    __softboundcets_flush_lock_cache(__SOFTBOUNDCETS_LOCK_CACHE_ENTRIES / 2);
+#endif
 }
 
 __WEAK_INLINE void*  __softboundcets_allocate_lock_location() {
   
   void* temp= NULL;
+
+#ifdef __SOFTBOUNDCETS_THREADS
+  if(__softboundcets_lock_next_location == NULL && 
+     __softboundcets_lock_new_location == __softboundcets_lock_new_location_end) {
+    __softboundcets_refill_lock_cache();
+  }
+#endif
+
   if(__softboundcets_lock_next_location == NULL) {
     if(__SOFTBOUNDCETS_DEBUG) {
       __softboundcets_printf("[lock_allocate] new_lock_location=%p\n", 
                              __softboundcets_lock_new_location);
       
-      if(__softboundcets_lock_new_location  > 
-         __softboundcets_temporal_space_begin + __SOFTBOUNDCETS_N_TEMPORAL_ENTRIES){
-        __softboundcets_printf("[lock_allocate] out of temporal free entries \n");
-        __softboundcets_abort();
-      }
     }
 
+#ifndef __SOFTBOUNDCETS_THREADS
+    if(__softboundcets_lock_new_location == __softboundcets_lock_space_end)
+      __softboundcets_grow_lock_space(__softboundcets_lock_new_location + 1);
+#endif
+
     return __softboundcets_lock_new_location++;
   }
   else{
@@ -1105,6 +1848,10 @@ __WEAK_INLINE void*  __softboundcets_allocate_lock_location() {
     }
 
     __softboundcets_lock_next_location = *((void**)__softboundcets_lock_next_location);
+#ifdef __SOFTBOUNDCETS_THREADS
+    if(__softboundcets_lock_free_count != 0)
+      __softboundcets_lock_free_count--;
+#endif
     return temp;
   }
 }
@@ -1118,18 +1865,15 @@ __softboundcets_allocation_secondary_trie_allocate_range(void* initial_ptr,
 
   void* addr_of_ptr = initial_ptr;
   size_t start_addr_of_ptr = (size_t) addr_of_ptr;
-  size_t start_primary_index = start_addr_of_ptr >> 25;
+  size_t start_primary_index = start_addr_of_ptr >> __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT;
   
   size_t end_addr_of_ptr = (size_t)((char*) initial_ptr + size);
-  size_t end_primary_index = end_addr_of_ptr >> 25;
+  size_t end_primary_index = end_addr_of_ptr >> __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT;
   
   for(; start_primary_index <= end_primary_index; start_primary_index++){
     
-    __softboundcets_trie_entry_t* 
-      trie_secondary_table = __softboundcets_trie_primary_table[start_primary_index];    
-    if(trie_secondary_table == NULL) {
-      trie_secondary_table =  __softboundcets_trie_allocate();
-      __softboundcets_trie_primary_table[start_primary_index] = trie_secondary_table;
+    if(__softboundcets_trie_primary_table[start_primary_index] == NULL) {
+      __softboundcets_trie_install(start_primary_index);
     }
   }
 }
@@ -1144,26 +1888,18 @@ __softboundcets_allocation_secondary_trie_allocate(void* addr_of_ptr) {
 
 
   size_t ptr = (size_t) addr_of_ptr;
-  size_t primary_index = ( ptr >> 25);
-  //  size_t secondary_index = ((ptr >> 3) & 0x3fffff);
+  size_t primary_index = ( ptr >> __SOFTBOUNDCETS_TRIE_PRIMARY_SHIFT);
   
-  __softboundcets_trie_entry_t* 
-    trie_secondary_table = __softboundcets_trie_primary_table[primary_index];
-
-  if(trie_secondary_table == NULL) {
-    trie_secondary_table =  __softboundcets_trie_allocate();
-    __softboundcets_trie_primary_table[primary_index] = trie_secondary_table;
+  if(__softboundcets_trie_primary_table[primary_index] == NULL) {
+    __softboundcets_trie_install(primary_index);
   }
 
-  __softboundcets_trie_entry_t* 
-    trie_secondary_table_second_entry = __softboundcets_trie_primary_table[primary_index +1];
-
-  if(trie_secondary_table_second_entry == NULL) {
-    __softboundcets_trie_primary_table[primary_index+1] = __softboundcets_trie_allocate();
+  if(__softboundcets_trie_primary_table[primary_index +1] == NULL) {
+    __softboundcets_trie_install(primary_index+1);
   }
 
   if(primary_index != 0 && (__softboundcets_trie_primary_table[primary_index -1] == NULL)){
-    __softboundcets_trie_primary_table[primary_index-1] = __softboundcets_trie_allocate();    
+    __softboundcets_trie_install(primary_index-1);
   }
 
   return;
@@ -1177,8 +1913,14 @@ __softboundcets_stack_memory_allocation(void** ptr_lock, size_t* ptr_key) {
 #ifdef __SOFTBOUNDCETS_CONSTANT_STACK_KEY_LOCK
   *((size_t*) ptr_key) = 1;
   *((size_t**) ptr_lock) = __softboundcets_global_lock;
+#elif defined(__SOFTBOUNDCETS_PACKED_METADATA)
+  size_t* lock = (size_t*) __softboundcets_allocate_lock_location();
+  size_t temp_id = __softboundcets_packed_next_key(lock);
+  *((size_t**) ptr_lock) = lock;
+  *((size_t*)ptr_key) = temp_id;
+  *lock = temp_id;
 #else
-  size_t temp_id = __softboundcets_key_id_counter++;
+  size_t temp_id = __softboundcets_get_next_key();
   *((size_t**) ptr_lock) = (size_t*)__softboundcets_stack_temporal_space_begin++;
   *((size_t*)ptr_key) = temp_id;
   **((size_t**)ptr_lock) = temp_id;  
@@ -1189,13 +1931,18 @@ __softboundcets_stack_memory_allocation(void** ptr_lock, size_t* ptr_key) {
 __WEAK_INLINE void 
 __softboundcets_memory_allocation(void* ptr, void** ptr_lock, size_t* ptr_key){
 
-  size_t temp_id = __softboundcets_key_id_counter++;
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+  *((size_t**) ptr_lock) = (size_t*)__softboundcets_allocate_lock_location();  
+  size_t temp_id = __softboundcets_packed_next_key(*((size_t**) ptr_lock));
+#else
+  size_t temp_id = __softboundcets_get_next_key();
 
   *((size_t**) ptr_lock) = (size_t*)__softboundcets_allocate_lock_location();  
+#endif
   *((size_t*) ptr_key) = temp_id;
   **((size_t**) ptr_lock) = temp_id;
 
-  __softboundcets_add_to_free_map(temp_id, ptr);
+  __softboundcets_add_to_free_map(*ptr_lock, ptr);
   //  printf("memory allocation ptr=%zx, ptr_key=%zx\n", ptr, temp_id);
   __softboundcets_allocation_secondary_trie_allocate(ptr);
 
@@ -1210,76 +1957,274 @@ __WEAK_INLINE void* __softboundcets_get_global_lock(){
   return __softboundcets_global_lock;
 }
 
-__WEAK_INLINE void __softboundcets_add_to_free_map(size_t ptr_key, void* ptr) {
+/* The free map is a side table of the heap lock locations: the entry
+   of a lock location holds the pointer returned by the allocation that
+   owns it. Every heap object has its own lock location, so free finds
+   the entry of an object from its lock in constant time. */
+
+__WEAK_INLINE size_t* __softboundcets_free_map_entry(void* ptr_lock){
+
+  size_t index = (size_t)((size_t*) ptr_lock - __softboundcets_temporal_space_begin);
+
+  /* null, global and stack locks are not heap lock locations */
+  if((size_t*) ptr_lock < __softboundcets_temporal_space_begin || 
+     index >= __softboundcets_n_temporal_entries)
+    return NULL;
+
+  return &__softboundcets_free_map_table[index];
+}
+
+__WEAK_INLINE void __softboundcets_add_to_free_map(void* ptr_lock, void* ptr) {
 
   if(!__SOFTBOUNDCETS_FREE_MAP)
     return;
 
   assert(ptr!= NULL);
 
-  size_t counter  = 0;
-  while(1){
-    size_t index = (ptr_key + counter) % __SOFTBOUNDCETS_N_FREE_MAP_ENTRIES;
-    size_t* entry_ptr = &__softboundcets_free_map_table[index];
-    size_t tag = *entry_ptr;
+  size_t* entry_ptr = __softboundcets_free_map_entry(ptr_lock);
+  if(entry_ptr != NULL)
+    *entry_ptr = (size_t) ptr;
+}
 
-    if(tag == 0 || tag == 2) {
-      //      printf("entry_ptr=%zx, ptr=%zx, key=%zx\n", entry_ptr, ptr, ptr_key);
-      *entry_ptr = (size_t)(ptr);
-      return;
-    }
-    if(counter >= (__SOFTBOUNDCETS_N_FREE_MAP_ENTRIES)) {
+/* Aborts unless ptr is the start of a live heap object whose lock and
+   key are ptr_lock and ptr_key. It has to run before the lock location
+   is released, which reuses the location for the lock free list */
+
+__WEAK_INLINE void __softboundcets_check_remove_from_free_map(void* ptr_lock, 
+                                                              size_t ptr_key, 
+                                                              void* ptr) {
+
+  if(! __SOFTBOUNDCETS_FREE_MAP){
+    return;
+  }
+
+  size_t* entry_ptr = __softboundcets_free_map_entry(ptr_lock);
+
+  /* a freed or reallocated lock location no longer holds the key */
+  if(entry_ptr == NULL || *entry_ptr != (size_t) ptr || 
+     *((size_t*) ptr_lock) != ptr_key) {
 #ifndef __NOSIM_CHECKS
-      __softboundcets_abort();
+    if(__SOFTBOUNDCETS_DEBUG) {
+      __softboundcets_printf("[free_map] invalid free ptr=%p, lock=%p, key=%zx\n", 
+                             ptr, ptr_lock, ptr_key);
+    }
+    __softboundcets_abort();
 #else
-      break;
+    return;
 #endif
-    }
-    counter++;
   }
-  return;
+
+  *entry_ptr = 0;
 }
 
+/* With __SOFTBOUNDCETS_ALLOCATOR, the heap objects of the program
+ * come from an allocator of the runtime instead of glibc malloc, in a
+ * region reserved at startup. Objects of up to
+ * __SOFTBOUNDCETS_HEAP_MAX_SMALL_SIZE bytes are carved out of 64 KB
+ * slabs of one size class, and the header of a slab holds the lock of
+ * each of its objects. Larger objects take a run of pages whose first
+ * page holds the lock. The lock of an object is found from its
+ * address, so free needs no free map. A slab keeps its size class and
+ * a run its length, so a lock location only ever holds locks. Each
+ * thread caches the free objects of each size class, and allocation
+ * and free only take the lock of the size class to refill or flush
+ * the cache. Objects from other allocators (strdup, ...) keep the
+ * temporal space locks and the free map.
+ */
+#ifdef __SOFTBOUNDCETS_ALLOCATOR
+
+#if !defined(__SOFTBOUNDCETS_SPATIAL_TEMPORAL) || __WORDSIZE == 32
+#error "__SOFTBOUNDCETS_ALLOCATOR needs 64 bit spatial and temporal metadata"
+#endif
+#ifdef __SOFTBOUNDCETS_PACKED_METADATA
+#error "__SOFTBOUNDCETS_ALLOCATOR keeps the locks outside the temporal space indexed by packed keys"
+#endif
+
+static const size_t __SOFTBOUNDCETS_HEAP_SLAB_SIZE = ((size_t) 64 * (size_t) 1024);
+static const size_t __SOFTBOUNDCETS_HEAP_PAGE_SIZE = ((size_t) 4096);
+static const size_t __SOFTBOUNDCETS_HEAP_MAX_SMALL_SIZE = ((size_t) 8192);
+/* the slabs are followed by the runs */
+static const size_t __SOFTBOUNDCETS_HEAP_SLAB_REGION_SIZE = ((size_t) 512 * (size_t) 1024 * (size_t) 1024 * (size_t) 1024);
+static const size_t __SOFTBOUNDCETS_HEAP_RUN_REGION_SIZE = ((size_t) 512 * (size_t) 1024 * (size_t) 1024 * (size_t) 1024);
+
+/* 16 to 128 bytes in steps of 16, then four classes per power of two */
+#define __SOFTBOUNDCETS_HEAP_N_CLASSES 32
+/* runs of 2^n pages */
+#define __SOFTBOUNDCETS_HEAP_N_RUN_CLASSES 28
+
+/* A thread takes this many objects of a size class at a time, and
+   returns half of its cached objects once it caches twice as many */
+static const size_t __SOFTBOUNDCETS_HEAP_BATCH_SIZE = 32;
+static const size_t __SOFTBOUNDCETS_HEAP_CACHE_ENTRIES = 128;
+
+typedef struct __softboundcets_slab {
+  size_t object_size;
+  /* (2^32 / object_size) + 1, which divides the offsets in the slab */
+  size_t reciprocal;
+  char* objects;
+  size_t n_objects;
+  /* objects [0, n_fresh) have been handed out at least once */
+  size_t n_fresh;
+  /* objects returned by the thread caches */
+  void* free_list;
+  size_t n_free;
+  struct __softboundcets_slab* next_partial;
+  size_t on_partial;
+  size_t locks[];
+} __softboundcets_slab_t;
+
+typedef struct __softboundcets_heap_run {
+  size_t size;
+  size_t run_class;
+  struct __softboundcets_heap_run* next;
+  size_t lock;
+} __softboundcets_heap_run_t;
 
-__WEAK_INLINE void __softboundcets_check_remove_from_free_map(size_t ptr_key, void* ptr) {
+typedef struct {
+  void* objects;
+  size_t count;
+} __softboundcets_heap_cache_t;
 
-  if(! __SOFTBOUNDCETS_FREE_MAP){
+extern char* __softboundcets_heap_begin;
+extern __SOFTBOUNDCETS_THREAD_LOCAL 
+__softboundcets_heap_cache_t __softboundcets_heap_cache[__SOFTBOUNDCETS_HEAP_N_CLASSES];
+
+extern void* __softboundcets_heap_refill(size_t size_class);
+extern void __softboundcets_heap_flush(size_t size_class, size_t count);
+extern void __softboundcets_heap_flush_all(void);
+extern void* __softboundcets_heap_allocate_run(size_t size, size_t** ptr_lock);
+extern void __softboundcets_heap_free_run(void* ptr, void* ptr_lock, size_t ptr_key);
+
+__WEAK_INLINE size_t __softboundcets_heap_size_class(size_t size){
+
+  if(size <= 128)
+    return size == 0 ? 0 : ((size + 15) >> 4) - 1;
+
+  size_t last = size - 1;
+  size_t log2 = (sizeof(size_t) * 8 - 1) - __builtin_clzl(last);
+  return 8 + (log2 - 7) * 4 + ((last >> (log2 - 2)) & 3);
+}
+
+__WEAK_INLINE size_t __softboundcets_heap_class_size(size_t size_class){
+
+  if(size_class < 8)
+    return (size_class + 1) << 4;
+
+  size_t log2 = 7 + ((size_class - 8) >> 2);
+  return (5 + ((size_class - 8) & 3)) << (log2 - 2);
+}
+
+/* Returns 1 if ptr is in the region of the allocator */
+__WEAK_INLINE int __softboundcets_heap_contains(void* ptr){
+
+  return __softboundcets_heap_begin != NULL && 
+    (size_t)((char*) ptr - __softboundcets_heap_begin) < 
+    __SOFTBOUNDCETS_HEAP_SLAB_REGION_SIZE + __SOFTBOUNDCETS_HEAP_RUN_REGION_SIZE;
+}
+
+__WEAK_INLINE __softboundcets_slab_t* __softboundcets_heap_slab(void* ptr){
+
+  return (__softboundcets_slab_t*) ((size_t) ptr & ~(__SOFTBOUNDCETS_HEAP_SLAB_SIZE - 1));
+}
+
+__WEAK_INLINE size_t 
+__softboundcets_heap_slab_index(__softboundcets_slab_t* slab, void* ptr){
+
+  return ((size_t)((char*) ptr - slab->objects) * slab->reciprocal) >> 32;
+}
+
+/* Returns the number of bytes usable at ptr, an object of the allocator */
+__WEAK_INLINE size_t __softboundcets_heap_usable_size(void* ptr){
+
+  if((size_t)((char*) ptr - __softboundcets_heap_begin) < 
+     __SOFTBOUNDCETS_HEAP_SLAB_REGION_SIZE)
+    return __softboundcets_heap_slab(ptr)->object_size;
+
+  __softboundcets_heap_run_t* run = 
+    (__softboundcets_heap_run_t*) ((char*) ptr - __SOFTBOUNDCETS_HEAP_PAGE_SIZE);
+  return (__SOFTBOUNDCETS_HEAP_PAGE_SIZE << run->run_class) - __SOFTBOUNDCETS_HEAP_PAGE_SIZE;
+}
+
+/* Allocates size bytes with a new key in the lock of the object */
+__WEAK_INLINE void* 
+__softboundcets_heap_allocate(size_t size, void** ptr_lock, size_t* ptr_key){
+
+  void* ptr;
+  size_t* lock;
+
+  if(size <= __SOFTBOUNDCETS_HEAP_MAX_SMALL_SIZE){
+    size_t size_class = __softboundcets_heap_size_class(size);
+    __softboundcets_heap_cache_t* cache = &__softboundcets_heap_cache[size_class];
+
+    ptr = cache->objects;
+    if(ptr != NULL){
+      cache->objects = *((void**) ptr);
+      cache->count--;
+    }
+    else{
+      ptr = __softboundcets_heap_refill(size_class);
+      if(ptr == NULL)
+        return NULL;
+    }
+
+    __softboundcets_slab_t* slab = __softboundcets_heap_slab(ptr);
+    lock = &slab->locks[__softboundcets_heap_slab_index(slab, ptr)];
+  }
+  else{
+    ptr = __softboundcets_heap_allocate_run(size, &lock);
+    if(ptr == NULL)
+      return NULL;
+  }
+
+  size_t key = __softboundcets_get_next_key();
+  *lock = key;
+  *((size_t**) ptr_lock) = lock;
+  *ptr_key = key;
+  return ptr;
+}
+
+/* Frees ptr, an object of the allocator, after checking that it is
+   the start of a live object whose lock and key are ptr_lock and
+   ptr_key */
+__WEAK_INLINE void 
+__softboundcets_heap_free(void* ptr, void* ptr_lock, size_t ptr_key){
+
+  if((size_t)((char*) ptr - __softboundcets_heap_begin) >= 
+     __SOFTBOUNDCETS_HEAP_SLAB_REGION_SIZE){
+    __softboundcets_heap_free_run(ptr, ptr_lock, ptr_key);
     return;
   }
-  size_t counter = 0;
-  while(1) {
-    size_t index = (ptr_key + counter) % __SOFTBOUNDCETS_N_FREE_MAP_ENTRIES;
-    size_t* entry_ptr = &__softboundcets_free_map_table[index];
-    size_t tag = *entry_ptr;
-
-    if(tag == 0) {
-#ifndef __NOSIM_CHECKS      
-      //      printf("free map does not have the key\n");
-      __softboundcets_abort();
-#else
-      break;
-#endif
-    }
 
-    if(tag == (size_t) ptr) {      
-      *entry_ptr = 2;
-      return;
-    }
+  __softboundcets_slab_t* slab = __softboundcets_heap_slab(ptr);
+  size_t index = __softboundcets_heap_slab_index(slab, ptr);
+  size_t* lock = &slab->locks[index];
 
-    if(counter >= __SOFTBOUNDCETS_N_FREE_MAP_ENTRIES) {
-      //      printf("free map out of entries\n");
+  if((char*) ptr < slab->objects || index >= slab->n_objects || 
+     slab->objects + index * slab->object_size != (char*) ptr ||
+     (void*) lock != ptr_lock || *lock != ptr_key){
 #ifndef __NOSIM_CHECKS
-      printf("free map out of entries\n");
-      __softboundcets_abort();
+    if(__SOFTBOUNDCETS_DEBUG) {
+      __softboundcets_printf("[heap_free] invalid free ptr=%p, lock=%p, key=%zx\n", 
+                             ptr, ptr_lock, ptr_key);
+    }
+    __softboundcets_abort();
 #else
-      break;
+    return;
 #endif
-    }
-    counter++;
   }
-  return;
+  *lock = 0;
+
+  size_t size_class = __softboundcets_heap_size_class(slab->object_size);
+  __softboundcets_heap_cache_t* cache = &__softboundcets_heap_cache[size_class];
+  *((void**) ptr) = cache->objects;
+  cache->objects = ptr;
+  cache->count++;
+  if(cache->count >= __SOFTBOUNDCETS_HEAP_CACHE_ENTRIES)
+    __softboundcets_heap_flush(size_class, __SOFTBOUNDCETS_HEAP_CACHE_ENTRIES / 2);
 }
 
+#endif
+
  __METADATA_INLINE void __softboundcets_metadata_load_vector(void* addr_of_ptr, 
 							     void** base, 
 							     void** bound, 
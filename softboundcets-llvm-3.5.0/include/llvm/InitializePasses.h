@@ -46,6 +46,10 @@ void initializeInstCombine(PassRegistry&);
 /// initializeIPO - Initialize all passes linked into the IPO library.
 void initializeIPO(PassRegistry&);
 
+/// initializeSoftBoundCETS - Initialize all passes linked into the
+/// SoftBoundCETS library.
+void initializeSoftBoundCETS(PassRegistry&);
+
 /// initializeInstrumentation - Initialize all passes linked into the
 /// Instrumentation library.
 void initializeInstrumentation(PassRegistry&);
@@ -279,6 +283,15 @@ void initializeBBVectorizePass(PassRegistry&);
 void initializeMachineFunctionPrinterPassPass(PassRegistry&);
 void initializeStackMapLivenessPass(PassRegistry&);
 void initializeLoadCombinePass(PassRegistry&);
+void initializeFixByValAttributesPassPass(PassRegistry&);
+void initializeInitializeSoftBoundCETSPass(PassRegistry&);
+void initializeInitializeSoftBoundCETSMPXPass(PassRegistry&);
+void initializeInitializeSoftBoundMPXPass(PassRegistry&);
+void initializeShadowStackOptPass(PassRegistry&);
+void initializeSoftBoundCETSMPXPassPass(PassRegistry&);
+void initializeSoftBoundMPXPassPass(PassRegistry&);
+void initializeSpatialCheckOptPass(PassRegistry&);
+void initializeStripSBCETSIntrinsicsPass(PassRegistry&);
 }
 
 #endif
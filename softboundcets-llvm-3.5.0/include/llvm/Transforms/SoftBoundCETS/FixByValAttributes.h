@@ -110,6 +110,7 @@ class FixByValAttributesPass: public ModulePass{
  public:
   static char ID;
  FixByValAttributesPass(): ModulePass(ID){
+    initializeFixByValAttributesPassPass(*PassRegistry::getPassRegistry());
   }
   const char* getPassName() const { return "FixByValAttributes";}
   
@@ -29,9 +29,11 @@ class InitializeSoftBoundCETS: public ModulePass {
   void constructMetadataHandlers(Module &);
   void constructShadowStackHandlers(Module &);
   void constructAuxillaryFunctionHandlers(Module &);
+  void constructRuntimeHelperLinkage(Module &);
   InitializeSoftBoundCETS(): ModulePass(ID){        
     spatial_safety = true;
     temporal_safety= true;
+    initializeInitializeSoftBoundCETSPass(*PassRegistry::getPassRegistry());
   }
   
   const char* getPassName() const { return "InitializeSoftBoundCETS";}
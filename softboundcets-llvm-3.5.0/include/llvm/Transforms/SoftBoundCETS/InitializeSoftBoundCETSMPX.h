@@ -26,6 +26,7 @@ class InitializeSoftBoundCETSMPX: public ModulePass {
   void constructShadowStackHandlers(Module &);
   void constructAuxillaryFunctionHandlers(Module &);
   InitializeSoftBoundCETSMPX(): ModulePass(ID){        
+    initializeInitializeSoftBoundCETSMPXPass(*PassRegistry::getPassRegistry());
   }
   
   const char* getPassName() const { return "InitializeSoftBoundCETSMPX";}
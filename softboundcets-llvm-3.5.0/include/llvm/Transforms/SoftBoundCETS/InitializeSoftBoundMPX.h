@@ -32,6 +32,7 @@ class InitializeSoftBoundMPX: public ModulePass {
   InitializeSoftBoundMPX(): ModulePass(ID){        
     spatial_safety = true;
     temporal_safety= true;
+    initializeInitializeSoftBoundMPXPass(*PassRegistry::getPassRegistry());
   }
   
   const char* getPassName() const { return "InitializeSoftBoundMPX";}
@@ -119,10 +119,18 @@ class ShadowStackOpt: public ModulePass {
  private:
   bool runOnModule(Module &);
   void transformFunctions();
+
+  /* Runs even without -softboundcets_shadow_stack_opt */
+  bool m_enabled;
   void transformIndividualFunction(Function*);
   
   std::vector<Function*> FunctionsToTransform;
   bool checkFunctionOfInterest(Function*);
+  bool checkCallee(Function*);
+  bool checkCallSite(CallInst*, Function*);
+  CallInst* findShadowStackCall(Instruction*, StringRef, int, int, bool, StringRef);
+  bool getShadowStackStores(Instruction*, int, Value**, bool);
+  void createShadowStackThunk(Function*, Function*);
   StructType* getStructMetadataType(Type*);
   void handleCallUseOfFunction(CallInst*, Function *);
   void ProcessReturnInst(ReturnInst*, Function*);
@@ -132,6 +140,11 @@ class ShadowStackOpt: public ModulePass {
   Type* m_void_ptr_type;
   Type* m_sizet_type;
 
+  /* shadow stack handlers for the base, bound, key and lock */
+  Function* m_shadow_stack_load_funcs[4];
+  Function* m_shadow_stack_store_funcs[4];
+  Function* m_shadow_stack_metadata_store_func;
+
   Instruction* getPrevInstruction(Instruction * I){
     
     BasicBlock::iterator i = I;
@@ -166,7 +179,8 @@ class ShadowStackOpt: public ModulePass {
  public:
   static char ID;
   
- ShadowStackOpt(): ModulePass(ID){
+ ShadowStackOpt(bool enabled = false): ModulePass(ID), m_enabled(enabled){
+    initializeShadowStackOptPass(*PassRegistry::getPassRegistry());
   }
 
   const char* getPassName() const {return "ShadowStackOpt";}
@@ -473,14 +473,11 @@ class SoftBoundCETSMPXPass: public ModulePass {
  public:
   static char ID;
 
-  /* INITIALIZE_PASS(SoftBoundCETSMPXPass, "softboundcetspass", */
-  /*               "SoftBound CETS for memory safety", false, false) */
-    
-    
  SoftBoundCETSMPXPass(StringRef BlacklistFile = "")
    : ModulePass(ID),
     BlacklistFile(BlacklistFile){
 
+    initializeSoftBoundCETSMPXPassPass(*PassRegistry::getPassRegistry());
   }
   const char* getPassName() const { return " SoftBoundCETSMPXPass";}
 
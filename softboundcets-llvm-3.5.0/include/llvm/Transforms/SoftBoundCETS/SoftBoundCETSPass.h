@@ -49,6 +49,7 @@
 #include "llvm/ADT/FoldingSet.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Triple.h"
 
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Constants.h"
@@ -85,14 +86,20 @@
 #include "llvm/IR/Dominators.h"
 #include "llvm/ADT/DepthFirstIterator.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/CallGraph.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/CFG.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/PostOrderIterator.h"
 //#include "llvm/Support/Debug.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
@@ -101,6 +108,9 @@
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Target/TargetLibraryInfo.h"
 #include "llvm/Analysis/TargetFolder.h"
 #include "llvm/Support/SpecialCaseList.h"
@@ -144,6 +154,7 @@ class SoftBoundCETSPass: public ModulePass {
   Function* m_shadow_stack_bound_store;
   Function* m_shadow_stack_key_store;
   Function* m_shadow_stack_lock_store;
+  Function* m_shadow_stack_metadata_store;
   
   Function* m_spatial_load_dereference_check;
   Function* m_spatial_store_dereference_check;
@@ -158,6 +169,7 @@ class SoftBoundCETSPass: public ModulePass {
   Function* m_call_dereference_func;
   Function* m_memcopy_check;
   Function* m_memset_check;
+  Function* m_abort_func;
 
   Function* m_metadata_map_func;
   Function* m_metadata_load_base_func;
@@ -169,6 +181,12 @@ class SoftBoundCETSPass: public ModulePass {
    * a given pointer 
    */
   Function* m_load_base_bound_func;
+
+  /* Functions that return the spatial and the temporal metadata of a
+   * pointer by value
+   */
+  Function* m_metadata_load_spatial_func;
+  Function* m_metadata_load_temporal_func;
   Function* m_metadata_load_vector_func;
   Function* m_metadata_store_vector_func;
   
@@ -177,6 +195,24 @@ class SoftBoundCETSPass: public ModulePass {
    * for a given pointer
    */
   Function* m_store_base_bound_func;
+
+  /* Function that installs the metadata of the pointers in the
+   * initializers of the globals of the module from its table
+   */
+  Function* m_install_global_metadata_func;
+
+  /* Functions that keep the pointers accessed by atomic instructions
+   * consistent with their metadata
+   */
+  Function* m_metadata_load_atomic_func;
+  Function* m_metadata_lock_func;
+  Function* m_metadata_unlock_func;
+
+  /* Pointer to the linear shadow region of the runtime,
+   * __softboundcets_linear_shadow_<bits>, with
+   * -softboundcets_linear_shadow
+   */
+  Constant* m_linear_shadow;
   
   /* void pointer type, used many times in the Softboundcets pass */
   Type* m_void_ptr_type;
@@ -211,6 +247,13 @@ class SoftBoundCETSPass: public ModulePass {
 
 
   DominatorTree* m_dominator_tree;
+  PostDominatorTree* m_post_dominator_tree;
+
+  /* Loop and induction variable analyses for hoisting the checks out
+   * of the loops
+   */
+  LoopInfo* m_loop_info;
+  ScalarEvolution* m_scalar_evolution;
   
   /* Book-keeping structures for identifying original instructions in
    * the program, pointers and their corresponding base and bound
@@ -238,6 +281,51 @@ class SoftBoundCETSPass: public ModulePass {
 
 
   std::map<GlobalVariable*, int> m_initial_globals;
+
+  /* Bytes accessed by a load/store relative to the pointer it is
+   * derived from through bitcasts and constant offset GEPs
+   */
+  struct SpatialCheckRange {
+    Value* root;
+    int64_t lo;
+    int64_t hi;
+  };
+
+  /* Loads/stores whose spatial check has been widened to also cover
+   * the checks it made redundant
+   */
+  std::map<Value*, SpatialCheckRange> m_widened_spatial_checks;
+
+  /* Load/store checked by each dereference check call, recorded with
+   * -softboundcets_chk_intrinsic for introduceCheckIntrinsics
+   */
+  std::map<CallInst*, Instruction*> m_check_access;
+
+  /* Instructions that load the metadata of the pointers loaded in the
+   * function, in program order, moved to their uses by
+   * sinkMetadataLoads
+   */
+  std::vector<Instruction*> m_metadata_loads;
+
+  /* (address, base, bound) records of the pointers in the initializers
+   * of the globals, emitted as one table by emitGlobalMetadataTable
+   */
+  std::vector<Constant*> m_global_metadata_records;
+
+  /* Integer values produced by atomic instructions that hold a
+   * pointer, with their metadata in the pointer maps
+   */
+  std::map<Value*, int> m_atomic_pointer_values;
+
+  /* Atomic loads replaced by an atomic reload with the metadata,
+   * erased once their dereference checks are in place
+   */
+  std::vector<LoadInst*> m_replaced_atomic_loads;
+
+  /* Unlock call following each atomic exchange of a pointer, the
+   * metadata store of the exchange is inserted before it
+   */
+  std::map<Value*, Instruction*> m_atomic_metadata_unlock;
   
   /* Map of all functions for which Softboundcets Transformation must
    * be invoked
@@ -274,6 +362,7 @@ class SoftBoundCETSPass: public ModulePass {
   void gatherBaseBoundPass1(Function*);
   void gatherBaseBoundPass2(Function*);
   void addDereferenceChecks(Function*);
+  void eraseReplacedAtomicLoads();
   bool checkIfFunctionOfInterest(Function*);
   bool isFuncDefSoftBound(const std::string &str);
   std::string transformFunctionName(const std::string &str);
@@ -289,6 +378,12 @@ class SoftBoundCETSPass: public ModulePass {
                     BasicBlock::iterator&);  
   
   void insertMetadataLoad(LoadInst*);
+  CallInst* insertMetadataLoadCall(Function*, Value*, Instruction*, 
+                                   Value*&, Value*&, Value*&, Value*&);
+  void insertMetadataLoadByValue(Value*, Instruction*, 
+                                 Value*&, Value*&, Value*&, Value*&);
+  void getLinearShadowEntry(Value*, Instruction*, 
+                            Value*&, Value*&, Value*&, Value*&);
   void handleLoad(LoadInst*);
   void handleVectorStore(StoreInst*);
   void handleStore(StoreInst*);
@@ -299,11 +394,26 @@ class SoftBoundCETSPass: public ModulePass {
   void handlePHIPass2(PHINode*);
   void handleCall(CallInst*);
   void handleMemcpy(CallInst*);
+  bool isUnionType(StructType*);
+  bool typeHasPointers(Type*);
+  bool typeHoldsBytes(Type*);
+  bool collectPointerOffsets(Type*, uint64_t, uint64_t, unsigned, 
+                             SmallVectorImpl<uint64_t>&);
+  int classifyMemcopyOperand(Value*, Value*, Type* &);
+  bool introduceInlineMetadataCopy(Value*, Value*, Type*, uint64_t, 
+                                   Instruction*);
   void handleIndirectCall(CallInst*);
   void handleExtractValue(ExtractValueInst*);
   void handleExtractElement(ExtractElementInst*);
   void handleSelect(SelectInst*, int);
   void handleIntToPtr(IntToPtrInst*);
+  bool isPointerValuedAtomic(Instruction*);
+  void getAtomicValueMetadata(Value*, Instruction*, Value*&, Value*&, 
+                              Value*&, Value*&);
+  void handleAtomicLoad(LoadInst*);
+  void handleAtomicStore(StoreInst*);
+  void handleAtomicExchangePass1(Instruction*);
+  void handleAtomicExchangePass2(Instruction*);
   void identifyFuncToTrans(Module&);
   
   void transformFunctions(Module&);
@@ -329,6 +439,24 @@ class SoftBoundCETSPass: public ModulePass {
   void addTemporalChecks(Instruction*, 
                          std::map<Value*, int>&, 
                          std::map<Value*, int>&);
+  void inlineDereferenceChecks(Function*);
+  void introduceCheckIntrinsics(Function*);
+  bool isDereferenceCheckCall(Instruction*);
+  bool isSpatialCheckCall(CallInst*);
+  void optimizeLoopChecks(Function*);
+  void hoistLoopChecks(Loop*);
+  bool canMakeLoopInvariant(Loop*, Value*);
+  bool loopHasOpaqueCalls(Loop*);
+  bool isOpaqueCall(Instruction*, bool metadata_writes = false);
+  bool pathHasOpaqueCalls(Instruction*, Instruction*, 
+                          bool metadata_writes = false);
+  void sinkMetadataLoads(Function*);
+  Instruction* getMetadataUsePoint(Instruction*, BasicBlock*);
+  void mergeMetadataLoads(Function*, DominatorTree&);
+  bool getSpatialCheckRange(Instruction*, SpatialCheckRange&);
+  void eliminateRedundantSpatialChecks(std::vector<Instruction*>&, 
+                                       std::map<Value*, int>&);
+  BasicBlock* getAbortBlock(Function*, BasicBlock* &);
 
   bool optimizeTemporalChecks(Instruction*, 
                               std::map<Value*, int>&, 
@@ -356,12 +484,17 @@ class SoftBoundCETSPass: public ModulePass {
 
   
   enum { SBCETS_BITCAST, SBCETS_GEP};
+  enum { SBCETS_MEMCOPY_UNKNOWN, SBCETS_MEMCOPY_NO_PTRS, 
+         SBCETS_MEMCOPY_HAS_PTRS };
   /* Auxillary base and propagation functions */
 
   void handleGlobalSequentialTypeInitializer(Module&, GlobalVariable*);
   void handleGlobalStructTypeInitializer(Module& , StructType* , 
                                          Constant* , GlobalVariable*, 
                                          std::vector<Constant*>, int) ;
+  void addGlobalMetadataStore(Module&, Constant*, Value*, Value*, 
+                              Value*, Instruction*);
+  void emitGlobalMetadataTable(Module&);
 
   void addBaseBoundGlobals(Module&);
   Instruction* getGlobalInitInstruction(Module&);
@@ -477,29 +610,23 @@ class SoftBoundCETSPass: public ModulePass {
   static char ID;
 
 
-  /* INITIALIZE_PASS(SoftBoundCETSPass, "softboundcetspass", */
-  /*               "SoftBound CETS for memory safety", false, false) */
-    
-    
  SoftBoundCETSPass(StringRef BlacklistFile = "")
    : ModulePass(ID),
     BlacklistFile(BlacklistFile){
     spatial_safety= true;
     temporal_safety=true;
 
-    //    initializeSoftBoundCETSPass(*PassRegistry::getPassRegistry());
-
+    initializeSoftBoundCETSPassPass(*PassRegistry::getPassRegistry());
   }
   const char* getPassName() const { return " SoftBoundCETSPass";}
 
 
   void getAnalysisUsage(AnalysisUsage& au) const override {
 
-#if 0
     au.addRequired<DominatorTreeWrapperPass>();
-#endif 
-
+    au.addRequired<PostDominatorTree>();
     au.addRequired<LoopInfo>();
+    au.addRequired<ScalarEvolution>();
     //    au.addRequired<DataLayout>();
     au.addRequired<TargetLibraryInfo>();
   }
@@ -414,6 +414,7 @@ class SoftBoundMPXPass: public ModulePass {
     spatial_safety= true;
     temporal_safety=true;
 
+    initializeSoftBoundMPXPassPass(*PassRegistry::getPassRegistry());
   }
   const char* getPassName() const { return " SoftBoundMPXPass";}
 
@@ -143,6 +143,7 @@ class SpatialCheckOpt: public FunctionPass {
   static char ID;
   
  SpatialCheckOpt(): FunctionPass(ID){
+    initializeSpatialCheckOptPass(*PassRegistry::getPassRegistry());
   }
 
   const char* getPassName() const {return "SpatialCheckOpt";}
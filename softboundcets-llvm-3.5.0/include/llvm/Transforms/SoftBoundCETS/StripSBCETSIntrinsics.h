@@ -1,36 +1,88 @@
+//=== SoftBoundCETS/StripSBCETSIntrinsics.h --*- C++ -*=====///
+// Lowering of the SoftBoundCETS check intrinsics
+// Copyright (c) 2014 Santosh Nagarakatte, Milo M. K. Martin. All rights reserved.
+//
+// Developed by: Santosh Nagarakatte,
+//               Department of Computer Science,
+//               Rutgers University
+//               http://www.cs.rutgers.edu/~santosh.nagarakatte/softbound/
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal with the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+//   1. Redistributions of source code must retain the above copyright notice,
+//      this list of conditions and the following disclaimers.
 
+//   2. Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimers in the
+//      documentation and/or other materials provided with the distribution.
+
+//   3. Neither the names of Santosh Nagarakatte,
+//      Rutgers University, nor the names of its contributors may be
+//      used to endorse or promote products derived from this Software
+//      without specific prior written permission.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// WITH THE SOFTWARE.
+//===---------------------------------------------------------------------===//
 
 #ifndef SOFTBOUNDCETS_STRIPSB_INTRINSICS_H
 #define SOFTBOUNDCETS_STRIPSB_INTRINSICS_H
 
-#include "llvm/Intrinsics.h"
-
 #include "llvm/Pass.h"
-#include "llvm/Module.h"
-#include "llvm/Function.h"
-#include "llvm/LLVMContext.h"
-#include "llvm/LLVMContext.h"
-#include "llvm/Instructions.h"
-#include "llvm/Instruction.h"
-#include "llvm/Target/TargetData.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
+#include <vector>
 
 using namespace llvm;
 
 class StripSBCETSIntrinsics: public FunctionPass {
 
+ private:
+  /* dereference check handlers the intrinsics are lowered to */
+  Function* m_spatial_load_dereference_check;
+  Function* m_spatial_store_dereference_check;
+  Function* m_temporal_load_dereference_check;
+  Function* m_temporal_store_dereference_check;
+  Function* m_abort_func;
+
+  bool isStoreCheck(IntrinsicInst*);
+  void lowerToCall(IntrinsicInst*);
+  void lowerToCompare(IntrinsicInst*, BasicBlock* &);
+  BasicBlock* getAbortBlock(Function*, BasicBlock* &);
+
  public:
-  bool runOnFunction(Function &);
+  bool doInitialization(Module &) override;
+  bool runOnFunction(Function &) override;
   static char ID;
 
-  bool iterateOverFunctions(Function&);
-
-  StripSBCETSIntrinsics(): FunctionPass(ID){       
+  StripSBCETSIntrinsics(): FunctionPass(ID){
+    initializeStripSBCETSIntrinsicsPass(*PassRegistry::getPassRegistry());
   }
-  
+
   const char* getPassName() const { return "StripSBCETSIntrinsics";}
 };
 
 
 #endif
-
@@ -53,8 +53,8 @@ fix_specific_byval
 
 char FixByValAttributesPass:: ID = 0;
 
-static RegisterPass<FixByValAttributesPass> P ("FixByValAttributesPass",
-                                               "Transform all byval Attributes");
+INITIALIZE_PASS(FixByValAttributesPass, "FixByValAttributesPass",
+                "Transform all byval Attributes", false, false)
 
 void 
 FixByValAttributesPass::createGEPStores(Value* result_alloca, 
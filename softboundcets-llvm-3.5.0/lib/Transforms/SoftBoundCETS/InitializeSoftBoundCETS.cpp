@@ -61,8 +61,8 @@ extern cl::opt<bool> disable_temporal_safety;
 
 char InitializeSoftBoundCETS :: ID = 0;
 
-static RegisterPass<InitializeSoftBoundCETS> P 
-("InitializeSoftBoundCETS","Prototype Creator Pass for SoftBoundCETS");
+INITIALIZE_PASS(InitializeSoftBoundCETS, "InitializeSoftBoundCETS",
+                "Prototype Creator Pass for SoftBoundCETS", false, false)
 
 void InitializeSoftBoundCETS:: constructShadowStackHandlers(Module & module){
 
@@ -75,7 +75,7 @@ void InitializeSoftBoundCETS:: constructShadowStackHandlers(Module & module){
   module.getOrInsertFunction("__softboundcets_allocate_shadow_stack_space", 
                              VoidTy, Int32Ty, NULL);
   module.getOrInsertFunction("__softboundcets_deallocate_shadow_stack_space", 
-                             VoidTy, NULL);
+                             VoidTy, Int32Ty, NULL);
 
   if(spatial_safety){
     module.getOrInsertFunction("__softboundcets_load_base_shadow_stack", 
@@ -105,6 +105,12 @@ void InitializeSoftBoundCETS:: constructShadowStackHandlers(Module & module){
                                VoidTy, VoidPtrTy, Int32Ty, NULL);
   }
 
+  if(spatial_safety && temporal_safety){
+    module.getOrInsertFunction("__softboundcets_store_metadata_shadow_stack", 
+                               VoidTy, VoidPtrTy, VoidPtrTy, SizeTy, 
+                               VoidPtrTy, Int32Ty, NULL);
+  }
+
 }
 
 void InitializeSoftBoundCETS:: constructMetadataHandlers(Module & module){
@@ -123,6 +129,33 @@ void InitializeSoftBoundCETS:: constructMetadataHandlers(Module & module){
 
   Type* PtrVoidPtrTy = PointerType::getUnqual(VoidPtrTy);
   Type* PtrSizeTy = PointerType::getUnqual(SizeTy);
+
+  /* The metadata loads return {base, bound} and {key, lock}, which
+   * fit in a pair of registers.
+   */
+  Type* SpatialMetadataTy = StructType::get(VoidPtrTy, VoidPtrTy, NULL);
+  Type* TemporalMetadataTy = StructType::get(SizeTy, VoidPtrTy, NULL);
+
+  if(spatial_safety){
+    module.getOrInsertFunction("__softboundcets_metadata_load_spatial",
+                               SpatialMetadataTy, VoidPtrTy, NULL);
+  }
+  if(temporal_safety){
+    module.getOrInsertFunction("__softboundcets_metadata_load_temporal",
+                               TemporalMetadataTy, VoidPtrTy, NULL);
+  }
+
+  const char* metadata_loads[] = {
+    "__softboundcets_metadata_load_spatial",
+    "__softboundcets_metadata_load_temporal"
+  };
+  for(unsigned i = 0; i < sizeof(metadata_loads)/sizeof(metadata_loads[0]); i++){
+    Function* metadata_load = module.getFunction(metadata_loads[i]);
+    if(metadata_load){
+      metadata_load->addFnAttr(Attribute::ReadOnly);
+      metadata_load->addFnAttr(Attribute::NoUnwind);
+    }
+  }
   
   // parameterize by spatial and temporal
 
@@ -144,6 +177,28 @@ void InitializeSoftBoundCETS:: constructMetadataHandlers(Module & module){
     module.getOrInsertFunction("__softboundcets_metadata_load_lock",
                                VoidPtrTy, VoidPtrTy, NULL);
 
+    /* The accessors only read the metadata, so the ones whose result
+     * is unused are removed. The map function allocates and installs
+     * trie tables, so it is not readonly.
+     */
+    Function* metadata_map = module.getFunction("__softboundcets_metadata_map");
+    if(metadata_map)
+      metadata_map->addFnAttr(Attribute::NoUnwind);
+
+    const char* metadata_accessors[] = { 
+      "__softboundcets_metadata_load_base",
+      "__softboundcets_metadata_load_bound",
+      "__softboundcets_metadata_load_key",
+      "__softboundcets_metadata_load_lock"
+    };
+    for(unsigned i = 0; i < sizeof(metadata_accessors)/sizeof(metadata_accessors[0]); i++){
+      Function* accessor = module.getFunction(metadata_accessors[i]);
+      if(accessor){
+        accessor->addFnAttr(Attribute::ReadOnly);
+        accessor->addFnAttr(Attribute::NoUnwind);
+      }
+    }
+
     module.getOrInsertFunction("__softboundcets_metadata_load_vector", 
                                VoidTy, VoidPtrTy, PtrVoidPtrTy, PtrVoidPtrTy, 
                                PtrSizeTy, PtrVoidPtrTy, Int32Ty, NULL);
@@ -162,6 +217,10 @@ void InitializeSoftBoundCETS:: constructMetadataHandlers(Module & module){
                                VoidTy, VoidPtrTy, VoidPtrTy, 
                                VoidPtrTy, SizeTy, VoidPtrTy, NULL);
 
+    module.getOrInsertFunction("__softboundcets_metadata_load_atomic", 
+                               VoidPtrTy, VoidPtrTy, PtrVoidPtrTy, PtrVoidPtrTy, 
+                               PtrSizeTy, PtrVoidPtrTy, NULL);
+
     module.getOrInsertFunction("__softboundcets_memcopy_check",
                                VoidTy, VoidPtrTy, VoidPtrTy, SizeTy, 
                                VoidPtrTy, VoidPtrTy, VoidPtrTy, VoidPtrTy,
@@ -183,6 +242,10 @@ void InitializeSoftBoundCETS:: constructMetadataHandlers(Module & module){
                                VoidTy, VoidPtrTy, VoidPtrTy, 
                                VoidPtrTy, NULL);
 
+    module.getOrInsertFunction("__softboundcets_metadata_load_atomic",
+                               VoidPtrTy, VoidPtrTy, PtrVoidPtrTy, PtrVoidPtrTy,
+                               NULL);
+
     module.getOrInsertFunction("__softboundcets_memcopy_check",
                                VoidTy, VoidPtrTy, VoidPtrTy, SizeTy, 
                                VoidPtrTy, VoidPtrTy, VoidPtrTy, VoidPtrTy, NULL);
@@ -202,6 +265,9 @@ void InitializeSoftBoundCETS:: constructMetadataHandlers(Module & module){
     module.getOrInsertFunction("__softboundcets_metadata_store", 
                                VoidTy, VoidPtrTy,SizeTy, VoidPtrTy, NULL);
 
+    module.getOrInsertFunction("__softboundcets_metadata_load_atomic",
+                               VoidPtrTy, VoidPtrTy, PtrSizeTy, PtrVoidPtrTy, NULL);
+
     module.getOrInsertFunction("__softboundcets_memcopy_check",
                                VoidTy, VoidPtrTy, VoidPtrTy, SizeTy, 
                                SizeTy, VoidPtrTy, SizeTy, VoidPtrTy, NULL);
@@ -213,9 +279,18 @@ void InitializeSoftBoundCETS:: constructMetadataHandlers(Module & module){
   }
 
 
+  module.getOrInsertFunction("__softboundcets_metadata_lock", 
+                             VoidTy, VoidPtrTy, NULL);
+
+  module.getOrInsertFunction("__softboundcets_metadata_unlock", 
+                             VoidTy, VoidPtrTy, NULL);
+
   module.getOrInsertFunction("__softboundcets_get_global_lock", 
                              VoidPtrTy, NULL);
 
+  module.getOrInsertFunction("__softboundcets_install_global_metadata", 
+                             VoidTy, VoidPtrTy, SizeTy, NULL);
+
   module.getOrInsertFunction("__softboundcets_stack_memory_allocation", 
                              VoidTy, PtrVoidPtrTy, 
                              PtrSizeTy, NULL);
@@ -279,6 +354,28 @@ void InitializeSoftBoundCETS:: constructCheckHandlers(Module & module){
 
   }
 
+  /* The checks abort on failure but never unwind */
+  const char* dereference_checks[] = {
+    "__softboundcets_spatial_load_dereference_check",
+    "__softboundcets_spatial_store_dereference_check",
+    "__softboundcets_temporal_load_dereference_check",
+    "__softboundcets_temporal_store_dereference_check"
+  };
+  for(unsigned i = 0; i < sizeof(dereference_checks)/sizeof(dereference_checks[0]); i++){
+    Function* check = module.getFunction(dereference_checks[i]);
+    if(check){
+      check->addFnAttr(Attribute::NoUnwind);
+    }
+  }
+
+  // Target of the cold path of the inlined dereference checks
+  Function* abort_func = 
+    (Function*) module.getOrInsertFunction("__softboundcets_abort", 
+                                           void_ty, NULL);
+  abort_func->setDoesNotReturn();
+  abort_func->setDoesNotThrow();
+  abort_func->addFnAttr(Attribute::Cold);
+
   Function* global_init = (Function *) module.getOrInsertFunction("__softboundcets_global_init", 
                                                                   void_ty, NULL);
 
@@ -349,6 +446,31 @@ void InitializeSoftBoundCETS:: constructCheckHandlers(Module & module){
 
 }
 
+//
+// Method: constructRuntimeHelperLinkage
+//
+// Description: When the driver links the bitcode of the runtime
+// helpers into the module (-fsoftboundcets-rt-bitcode), their
+// definitions are weak. This function makes them linkonce_odr, so
+// that the copies the instrumentation does not call are removed from
+// the object file. Every copy comes from the same runtime, so any
+// of them can be used.
+
+void InitializeSoftBoundCETS::constructRuntimeHelperLinkage(Module& module){
+
+  for(Module::iterator ff_begin = module.begin(), ff_end = module.end();
+      ff_begin != ff_end; ++ff_begin){
+    Function* func = ff_begin;
+
+    if(func->isDeclaration() || !func->hasWeakLinkage())
+      continue;
+    if(!func->getName().startswith("__softboundcets_"))
+      continue;
+
+    func->setLinkage(GlobalValue::LinkOnceODRLinkage);
+  }
+}
+
 
 bool InitializeSoftBoundCETS:: runOnModule (Module& module){
 
@@ -364,6 +486,7 @@ bool InitializeSoftBoundCETS:: runOnModule (Module& module){
   constructCheckHandlers(module);
   constructShadowStackHandlers(module);
   constructMetadataHandlers(module); 
+  constructRuntimeHelperLinkage(module);
   //  constructAuxillaryFunctionHandlers(module);
   return true;
 }
@@ -39,8 +39,8 @@
 
 char InitializeSoftBoundCETSMPX :: ID = 0;
 
-static RegisterPass<InitializeSoftBoundCETSMPX> P 
-("InitializeSoftBoundCETSMPX","Prototype Creator Pass for Softboundcetsmpx");
+INITIALIZE_PASS(InitializeSoftBoundCETSMPX, "InitializeSoftBoundCETSMPX",
+                "Prototype Creator Pass for Softboundcetsmpx", false, false)
 
 void InitializeSoftBoundCETSMPX:: constructShadowStackHandlers(Module & module){
 
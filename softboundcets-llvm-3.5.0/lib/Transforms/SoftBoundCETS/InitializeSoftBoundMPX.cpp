@@ -66,8 +66,8 @@ extern cl::opt<bool> disable_temporal_safety;
 
 char InitializeSoftBoundMPX :: ID = 0;
 
-static RegisterPass<InitializeSoftBoundMPX> P 
-("InitializeSoftBoundMPX","Prototype Creator Pass for Softboundmpx");
+INITIALIZE_PASS(InitializeSoftBoundMPX, "InitializeSoftBoundMPX",
+                "Prototype Creator Pass for Softboundmpx", false, false)
 
 void InitializeSoftBoundMPX:: constructShadowStackHandlers(Module & module){
 
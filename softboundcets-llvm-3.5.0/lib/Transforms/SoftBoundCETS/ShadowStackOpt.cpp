@@ -38,11 +38,253 @@
 
 #include "llvm/Transforms/SoftBoundCETS/ShadowStackOpt.h"
 
+static cl::opt<bool>
+softboundcets_shadow_stack_opt
+("softboundcets_shadow_stack_opt",
+ cl::desc("pass the metadata of pointer arguments and return values as extra arguments instead of the shadow stack"),
+ cl::init(true));
+
+static cl::opt<bool>
+softboundcets_shadow_stack_thunks
+("softboundcets_shadow_stack_thunks",
+ cl::desc("transform address taken and externally visible functions, keeping a shadow stack thunk with the original name"),
+ cl::init(true));
+
+static const char* const shadow_stack_allocate = 
+  "__softboundcets_allocate_shadow_stack_space";
+static const char* const shadow_stack_deallocate = 
+  "__softboundcets_deallocate_shadow_stack_space";
+
+/* base, bound, key and lock, in the order of the extra arguments */
+static const char* const shadow_stack_loads[] = {
+  "__softboundcets_load_base_shadow_stack",
+  "__softboundcets_load_bound_shadow_stack",
+  "__softboundcets_load_key_shadow_stack",
+  "__softboundcets_load_lock_shadow_stack"
+};
+
+static const char* const shadow_stack_stores[] = {
+  "__softboundcets_store_base_shadow_stack",
+  "__softboundcets_store_bound_shadow_stack",
+  "__softboundcets_store_key_shadow_stack",
+  "__softboundcets_store_lock_shadow_stack"
+};
+
+/* stores the four fields, with the index as the fifth argument */
+static const char* const shadow_stack_metadata_store = 
+  "__softboundcets_store_metadata_shadow_stack";
 
 char ShadowStackOpt::ID = 0;
 
-static RegisterPass<ShadowStackOpt> P ("ShadowStackOpt", 
-					"Shadow Stack Optimizations");
+INITIALIZE_PASS(ShadowStackOpt, "ShadowStackOpt",
+                "Shadow Stack Optimizations", false, false)
+
+//
+// Method: findShadowStackCall()
+//
+// Description:
+//
+// This function looks for a call to the shadow stack handler
+// ss_string, starting next to I and moving forward or backward in its
+// basic block. When index_op is not -1, the operand index_op of the
+// call has to be the constant index. The search gives up at a call to
+// stop_string, which delimits the shadow stack operations of another
+// call site.
+//
+
+CallInst* 
+ShadowStackOpt::findShadowStackCall(Instruction* I, StringRef ss_string,
+                                    int index_op, int index, bool forward,
+                                    StringRef stop_string){
+
+  BasicBlock* BB = I->getParent();
+  BasicBlock::iterator it = I;
+
+  while(true){
+    if(forward){
+      ++it;
+      if(it == BB->end())
+        return nullptr;
+    }
+    else{
+      if(it == BB->begin())
+        return nullptr;
+      --it;
+    }
+
+    CallInst* shadow = dyn_cast<CallInst>(it);
+    if(!shadow)
+      continue;
+
+    Function* func = shadow->getCalledFunction();
+    if(!func)
+      continue;
+
+    if(func->getName() == ss_string){
+      if(index_op == -1)
+        return shadow;
+
+      ConstantInt* constant = dyn_cast<ConstantInt>(shadow->getArgOperand(index_op));
+      if(constant && constant->getSExtValue() == index)
+        return shadow;
+    }
+
+    if(!stop_string.empty() && func->getName() == stop_string)
+      return nullptr;
+  }
+}
+
+//
+// Method: getShadowStackStores()
+//
+// Description:
+//
+// This function finds the shadow stack stores of the metadata of the
+// pointer argument index, or of the returned pointer when index is 0,
+// before I. SoftBoundCETS emits either one combined store or one
+// store per field. The stored base, bound, key and lock are returned
+// in metadata, and the stores are erased when erase is true.
+//
+
+bool ShadowStackOpt::getShadowStackStores(Instruction* I, int index, 
+                                          Value** metadata, bool erase){
+
+  CallInst* combined = findShadowStackCall(I, shadow_stack_metadata_store, 
+                                           4, index, false, 
+                                           shadow_stack_allocate);
+  if(combined){
+    for(int j = 0; j < 4; j++){
+      metadata[j] = combined->getArgOperand(j);
+    }
+    if(erase)
+      combined->eraseFromParent();
+    return true;
+  }
+
+  CallInst* stores[4];
+  for(int j = 0; j < 4; j++){
+    stores[j] = findShadowStackCall(I, shadow_stack_stores[j], 1, index, 
+                                    false, shadow_stack_allocate);
+    if(!stores[j])
+      return false;
+  }
+
+  for(int j = 0; j < 4; j++){
+    metadata[j] = stores[j]->getArgOperand(0);
+    if(erase)
+      stores[j]->eraseFromParent();
+  }
+  return true;
+}
+
+//
+// Method: checkCallSite()
+//
+// Description:
+//
+// This function returns true if call is a direct call to func with
+// the complete shadow stack sequence introduced by SoftBoundCETS
+// around it. Other calls keep using the shadow stack.
+//
+
+bool ShadowStackOpt::checkCallSite(CallInst* call, Function* func){
+
+  if(call->getCalledValue() != func)
+    return false;
+
+  if(!findShadowStackCall(call, shadow_stack_allocate, -1, 0, false, 
+                          shadow_stack_deallocate))
+    return false;
+
+  int arg_no = 0;
+  for(unsigned i = 0; i < call->getNumArgOperands(); i++){
+    Value* arg_value = call->getArgOperand(i);
+
+    /* the function also escapes through this call */
+    if(arg_value == func)
+      return false;
+
+    if(!isa<PointerType>(arg_value->getType()))
+      continue;
+
+    arg_no++;
+    Value* metadata[4];
+    if(!getShadowStackStores(call, arg_no, metadata, false))
+      return false;
+  }
+
+  if(isa<PointerType>(call->getType())){
+    for(int j = 0; j < 4; j++){
+      if(!findShadowStackCall(call, shadow_stack_loads[j], 0, 0, true, 
+                              shadow_stack_deallocate))
+        return false;
+    }
+  }
+
+  return findShadowStackCall(call, shadow_stack_deallocate, -1, 0, true, 
+                             shadow_stack_allocate) != nullptr;
+}
+
+//
+// Method: checkCallee()
+//
+// Description:
+//
+// This function returns true if func loads the metadata of every
+// pointer argument from the shadow stack in its entry block and
+// stores the metadata of every pointer it returns to the shadow
+// stack, which is not the case for functions that SoftBoundCETS did
+// not instrument.
+//
+
+bool ShadowStackOpt::checkCallee(Function* func){
+
+  Instruction* terminator = func->getEntryBlock().getTerminator();
+  int arg_no = 0;
+
+  for(Function::arg_iterator i = func->arg_begin(), e = func->arg_end();
+      i != e; ++i) {
+    if(!isa<PointerType>(i->getType()))
+      continue;
+
+    /* byval arguments do not read their metadata from the shadow stack */
+    if(i->hasByValAttr())
+      return false;
+
+    arg_no++;
+    for(int j = 0; j < 4; j++){
+      if(!findShadowStackCall(terminator, shadow_stack_loads[j], 0, arg_no, 
+                              false, ""))
+        return false;
+    }
+  }
+
+  if(!isa<PointerType>(func->getReturnType()))
+    return true;
+
+  for(auto &BB: *func){
+    ReturnInst* ret_inst = dyn_cast<ReturnInst>(BB.getTerminator());
+    if(!ret_inst)
+      continue;
+
+    Value* metadata[4];
+    if(!getShadowStackStores(ret_inst, 0, metadata, false))
+      return false;
+  }
+  return true;
+}
+
+//
+// Method: checkFunctionOfInterest()
+//
+// Description:
+//
+// This function returns true if func takes or returns pointers and
+// has direct calls that can pass the metadata as arguments. Functions
+// that are visible outside the module or have other uses keep a
+// shadow stack thunk with their name, so they can also be transformed
+// unless the thunks are disabled.
+//
 
 bool ShadowStackOpt::checkFunctionOfInterest(Function* func){
 
@@ -52,18 +294,13 @@ bool ShadowStackOpt::checkFunctionOfInterest(Function* func){
 
   if(func->isVarArg())
     return false;
+
+  /* calls in the module must reach the definition that is linked in */
+  if(func->mayBeOverridden())
+    return false;
   
-  bool function_direct = true;
   bool function_ptr_argsret = false;
 
-  for(User * NU: func->users()){
-    CallInst * call_inst = dyn_cast<CallInst>(NU);
-    if(!call_inst){   
-      function_direct = false;
-      break;
-    }    
-  }
-
   Type* Rty = func->getReturnType();
 
   if(isa<PointerType>(Rty))
@@ -76,7 +313,26 @@ bool ShadowStackOpt::checkFunctionOfInterest(Function* func){
       break;
     }
   }
-  return ((function_direct) && (function_ptr_argsret));
+
+  if(!function_ptr_argsret || !checkCallee(func))
+    return false;
+
+  bool function_direct = false;
+  bool needs_thunk = !func->hasLocalLinkage();
+
+  for(User * NU: func->users()){
+    CallInst * call_inst = dyn_cast<CallInst>(NU);
+    if(call_inst && checkCallSite(call_inst, func)){
+      function_direct = true;
+      continue;
+    }
+    needs_thunk = true;
+  }
+
+  if(needs_thunk && !softboundcets_shadow_stack_thunks)
+    return false;
+
+  return function_direct;
 }
 
 //
@@ -106,33 +362,8 @@ ShadowStackOpt::getShadowStackLoadHandler(Instruction *call,
 					  StringRef ss_string, 
 					  int index){
 
-  Instruction* returnval = nullptr;
-  Instruction *next = call;
-
-  while(true){
-    next = getPrevInstruction(next);
-
-    if(next == call->getParent()->getTerminator())
-      break;
-
-    if(CallInst* shadow = dyn_cast<CallInst>(next)){
-      Function* func = shadow->getCalledFunction();
-
-      if((func->getName().find(ss_string) == 0) ||
-	 (func->getName().find(ss_string) == 0)){
-
-	if(ConstantInt * constant = dyn_cast<ConstantInt>(shadow->getOperand(0))){
-	  if(constant->getUniqueInteger() == index){
-	    returnval = shadow;
-	    break;
-	  }
-	}
-	else{
-	  assert(0 && "invalid shadow stack operation found");
-	}
-      }
-    }
-  }//while loop
+  Instruction* returnval = findShadowStackCall(call, ss_string, 0, index, 
+                                               false, "");
   assert((returnval != nullptr) && "no shadow stack function to replace?");
 
   return returnval;
@@ -145,44 +376,21 @@ ShadowStackOpt::getShadowStackArgHandler(Instruction *call,
 					 int index){
 
   Value* returnval = nullptr;
-  Instruction *next = call;
-  bool check = false;
+  CallInst* shadow = nullptr;
 
   if(index == -1){
-    check = true;
+    shadow = findShadowStackCall(call, ss_string, -1, 0, false, "");
   }
-  
-  while(true){
-    next = getPrevInstruction(next);
-
-    if(next == call->getParent()->getTerminator())
-      break;
-
-    if(CallInst* shadow = dyn_cast<CallInst>(next)){
-      Function* func = shadow->getCalledFunction();
-
-      if((func->getName().find(ss_string) == 0) ||
-	 (func->getName().find(ss_string) == 0)){
-
-	if(check == true){
-	  next->eraseFromParent();
-	  break;
-	}
+  else{
+    shadow = findShadowStackCall(call, ss_string, 1, index, false, 
+                                 shadow_stack_allocate);
+  }
+  assert((shadow != nullptr) && "no shadow stack function to replace?");
 
-	if(ConstantInt * constant = dyn_cast<ConstantInt>(shadow->getOperand(1))){
-	  if(constant->getUniqueInteger() == index){
-	    returnval = shadow->getOperand(0);
-	    next->eraseFromParent();
-	    break;
-	  }
-	}
-	else{
-	  assert(0 && "invalid shadow stack operation found");
-	}
-      }
-    }
-  }//while loop
-  assert(((check == true) || (returnval != nullptr)) && "no shadow stack function to replace?");
+  if(index != -1){
+    returnval = shadow->getArgOperand(0);
+  }
+  shadow->eraseFromParent();
 
   return returnval;
 }
@@ -190,27 +398,17 @@ ShadowStackOpt::getShadowStackArgHandler(Instruction *call,
 CallInst* ShadowStackOpt::getShadowStackRetHandler(CallInst *call, StringRef ss_string){
 
   CallInst* returnval = nullptr;
-  Instruction* next = call;
-  while(true){
-    next = getNextInstruction(next);
-
-    if(next == call->getParent()->getTerminator())
-      break;
-
-    if(CallInst* shadow = dyn_cast<CallInst>(next)){
-      Function* func = shadow->getCalledFunction();
 
-      if((func->getName().find(ss_string) == 0) ||
-	 (func->getName().find(ss_string) == 0)){
-	returnval = shadow;
-	break;
-      }
-    }
-  }//while loop
+  if(ss_string == shadow_stack_deallocate){
+    returnval = findShadowStackCall(call, ss_string, -1, 0, true, 
+                                    shadow_stack_allocate);
+  }
+  else{
+    returnval = findShadowStackCall(call, ss_string, 0, 0, true, 
+                                    shadow_stack_deallocate);
+  }
   assert((returnval != nullptr) && "no shadow stack function to replace?");
   return returnval;
-
-
 }
 
 
@@ -218,19 +416,16 @@ void ShadowStackOpt:: ReplaceShadowStackLoads(Value* Cbase, Value* Cbound,
 					      Value* Ckey, Value* Clock,
 					      CallInst* call){
 
-  CallInst* shadow_base = getShadowStackRetHandler(call, "__softboundcets_load_base_shadow_stack");
-  CallInst* shadow_bound = getShadowStackRetHandler(call,"__softboundcets_load_bound_shadow_stack");
-  CallInst* shadow_key = getShadowStackRetHandler(call, "__softboundcets_load_key_shadow_stack");
-  CallInst* shadow_lock = getShadowStackRetHandler(call, "__softboundcets_load_lock_shadow_stack");
+  CallInst* shadow_base = getShadowStackRetHandler(call, shadow_stack_loads[0]);
+  CallInst* shadow_bound = getShadowStackRetHandler(call, shadow_stack_loads[1]);
+  CallInst* shadow_key = getShadowStackRetHandler(call, shadow_stack_loads[2]);
+  CallInst* shadow_lock = getShadowStackRetHandler(call, shadow_stack_loads[3]);
 
   shadow_base->replaceAllUsesWith(Cbase);
   shadow_bound->replaceAllUsesWith(Cbound);
   shadow_key->replaceAllUsesWith(Ckey);
   shadow_lock->replaceAllUsesWith(Clock);
 
-  CallInst* shadow_deallocate = getShadowStackRetHandler(call, "__softboundcets_deallocate_shadow_stack_space");
-  
-  shadow_deallocate->eraseFromParent();
   shadow_base->eraseFromParent();
   shadow_bound->eraseFromParent();
   shadow_key->eraseFromParent();
@@ -317,6 +512,7 @@ void ShadowStackOpt::handleCallUseOfFunction(CallInst *CI,
   int arg_index;
   CallSite::arg_iterator arg_i = CS.arg_begin();
   arg_index = 1;
+  int ptr_arg_no = 0;
 
   std::vector<Value*> extra_actual_parameters;
 
@@ -327,16 +523,13 @@ void ShadowStackOpt::handleCallUseOfFunction(CallInst *CI,
 
     if(isa<PointerType>(arg_value_considered->getType())) {
 
-      Value* cs_base = getShadowStackArgHandler(CI, "__softboundcets_store_base_shadow_stack", arg_index);
-      extra_actual_parameters.push_back(cs_base);
-      Value* cs_bound = getShadowStackArgHandler(CI, "__softboundcets_store_bound_shadow_stack", arg_index);
-      extra_actual_parameters.push_back(cs_bound);
-      Value* cs_key = getShadowStackArgHandler(CI, "__softboundcets_store_key_shadow_stack", arg_index);
-      extra_actual_parameters.push_back(cs_key);
-
-      Value* cs_lock = getShadowStackArgHandler(CI, "__softboundcets_store_lock_shadow_stack", arg_index);
-      extra_actual_parameters.push_back(cs_lock);
-      
+      /* shadow stack slots are numbered over the pointer arguments */
+      ptr_arg_no++;
+      Value* cs_metadata[4];
+      bool found = getShadowStackStores(CI, ptr_arg_no, cs_metadata, true);
+      assert(found && "no shadow stack function to replace?");
+      extra_actual_parameters.insert(extra_actual_parameters.end(), 
+                                     cs_metadata, cs_metadata + 4);
 
     }/* if pointer argument ends */
     else{
@@ -349,7 +542,13 @@ void ShadowStackOpt::handleCallUseOfFunction(CallInst *CI,
     }
   } /* iterating over original argument ends */
 
-  getShadowStackArgHandler(CI, "__softboundcets_allocate_shadow_stack_space", -1);
+  if(call_pal.hasAttributes(AttributeSet::FunctionIndex))
+    param_attrs_vec.push_back(AttributeSet::get(call->getContext(), call_pal.getFnAttributes()));
+
+  CallInst* shadow_deallocate = getShadowStackRetHandler(CI, shadow_stack_deallocate);
+  shadow_deallocate->eraseFromParent();
+
+  getShadowStackArgHandler(CI, shadow_stack_allocate, -1);
 
 
 
@@ -362,15 +561,14 @@ void ShadowStackOpt::handleCallUseOfFunction(CallInst *CI,
   }
 
   // Create the new call instruction
-  Instruction* new_inst;
-  if(InvokeInst* invoke_call = dyn_cast<InvokeInst>(call)) {
-    invoke_call->dump();
-    assert(0 && "Invoke not handled");
-  }
+  CallInst* new_inst = CallInst::Create(NF, call_args, "", call);
+  new_inst->setCallingConv(CI->getCallingConv());
+  new_inst->setAttributes(AttributeSet::get(call->getContext(), param_attrs_vec));  
 
-  new_inst = CallInst::Create(NF, call_args, "", call);
-  cast<CallInst>(new_inst)->setCallingConv(CI->getCallingConv());
-  cast<CallInst>(new_inst)->setAttributes(AttributeSet::get(call->getContext(), param_attrs_vec));  
+  if(!ret_type_is_pointer){
+    call->replaceAllUsesWith(new_inst);
+    new_inst->takeName(call);
+  }
   call->eraseFromParent();    
 }
 
@@ -392,47 +590,19 @@ void ShadowStackOpt::ProcessReturnInst(ReturnInst* ret_inst, Function* NF){
   
   new StoreInst(pointer, gep_ret_ptr, ret_inst);
 
+  static const char* const field_names[] = {".base", ".bound", ".key", ".lock"};
 
-  Value* base, *bound, *key, *lock;
-
-  base = getShadowStackArgHandler(ret_inst, "__softboundcets_store_base_shadow_stack", 0);  
-  bound = getShadowStackArgHandler(ret_inst, "__softboundcets_store_bound_shadow_stack", 0);  
-  key = getShadowStackArgHandler(ret_inst, "__softboundcets_store_key_shadow_stack", 0);
-  lock = getShadowStackArgHandler(ret_inst, "__softboundcets_store_lock_shadow_stack", 0);
-  
-  idxs[1] = ConstantInt::get(Type::getInt32Ty(ret_inst->getContext()), 1);
-  
-  Value* gep_ret_base = GetElementPtrInst::Create(ret_argument, idxs,
-						  ret_arg->getName() + ".base",
-						  ret_inst);
-  
-  new StoreInst(base, gep_ret_base, ret_inst);
-
-
-  idxs[1] = ConstantInt::get(Type::getInt32Ty(ret_inst->getContext()), 2);
-  
-  Value* gep_ret_bound = GetElementPtrInst::Create(ret_argument, idxs,
-						   ret_arg->getName() + ".bound",
-						   ret_inst);
-
-  new StoreInst(bound, gep_ret_bound, ret_inst);
-
-  idxs[1] = ConstantInt::get(Type::getInt32Ty(ret_inst->getContext()), 3);
-  
-  Value* gep_ret_key = GetElementPtrInst::Create(ret_argument, idxs,
-						 ret_arg->getName() + ".key",
-						 ret_inst);
-
-  new StoreInst(key, gep_ret_key, ret_inst);
+  Value* metadata[4];
+  bool found = getShadowStackStores(ret_inst, 0, metadata, true);
+  assert(found && "no shadow stack function to replace?");
 
-
-  idxs[1] = ConstantInt::get(Type::getInt32Ty(ret_inst->getContext()), 4);
-  
-  Value* gep_ret_lock = GetElementPtrInst::Create(ret_argument, idxs,
-						  ret_arg->getName() + ".lock",
-						  ret_inst);
-
-  new StoreInst(lock, gep_ret_lock, ret_inst);
+  for(int j = 0; j < 4; j++){
+    idxs[1] = ConstantInt::get(Type::getInt32Ty(ret_inst->getContext()), j + 1);
+    Value* gep_ret_metadata = GetElementPtrInst::Create(ret_argument, idxs,
+                                                        ret_arg->getName() + field_names[j],
+                                                        ret_inst);
+    new StoreInst(metadata[j], gep_ret_metadata, ret_inst);
+  }
   
   BasicBlock* BB = ret_inst->getParent();
   ReturnInst::Create(ret_inst->getContext(), BB);
@@ -451,14 +621,10 @@ void ShadowStackOpt::ProcessArgsandRemoveShadowCalls(Function *F, Function* NF){
     arg_i2++;
   }
 
-  std::vector<StringRef> extra_arguments;
-
-
-  int ptr_arg_count=0;
-  unsigned int org_num_arguments = 0;
+  std::vector<std::string> extra_arguments;
 
   for (Function::arg_iterator arg_i = F->arg_begin(), arg_e = F->arg_end();
-       arg_i != arg_e; ++arg_i, ++org_num_arguments){
+       arg_i != arg_e; ++arg_i){
 
     Argument* ptr_arg = dyn_cast<Argument>(arg_i);
     Value* ptr_arg_value = ptr_arg;
@@ -474,48 +640,102 @@ void ShadowStackOpt::ProcessArgsandRemoveShadowCalls(Function *F, Function* NF){
     ++arg_i2;
   }
 
-  std::vector<StringRef>:: iterator args_it = extra_arguments.begin();
+  static const char* const field_names[] = {"_base", "_bound", "_key", "_lock"};
 
   Instruction* terminator= NF->begin()->getTerminator();
-  Instruction* start = getPrevInstruction(terminator);
   int arg_count = 0;
-  while(args_it != extra_arguments.end()){
+  for(std::vector<std::string>::iterator args_it = extra_arguments.begin(), 
+        args_e = extra_arguments.end(); args_it != args_e; ++args_it){
     
     ++arg_count;
-    StringRef ptr_arg = *args_it;
 
-    
-    
-    ++args_it;
+    for(int j = 0; j < 4; j++){
+      arg_i2->setName(*args_it + field_names[j]);
+      Instruction* ss_inst = getShadowStackLoadHandler(terminator, shadow_stack_loads[j], arg_count);
+      ss_inst->replaceAllUsesWith(arg_i2);
+      ss_inst->eraseFromParent();
+      ++arg_i2;
+    }
+  }
+}
+
+//
+// Method: createShadowStackThunk()
+//
+// Description:
+//
+// This function turns F, whose body has moved to NF, into a thunk
+// that keeps the shadow stack convention: it reads the metadata of the
+// pointer arguments from the shadow stack, calls NF and writes the
+// metadata of the returned pointer back to the shadow stack. Indirect
+// calls and calls from other modules go through the thunk.
+//
 
-    Instruction* ss_inst;
+void ShadowStackOpt::createShadowStackThunk(Function* F, Function* NF){
 
-    arg_i2->setName(ptr_arg + "_base");
-    ss_inst = getShadowStackLoadHandler(start, "__softboundcets_load_base_shadow_stack", arg_count);
-    ss_inst->replaceAllUsesWith(arg_i2);
-    ss_inst->eraseFromParent();
-    
-    ++arg_i2;
+  LLVMContext& C = F->getContext();
+  BasicBlock* entry = BasicBlock::Create(C, "entry", F);
+  Type* int32_type = Type::getInt32Ty(C);
 
-    arg_i2->setName(ptr_arg + "_bound");
-    ss_inst = getShadowStackLoadHandler(start, "__softboundcets_load_bound_shadow_stack", arg_count);
-    ss_inst->replaceAllUsesWith(arg_i2);
-    ss_inst->eraseFromParent();
+  SmallVector<Value*, 16> call_args;
+  SmallVector<Value*, 16> metadata_args;
+  AllocaInst* ret_ai = nullptr;
 
-    ++arg_i2;    
-   
-    arg_i2->setName(ptr_arg + "_key");
-    ss_inst = getShadowStackLoadHandler(start, "__softboundcets_load_key_shadow_stack", arg_count);
-    ss_inst->replaceAllUsesWith(arg_i2);
-    ss_inst->eraseFromParent();
+  if(isa<PointerType>(F->getReturnType())){
+    ret_ai = new AllocaInst(getStructMetadataType(F->getReturnType()), 
+                            "struct_ret", entry);
+    call_args.push_back(ret_ai);
+  }
 
-    ++arg_i2;
-    
-    arg_i2->setName(ptr_arg + "_lock");
-    ss_inst = getShadowStackLoadHandler(start, "__softboundcets_load_lock_shadow_stack", arg_count);
-    ss_inst->replaceAllUsesWith(arg_i2);
-    ss_inst->eraseFromParent();
-    ++arg_i2;   
+  int arg_no = 0;
+  for(Function::arg_iterator i = F->arg_begin(), e = F->arg_end();
+      i != e; ++i) {
+    call_args.push_back(i);
+    if(!isa<PointerType>(i->getType()))
+      continue;
+
+    arg_no++;
+    Value* index = ConstantInt::get(int32_type, arg_no);
+    for(int j = 0; j < 4; j++){
+      metadata_args.push_back(CallInst::Create(m_shadow_stack_load_funcs[j], 
+                                               index, "", entry));
+    }
+  }
+  call_args.append(metadata_args.begin(), metadata_args.end());
+
+  CallInst* call = CallInst::Create(NF, call_args, "", entry);
+  call->setCallingConv(NF->getCallingConv());
+
+  if(ret_ai){
+    Value* idxs[2] = {ConstantInt::get(int32_type, 0), 
+                      ConstantInt::get(int32_type, 0)};
+    Value* ret_ptr = new LoadInst(GetElementPtrInst::Create(ret_ai, idxs, "", entry), 
+                                  "", entry);
+    Value* metadata[4];
+    for(int j = 0; j < 4; j++){
+      idxs[1] = ConstantInt::get(int32_type, j + 1);
+      metadata[j] = new LoadInst(GetElementPtrInst::Create(ret_ai, idxs, "", entry), 
+                                 "", entry);
+    }
+
+    Value* index = ConstantInt::get(int32_type, 0);
+    if(m_shadow_stack_metadata_store_func){
+      Value* args[5] = {metadata[0], metadata[1], metadata[2], metadata[3], index};
+      CallInst::Create(m_shadow_stack_metadata_store_func, args, "", entry);
+    }
+    else{
+      for(int j = 0; j < 4; j++){
+        Value* args[2] = {metadata[j], index};
+        CallInst::Create(m_shadow_stack_store_funcs[j], args, "", entry);
+      }
+    }
+    ReturnInst::Create(C, ret_ptr, entry);
+  }
+  else if(F->getReturnType()->isVoidTy()){
+    ReturnInst::Create(C, entry);
+  }
+  else{
+    ReturnInst::Create(C, call, entry);
   }
 }
 
@@ -539,7 +759,6 @@ void ShadowStackOpt::transformIndividualFunction(Function* F){
 
   }
 
-  const FunctionType* fty = F->getFunctionType();
   std::vector<Type*> params;
 
   SmallVector<AttributeSet, 8> param_attrs_vec;
@@ -577,6 +796,9 @@ void ShadowStackOpt::transformIndividualFunction(Function* F){
     }
   }
 
+  if(pal.hasAttributes(AttributeSet::FunctionIndex))
+    param_attrs_vec.push_back(AttributeSet::get(F->getContext(), pal.getFnAttributes()));
+
   for(int i = 0; i < count; i++){
 
     /* push the metadata for each pointer argument at the end of the function */
@@ -587,23 +809,32 @@ void ShadowStackOpt::transformIndividualFunction(Function* F){
   }
 
   FunctionType* nfty = FunctionType::get(new_ret_type, params, false);
-  Function* new_func = Function::Create(nfty, F->getLinkage(), F->getName()+ ".mod");
+
+  /* Only the calls in this module use the new convention */
+  Function* new_func = Function::Create(nfty, GlobalValue::InternalLinkage, 
+                                        F->getName()+ ".mod");
   
 
   // set the new function attributes
   new_func->copyAttributesFrom(F);
+  new_func->setVisibility(GlobalValue::DefaultVisibility);
   new_func->setAttributes(AttributeSet::get(F->getContext(), param_attrs_vec));
 
   /* Add the new function into Module's function list */
   F->getParent()->getFunctionList().insert(F, new_func);
 
+  /* the calls are replaced, so do not walk the use list itself */
+  std::vector<CallInst*> direct_calls;
   for (User *U: F->users()){
     CallInst* CI = dyn_cast<CallInst>(U);
-
-    if(!CI){
-      assert (0 && "Non-call uses of Function and being transformed?");
+    if(CI && checkCallSite(CI, F)){
+      direct_calls.push_back(CI);
     }
-    handleCallUseOfFunction(CI, new_func);   
+  }
+
+  for(std::vector<CallInst*>::iterator i = direct_calls.begin(), 
+        e = direct_calls.end(); i != e; ++i){
+    handleCallUseOfFunction(*i, new_func);   
   }
 
   if(isa<PointerType>(F->getReturnType())){    
@@ -623,13 +854,13 @@ void ShadowStackOpt::transformIndividualFunction(Function* F){
 
   new_func->getBasicBlockList().splice(new_func->begin(), F->getBasicBlockList());
   ProcessArgsandRemoveShadowCalls(F, new_func);
-  F->eraseFromParent();
-
-#if 0
-  func->setLinkage(GlobalValue::ExternalLinkage);
-#endif
-
 
+  if(F->hasLocalLinkage() && F->use_empty()){
+    F->eraseFromParent();
+  }
+  else{
+    createShadowStackThunk(F, new_func);
+  }
 }
 
 
@@ -648,9 +879,23 @@ void ShadowStackOpt::transformFunctions(){
 
 bool ShadowStackOpt::runOnModule(Module &M){
 
+  if(!m_enabled && !softboundcets_shadow_stack_opt)
+    return false;
+
   m_void_ptr_type = PointerType::getUnqual(Type::getInt8Ty(M.getContext()));
   m_sizet_type = Type::getInt64Ty(M.getContext());
 
+  /* Modules that SoftBoundCETS did not instrument have no handlers */
+  for(int j = 0; j < 4; j++){
+    m_shadow_stack_load_funcs[j] = M.getFunction(shadow_stack_loads[j]);
+    m_shadow_stack_store_funcs[j] = M.getFunction(shadow_stack_stores[j]);
+    if(!m_shadow_stack_load_funcs[j] || !m_shadow_stack_store_funcs[j])
+      return false;
+  }
+  m_shadow_stack_metadata_store_func = M.getFunction(shadow_stack_metadata_store);
+
+  FunctionsToTransform.clear();
+
   for (Module::iterator ff_begin = M.begin(), ff_end = M.end();
        ff_begin != ff_end; ++ff_begin){
 
@@ -660,5 +905,5 @@ bool ShadowStackOpt::runOnModule(Module &M){
     }
   }
   transformFunctions();
-  return true;
+  return !FunctionsToTransform.empty();
 }
@@ -42,7 +42,20 @@
 //===---------------------------------------------------------------------===//
 
 #include "llvm/Transforms/SoftBoundCETS/SoftBoundCETSPass.h"
+#include "llvm/ADT/Statistic.h"
 
+#define DEBUG_TYPE "softboundcets"
+
+STATISTIC(NumDominatedSpatialChecks, 
+          "Number of spatial checks subsumed by a dominating check");
+STATISTIC(NumPostDominatedSpatialChecks, 
+          "Number of spatial checks merged into an earlier check");
+STATISTIC(NumSunkMetadataLoads, 
+          "Number of metadata loads moved towards their uses");
+STATISTIC(NumDroppedMetadataLoads, 
+          "Number of unused metadata loads removed");
+STATISTIC(NumMergedMetadataLoads, 
+          "Number of metadata loads replaced by an earlier load");
 
 
 cl::opt<bool>
@@ -54,7 +67,7 @@ eliminate_struct_checks
 cl::opt<bool>
 simple_metadata_mode
 ("simple_metadata_mode",
- cl::desc("use wrapper functions for metadata loads instead of allocas"),
+ cl::desc("use a wrapper function for each metadata field loaded instead of allocas"),
  cl::init(false));
 
 cl::opt<bool>
@@ -93,10 +106,10 @@ metadata_prop_only
  cl::desc("perform only metadata propagation"),
  cl::init(false));
 
-static cl::opt<bool>
+cl::opt<bool>
 chk_intrinsic
 ("softboundcets_chk_intrinsic",
- cl::desc("insert intrinsics for spatial and temporal safety"),
+ cl::desc("emit dereference checks as llvm.sbcets check intrinsics that the optimizer can merge and hoist"),
  cl::init(false));
 
 
@@ -211,6 +224,54 @@ DISABLE_MEMCOPY_METADATA_COPIES
  cl::desc("disable metadata copies with memcopy"),
  cl::init(false));
 
+static cl::opt<bool>
+MEMCOPYMETADATAELISION
+("softboundcets_memcpy_metadata_elision",
+ cl::desc("omit the metadata copy of memcopies whose types show that they copy no pointers"),
+ cl::init(true));
+
+static cl::opt<unsigned>
+MEMCOPYINLINEMETADATACOPIES
+("softboundcets_memcpy_inline_metadata_copies",
+ cl::desc("copy the metadata of fixed size memcopies of types with up to this many pointers inline"),
+ cl::init(4));
+
+static cl::opt<bool>
+LOOPCHECKOPT
+("softboundcets_loop_check_opt",
+ cl::desc("hoist loop invariant checks and widen induction variable checks out of loops"),
+ cl::init(true));
+
+static cl::opt<bool>
+LAZYMETADATALOADS
+("softboundcets_lazy_metadata_loads",
+ cl::desc("load the metadata of a loaded pointer where it is used instead of at the load"),
+ cl::init(true));
+
+static cl::opt<bool>
+LINEARSHADOW
+("softboundcets_linear_shadow",
+ cl::desc("compute the metadata addresses inline for a runtime built with __SOFTBOUNDCETS_LINEAR_SHADOW"),
+ cl::init(false));
+
+static cl::opt<unsigned>
+LINEARSHADOWBITS
+("softboundcets_linear_shadow_bits",
+ cl::desc("address bits covered by the linear shadow region, as __SOFTBOUNDCETS_LINEAR_SHADOW_BITS in the runtime"),
+ cl::init(43));
+
+static cl::opt<bool>
+INLINECHECKS
+("softboundcets_inline_checks",
+ cl::desc("emit dereference checks as inline compare and branch instead of runtime calls"),
+ cl::init(false));
+
+static cl::opt<bool>
+STATICGLOBALMETADATA
+("softboundcets_static_global_metadata",
+ cl::desc("emit the metadata of pointers in global initializers as a table installed by the runtime"),
+ cl::init(true));
+
 #if 0
 static cl::opt<bool>
 unsafe_byval_opt
@@ -219,12 +280,17 @@ unsafe_byval_opt
  cl::init(false));
 #endif
 
-// #define SOFTBOUNDCETS_CHK_INTRINSIC 1
-
 char SoftBoundCETSPass:: ID = 0;
 
-static RegisterPass<SoftBoundCETSPass> P ("SoftBoundCETSPass",
-                                          "SoftBound Pass for Spatial Safety");
+INITIALIZE_PASS_BEGIN(SoftBoundCETSPass, "SoftBoundCETSPass",
+                      "SoftBound Pass for Spatial Safety", false, false)
+INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(PostDominatorTree)
+INITIALIZE_PASS_DEPENDENCY(LoopInfo)
+INITIALIZE_PASS_DEPENDENCY(ScalarEvolution)
+INITIALIZE_PASS_DEPENDENCY(TargetLibraryInfo)
+INITIALIZE_PASS_END(SoftBoundCETSPass, "SoftBoundCETSPass",
+                    "SoftBound Pass for Spatial Safety", false, false)
 
 
 //
@@ -371,6 +437,13 @@ void SoftBoundCETSPass::initializeSoftBoundVariables(Module& module) {
       module.getFunction("__softboundcets_store_lock_shadow_stack");
     assert(m_shadow_stack_lock_store && 
            "__softboundcets_store_lock_shadow_stack NULL?");
+
+    if(spatial_safety){
+      m_shadow_stack_metadata_store = 
+        module.getFunction("__softboundcets_store_metadata_shadow_stack");
+      assert(m_shadow_stack_metadata_store && 
+             "__softboundcets_store_metadata_shadow_stack NULL?");
+    }
     
     
     m_temporal_stack_memory_allocation = 
@@ -414,10 +487,38 @@ void SoftBoundCETSPass::initializeSoftBoundVariables(Module& module) {
   
   m_load_base_bound_func = module.getFunction("__softboundcets_metadata_load");
   assert(m_load_base_bound_func && "__softboundcets_metadata_load null?");
+
+  if(spatial_safety){
+    m_metadata_load_spatial_func = 
+      module.getFunction("__softboundcets_metadata_load_spatial");
+    assert(m_metadata_load_spatial_func && 
+           "__softboundcets_metadata_load_spatial null?");
+  }
+
+  if(temporal_safety){
+    m_metadata_load_temporal_func = 
+      module.getFunction("__softboundcets_metadata_load_temporal");
+    assert(m_metadata_load_temporal_func && 
+           "__softboundcets_metadata_load_temporal null?");
+  }
   
   m_store_base_bound_func = module.getFunction("__softboundcets_metadata_store");
   assert(m_store_base_bound_func && "__softboundcets_metadata_store null?");
 
+  m_install_global_metadata_func = 
+    module.getFunction("__softboundcets_install_global_metadata");
+  assert(m_install_global_metadata_func && 
+         "__softboundcets_install_global_metadata null?");
+
+  m_metadata_load_atomic_func = module.getFunction("__softboundcets_metadata_load_atomic");
+  assert(m_metadata_load_atomic_func && "__softboundcets_metadata_load_atomic null?");
+
+  m_metadata_lock_func = module.getFunction("__softboundcets_metadata_lock");
+  assert(m_metadata_lock_func && "__softboundcets_metadata_lock null?");
+
+  m_metadata_unlock_func = module.getFunction("__softboundcets_metadata_unlock");
+  assert(m_metadata_unlock_func && "__softboundcets_metadata_unlock null?");
+
   m_call_dereference_func = 
     module.getFunction("__softboundcets_spatial_call_dereference_check");
   assert(m_call_dereference_func && 
@@ -433,6 +534,9 @@ void SoftBoundCETSPass::initializeSoftBoundVariables(Module& module) {
   assert(m_memcopy_check && 
          "__softboundcets_memset_check function null?");
 
+  m_abort_func = module.getFunction("__softboundcets_abort");
+  assert(m_abort_func && "__softboundcets_abort function null?");
+
 
   m_void_ptr_type = PointerType::getUnqual(Type::getInt8Ty(module.getContext()));
     
@@ -479,6 +583,19 @@ void SoftBoundCETSPass::initializeSoftBoundVariables(Module& module) {
 
   m_sizet_null_ptr = ConstantPointerNull::get(sizet_ptr_ty);
 
+  m_linear_shadow = NULL;
+  if(LINEARSHADOW){
+    assert(m_is_64_bit && spatial_safety && temporal_safety && 
+           "linear shadow only with 64 bit spatial and temporal safety");
+    assert(LINEARSHADOWBITS > 3 && LINEARSHADOWBITS < 48 && 
+           "linear shadow bits out of range?");
+    // The name carries the window, so that the program only links
+    // with a runtime built for the same linear shadow
+    m_linear_shadow = 
+      module.getOrInsertGlobal("__softboundcets_linear_shadow_" + 
+                               utostr(LINEARSHADOWBITS), m_void_ptr_type);
+  }
+
 
   m_constantint32ty_one = 
     ConstantInt::get(Type::getInt32Ty(module.getContext()), 1);
@@ -837,6 +954,9 @@ bool SoftBoundCETSPass::isFuncDefSoftBound(const std::string &str) {
     m_func_wrappers_available["memchr"] = true;
     m_func_wrappers_available["rindex"] = true;
     m_func_wrappers_available["strtoul"] = true;
+    m_func_wrappers_available["getline"] = true;
+    m_func_wrappers_available["getdelim"] = true;
+    m_func_wrappers_available["__getdelim"] = true;
     m_func_wrappers_available["strtod"] = true;
     m_func_wrappers_available["strtol"] = true;
     m_func_wrappers_available["strchr"] = true;
@@ -890,6 +1010,10 @@ bool SoftBoundCETSPass::isFuncDefSoftBound(const std::string &str) {
     m_func_wrappers_available["__ctype_toupper_loc"] = true;
     m_func_wrappers_available["__ctype_tolower_loc"] = true;
     m_func_wrappers_available["qsort"] = true;
+    m_func_wrappers_available["pthread_create"] = true;
+    m_func_wrappers_available["pthread_exit"] = true;
+    m_func_wrappers_available["pthread_join"] = true;
+    m_func_wrappers_available["pthread_detach"] = true;
 
     m_func_def_softbound["puts"] = true;
     m_func_def_softbound["__softboundcets_intermediate"]= true;
@@ -906,6 +1030,7 @@ bool SoftBoundCETSPass::isFuncDefSoftBound(const std::string &str) {
     m_func_def_softbound["__softboundcets_store_bound_shadow_stack"] = true;      
     m_func_def_softbound["__softboundcets_store_key_shadow_stack"] = true;      
     m_func_def_softbound["__softboundcets_store_lock_shadow_stack"] = true;      
+    m_func_def_softbound["__softboundcets_store_metadata_shadow_stack"] = true;      
     m_func_def_softbound["__softboundcets_deallocate_shadow_stack_space"] = true;
 
     m_func_def_softbound["__softboundcets_trie_allocate"] = true;
@@ -933,6 +1058,8 @@ bool SoftBoundCETSPass::isFuncDefSoftBound(const std::string &str) {
     m_func_def_softbound["__softboundcets_metadata_store_vector"] = true;
     
     m_func_def_softbound["__softboundcets_metadata_load"] = true;
+    m_func_def_softbound["__softboundcets_metadata_load_spatial"] = true;
+    m_func_def_softbound["__softboundcets_metadata_load_temporal"] = true;
     m_func_def_softbound["__softboundcets_metadata_store"] = true;
     m_func_def_softbound["__hashProbeAddrOfPtr"] = true;
     m_func_def_softbound["__memcopyCheck"] = true;
@@ -1028,6 +1155,11 @@ bool SoftBoundCETSPass::isFuncDefSoftBound(const std::string &str) {
     return true;
   }
 
+  // Runtime helpers linked into the module from the runtime bitcode
+  if (str.find("__softboundcets_") == 0) {
+    return true;
+  }
+
   return false;
 }
 
@@ -1182,6 +1314,20 @@ void SoftBoundCETSPass::addStoreBaseBoundFunc(Value* pointer_dest,
     args.push_back(pointer_key);
     args.push_back(pointer_lock);
   }
+
+  if(LINEARSHADOW){
+    Value* base_addr = NULL;
+    Value* bound_addr = NULL;
+    Value* key_addr = NULL;
+    Value* lock_addr = NULL;
+    getLinearShadowEntry(pointer_dest_cast, insert_at, 
+                         base_addr, bound_addr, key_addr, lock_addr);
+    new StoreInst(pointer_base_cast, base_addr, insert_at);
+    new StoreInst(pointer_bound_cast, bound_addr, insert_at);
+    new StoreInst(pointer_key, key_addr, insert_at);
+    new StoreInst(pointer_lock, lock_addr, insert_at);
+    return;
+  }
   CallInst::Create(m_store_base_bound_func, args, "", insert_at);
 }
 
@@ -1629,6 +1775,20 @@ SoftBoundCETSPass::introduceShadowStackStores(Value* ptr_value,
     ConstantInt::get(Type::getInt32Ty(ptr_value->getType()->getContext()), 
                      arg_no, false);
 
+  /* With both safeties, the four fields are stored with one call */
+  if(spatial_safety && temporal_safety){
+    Value* func_lock = getAssociatedFuncLock(insert_at);
+
+    SmallVector<Value*, 8> args;
+    args.push_back(castToVoidPtr(getAssociatedBase(ptr_value), insert_at));
+    args.push_back(castToVoidPtr(getAssociatedBound(ptr_value), insert_at));
+    args.push_back(getAssociatedKey(ptr_value));
+    args.push_back(getAssociatedLock(ptr_value, func_lock));
+    args.push_back(argno_value);
+    CallInst::Create(m_shadow_stack_metadata_store, args, "", insert_at);
+    return;
+  }
+
   if(spatial_safety){
     Value* ptr_base = getAssociatedBase(ptr_value);
     Value* ptr_bound = getAssociatedBound(ptr_value);
@@ -1679,7 +1839,14 @@ SoftBoundCETSPass:: introduceShadowStackDeallocation(CallInst* call_inst,
   int pointer_args_return = getNumPointerArgsAndReturn(call_inst);
   if(pointer_args_return == 0)
     return;
+
+  /* the frame size is a constant, as in the allocation */
+  Value* total_ptr_args = 
+    ConstantInt::get(Type::getInt32Ty(call_inst->getContext()), 
+                     pointer_args_return, false);
+
   SmallVector<Value*, 8> args;    
+  args.push_back(total_ptr_args);
   CallInst::Create(m_shadow_stack_deallocate, args, "", insert_at);
 }
 
@@ -2124,19 +2291,9 @@ SoftBoundCETSPass::handleGlobalSequentialTypeInitializer(Module& module,
 
             Constant* Indices[3] = {index0, index1, index2};              
             Constant* addr_of_ptr = ConstantExpr::getGetElementPtr(gv, Indices);
-            Type* initializer_type = initializer_opd->getType();
-            Value* initializer_size = getSizeOfType(initializer_type);
-            
-            Value* operand_key = NULL;
-            Value* operand_lock = NULL;
-            if(temporal_safety){
-              operand_key = m_constantint_one;
-              operand_lock = 
-                introduceGlobalLockFunction(init_function_terminator);
-            }
-            addStoreBaseBoundFunc(addr_of_ptr, operand_base, operand_bound, 
-                                  operand_key, operand_lock, initializer_opd, 
-                                  initializer_size, init_function_terminator);
+            addGlobalMetadataStore(module, addr_of_ptr, operand_base, 
+                                   operand_bound, initializer_opd, 
+                                   init_function_terminator);
           }                       
         } // Iterating over struct element ends 
       } // Iterating over array element ends         
@@ -2156,20 +2313,8 @@ SoftBoundCETSPass::handleGlobalSequentialTypeInitializer(Module& module,
     getConstantExprBaseBound(given_constant, 
                              initializer_base, 
                              initializer_bound);
-    Type* initializer_type = initializer->getType();
-    Value* initializer_size = getSizeOfType(initializer_type);
-    
-    Value* operand_key = NULL;
-    Value* operand_lock = NULL;
-    if(temporal_safety){
-      operand_key = m_constantint_one;
-      operand_lock = 
-        introduceGlobalLockFunction(init_function_terminator);
-    }
-    
-    addStoreBaseBoundFunc(gv, initializer_base, initializer_bound, operand_key,
-                          operand_lock, initializer, initializer_size, 
-                          init_function_terminator);        
+    addGlobalMetadataStore(module, gv, initializer_base, initializer_bound, 
+                           initializer, init_function_terminator);
   }
 
 }
@@ -2216,16 +2361,8 @@ handleGlobalStructTypeInitializer(Module& module,
       Value* operand_base = NULL;
       Value* operand_bound = NULL;
       
-      Value* operand_key = NULL;
-      Value* operand_lock = NULL;
-      
       Constant* addr_of_ptr = NULL;
       
-      if(temporal_safety){
-        operand_key = m_constantint_one;
-        operand_lock = introduceGlobalLockFunction(first);  
-      }
-      
       if(spatial_safety){
         Constant* given_constant = dyn_cast<Constant>(initializer_opd);
         assert(given_constant && 
@@ -2242,13 +2379,8 @@ handleGlobalStructTypeInitializer(Module& module,
       indices_addr_ptr.push_back(index2);
       length++;
       addr_of_ptr = ConstantExpr::getGetElementPtr(gv, indices_addr_ptr);
-      
-      Type* initializer_type = initializer_opd->getType();
-      Value* initializer_size = getSizeOfType(initializer_type);     
-      addStoreBaseBoundFunc(addr_of_ptr, operand_base, 
-                            operand_bound, operand_key, 
-                            operand_lock, initializer_opd, 
-                            initializer_size, first);
+      addGlobalMetadataStore(module, addr_of_ptr, operand_base, 
+                             operand_bound, initializer_opd, first);
       
       //    if(spatial_safety){
         indices_addr_ptr.pop_back();
@@ -2760,6 +2892,13 @@ SoftBoundCETSPass::addLoadStoreChecks(Instruction* load_store,
     // operand
     pointer_operand = sti->getOperand(1);
   }
+
+  if(isa<AtomicCmpXchgInst>(load_store) || isa<AtomicRMWInst>(load_store)){
+    if(!STORECHECKS)
+      return;
+
+    pointer_operand = getPointerLoadStore(load_store);
+  }
     
   assert(pointer_operand && "pointer operand null?");
 
@@ -2787,45 +2926,12 @@ SoftBoundCETSPass::addLoadStoreChecks(Instruction* load_store,
     
     if(BOUNDSCHECKOPT) {
       // Enable dominator based dereference check optimization only when
-      // suggested
+      // suggested. The map is computed by
+      // eliminateRedundantSpatialChecks
       
       if(FDCE_map.count(load_store)) {
         return;
       }
-      
-      // FIXME: Add more comments here Iterate over the uses
-      
-      for(Value::use_iterator ui = pointer_operand->use_begin(), 
-            ue = pointer_operand->use_end(); 
-          ui != ue; ++ui) {
-        
-        Instruction* temp_inst = dyn_cast<Instruction>(*ui);       
-        if(!temp_inst)
-          continue;
-        
-        if(temp_inst == load_store)
-          continue;
-        
-        if(!isa<LoadInst>(temp_inst) && !isa<StoreInst>(temp_inst))
-          continue;
-        
-        if(isa<StoreInst>(temp_inst)){
-          if(temp_inst->getOperand(1) != pointer_operand){
-            // When a pointer is a being stored at at a particular
-            // address, don't elide the check
-            continue;
-          }
-        }
-        
-#if 0
-        if(m_dominator_tree->dominates(load_store, temp_inst)) {
-          if(!FDCE_map.count(temp_inst)) {
-            FDCE_map[temp_inst] = true;
-            continue;
-          }                  
-        }
-#endif
-      } // Iterating over uses ends 
     } // BOUNDSCHECKOPT ends 
   }
     
@@ -2850,6 +2956,24 @@ SoftBoundCETSPass::addLoadStoreChecks(Instruction* load_store,
   Value* bitcast_bound = castToVoidPtr(tmp_bound, load_store);    
   args.push_back(bitcast_bound);
    
+  if(m_widened_spatial_checks.count(load_store)){
+    // Check the bytes of all the accesses merged into this check
+    SpatialCheckRange& range = m_widened_spatial_checks[load_store];
+    Value* cast_root = castToVoidPtr(range.root, load_store);
+    Value* range_start = 
+      GetElementPtrInst::Create(cast_root, 
+                                ConstantInt::get(m_key_type, range.lo), 
+                                "range.start", load_store);
+    args.push_back(range_start);
+    args.push_back(ConstantInt::get(Type::getInt64Ty(load_store->getContext()),
+                                    range.hi - range.lo));
+    
+    CallInst::Create(isa<LoadInst>(load_store) ? 
+                     m_spatial_load_dereference_check : 
+                     m_spatial_store_dereference_check, args, "", load_store);
+    return;
+  }
+
   Value* cast_pointer_operand_value = castToVoidPtr(pointer_operand, 
                                                     load_store);    
   args.push_back(cast_pointer_operand_value);
@@ -2859,14 +2983,20 @@ SoftBoundCETSPass::addLoadStoreChecks(Instruction* load_store,
   Value* size_of_type = getSizeOfType(pointer_operand_type);
   args.push_back(size_of_type);
 
+  CallInst* check_call = NULL;
   if(isa<LoadInst>(load_store)){
             
-    CallInst::Create(m_spatial_load_dereference_check, args, "", load_store);
+    check_call = CallInst::Create(m_spatial_load_dereference_check, args, 
+                                  "", load_store);
   }
   else{    
-    CallInst::Create(m_spatial_store_dereference_check, args, "", load_store);
+    check_call = CallInst::Create(m_spatial_store_dereference_check, args, 
+                                  "", load_store);
   }
 
+  if(chk_intrinsic)
+    m_check_access[check_call] = load_store;
+
   return;
 }
 
@@ -2881,12 +3011,7 @@ bool
 SoftBoundCETSPass::
 optimizeGlobalAndStackVariableChecks(Instruction* load_store) {
     
-  Value* pointer_operand = NULL;
-  if(isa<LoadInst>(load_store)){
-    pointer_operand = load_store->getOperand(0);
-  } else{
-    pointer_operand = load_store->getOperand(1);
-  }
+  Value* pointer_operand = getPointerLoadStore(load_store);
 
   while(true) {      
     if(isa<AllocaInst>(pointer_operand)){        
@@ -2994,6 +3119,11 @@ SoftBoundCETSPass::getPointerLoadStore(Instruction* load_store) {
   if (isa<StoreInst>(load_store)) {
     pointer_operand = load_store->getOperand(1);
   }
+
+  // cmpxchg and atomicrmw access the location in their first operand
+  if (isa<AtomicCmpXchgInst>(load_store) || isa<AtomicRMWInst>(load_store)) {
+    pointer_operand = load_store->getOperand(0);
+  }
   assert((pointer_operand != NULL) && "pointer_operand null");
   return pointer_operand;
 }
@@ -3210,6 +3340,13 @@ SoftBoundCETSPass::addTemporalChecks(Instruction* load_store,
     // operand
     pointer_operand = sti->getOperand(1);
   }
+
+  if(isa<AtomicCmpXchgInst>(load_store) || isa<AtomicRMWInst>(load_store)){
+    if(!TEMPORALSTORECHECKS)
+      return;
+
+    pointer_operand = getPointerLoadStore(load_store);
+  }
   
   assert(pointer_operand && "pointer_operand null?");
 
@@ -3303,182 +3440,941 @@ SoftBoundCETSPass::addTemporalChecks(Instruction* load_store,
   
   args.push_back(tmp_key);
   
-#ifdef SOFTBOUNDCETS_CHK_INTRINSIC
-
-    if(chk_intrinsic){
-      Module* M = load_store->getParent()->getParent()->getParent();
-      Type* Tys[] = { m_void_ptr_type, m_key_type, m_void_ptr_type, m_void_ptr_type};
-      Function* temporal_chk_function =  Intrinsic::getDeclaration(M, Intrinsic::sbcets_temporalchk, Tys);
-
-      CallInst::Create(temporal_chk_function, args, "", load_store);
-
-      return;
-    }
-#endif
-
     if(spatial_safety){
       args.push_back(tmp_base);
       args.push_back(tmp_bound);
     }
     
+    CallInst* check_call = NULL;
     if(isa<LoadInst>(load_store)){
-      CallInst::Create(m_temporal_load_dereference_check, args, "", load_store);
+      check_call = CallInst::Create(m_temporal_load_dereference_check, args, 
+                                    "", load_store);
     }
     else {
-      CallInst::Create(m_temporal_store_dereference_check, args, "", load_store);
+      check_call = CallInst::Create(m_temporal_store_dereference_check, args, 
+                                    "", load_store);
     }    
+
+    if(chk_intrinsic)
+      m_check_access[check_call] = load_store;
     return;
 }
 
+//
+// Method: isDereferenceCheckCall
+//
+// Description: This function returns true if the instruction is a
+// call to one of the spatial or temporal dereference check handlers
+// introduced by addLoadStoreChecks and addTemporalChecks.
 
+bool SoftBoundCETSPass::isDereferenceCheckCall(Instruction* inst) {
 
-void SoftBoundCETSPass::addDereferenceChecks(Function* func) {
+  CallInst* call_inst = dyn_cast<CallInst>(inst);
+  if(!call_inst)
+    return false;
 
-  Function &F = *func;
-  
-  if(func->isVarArg())
-    return;
+  Function* callee = call_inst->getCalledFunction();
+  if(!callee)
+    return false;
 
-  if(metadata_prop_only)
-    return;
+  if(spatial_safety && isSpatialCheckCall(call_inst))
+    return true;
 
-#if 0
-  if(Blacklist->isIn(F))
-    return;
+  if(temporal_safety && 
+     (callee == m_temporal_load_dereference_check ||
+      callee == m_temporal_store_dereference_check))
+    return true;
 
-#endif
+  return false;
+}
 
-  std::vector<Instruction*> CheckWorkList;
-  std::map<Value*, bool> ElideSpatialCheck;
-  std::map<Value*, bool> ElideTemporalCheck;
-  
+bool SoftBoundCETSPass::isSpatialCheckCall(CallInst* call_inst) {
 
+  if(!spatial_safety)
+    return false;
 
-  // identify all the instructions where we need to insert the spatial checks
-  for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i){
+  Function* callee = call_inst->getCalledFunction();
+  return (callee == m_spatial_load_dereference_check || 
+          callee == m_spatial_store_dereference_check);
+}
 
-    Instruction* I = &*i;
+//
+// Method: loopHasOpaqueCalls
+//
+// Description: This function returns true if the loop has a call
+// other than the SoftBoundCETS check and metadata handlers. Such a
+// call can free the memory being accessed (changing the lock) or
+// never return, so a check cannot be moved across it.
 
-    if(!m_present_in_original.count(I)){
-      continue;
+bool SoftBoundCETSPass::loopHasOpaqueCalls(Loop* loop) {
+
+  for(Loop::block_iterator bi = loop->block_begin(), be = loop->block_end(); 
+      bi != be; ++bi){
+    BasicBlock* bb = *bi;
+    for(BasicBlock::iterator i = bb->begin(), ie = bb->end(); i != ie; ++i){
+      if(isOpaqueCall(i))
+        return true;
     }
-    // add check optimizations here
-    // add checks for memory fences and atomic exchanges
-    if(isa<LoadInst>(I) || isa<StoreInst>(I)){
-      CheckWorkList.push_back(I);
-    }     
-    if(isa<AtomicCmpXchgInst>(I) || isa<AtomicRMWInst>(I)){
-      assert(0 && "Atomic Instructions not handled");
-    }    
   }
+  return false;
+}
 
-#if 0
-  // spatial check optimizations here 
-
-  for(std::vector<Instruction*>::iterator i = CheckWorkList.begin(), 
-	e = CheckWorkList.end(); i!= e; ++i){
+//
+// Method: isOpaqueCall
+//
+// Description: This function returns true if the instruction is a
+// call other than an intrinsic or a SoftBoundCETS check/metadata
+// handler, i.e. a call that can free memory or not return. With
+// metadata_writes, the handlers that write the metadata space are
+// opaque as well, and so is every store with the inline metadata
+// stores of -softboundcets_linear_shadow.
 
-    Instruction* inst = *i;
-    Value* pointer_operand = NULL;
-    
-    if(ElideSpatialCheck.count(inst))
-      continue;
-    
-    if(isa<LoadInst>(inst)){
-      LoadInst* ldi = dyn_cast<LoadInst>(inst);
-      pointer_operand = ldi->getPointerOperand();
-    }
-    if(isa<StoreInst>(inst)){
-      StoreInst* st = dyn_cast<StoreInst>(inst);
-      pointer_operand = st->getOperand(1);      
-    }
+bool SoftBoundCETSPass::isOpaqueCall(Instruction* inst, 
+                                     bool metadata_writes) {
 
-    for(Value::use_iterator ui = pointer_operand->use_begin(),  
-	  ue = pointer_operand->use_end();
-	ui != ue; ++ui){
+  if(isa<InvokeInst>(inst))
+    return true;
 
-      Instruction* use_inst = dyn_cast<Instruction>(*ui);
-      if(!use_inst || (use_inst == inst))
-	continue;
+  // The metadata stores are inline with the linear shadow
+  if(metadata_writes && LINEARSHADOW && isa<StoreInst>(inst))
+    return true;
+      
+  CallInst* call_inst = dyn_cast<CallInst>(inst);
+  if(!call_inst || isa<IntrinsicInst>(call_inst))
+    return false;
 
-      if(!isa<LoadInst>(use_inst)  && !isa<StoreInst>(use_inst))
-	continue;
+  Function* callee = call_inst->getCalledFunction();
+  if(callee && callee->getName().startswith("__softboundcets_") && 
+     callee->getName().find("deallocation") == StringRef::npos){
 
-      if(isa<StoreInst>(use_inst)){
-	if(use_inst->getOperand(1) != pointer_operand)
-	  continue;
-      }
+    if(!metadata_writes)
+      return false;
 
-#if 0
-      if(m_dominator_tree->dominates(inst, use_inst)){
-	if(!ElideSpatialCheck.count(use_inst))
-	  ElideSpatialCheck[use_inst] = true;		
-      }
-    }
-#endif  
+    StringRef name = callee->getName();
+    return (name.startswith("__softboundcets_metadata_store") ||
+            name == "__softboundcets_copy_metadata" ||
+            name == "__softboundcets_metadata_lock" ||
+            name == "__softboundcets_metadata_unlock" ||
+            name.endswith("_init"));
   }
 
-#endif
+  return true;
+}
 
-  //Temporal Check Optimizations
+//
+// Method: pathHasOpaqueCalls
+//
+// Description: This function returns true if an opaque call can
+// execute on a path from the instruction "from" to the instruction
+// "to", or if such a path can execute "from" again before reaching
+// "to". With metadata_writes, the metadata stores are opaque and a
+// path that executes "from" again is ignored, as "from" then reloads
+// the metadata.
 
-  
-#if 0
+bool SoftBoundCETSPass::pathHasOpaqueCalls(Instruction* from, 
+                                           Instruction* to, 
+                                           bool metadata_writes) {
 
-#endif
+  BasicBlock* from_bb = from->getParent();
+  BasicBlock* to_bb = to->getParent();
 
-  /* intra-procedural load dererference check elimination map */
-  std::map<Value*, int> func_deref_check_elim_map;
-  std::map<Value*, int> func_temporal_check_elim_map;
+  BasicBlock::iterator i = from;
+  for(++i; i != from_bb->end() && &*i != to; ++i){
+    if(isOpaqueCall(i, metadata_writes))
+      return true;
+  }
 
-  /* WorkList Algorithm for adding dereference checks. Each basic
-   * block is visited only once. We start by visiting the current
-   * basic block, then pushing all the successors of the current
-   * basic block on to the queue if it has not been visited
-   */
-    
+  if(from_bb == to_bb && i != from_bb->end())
+    return false;
+  
+  for(BasicBlock::iterator i = to_bb->begin(); &*i != to; ++i){
+    if(isOpaqueCall(i, metadata_writes))
+      return true;
+  }
+
+  // Blocks reached from "from" before reaching the block of "to"
   std::set<BasicBlock*> bb_visited;
   std::queue<BasicBlock*> bb_worklist;
-  Function:: iterator bb_begin = func->begin();
-
-  BasicBlock* bb = dyn_cast<BasicBlock>(bb_begin);
-  assert(bb && "Not a basic block  and I am adding dereference checks?");
-  bb_worklist.push(bb);
+  for(succ_iterator si = succ_begin(from_bb), se = succ_end(from_bb); 
+      si != se; ++si) {
+    bb_worklist.push(*si);
+  }
 
-    
-  while(bb_worklist.size() != 0) {
-      
-    bb = bb_worklist.front();
-    assert(bb && "Not a BasicBlock?");
+  while(bb_worklist.size() != 0){
+    BasicBlock* bb = bb_worklist.front();
     bb_worklist.pop();
 
-    if(bb_visited.count(bb)) {
-      /* Block already visited */
-      continue;
+    if(bb == from_bb){
+      if(metadata_writes)
+        continue;
+      return true;
     }
 
-    /* If here implies basic block not visited */
-    /* Insert the block into the set of visited blocks */
+    if(bb == to_bb || bb_visited.count(bb))
+      continue;
     bb_visited.insert(bb);
 
-    /* Iterating over the successors and adding the successors to
-     * the worklist
-     */
+    for(BasicBlock::iterator i = bb->begin(), ie = bb->end(); i != ie; ++i){
+      if(isOpaqueCall(i, metadata_writes))
+        return true;
+    }
+
     for(succ_iterator si = succ_begin(bb), se = succ_end(bb); si != se; ++si) {
-        
-      BasicBlock* next_bb = *si;
-      assert(next_bb && "Not a basic block and I am adding to the base and bound worklist?");
-      bb_worklist.push(next_bb);
+      bb_worklist.push(*si);
     }
+  }
+  return false;
+}
 
-    /* basic block load deref check optimization */
-    std::map<Value*, int> bb_deref_check_map;
-    std::map<Value*, int> bb_temporal_check_elim_map;
-    /* structure check optimization */
-    std::map<Value*, int> bb_struct_check_opt;
+//
+// Method: getSpatialCheckRange
+//
+// Description: This function computes the bytes accessed by the load
+// or store relative to the root pointer it is derived from through
+// bitcasts and GEPs with constant indices. Such pointers have the
+// same base and bound as the root.
 
-    for(BasicBlock::iterator i = bb->begin(), ie = bb->end(); i != ie; ++i){
-      Value* v1 = dyn_cast<Value>(i);
+bool SoftBoundCETSPass::getSpatialCheckRange(Instruction* load_store, 
+                                             SpatialCheckRange& range) {
+
+  Value* pointer_operand = getPointerLoadStore(load_store);
+  PointerType* ptr_type = cast<PointerType>(pointer_operand->getType());
+  
+  if(!ptr_type->getElementType()->isSized())
+    return false;
+
+  APInt offset(TD->getPointerSizeInBits(), 0);
+  Value* root = pointer_operand;
+
+  while(true){
+    if(BitCastInst* bitcast_inst = dyn_cast<BitCastInst>(root)){
+      root = bitcast_inst->getOperand(0);
+      continue;
+    }
+
+    // Bounds of a GEP differ from its source when shrinking bounds
+    GetElementPtrInst* gep = dyn_cast<GetElementPtrInst>(root);
+    if(gep && !SHRINKBOUNDS){
+      APInt gep_offset(offset.getBitWidth(), 0);
+      if(gep->accumulateConstantOffset(*TD, gep_offset)){
+        offset += gep_offset;
+        root = gep->getPointerOperand();
+        continue;
+      }
+    }
+    break;
+  }
+
+  range.root = root;
+  range.lo = offset.getSExtValue();
+  range.hi = range.lo + TD->getTypeAllocSize(ptr_type->getElementType());
+  return true;
+}
+
+//
+// Method: eliminateRedundantSpatialChecks
+//
+// Description: This function identifies the loads and stores whose
+// spatial check is redundant and records them in the elimination map
+// used by addLoadStoreChecks. Two accesses with the same root pointer
+// are checked against the same base and bound:
+//
+// (1) When a later access is control equivalent to an earlier access
+// (dominated and post-dominated by it) and executes after it with no
+// opaque call in between, the earlier check is widened to cover both
+// accesses and the later check is dropped. As base and bound form a
+// single interval, checking the union of the two ranges is the same
+// as checking both.
+//
+// (2) A check that dominates a later access whose bytes it already
+// covers makes the later check redundant.
+//
+
+void 
+SoftBoundCETSPass::eliminateRedundantSpatialChecks(std::vector<Instruction*>& 
+                                                   check_worklist, 
+                                                   std::map<Value*, int>& 
+                                                   FDCE_map) {
+
+  std::map<Value*, std::vector<Instruction*> > root_checks;
+  std::map<Instruction*, SpatialCheckRange> check_range;
+  
+  for(std::vector<Instruction*>::iterator i = check_worklist.begin(), 
+	e = check_worklist.end(); i!= e; ++i){
+
+    Instruction* load_store = *i;
+    if(isa<LoadInst>(load_store) && (!LOADCHECKS || store_only))
+      continue;
+    
+    if(isa<StoreInst>(load_store) && !STORECHECKS)
+      continue;
+
+    // Constants are handled by addLoadStoreChecks
+    Value* pointer_operand = getPointerLoadStore(load_store);
+    if(isa<Constant>(pointer_operand))
+      continue;
+
+    if(eliminate_struct_checks && isStructOperand(pointer_operand))
+      continue;
+    
+    SpatialCheckRange range;
+    if(!getSpatialCheckRange(load_store, range))
+      continue;
+
+    check_range[load_store] = range;
+    root_checks[range.root].push_back(load_store);
+  }
+
+  for(std::map<Value*, std::vector<Instruction*> >::iterator 
+        ri = root_checks.begin(), re = root_checks.end(); ri != re; ++ri){
+
+    std::vector<Instruction*>& checks = ri->second;
+    
+    // Widen the checks post-dominated by checks on the same root
+    for(std::vector<Instruction*>::iterator i = checks.begin(), 
+          ie = checks.end(); i != ie; ++i){
+      Instruction* inst = *i;
+      if(FDCE_map.count(inst))
+        continue;
+      
+      for(std::vector<Instruction*>::iterator j = checks.begin(), 
+            je = checks.end(); j != je; ++j){
+        Instruction* later_inst = *j;
+        if(later_inst == inst || FDCE_map.count(later_inst))
+          continue;
+
+        if(!m_dominator_tree->dominates(inst, later_inst))
+          continue;
+        
+        if(!m_post_dominator_tree->dominates(later_inst->getParent(), 
+                                             inst->getParent()))
+          continue;
+
+        if(pathHasOpaqueCalls(inst, later_inst))
+          continue;
+
+        SpatialCheckRange& range = check_range[inst];
+        SpatialCheckRange& later_range = check_range[later_inst];
+        range.lo = std::min(range.lo, later_range.lo);
+        range.hi = std::max(range.hi, later_range.hi);
+        m_widened_spatial_checks[inst] = range;
+        FDCE_map[later_inst] = 1;
+        ++NumPostDominatedSpatialChecks;
+      }
+    }
+
+    // Remove the checks covered by a dominating check
+    for(std::vector<Instruction*>::iterator i = checks.begin(), 
+          ie = checks.end(); i != ie; ++i){
+      Instruction* inst = *i;
+      if(FDCE_map.count(inst))
+        continue;
+      
+      SpatialCheckRange& range = check_range[inst];
+      for(std::vector<Instruction*>::iterator j = checks.begin(), 
+            je = checks.end(); j != je; ++j){
+        Instruction* later_inst = *j;
+        if(later_inst == inst || FDCE_map.count(later_inst))
+          continue;
+
+        SpatialCheckRange& later_range = check_range[later_inst];
+        if(later_range.lo < range.lo || later_range.hi > range.hi)
+          continue;
+
+        if(m_dominator_tree->dominates(inst, later_inst)){
+          FDCE_map[later_inst] = 1;
+          ++NumDominatedSpatialChecks;
+        }
+      }
+    }
+  }
+}
+
+//
+// Method: canMakeLoopInvariant
+//
+// Description: This function returns true if Loop::makeLoopInvariant
+// would succeed for the value, without hoisting anything. It follows
+// the same rules, as makeLoopInvariant hoists the operands it can
+// before finding one it cannot.
+//
+
+bool SoftBoundCETSPass::canMakeLoopInvariant(Loop* loop, Value* value) {
+
+  Instruction* inst = dyn_cast<Instruction>(value);
+  if(!inst || loop->isLoopInvariant(inst))
+    return true;
+
+  if(!isSafeToSpeculativelyExecute(inst) || inst->mayReadFromMemory() || 
+     isa<LandingPadInst>(inst))
+    return false;
+
+  for(unsigned i = 0; i < inst->getNumOperands(); ++i){
+    if(!canMakeLoopInvariant(loop, inst->getOperand(i)))
+      return false;
+  }
+  return true;
+}
+
+//
+// Method: hoistLoopChecks
+//
+// Description: This function moves the dereference checks executed
+// on every iteration of the loop to the preheader. A check whose
+// operands are loop invariant is moved as is. A spatial check on an
+// affine induction variable pointer {start,+,step} is replaced by two
+// checks of the addresses accessed in the first and the last
+// iteration, which together cover every address accessed in the
+// loop.
+//
+// A check in a block that dominates the exiting block runs at least
+// once whenever the loop is entered. A check after the exit test in
+// the header runs backedge-taken-count times, so the hoisted check is
+// guarded by a non-zero trip count.
+//
+
+void SoftBoundCETSPass::hoistLoopChecks(Loop* loop) {
+
+  BasicBlock* preheader = loop->getLoopPreheader();
+  BasicBlock* latch = loop->getLoopLatch();
+  BasicBlock* exiting = loop->getExitingBlock();
+  BasicBlock* header = loop->getHeader();
+
+  if(!preheader || !latch || !exiting)
+    return;
+
+  if(loopHasOpaqueCalls(loop))
+    return;
+
+  ScalarEvolution* SE = m_scalar_evolution;
+  const SCEV* backedge_count = SE->getBackedgeTakenCount(loop);
+  bool count_known = !isa<SCEVCouldNotCompute>(backedge_count) && 
+    isSafeToExpand(backedge_count, *SE);
+
+  std::vector<CallInst*> check_calls;
+  for(Loop::block_iterator bi = loop->block_begin(), be = loop->block_end(); 
+      bi != be; ++bi){
+    BasicBlock* bb = *bi;
+    
+    // checks in the inner loops are hoisted by the inner loops
+    if(m_loop_info->getLoopFor(bb) != loop)
+      continue;
+
+    for(BasicBlock::iterator i = bb->begin(), ie = bb->end(); i != ie; ++i){
+      if(isDereferenceCheckCall(i))
+        check_calls.push_back(cast<CallInst>(i));
+    }
+  }
+
+  SCEVExpander expander(*SE, "softboundcets");
+  Instruction* insert_at = preheader->getTerminator();
+  
+  std::vector<CallInst*> hoisted_checks;
+  std::vector<CallInst*> guarded_checks;
+  std::vector<CallInst*> widened_checks;
+
+  for(std::vector<CallInst*>::iterator i = check_calls.begin(), 
+        e = check_calls.end(); i != e; ++i){
+
+    CallInst* call_inst = *i;
+    BasicBlock* bb = call_inst->getParent();
+
+    if(isSpatialCheckCall(call_inst) ? 
+       disable_spatial_check_opt : disable_temporal_check_opt)
+      continue;
+    
+    // Check must be executed in every iteration
+    if(!m_dominator_tree->dominates(bb, latch))
+      continue;
+
+    bool before_exit = m_dominator_tree->dominates(bb, exiting);
+    if(!before_exit && ((exiting != header) || !count_known))
+      continue;
+
+    // Hoist the operands only when all of them can be hoisted, so that
+    // a check that stays in the loop leaves its operands in place
+    bool invariant = true;
+    for(unsigned arg = 0; arg < call_inst->getNumArgOperands(); ++arg){
+      if(!canMakeLoopInvariant(loop, call_inst->getArgOperand(arg))){
+        invariant = false;
+        break;
+      }
+    }
+
+    if(invariant){
+      bool changed = false;
+      for(unsigned arg = 0; arg < call_inst->getNumArgOperands(); ++arg){
+        loop->makeLoopInvariant(call_inst->getArgOperand(arg), changed);
+      }
+
+      if(before_exit)
+        hoisted_checks.push_back(call_inst);
+      else
+        guarded_checks.push_back(call_inst);
+      continue;
+    }
+
+    // Only the pointer of a spatial check may vary in the loop
+    if(!isSpatialCheckCall(call_inst) || !count_known)
+      continue;
+
+    bool metadata_invariant = true;
+    for(unsigned arg = 0; arg < call_inst->getNumArgOperands(); ++arg){
+      if(arg != 2 && !loop->isLoopInvariant(call_inst->getArgOperand(arg)))
+        metadata_invariant = false;
+    }
+    if(!metadata_invariant)
+      continue;
+
+    const SCEVAddRecExpr* ptr_rec = 
+      dyn_cast<SCEVAddRecExpr>(SE->getSCEV(call_inst->getArgOperand(2)));
+    if(!ptr_rec || !ptr_rec->isAffine() || ptr_rec->getLoop() != loop)
+      continue;
+
+    // Index of the last iteration that executes the check
+    Type* index_ty = SE->getEffectiveSCEVType(ptr_rec->getType());
+    const SCEV* last_iteration = 
+      SE->getTruncateOrZeroExtend(backedge_count, index_ty);
+    if(!before_exit){
+      last_iteration = SE->getMinusSCEV(last_iteration, 
+                                        SE->getConstant(index_ty, 1));
+    }
+
+    const SCEV* first_ptr = ptr_rec->getStart();
+    const SCEV* last_ptr = ptr_rec->evaluateAtIteration(last_iteration, *SE);
+    if(!isSafeToExpand(first_ptr, *SE) || !isSafeToExpand(last_ptr, *SE))
+      continue;
+
+    Value* first_value = expander.expandCodeFor(first_ptr, m_void_ptr_type, 
+                                                insert_at);
+    Value* last_value = expander.expandCodeFor(last_ptr, m_void_ptr_type, 
+                                               insert_at);
+
+    SmallVector<Value*, 8> args;
+    args.push_back(call_inst->getArgOperand(0));
+    args.push_back(call_inst->getArgOperand(1));
+    args.push_back(first_value);
+    args.push_back(call_inst->getArgOperand(3));
+
+    CallInst* first_check = CallInst::Create(call_inst->getCalledFunction(), 
+                                             args, "", insert_at);
+    args[2] = last_value;
+    CallInst* last_check = CallInst::Create(call_inst->getCalledFunction(), 
+                                            args, "", insert_at);
+
+    if(before_exit){
+      hoisted_checks.push_back(first_check);
+      hoisted_checks.push_back(last_check);
+    } else {
+      guarded_checks.push_back(first_check);
+      guarded_checks.push_back(last_check);
+    }
+    widened_checks.push_back(call_inst);
+  }
+
+  for(std::vector<CallInst*>::iterator i = hoisted_checks.begin(), 
+        e = hoisted_checks.end(); i != e; ++i){
+    (*i)->moveBefore(insert_at);
+  }
+
+  for(std::vector<CallInst*>::iterator i = widened_checks.begin(), 
+        e = widened_checks.end(); i != e; ++i){
+    m_check_access.erase(*i);
+    (*i)->eraseFromParent();
+  }
+
+  if(guarded_checks.empty())
+    return;
+
+  // Execute the guarded checks only when the loop takes the backedge
+  Value* count_value = expander.expandCodeFor(backedge_count, 
+                                              backedge_count->getType(), 
+                                              insert_at);
+  Value* loop_taken = 
+    new ICmpInst(insert_at, CmpInst::ICMP_NE, count_value, 
+                 Constant::getNullValue(count_value->getType()), 
+                 "softboundcets.loop.taken");
+  TerminatorInst* then_term = 
+    SplitBlockAndInsertIfThen(loop_taken, insert_at, false, 
+                              NULL, m_dominator_tree);
+
+  if(Loop* parent_loop = loop->getParentLoop()){
+    parent_loop->addBasicBlockToLoop(then_term->getParent(), 
+                                     m_loop_info->getBase());
+    parent_loop->addBasicBlockToLoop(then_term->getSuccessor(0), 
+                                     m_loop_info->getBase());
+  }
+
+  for(std::vector<CallInst*>::iterator i = guarded_checks.begin(), 
+        e = guarded_checks.end(); i != e; ++i){
+    (*i)->moveBefore(then_term);
+  }
+}
+
+//
+// Method: optimizeLoopChecks
+//
+// Description: This function hoists the dereference checks out of
+// the loops in the function. The loops are visited innermost first so
+// that a check hoisted to the preheader of an inner loop can be
+// hoisted again out of the enclosing loop.
+//
+
+void SoftBoundCETSPass::optimizeLoopChecks(Function* func) {
+
+  if(!LOOPCHECKOPT)
+    return;
+
+  if(func->isVarArg() || metadata_prop_only)
+    return;
+  
+  m_loop_info = &getAnalysis<LoopInfo>(*func);
+  m_scalar_evolution = &getAnalysis<ScalarEvolution>(*func);
+  m_dominator_tree = &getAnalysis<DominatorTreeWrapperPass>(*func).getDomTree();
+
+  std::vector<Loop*> loops;
+  for(LoopInfo::iterator i = m_loop_info->begin(), e = m_loop_info->end(); 
+      i != e; ++i){
+    for(po_iterator<Loop*> li = po_begin(*i), le = po_end(*i); li != le; ++li){
+      loops.push_back(*li);
+    }
+  }
+
+  for(std::vector<Loop*>::iterator i = loops.begin(), e = loops.end(); 
+      i != e; ++i){
+    hoistLoopChecks(*i);
+  }
+
+  // The trip counts hold handles to the exiting blocks and outlive
+  // this pass, which is not told when later passes delete the blocks
+  for(LoopInfo::iterator i = m_loop_info->begin(), e = m_loop_info->end();
+      i != e; ++i){
+    m_scalar_evolution->forgetLoop(*i);
+  }
+}
+
+//
+// Method: getAbortBlock
+//
+// Description: This function returns the cold block of the function
+// that calls __softboundcets_abort. All the inlined checks in a
+// function branch to the same block, which is created on first use.
+
+BasicBlock* 
+SoftBoundCETSPass::getAbortBlock(Function* func, BasicBlock* & abort_bb) {
+
+  if(abort_bb)
+    return abort_bb;
+
+  abort_bb = BasicBlock::Create(func->getContext(), 
+                                "softboundcets.abort", func);
+  CallInst* abort_call = CallInst::Create(m_abort_func, "", abort_bb);
+  abort_call->setDoesNotReturn();
+  abort_call->setDoesNotThrow();
+  new UnreachableInst(func->getContext(), abort_bb);
+  return abort_bb;
+}
+
+//
+// Method: inlineDereferenceChecks
+//
+// Description: This function replaces the calls to the spatial and
+// temporal dereference check handlers introduced by
+// addDereferenceChecks with the equivalent compare and branch in the
+// IR. The failing path branches to the cold abort block so that the
+// backend can schedule and fold the checks without the call
+// overhead. The checks are inlined after all of them have been
+// introduced as the basic blocks are split here.
+//
+
+void SoftBoundCETSPass::inlineDereferenceChecks(Function* func) {
+
+  if(!INLINECHECKS)
+    return;
+
+  std::vector<CallInst*> check_calls;
+
+  for(inst_iterator i = inst_begin(func), e = inst_end(func); i != e; ++i){
+    if(isDereferenceCheckCall(&*i)){
+      check_calls.push_back(cast<CallInst>(&*i));
+    }
+  }
+
+  if(check_calls.empty())
+    return;
+
+  LLVMContext& context = func->getContext();
+  Type* int64_ty = Type::getInt64Ty(context);
+  MDNode* cold_weights = MDBuilder(context).createBranchWeights(1, 1 << 20);
+  BasicBlock* abort_bb = NULL;
+  
+  for(std::vector<CallInst*>::iterator i = check_calls.begin(), 
+        e = check_calls.end(); i != e; ++i){
+
+    CallInst* call_inst = *i;
+    Value* cond = NULL;
+
+    if(isSpatialCheckCall(call_inst)) {
+
+      // (ptr < base) || (ptr + size > bound)
+      Value* base = new PtrToIntInst(call_inst->getArgOperand(0), int64_ty, 
+                                     "base.int", call_inst);
+      Value* bound = new PtrToIntInst(call_inst->getArgOperand(1), int64_ty, 
+                                      "bound.int", call_inst);
+      Value* ptr = new PtrToIntInst(call_inst->getArgOperand(2), int64_ty, 
+                                    "ptr.int", call_inst);
+      Value* size = call_inst->getArgOperand(3);
+      Value* ptr_end = BinaryOperator::Create(Instruction::Add, ptr, size, 
+                                              "ptr.end", call_inst);
+      Value* below = new ICmpInst(call_inst, CmpInst::ICMP_ULT, ptr, base, 
+                                  "ptr.below");
+      Value* above = new ICmpInst(call_inst, CmpInst::ICMP_UGT, ptr_end, bound, 
+                                  "ptr.above");
+      cond = BinaryOperator::Create(Instruction::Or, below, above, 
+                                    "spatial.fail", call_inst);
+    } else {
+
+      // *lock != key
+      Value* key = call_inst->getArgOperand(1);
+      Value* lock = new BitCastInst(call_inst->getArgOperand(0), 
+                                    PointerType::getUnqual(key->getType()), 
+                                    "lock.ptr", call_inst);
+      Value* lock_value = new LoadInst(lock, "lock.value", call_inst);
+      cond = new ICmpInst(call_inst, CmpInst::ICMP_NE, lock_value, key, 
+                          "temporal.fail");
+    }
+
+    BasicBlock* bb = call_inst->getParent();
+    BasicBlock* cont_bb = bb->splitBasicBlock(call_inst, "softboundcets.cont");
+    TerminatorInst* old_br = bb->getTerminator();
+    BranchInst* br = BranchInst::Create(getAbortBlock(func, abort_bb), cont_bb, 
+                                        cond, old_br);
+    br->setMetadata(LLVMContext::MD_prof, cold_weights);
+    br->setDebugLoc(call_inst->getDebugLoc());
+    old_br->eraseFromParent();
+    call_inst->eraseFromParent();
+  }
+}
+
+//
+// Method: introduceCheckIntrinsics
+//
+// Description: This function replaces the dereference check calls
+// with the llvm.sbcets.spatial.check and llvm.sbcets.temporal.check
+// intrinsics. An intrinsic returns the pointer it checks and the
+// load/store accesses memory through the returned pointer, so the
+// check lives as long as the access. The spatial check does not
+// access memory and the temporal check only reads the lock, which
+// lets GVN and EarlyCSE merge identical checks and LICM hoist them,
+// while a free in between still keeps two temporal checks apart. The
+// two checks of an access are chained in dominance order.
+//
+// A check that no longer dominates its access (a guarded loop check),
+// a widened range check and the temporal check of a pointer defined
+// after the hoisted check remain calls to the handlers. The
+// intrinsics are lowered by StripSBCETSIntrinsics.
+//
+
+void SoftBoundCETSPass::introduceCheckIntrinsics(Function* func) {
+
+  if(!chk_intrinsic || m_check_access.empty())
+    return;
+
+  DominatorTree dominator_tree;
+  dominator_tree.recalculate(*func);
+
+  std::vector<Instruction*> accesses;
+  std::map<Instruction*, std::vector<CallInst*> > access_checks;
+
+  for(inst_iterator i = inst_begin(func), e = inst_end(func); i != e; ++i){
+    CallInst* call_inst = dyn_cast<CallInst>(&*i);
+    if(!call_inst || !m_check_access.count(call_inst))
+      continue;
+
+    Instruction* load_store = m_check_access[call_inst];
+    if(!dominator_tree.dominates(call_inst, load_store))
+      continue;
+
+    if(!access_checks.count(load_store))
+      accesses.push_back(load_store);
+    access_checks[load_store].push_back(call_inst);
+  }
+  m_check_access.clear();
+
+  Module* module = func->getParent();
+  Type* int64_ty = Type::getInt64Ty(func->getContext());
+  Function* spatial_check = 
+    Intrinsic::getDeclaration(module, Intrinsic::sbcets_spatial_check);
+  Function* temporal_check = 
+    Intrinsic::getDeclaration(module, Intrinsic::sbcets_temporal_check);
+
+  for(std::vector<Instruction*>::iterator i = accesses.begin(), 
+        e = accesses.end(); i != e; ++i){
+
+    Instruction* load_store = *i;
+    Value* pointer_operand = getPointerLoadStore(load_store);
+    if(pointer_operand->getType()->getPointerAddressSpace() != 0)
+      continue;
+
+    std::vector<CallInst*>& checks = access_checks[load_store];
+    assert(checks.size() <= 2 && "more than a spatial and a temporal check?");
+    if(checks.size() == 2 && dominator_tree.dominates(checks[1], checks[0]))
+      std::swap(checks[0], checks[1]);
+
+    Value* checked_ptr = NULL;
+    for(std::vector<CallInst*>::iterator ci = checks.begin(), 
+          ce = checks.end(); ci != ce; ++ci){
+
+      CallInst* call_inst = *ci;
+      bool is_spatial = isSpatialCheckCall(call_inst);
+      Value* ptr = checked_ptr;
+      if(!ptr && is_spatial){
+        ptr = call_inst->getArgOperand(2);
+      }
+      if(!ptr){
+        Instruction* ptr_inst = dyn_cast<Instruction>(pointer_operand);
+        if(ptr_inst && !dominator_tree.dominates(ptr_inst, call_inst))
+          continue;
+        ptr = castToVoidPtr(pointer_operand, call_inst);
+      }
+
+      // spatial: ptr, base, bound, size temporal: ptr, lock, key
+      IRBuilder<> builder(call_inst);
+      SmallVector<Value*, 4> args;
+      args.push_back(ptr);
+      args.push_back(call_inst->getArgOperand(0));
+      if(is_spatial){
+        args.push_back(call_inst->getArgOperand(1));
+        args.push_back(builder.CreateZExtOrTrunc(call_inst->getArgOperand(3), 
+                                                 int64_ty));
+      } else {
+        args.push_back(builder.CreateZExtOrTrunc(call_inst->getArgOperand(1), 
+                                                 int64_ty));
+      }
+
+      CallInst* check = builder.CreateCall(is_spatial ? spatial_check : 
+                                           temporal_check, args, "checked");
+      check->setDebugLoc(call_inst->getDebugLoc());
+      call_inst->eraseFromParent();
+      checked_ptr = check;
+    }
+
+    if(!checked_ptr)
+      continue;
+
+    IRBuilder<> builder(load_store);
+    Value* new_pointer = builder.CreateBitCast(checked_ptr, 
+                                               pointer_operand->getType());
+    load_store->setOperand(isa<StoreInst>(load_store) ? 1 : 0, new_pointer);
+  }
+}
+
+
+
+void SoftBoundCETSPass::addDereferenceChecks(Function* func) {
+
+  Function &F = *func;
+  
+  if(func->isVarArg())
+    return;
+
+  if(metadata_prop_only)
+    return;
+
+#if 0
+  if(Blacklist->isIn(F))
+    return;
+
+#endif
+
+  std::vector<Instruction*> CheckWorkList;
+  std::map<Value*, bool> ElideSpatialCheck;
+  std::map<Value*, bool> ElideTemporalCheck;
+  
+
+
+  // identify all the instructions where we need to insert the spatial checks
+  for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i){
+
+    Instruction* I = &*i;
+
+    if(!m_present_in_original.count(I)){
+      continue;
+    }
+    // add check optimizations here
+    if(isa<LoadInst>(I) || isa<StoreInst>(I)){
+      CheckWorkList.push_back(I);
+    }     
+  }
+
+  /* intra-procedural load dererference check elimination map */
+  std::map<Value*, int> func_deref_check_elim_map;
+  std::map<Value*, int> func_temporal_check_elim_map;
+
+  // spatial check optimizations here 
+  if(spatial_safety && BOUNDSCHECKOPT && !disable_spatial_check_opt){
+    m_dominator_tree = 
+      &getAnalysis<DominatorTreeWrapperPass>(*func).getDomTree();
+    m_post_dominator_tree = &getAnalysis<PostDominatorTree>(*func);
+
+    eliminateRedundantSpatialChecks(CheckWorkList, func_deref_check_elim_map);
+  }
+
+  //Temporal Check Optimizations
+
+  
+#if 0
+
+#endif
+
+  /* WorkList Algorithm for adding dereference checks. Each basic
+   * block is visited only once. We start by visiting the current
+   * basic block, then pushing all the successors of the current
+   * basic block on to the queue if it has not been visited
+   */
+    
+  std::set<BasicBlock*> bb_visited;
+  std::queue<BasicBlock*> bb_worklist;
+  Function:: iterator bb_begin = func->begin();
+
+  BasicBlock* bb = dyn_cast<BasicBlock>(bb_begin);
+  assert(bb && "Not a basic block  and I am adding dereference checks?");
+  bb_worklist.push(bb);
+
+    
+  while(bb_worklist.size() != 0) {
+      
+    bb = bb_worklist.front();
+    assert(bb && "Not a BasicBlock?");
+    bb_worklist.pop();
+
+    if(bb_visited.count(bb)) {
+      /* Block already visited */
+      continue;
+    }
+
+    /* If here implies basic block not visited */
+    /* Insert the block into the set of visited blocks */
+    bb_visited.insert(bb);
+
+    /* Iterating over the successors and adding the successors to
+     * the worklist
+     */
+    for(succ_iterator si = succ_begin(bb), se = succ_end(bb); si != se; ++si) {
+        
+      BasicBlock* next_bb = *si;
+      assert(next_bb && "Not a basic block and I am adding to the base and bound worklist?");
+      bb_worklist.push(next_bb);
+    }
+
+    /* basic block load deref check optimization */
+    std::map<Value*, int> bb_deref_check_map;
+    std::map<Value*, int> bb_temporal_check_elim_map;
+    /* structure check optimization */
+    std::map<Value*, int> bb_struct_check_opt;
+
+    for(BasicBlock::iterator i = bb->begin(), ie = bb->end(); i != ie; ++i){
+      Value* v1 = dyn_cast<Value>(i);
       Instruction* new_inst = dyn_cast<Instruction>(i);
       
       /* Do the dereference check stuff */
@@ -3501,6 +4397,13 @@ void SoftBoundCETSPass::addDereferenceChecks(Function* func) {
         continue;
       }
 
+      /* cmpxchg and atomicrmw read and write the location */
+      if(isa<AtomicCmpXchgInst>(new_inst) || isa<AtomicRMWInst>(new_inst)){
+        addLoadStoreChecks(new_inst, func_deref_check_elim_map);
+        addTemporalChecks(new_inst, bb_temporal_check_elim_map, func_temporal_check_elim_map);
+        continue;
+      }
+
       /* check call through function pointers */
       if(isa<CallInst>(new_inst)) {
           
@@ -3770,6 +4673,11 @@ void SoftBoundCETSPass::handleStore(StoreInst* store_inst) {
   Value* operand = store_inst->getOperand(0);
   Value* pointer_dest = store_inst->getOperand(1);
   Instruction* insert_at = getNextInstruction(store_inst);
+
+  if(store_inst->isAtomic() && isPointerValuedAtomic(store_inst)){
+    handleAtomicStore(store_inst);
+    return;
+  }
     
   if(isa<VectorType>(operand->getType())){
     const VectorType* vector_ty = dyn_cast<VectorType>(operand->getType());
@@ -3917,67 +4825,323 @@ Instruction* SoftBoundCETSPass:: getGlobalInitInstruction(Module& module){
       assert(global_init_terminator && "return inst null?");
     }
   }
-  assert(global_init_terminator && "global init does not have return, strange");
-  return global_init_terminator;
-}
+  assert(global_init_terminator && "global init does not have return, strange");
+  return global_init_terminator;
+}
+
+
+
+void SoftBoundCETSPass::handleGEP(GetElementPtrInst* gep_inst) {
+  Value* getelementptr_operand = gep_inst->getPointerOperand();
+  propagateMetadata(getelementptr_operand, gep_inst, SBCETS_GEP);
+}
+
+void SoftBoundCETSPass::handleMemcpy(CallInst* call_inst){
+    
+
+  if(DISABLE_MEMCOPY_METADATA_COPIES)
+    return;
+
+
+  Function* func = call_inst->getCalledFunction();
+  if(!func)
+    return;
+
+  assert(func && "function is null?");
+
+  CallSite cs(call_inst);
+  Value* arg1 = cs.getArgument(0);
+  Value* arg2 = cs.getArgument(1);
+  Value* arg3 = cs.getArgument(2);
+
+  SmallVector<Value*, 8> args;
+  args.push_back(arg1);
+  args.push_back(arg2);
+  args.push_back(arg3);
+
+  if(arg3->getType() == Type::getInt64Ty(arg3->getContext())){
+
+    if(MEMCOPYMETADATAELISION){
+      Type* dest_layout = NULL;
+      Type* src_layout = NULL;
+      int dest_class = classifyMemcopyOperand(arg1, arg3, dest_layout);
+      int src_class = classifyMemcopyOperand(arg2, arg3, src_layout);
+
+      // Neither side can hold a pointer, there is no metadata to copy
+      if(dest_class == SBCETS_MEMCOPY_NO_PTRS && 
+         src_class == SBCETS_MEMCOPY_NO_PTRS){
+        return;
+      }
+
+      ConstantInt* length = dyn_cast<ConstantInt>(arg3);
+      Type* layout_type = src_layout ? src_layout : dest_layout;
+      if(length && layout_type && 
+         (!dest_layout || !src_layout || dest_layout == src_layout) &&
+         introduceInlineMetadataCopy(arg1, arg2, layout_type, 
+                                     length->getZExtValue(), call_inst)){
+        return;
+      }
+    }
+    CallInst::Create(m_copy_metadata, args, "", call_inst);
+  }
+  else{
+    //    CallInst::Create(m_copy_metadata, args, "", call_inst);
+  }
+  args.clear();
+
+#if 0
+
+  Value* arg1_base = castToVoidPtr(getAssociatedBase(arg1), call_inst);
+  Value* arg1_bound = castToVoidPtr(getAssociatedBound(arg1), call_inst);
+  Value* arg2_base = castToVoidPtr(getAssociatedBase(arg2), call_inst);
+  Value* arg2_bound = castToVoidPtr(getAssociatedBound(arg2), call_inst);
+  args.push_back(arg1);
+  args.push_back(arg1_base);
+  args.push_back(arg1_bound);
+  args.push_back(arg2);
+  args.push_back(arg2_base);
+  args.push_back(arg2_bound);
+  args.push_back(arg3);
+
+  CallInst::Create(m_memcopy_check,args.begin(), args.end(), "", call_inst);
+
+#endif
+  return;
+    
+}
+
+//
+// Method: isUnionType
+//
+// Description: This function returns true if struct_type is the type
+// clang gives to a C union.
+
+bool SoftBoundCETSPass::isUnionType(StructType* struct_type) {
+
+  return struct_type->hasName() && 
+    struct_type->getName().startswith("union.");
+}
+
+//
+// Method: typeHasPointers
+//
+// Description: This function returns true if a value of type ty
+// contains a pointer, i.e. if memory of type ty can have metadata.
+// clang lowers a union to one of its members, e.g. union { long l;
+// char* p; } to { i64 }, so the elements of a union say nothing about
+// the pointers it holds.
+
+bool SoftBoundCETSPass::typeHasPointers(Type* ty) {
+
+  if(isa<PointerType>(ty))
+    return true;
+
+  if(SequentialType* seq_type = dyn_cast<SequentialType>(ty))
+    return typeHasPointers(seq_type->getElementType());
+
+  if(StructType* struct_type = dyn_cast<StructType>(ty)){
+    // The elements of an opaque struct or a union are not known
+    if(struct_type->isOpaque() || isUnionType(struct_type))
+      return true;
+
+    for(StructType::element_iterator I = struct_type->element_begin(), 
+          E = struct_type->element_end(); I != E; ++I){
+      if(typeHasPointers(*I))
+        return true;
+    }
+  }
+  return false;
+}
+
+//
+// Method: typeHoldsBytes
+//
+// Description: This function returns true if a value of type ty
+// contains chars, e.g. a char array. C lets a program copy any object,
+// pointers included, through an array of chars, e.g. into the
+// temporary of a generic swap, so the type of such memory does not
+// show that it holds no pointers. A variable length char array is an
+// alloca of i8.
+
+bool SoftBoundCETSPass::typeHoldsBytes(Type* ty) {
+
+  if(ty->isIntegerTy(8))
+    return true;
+
+  if(SequentialType* seq_type = dyn_cast<SequentialType>(ty))
+    return typeHoldsBytes(seq_type->getElementType());
+
+  if(StructType* struct_type = dyn_cast<StructType>(ty)){
+    for(StructType::element_iterator I = struct_type->element_begin(), 
+          E = struct_type->element_end(); I != E; ++I){
+      if(typeHoldsBytes(*I))
+        return true;
+    }
+  }
+  return false;
+}
+
+//
+// Method: collectPointerOffsets
+//
+// Description: This function appends the offsets of the pointers in
+// the first length bytes of a value of type ty at offset to
+// offsets. It returns false if there are more than limit of them.
+
+bool SoftBoundCETSPass::collectPointerOffsets(Type* ty, uint64_t offset, 
+                                              uint64_t length, 
+                                              unsigned limit,
+                                              SmallVectorImpl<uint64_t>& offsets) {
+
+  if(offset >= length || !typeHasPointers(ty))
+    return true;
+
+  if(isa<PointerType>(ty)){
+    if(offset + TD->getPointerSize() > length)
+      return true;
+    offsets.push_back(offset);
+    return offsets.size() <= limit;
+  }
 
+  if(StructType* struct_type = dyn_cast<StructType>(ty)){
+    // Unions are copied with the runtime handler
+    if(isUnionType(struct_type))
+      return false;
 
+    const StructLayout* layout = TD->getStructLayout(struct_type);
+    for(unsigned i = 0, n = struct_type->getNumElements(); i < n; i++){
+      if(!collectPointerOffsets(struct_type->getElementType(i), 
+                                offset + layout->getElementOffset(i), 
+                                length, limit, offsets))
+        return false;
+    }
+    return true;
+  }
 
-void SoftBoundCETSPass::handleGEP(GetElementPtrInst* gep_inst) {
-  Value* getelementptr_operand = gep_inst->getPointerOperand();
-  propagateMetadata(getelementptr_operand, gep_inst, SBCETS_GEP);
-}
+  if(ArrayType* array_type = dyn_cast<ArrayType>(ty)){
+    Type* element_type = array_type->getElementType();
+    uint64_t element_size = TD->getTypeAllocSize(element_type);
+    for(uint64_t i = 0, n = array_type->getNumElements(); 
+        i < n && offset + i * element_size < length; i++){
+      if(!collectPointerOffsets(element_type, offset + i * element_size, 
+                                length, limit, offsets))
+        return false;
+    }
+    return true;
+  }
 
-void SoftBoundCETSPass::handleMemcpy(CallInst* call_inst){
-    
+  // Vectors of pointers are copied with the runtime handler
+  return false;
+}
 
-  if(DISABLE_MEMCOPY_METADATA_COPIES)
-    return;
+//
+// Method: classifyMemcopyOperand
+//
+// Description: This function returns whether the memory at the
+// destination or source operand of a memcopy of length bytes holds
+// pointers (SBCETS_MEMCOPY_HAS_PTRS), holds no pointers
+// (SBCETS_MEMCOPY_NO_PTRS) or is unknown (SBCETS_MEMCOPY_UNKNOWN).
+// A pointer cast to i8* from a pointer to a type with pointers holds
+// pointers. Only the complete type of the underlying alloca or global
+// shows that the memory holds no pointers, as the pointee type of a
+// pointer into the heap need not be the type of the memory, and a
+// constant global that is initialized with zeros never has pointer
+// metadata. Memory with chars is unknown, see typeHoldsBytes. When
+// the operand holds pointers and the memcopy stays within a value of
+// its type, layout_type is set to the type.
 
+int SoftBoundCETSPass::classifyMemcopyOperand(Value* operand, 
+                                              Value* length, 
+                                              Type* & layout_type) {
 
-  Function* func = call_inst->getCalledFunction();
-  if(!func)
-    return;
+  layout_type = NULL;
 
-  assert(func && "function is null?");
+  PointerType* ptr_type = 
+    dyn_cast<PointerType>(operand->stripPointerCasts()->getType());
+  Type* pointee_type = ptr_type ? ptr_type->getElementType() : NULL;
 
-  CallSite cs(call_inst);
-  Value* arg1 = cs.getArgument(0);
-  Value* arg2 = cs.getArgument(1);
-  Value* arg3 = cs.getArgument(2);
+  // A char* says nothing about what the memory holds
+  if(pointee_type && pointee_type->isSized() && 
+     !pointee_type->isIntegerTy(8) && typeHasPointers(pointee_type)){
+    ConstantInt* constant_length = dyn_cast<ConstantInt>(length);
+    if(constant_length && constant_length->getZExtValue() <= 
+       TD->getTypeAllocSize(pointee_type))
+      layout_type = pointee_type;
+    return SBCETS_MEMCOPY_HAS_PTRS;
+  }
 
-  SmallVector<Value*, 8> args;
-  args.push_back(arg1);
-  args.push_back(arg2);
-  args.push_back(arg3);
+  Value* object = GetUnderlyingObject(operand, TD);
+  Type* object_type = NULL;
 
-  if(arg3->getType() == Type::getInt64Ty(arg3->getContext())){
-    CallInst::Create(m_copy_metadata, args, "", call_inst);
+  if(AllocaInst* alloca_inst = dyn_cast<AllocaInst>(object)){
+    object_type = alloca_inst->getAllocatedType();
   }
-  else{
-    //    CallInst::Create(m_copy_metadata, args, "", call_inst);
+  else if(GlobalVariable* gv = dyn_cast<GlobalVariable>(object)){
+    if(gv->isConstant() && gv->hasDefinitiveInitializer() && 
+       gv->getInitializer()->isNullValue())
+      return SBCETS_MEMCOPY_NO_PTRS;
+    object_type = gv->getType()->getElementType();
   }
-  args.clear();
 
-#if 0
+  if(object_type && object_type->isSized()){
+    if(typeHasPointers(object_type))
+      return SBCETS_MEMCOPY_HAS_PTRS;
+    if(!typeHoldsBytes(object_type))
+      return SBCETS_MEMCOPY_NO_PTRS;
+  }
 
-  Value* arg1_base = castToVoidPtr(getAssociatedBase(arg1), call_inst);
-  Value* arg1_bound = castToVoidPtr(getAssociatedBound(arg1), call_inst);
-  Value* arg2_base = castToVoidPtr(getAssociatedBase(arg2), call_inst);
-  Value* arg2_bound = castToVoidPtr(getAssociatedBound(arg2), call_inst);
-  args.push_back(arg1);
-  args.push_back(arg1_base);
-  args.push_back(arg1_bound);
-  args.push_back(arg2);
-  args.push_back(arg2_base);
-  args.push_back(arg2_bound);
-  args.push_back(arg3);
+  return SBCETS_MEMCOPY_UNKNOWN;
+}
 
-  CallInst::Create(m_memcopy_check,args.begin(), args.end(), "", call_inst);
+//
+// Method: introduceInlineMetadataCopy
+//
+// Description: This function copies the metadata of the pointers in
+// the first length bytes of a value of type layout_type from src to
+// dest before insert_at with metadata loads and stores, instead of
+// calling __softboundcets_copy_metadata for the whole range. All the
+// metadata is loaded before it is stored, so that it is also correct
+// for an overlapping memmove. It returns false, and introduces
+// nothing, if the value has more pointers than
+// -softboundcets_memcpy_inline_metadata_copies.
 
-#endif
-  return;
-    
+bool SoftBoundCETSPass::introduceInlineMetadataCopy(Value* dest, Value* src, 
+                                                    Type* layout_type, 
+                                                    uint64_t length,
+                                                    Instruction* insert_at) {
+
+  SmallVector<uint64_t, 8> offsets;
+  if(!collectPointerOffsets(layout_type, 0, length, 
+                            MEMCOPYINLINEMETADATACOPIES, offsets))
+    return false;
+
+  Value* dest_bitcast = castToVoidPtr(dest, insert_at);
+  Value* src_bitcast = castToVoidPtr(src, insert_at);
+  IRBuilder<> builder(insert_at);
+
+  SmallVector<Value*, 8> bases, bounds, keys, locks;
+  for(unsigned i = 0; i < offsets.size(); i++){
+    Value* src_ptr = builder.CreateConstGEP1_64(src_bitcast, offsets[i], 
+                                                "copy.src");
+    Value* base_load = NULL;
+    Value* bound_load = NULL;
+    Value* key_load = NULL;
+    Value* lock_load = NULL;
+    insertMetadataLoadByValue(src_ptr, insert_at, 
+                              base_load, bound_load, key_load, lock_load);
+    bases.push_back(base_load);
+    bounds.push_back(bound_load);
+    keys.push_back(key_load);
+    locks.push_back(lock_load);
+  }
+
+  for(unsigned i = 0; i < offsets.size(); i++){
+    Value* dest_ptr = builder.CreateConstGEP1_64(dest_bitcast, offsets[i], 
+                                                 "copy.dest");
+    addStoreBaseBoundFunc(dest_ptr, bases[i], bounds[i], keys[i], locks[i], 
+                          NULL, NULL, insert_at);
+  }
+  return true;
 }
 
 void 
@@ -4032,100 +5196,445 @@ void SoftBoundCETSPass::handleExtractElement(ExtractElementInst* EEI){
     associateKeyLock(EEI, ptr_key, ptr_lock);
     return;
   }
-     
-  assert (0 && "ExtractElement is returning a pointer, possibly some vectorization going on, not handled, try running with O0 or O1 or O2");    
-     
+     
+  assert (0 && "ExtractElement is returning a pointer, possibly some vectorization going on, not handled, try running with O0 or O1 or O2");    
+     
+}
+
+
+void SoftBoundCETSPass::handleExtractValue(ExtractValueInst* EVI){
+
+  if(isa<PointerType>(EVI->getType())){
+    assert(0 && "ExtractValue is returning a pointer, possibly some vectorization going on, not handled, try running with O0 or O1 or O2");
+  }
+  
+  if(spatial_safety){
+    associateBaseBound(EVI, m_void_null_ptr, m_infinite_bound_ptr);
+  }
+
+  if(temporal_safety){
+    Value* func_temp_lock = getAssociatedFuncLock(EVI);
+    associateKeyLock(EVI, m_constantint64ty_one, func_temp_lock);
+  }  
+  return;  
+}
+
+
+
+void SoftBoundCETSPass::handleCall(CallInst* call_inst) {
+
+  // Function* func = call_inst->getCalledFunction();
+  Value* mcall = call_inst;
+
+#if 0
+  CallingConv::ID id = call_inst->getCallingConv();
+
+
+  if(id == CallingConv::Fast){
+    printf("fast calling convention not handled\n");
+    exit(1);
+  }
+#endif 
+    
+  Function* func = call_inst->getCalledFunction();
+  if(func && ((func->getName().find("llvm.memcpy") == 0) || 
+              (func->getName().find("llvm.memmove") == 0))){
+    addMemcopyMemsetCheck(call_inst, func);
+    handleMemcpy(call_inst);
+    return;
+  }
+
+  
+
+  if(func && func->getName().find("llvm.memset") == 0){
+    addMemcopyMemsetCheck(call_inst, func);
+  }
+
+  if(func && isFuncDefSoftBound(func->getName())){
+
+    if(!isa<PointerType>(call_inst->getType())){
+      return;
+    }
+    
+    if(spatial_safety){
+      associateBaseBound(call_inst, m_void_null_ptr, m_void_null_ptr);
+    }
+    if(temporal_safety){
+      associateKeyLock(call_inst, m_constantint64ty_zero, m_void_null_ptr);
+    }
+    return;
+  }
+
+  Instruction* insert_at = getNextInstruction(call_inst);
+  //  call_inst->setCallingConv(CallingConv::C);
+
+  introduceShadowStackAllocation(call_inst);
+  iterateCallSiteIntroduceShadowStackStores(call_inst);
+    
+  if(isa<PointerType>(mcall->getType())) {
+
+      /* ShadowStack for the return value is 0 */
+      introduceShadowStackLoads(call_inst, insert_at, 0);       
+  }
+  introduceShadowStackDeallocation(call_inst,insert_at);
+}
+
+void SoftBoundCETSPass::handleIntToPtr(IntToPtrInst* inttoptrinst) {
+    
+  Value* inst = inttoptrinst;
+
+  // The old value returned by a cmpxchg is its first field
+  Value* int_value = inttoptrinst->getOperand(0);
+  ExtractValueInst* EVI = dyn_cast<ExtractValueInst>(int_value);
+  if(EVI && EVI->getNumIndices() == 1 && *EVI->idx_begin() == 0 && 
+     isa<AtomicCmpXchgInst>(EVI->getAggregateOperand())){
+    int_value = EVI->getAggregateOperand();
+  }
+
+  // Pointers read by atomic instructions keep their metadata
+  if(m_atomic_pointer_values.count(int_value)){
+    if(spatial_safety){
+      associateBaseBound(inst, getAssociatedBase(int_value), 
+                         getAssociatedBound(int_value));
+    }
+    if(temporal_safety){
+      Value* func_lock = getAssociatedFuncLock(inttoptrinst);
+      associateKeyLock(inst, getAssociatedKey(int_value), 
+                       getAssociatedLock(int_value, func_lock));
+    }
+    return;
+  }
+    
+  if(spatial_safety){
+    associateBaseBound(inst, m_void_null_ptr, m_void_null_ptr);
+  }
+  
+  if(temporal_safety){
+    associateKeyLock(inst, m_constantint64ty_zero, m_void_null_ptr);
+  }
+}
+
+//
+// Method: isPointerValuedAtomic
+//
+// Description: This function returns true if the atomic load, store,
+// cmpxchg or atomicrmw xchg reads or writes a pointer. Clang performs
+// atomic operations on pointers as operations on pointer sized
+// integers, so the casts of the location and of the values are
+// looked through.
+
+bool SoftBoundCETSPass::isPointerValuedAtomic(Instruction* inst) {
+
+  Value* pointer_operand = NULL;
+  Value* value_operand = NULL;
+
+  if(LoadInst* load_inst = dyn_cast<LoadInst>(inst)){
+    if(!load_inst->isAtomic())
+      return false;
+    pointer_operand = load_inst->getPointerOperand();
+  }
+  else if(StoreInst* store_inst = dyn_cast<StoreInst>(inst)){
+    if(!store_inst->isAtomic())
+      return false;
+    pointer_operand = store_inst->getPointerOperand();
+    value_operand = store_inst->getValueOperand();
+  }
+  else if(AtomicCmpXchgInst* cmpxchg = dyn_cast<AtomicCmpXchgInst>(inst)){
+    pointer_operand = cmpxchg->getPointerOperand();
+    value_operand = cmpxchg->getNewValOperand();
+  }
+  else if(AtomicRMWInst* rmw = dyn_cast<AtomicRMWInst>(inst)){
+    if(rmw->getOperation() != AtomicRMWInst::Xchg)
+      return false;
+    pointer_operand = rmw->getPointerOperand();
+    value_operand = rmw->getValOperand();
+  }
+  else {
+    return false;
+  }
+
+  PointerType* ptr_type = cast<PointerType>(pointer_operand->getType());
+  if(isa<PointerType>(ptr_type->getElementType()))
+    return true;
+
+  IntegerType* int_type = dyn_cast<IntegerType>(ptr_type->getElementType());
+  if(!int_type || int_type->getBitWidth() != TD->getPointerSizeInBits())
+    return false;
+
+  // location of pointer type accessed through a bitcast
+  PointerType* stripped_type = 
+    cast<PointerType>(pointer_operand->stripPointerCasts()->getType());
+  if(isa<PointerType>(stripped_type->getElementType()))
+    return true;
+
+  if(value_operand && isa<PtrToIntInst>(value_operand))
+    return true;
+
+  // value read converted back to a pointer
+  for(Value::user_iterator ui = inst->user_begin(), ue = inst->user_end(); 
+      ui != ue; ++ui){
+    if(isa<IntToPtrInst>(*ui))
+      return true;
+
+    ExtractValueInst* EVI = dyn_cast<ExtractValueInst>(*ui);
+    if(!EVI || *EVI->idx_begin() != 0)
+      continue;
+
+    for(Value::user_iterator ei = EVI->user_begin(), ee = EVI->user_end(); 
+        ei != ee; ++ei){
+      if(isa<IntToPtrInst>(*ei))
+        return true;
+    }
+  }
+  return false;
+}
+
+//
+// Method: getAtomicValueMetadata
+//
+// Description: This function obtains the metadata of the value
+// written by an atomic instruction. Integers that are not the result
+// of a ptrtoint get the same metadata as inttoptr gives them.
+
+void SoftBoundCETSPass::getAtomicValueMetadata(Value* value, 
+                                               Instruction* insert_at,
+                                               Value* & base, 
+                                               Value* & bound, 
+                                               Value* & key, 
+                                               Value* & lock){
+
+  if(PtrToIntInst* ptrtoint = dyn_cast<PtrToIntInst>(value)){
+    value = ptrtoint->getPointerOperand();
+  }
+
+  bool has_metadata = isa<PointerType>(value->getType()) && 
+    !isa<ConstantPointerNull>(value);
+
+  if(has_metadata && !isa<Constant>(value)){
+    if(spatial_safety && !checkBaseBoundMetadataPresent(value))
+      has_metadata = false;
+    if(temporal_safety && !checkKeyLockMetadataPresent(value))
+      has_metadata = false;
+  }
+
+  if(!has_metadata){
+    base = m_void_null_ptr;
+    bound = m_void_null_ptr;
+    key = m_constantint64ty_zero;
+    lock = m_void_null_ptr;
+    return;
+  }
+
+  if(Constant* given_constant = dyn_cast<Constant>(value)){
+    if(spatial_safety){
+      getConstantExprBaseBound(given_constant, base, bound);
+    }
+    if(temporal_safety){
+      key = m_constantint_one;
+      lock = m_func_global_lock[insert_at->getParent()->getParent()->getName()];
+    }
+    return;
+  }
+
+  if(spatial_safety){
+    base = castToVoidPtr(getAssociatedBase(value), insert_at);
+    bound = castToVoidPtr(getAssociatedBound(value), insert_at);
+  }
+
+  if(temporal_safety){
+    Value* func_lock = getAssociatedFuncLock(insert_at);
+    key = getAssociatedKey(value);
+    lock = getAssociatedLock(value, func_lock);
+  }
+}
+
+//
+// Method: handleAtomicLoad
+//
+// Description: This function reads the pointer loaded by an atomic
+// load again together with its metadata, so that a concurrent atomic
+// update of the location does not pair the pointer with the metadata
+// of another pointer. The original load only remains for its checks
+// and is erased by eraseReplacedAtomicLoads.
+
+void SoftBoundCETSPass::handleAtomicLoad(LoadInst* load_inst) {
+
+  Instruction* insert_at = getNextInstruction(load_inst);
+  Value* pointer_operand_bitcast = 
+    castToVoidPtr(load_inst->getPointerOperand(), insert_at);
+
+  Value* base_load = NULL;
+  Value* bound_load = NULL;
+  Value* key_load = NULL;
+  Value* lock_load = NULL;
+  CallInst* call_inst = 
+    insertMetadataLoadCall(m_metadata_load_atomic_func, pointer_operand_bitcast,
+                           insert_at, base_load, bound_load, key_load, lock_load);
+  
+  Value* loaded_value = NULL;
+  if(isa<PointerType>(load_inst->getType())){
+    loaded_value = call_inst;
+    if(load_inst->getType() != m_void_ptr_type){
+      loaded_value = new BitCastInst(call_inst, load_inst->getType(), "", insert_at);
+    }
+    load_inst->replaceAllUsesWith(loaded_value);
+  }
+  else {
+    loaded_value = new PtrToIntInst(call_inst, load_inst->getType(), "", insert_at);
+    load_inst->replaceAllUsesWith(loaded_value);
+    m_atomic_pointer_values[loaded_value] = 1;
+  }
+  m_replaced_atomic_loads.push_back(load_inst);
+
+  if(spatial_safety){
+    associateBaseBound(loaded_value, base_load, bound_load);
+  }
+  if(temporal_safety){
+    associateKeyLock(loaded_value, key_load, lock_load);
+  }
+}
+
+//
+// Method: eraseReplacedAtomicLoads
+//
+// Description: This function erases the atomic loads replaced by
+// handleAtomicLoad, so that a pointer atomic load is read only once,
+// by the reload under the metadata lock. Their dereference checks are
+// inserted before them and also check the reload; the checks stay
+// calls to the handlers, as the reload is not a load the check
+// intrinsics can rewrite.
+
+void SoftBoundCETSPass::eraseReplacedAtomicLoads() {
+
+  for(std::vector<LoadInst*>::iterator i = m_replaced_atomic_loads.begin(), 
+        e = m_replaced_atomic_loads.end(); i != e; ++i){
+
+    LoadInst* load_inst = *i;
+    assert(load_inst->use_empty() && "replaced atomic load still used?");
+
+    for(std::map<CallInst*, Instruction*>::iterator ci = m_check_access.begin(); 
+        ci != m_check_access.end();){
+      if(ci->second == load_inst)
+        m_check_access.erase(ci++);
+      else
+        ++ci;
+    }
+    m_present_in_original.erase(load_inst);
+    load_inst->eraseFromParent();
+  }
+  m_replaced_atomic_loads.clear();
 }
 
+//
+// Method: handleAtomicStore
+//
+// Description: This function stores the metadata of the pointer
+// written by an atomic store while holding the metadata lock of the
+// location.
 
-void SoftBoundCETSPass::handleExtractValue(ExtractValueInst* EVI){
+void SoftBoundCETSPass::handleAtomicStore(StoreInst* store_inst) {
 
-  if(isa<PointerType>(EVI->getType())){
-    assert(0 && "ExtractValue is returning a pointer, possibly some vectorization going on, not handled, try running with O0 or O1 or O2");
-  }
-  
-  if(spatial_safety){
-    associateBaseBound(EVI, m_void_null_ptr, m_infinite_bound_ptr);
-  }
+  Instruction* insert_at = getNextInstruction(store_inst);
+  Value* pointer_operand_bitcast = 
+    castToVoidPtr(store_inst->getPointerOperand(), store_inst);
 
-  if(temporal_safety){
-    Value* func_temp_lock = getAssociatedFuncLock(EVI);
-    associateKeyLock(EVI, m_constantint64ty_one, func_temp_lock);
-  }  
-  return;  
-}
+  CallInst::Create(m_metadata_lock_func, pointer_operand_bitcast, "", store_inst);
 
+  Value* base = NULL;
+  Value* bound = NULL;
+  Value* key = NULL;
+  Value* lock = NULL;
+  getAtomicValueMetadata(store_inst->getValueOperand(), insert_at, 
+                         base, bound, key, lock);
+  addStoreBaseBoundFunc(pointer_operand_bitcast, base, bound, key, lock, 
+                        NULL, NULL, insert_at);
 
+  CallInst::Create(m_metadata_unlock_func, pointer_operand_bitcast, "", insert_at);
+}
 
-void SoftBoundCETSPass::handleCall(CallInst* call_inst) {
+//
+// Method: handleAtomicExchangePass1
+//
+// Description: This function takes the metadata lock of the location
+// around a cmpxchg or atomicrmw xchg of a pointer and loads the
+// metadata of the old value. The metadata of the new value is stored
+// by handleAtomicExchangePass2 once the metadata of all the values is
+// available.
 
-  // Function* func = call_inst->getCalledFunction();
-  Value* mcall = call_inst;
+void SoftBoundCETSPass::handleAtomicExchangePass1(Instruction* atomic_inst) {
 
-#if 0
-  CallingConv::ID id = call_inst->getCallingConv();
+  Value* pointer_operand_bitcast = 
+    castToVoidPtr(getPointerLoadStore(atomic_inst), atomic_inst);
+  CallInst::Create(m_metadata_lock_func, pointer_operand_bitcast, "", atomic_inst);
 
+  Instruction* insert_at = getNextInstruction(atomic_inst);
 
-  if(id == CallingConv::Fast){
-    printf("fast calling convention not handled\n");
-    exit(1);
+  Value* base_load = NULL;
+  Value* bound_load = NULL;
+  Value* key_load = NULL;
+  Value* lock_load = NULL;
+  insertMetadataLoadByValue(pointer_operand_bitcast, insert_at, 
+                            base_load, bound_load, key_load, lock_load);
+
+  if(spatial_safety){
+    associateBaseBound(atomic_inst, base_load, bound_load);
   }
-#endif 
-    
-  Function* func = call_inst->getCalledFunction();
-  if(func && ((func->getName().find("llvm.memcpy") == 0) || 
-              (func->getName().find("llvm.memmove") == 0))){
-    addMemcopyMemsetCheck(call_inst, func);
-    handleMemcpy(call_inst);
-    return;
+  if(temporal_safety){
+    associateKeyLock(atomic_inst, key_load, lock_load);
   }
+  m_atomic_pointer_values[atomic_inst] = 1;
 
-  
+  m_atomic_metadata_unlock[atomic_inst] = 
+    CallInst::Create(m_metadata_unlock_func, pointer_operand_bitcast, "", insert_at);
+}
 
-  if(func && func->getName().find("llvm.memset") == 0){
-    addMemcopyMemsetCheck(call_inst, func);
+//
+// Method: handleAtomicExchangePass2
+//
+// Description: This function stores the metadata of the new value of
+// a cmpxchg or atomicrmw xchg of a pointer. A failed cmpxchg stores
+// back the metadata of the old value.
+
+void SoftBoundCETSPass::handleAtomicExchangePass2(Instruction* atomic_inst) {
+
+  assert(m_atomic_metadata_unlock.count(atomic_inst) && 
+         "atomic exchange not handled in the first pass?");
+  Instruction* insert_at = m_atomic_metadata_unlock[atomic_inst];
+
+  Value* new_value = NULL;
+  if(AtomicCmpXchgInst* cmpxchg = dyn_cast<AtomicCmpXchgInst>(atomic_inst)){
+    new_value = cmpxchg->getNewValOperand();
+  } else {
+    new_value = cast<AtomicRMWInst>(atomic_inst)->getValOperand();
   }
 
-  if(func && isFuncDefSoftBound(func->getName())){
+  Value* base = NULL;
+  Value* bound = NULL;
+  Value* key = NULL;
+  Value* lock = NULL;
+  getAtomicValueMetadata(new_value, insert_at, base, bound, key, lock);
 
-    if(!isa<PointerType>(call_inst->getType())){
-      return;
-    }
-    
+  if(isa<AtomicCmpXchgInst>(atomic_inst)){
+    Value* success = ExtractValueInst::Create(atomic_inst, 1, "", insert_at);
     if(spatial_safety){
-      associateBaseBound(call_inst, m_void_null_ptr, m_void_null_ptr);
+      base = SelectInst::Create(success, base, getAssociatedBase(atomic_inst), 
+                                "", insert_at);
+      bound = SelectInst::Create(success, bound, getAssociatedBound(atomic_inst), 
+                                 "", insert_at);
     }
     if(temporal_safety){
-      associateKeyLock(call_inst, m_constantint64ty_zero, m_void_null_ptr);
+      Value* func_lock = getAssociatedFuncLock(atomic_inst);
+      key = SelectInst::Create(success, key, getAssociatedKey(atomic_inst), 
+                               "", insert_at);
+      lock = SelectInst::Create(success, lock, 
+                                getAssociatedLock(atomic_inst, func_lock), 
+                                "", insert_at);
     }
-    return;
   }
 
-  Instruction* insert_at = getNextInstruction(call_inst);
-  //  call_inst->setCallingConv(CallingConv::C);
-
-  introduceShadowStackAllocation(call_inst);
-  iterateCallSiteIntroduceShadowStackStores(call_inst);
-    
-  if(isa<PointerType>(mcall->getType())) {
-
-      /* ShadowStack for the return value is 0 */
-      introduceShadowStackLoads(call_inst, insert_at, 0);       
-  }
-  introduceShadowStackDeallocation(call_inst,insert_at);
-}
-
-void SoftBoundCETSPass::handleIntToPtr(IntToPtrInst* inttoptrinst) {
-    
-  Value* inst = inttoptrinst;
-    
-  if(spatial_safety){
-    associateBaseBound(inst, m_void_null_ptr, m_void_null_ptr);
-  }
-  
-  if(temporal_safety){
-    associateKeyLock(inst, m_constantint64ty_zero, m_void_null_ptr);
-  }
+  Value* pointer_operand = getPointerLoadStore(atomic_inst);
+  addStoreBaseBoundFunc(pointer_operand, base, bound, key, lock, 
+                        NULL, NULL, insert_at);
 }
 
 
@@ -4194,6 +5703,16 @@ void SoftBoundCETSPass::gatherBaseBoundPass2(Function* func){
         }
         break;
 
+      case Instruction::AtomicCmpXchg:
+      case Instruction::AtomicRMW:
+        {
+          Instruction* atomic_inst = dyn_cast<Instruction>(v1);
+          if(isPointerValuedAtomic(atomic_inst)){
+            handleAtomicExchangePass2(atomic_inst);
+          }
+        }
+        break;
+
       case Instruction::PHI:
         {
           PHINode* phi_node = dyn_cast<PHINode>(v1);
@@ -4519,6 +6038,16 @@ void SoftBoundCETSPass::gatherBaseBoundPass1 (Function * func) {
           break;
         }
 
+      case Instruction::AtomicCmpXchg:
+      case Instruction::AtomicRMW:
+        {
+          Instruction* atomic_inst = dyn_cast<Instruction>(v1);
+          if(isPointerValuedAtomic(atomic_inst)){
+            handleAtomicExchangePass1(atomic_inst);
+          }
+        }
+        break;
+
       case Instruction::IntToPtr:
         {
           IntToPtrInst* inttoptrinst = dyn_cast<IntToPtrInst>(v1);
@@ -4628,14 +6157,6 @@ bool SoftBoundCETSPass:: isByValDerived(Value* pointer_operand){
 
 void SoftBoundCETSPass::insertMetadataLoad(LoadInst* load_inst){
 
-  AllocaInst* base_alloca;
-  AllocaInst* bound_alloca;
-  AllocaInst* key_alloca;
-  AllocaInst* lock_alloca;
-
-  SmallVector<Value*, 8> args;
-
-
   Value* load_inst_value = load_inst;
   Value* pointer_operand = load_inst->getPointerOperand();
   Instruction* load = load_inst;    
@@ -4646,12 +6167,79 @@ void SoftBoundCETSPass::insertMetadataLoad(LoadInst* load_inst){
    * from the shadow space
    */
   Value* pointer_operand_bitcast =  castToVoidPtr(pointer_operand, insert_at);      
-  Instruction* first_inst_func = dyn_cast<Instruction>(load_inst->getParent()->getParent()->begin()->begin());
+
+  Value* base_load = NULL;
+  Value* bound_load = NULL;
+  Value* key_load = NULL;
+  Value* lock_load = NULL;
+
+  /* The accessors read each field of the metadata separately, so
+   * that the fields used by no check are not loaded and, with a split
+   * metadata layout, a pointer that only has spatial checks does not
+   * touch the temporal plane.
+   */
+  if(simple_metadata_mode && spatial_safety && temporal_safety){
+    Value* entry_ptr = CallInst::Create(m_metadata_map_func, 
+                                        pointer_operand_bitcast, 
+                                        "metadata.map", insert_at);
+    base_load = CallInst::Create(m_metadata_load_base_func, entry_ptr, 
+                                 "base.load", insert_at);
+    bound_load = CallInst::Create(m_metadata_load_bound_func, entry_ptr, 
+                                  "bound.load", insert_at);
+    key_load = CallInst::Create(m_metadata_load_key_func, entry_ptr, 
+                                "key.load", insert_at);
+    lock_load = CallInst::Create(m_metadata_load_lock_func, entry_ptr, 
+                                 "lock.load", insert_at);
+  }
+  else {
+    insertMetadataLoadByValue(pointer_operand_bitcast, insert_at, 
+                              base_load, bound_load, key_load, lock_load);
+  }
+
+  if(LAZYMETADATALOADS){
+    BasicBlock::iterator i = load;
+    for(++i; &*i != insert_at; ++i){
+      m_metadata_loads.push_back(i);
+    }
+  }
+      
+  if(spatial_safety){
+    associateBaseBound(load_inst_value, base_load, bound_load);      
+  }
+
+  if(temporal_safety){
+    associateKeyLock(load_inst_value, key_load, lock_load);
+  }
+}
+
+//
+// Method: insertMetadataLoadCall
+//
+// Description: This function calls load_func with the address of the
+// pointer and the addresses of stack slots for the metadata, and
+// loads the metadata back from the slots before insert_at.
+
+CallInst* 
+SoftBoundCETSPass::insertMetadataLoadCall(Function* load_func, 
+                                          Value* pointer_operand_bitcast,
+                                          Instruction* insert_at, 
+                                          Value* & base_load, 
+                                          Value* & bound_load, 
+                                          Value* & key_load, 
+                                          Value* & lock_load){
+
+  AllocaInst* base_alloca = NULL;
+  AllocaInst* bound_alloca = NULL;
+  AllocaInst* key_alloca = NULL;
+  AllocaInst* lock_alloca = NULL;
+
+  SmallVector<Value*, 8> args;
+
+  Instruction* first_inst_func = dyn_cast<Instruction>(insert_at->getParent()->getParent()->begin()->begin());
   assert(first_inst_func && "function doesn't have any instruction and there is load???");
   
   /* address of pointer being pushed */
   args.push_back(pointer_operand_bitcast);
-    
 
   if(spatial_safety){
     
@@ -4666,30 +6254,296 @@ void SoftBoundCETSPass::insertMetadataLoad(LoadInst* load_inst){
 
   if(temporal_safety){
     
-    key_alloca = new AllocaInst(Type::getInt64Ty(load_inst->getType()->getContext()), "key.alloca", first_inst_func);
+    key_alloca = new AllocaInst(m_key_type, "key.alloca", first_inst_func);
     lock_alloca = new AllocaInst(m_void_ptr_type, "lock.alloca", first_inst_func);
 
     args.push_back(key_alloca);
     args.push_back(lock_alloca);
   }
   
-  CallInst::Create(m_load_base_bound_func, args, "", insert_at);
+  CallInst* call_inst = CallInst::Create(load_func, args, "", insert_at);
       
   if(spatial_safety){
-    Instruction* base_load = new LoadInst(base_alloca, "base.load", insert_at);
-    Instruction* bound_load = new LoadInst(bound_alloca, "bound.load", insert_at);
-    associateBaseBound(load_inst_value, base_load, bound_load);      
+    base_load = new LoadInst(base_alloca, "base.load", insert_at);
+    bound_load = new LoadInst(bound_alloca, "bound.load", insert_at);
   }
 
   if(temporal_safety){
-    Instruction* key_load = new LoadInst(key_alloca, "key.load", insert_at);
-    Instruction* lock_load = new LoadInst(lock_alloca, "lock.load", insert_at);    
-    associateKeyLock(load_inst_value, key_load, lock_load);
+    key_load = new LoadInst(key_alloca, "key.load", insert_at);
+    lock_load = new LoadInst(lock_alloca, "lock.load", insert_at);    
+  }
+  return call_inst;
+}
+
+//
+// Method: insertMetadataLoadByValue
+//
+// Description: This function loads the metadata of the pointer at
+// pointer_operand_bitcast with the functions that return it by value,
+// and extracts the fields from the returned pairs before insert_at.
+// Unlike insertMetadataLoadCall, it needs no stack slots, so a
+// function with many pointer loads does not get a large frame of
+// slots that are stored and loaded back.
+
+void 
+SoftBoundCETSPass::insertMetadataLoadByValue(Value* pointer_operand_bitcast,
+                                             Instruction* insert_at, 
+                                             Value* & base_load, 
+                                             Value* & bound_load, 
+                                             Value* & key_load, 
+                                             Value* & lock_load){
+
+  if(LINEARSHADOW){
+    Value* base_addr = NULL;
+    Value* bound_addr = NULL;
+    Value* key_addr = NULL;
+    Value* lock_addr = NULL;
+    getLinearShadowEntry(pointer_operand_bitcast, insert_at, 
+                         base_addr, bound_addr, key_addr, lock_addr);
+    base_load = new LoadInst(base_addr, "base.load", insert_at);
+    bound_load = new LoadInst(bound_addr, "bound.load", insert_at);
+    key_load = new LoadInst(key_addr, "key.load", insert_at);
+    lock_load = new LoadInst(lock_addr, "lock.load", insert_at);
+    return;
+  }
+
+  if(spatial_safety){
+    CallInst* spatial_load = 
+      CallInst::Create(m_metadata_load_spatial_func, pointer_operand_bitcast,
+                       "spatial.load", insert_at);
+    base_load = ExtractValueInst::Create(spatial_load, 0, 
+                                         "base.load", insert_at);
+    bound_load = ExtractValueInst::Create(spatial_load, 1, 
+                                          "bound.load", insert_at);
+  }
+
+  if(temporal_safety){
+    CallInst* temporal_load = 
+      CallInst::Create(m_metadata_load_temporal_func, pointer_operand_bitcast,
+                       "temporal.load", insert_at);
+    key_load = ExtractValueInst::Create(temporal_load, 0, 
+                                        "key.load", insert_at);
+    lock_load = ExtractValueInst::Create(temporal_load, 1, 
+                                         "lock.load", insert_at);
+  }
+}
+
+//
+// Method: getLinearShadowEntry
+//
+// Description: With -softboundcets_linear_shadow, the runtime keeps
+// the metadata of the pointer at addr in the 32 byte entry
+// ((addr >> 3) & mask) of the region at __softboundcets_linear_shadow,
+// and this function computes the addresses of the base, bound, key
+// and lock fields of the entry of pointer_operand_bitcast before
+// insert_at, as __softboundcets_linear_shadow_entry does. Unlike the
+// trie lookup, there is no table to load and no NULL to test.
+
+void 
+SoftBoundCETSPass::getLinearShadowEntry(Value* pointer_operand_bitcast,
+                                        Instruction* insert_at, 
+                                        Value* & base_addr, 
+                                        Value* & bound_addr, 
+                                        Value* & key_addr, 
+                                        Value* & lock_addr){
+
+  assert(m_linear_shadow && "linear shadow global null?");
+  LLVMContext& context = insert_at->getContext();
+  IRBuilder<> builder(insert_at);
+  Type* int64_ty = Type::getInt64Ty(context);
+  uint64_t index_mask = ((uint64_t) 1 << (LINEARSHADOWBITS - 3)) - 1;
+
+  Value* addr = builder.CreatePtrToInt(pointer_operand_bitcast, int64_ty, 
+                                       "shadow.addr");
+  Value* index = builder.CreateAnd(builder.CreateLShr(addr, 3), 
+                                   index_mask, "shadow.index");
+  Value* offset = builder.CreateShl(index, 5, "shadow.offset");
+
+  // The runtime sets the region up before any instrumented code runs
+  LoadInst* shadow = builder.CreateLoad(m_linear_shadow, "shadow.base");
+  shadow->setMetadata(LLVMContext::MD_invariant_load, 
+                      MDNode::get(context, None));
+  Value* entry = builder.CreateGEP(shadow, offset, "shadow.entry");
+
+  Type* void_ptr_ptr_type = PointerType::getUnqual(m_void_ptr_type);
+  base_addr = builder.CreateBitCast(entry, void_ptr_ptr_type, "shadow.base.addr");
+  bound_addr = builder.CreateBitCast(builder.CreateConstGEP1_32(entry, 8), 
+                                     void_ptr_ptr_type, "shadow.bound.addr");
+  key_addr = builder.CreateBitCast(builder.CreateConstGEP1_32(entry, 16), 
+                                   PointerType::getUnqual(m_key_type), 
+                                   "shadow.key.addr");
+  lock_addr = builder.CreateBitCast(builder.CreateConstGEP1_32(entry, 24), 
+                                    void_ptr_ptr_type, "shadow.lock.addr");
+}
+
+//
+// Method: getMetadataUsePoint
+//
+// Description: This function returns the instruction in bb before
+// which inst has to be placed to reach its uses in bb: the first
+// user in bb, or the terminator when the uses are in the blocks
+// dominated by bb or in phi nodes that take inst from bb.
+
+Instruction* 
+SoftBoundCETSPass::getMetadataUsePoint(Instruction* inst, BasicBlock* bb) {
+
+  for(BasicBlock::iterator i = bb->getFirstNonPHI(), ie = bb->end(); 
+      i != ie; ++i){
+    for(unsigned op = 0; op < i->getNumOperands(); ++op){
+      if(i->getOperand(op) == inst)
+        return i;
+    }
   }
+  return bb->getTerminator();
+}
+
+//
+// Method: sinkMetadataLoads
+//
+// Description: insertMetadataLoad loads the metadata of every loaded
+// pointer right after the load, although many loaded pointers are
+// only compared, hashed or stored back without a check. This
+// function removes the metadata loads without uses and moves the
+// others down the dominator tree to the nearest block that dominates
+// all their uses, so that the paths that do not use the metadata do
+// not touch the metadata space. A metadata load is not moved across a
+// metadata store or an opaque call, which may change the metadata of
+// the location, nor into a loop that does not contain it. The
+// instructions are visited in reverse so that the extractvalues and
+// accessors are placed before the call that produces their operand.
+//
+
+void SoftBoundCETSPass::sinkMetadataLoads(Function* func) {
+
+  if(m_metadata_loads.empty())
+    return;
+
+  LoopInfo& loop_info = getAnalysis<LoopInfo>(*func);
+  DominatorTree& dominator_tree = 
+    getAnalysis<DominatorTreeWrapperPass>(*func).getDomTree();
+
+  for(std::vector<Instruction*>::reverse_iterator i = m_metadata_loads.rbegin(), 
+        e = m_metadata_loads.rend(); i != e; ++i){
+
+    Instruction* inst = *i;
+    if(inst->use_empty()){
+      if(inst->mayReadFromMemory())
+        ++NumDroppedMetadataLoads;
+      inst->eraseFromParent();
+      continue;
+    }
 
+    // Nearest block dominating the uses
+    BasicBlock* use_bb = NULL;
+    for(Value::use_iterator ui = inst->use_begin(), ue = inst->use_end(); 
+        ui != ue; ++ui){
+      Use& use = *ui;
+      Instruction* user = cast<Instruction>(use.getUser());
+      BasicBlock* bb = user->getParent();
+      if(PHINode* phi = dyn_cast<PHINode>(user))
+        bb = phi->getIncomingBlock(use);
+
+      if(!dominator_tree.isReachableFromEntry(bb)){
+        use_bb = NULL;
+        break;
+      }
+      use_bb = use_bb ? dominator_tree.findNearestCommonDominator(use_bb, bb) : bb;
+    }
+
+    BasicBlock* inst_bb = inst->getParent();
+    if(!use_bb || use_bb == inst_bb)
+      continue;
+
+    // Walk up from the uses to the deepest block the load can move to
+    for(DomTreeNode* node = dominator_tree.getNode(use_bb); 
+        node && node->getBlock() != inst_bb; node = node->getIDom()){
+
+      BasicBlock* bb = node->getBlock();
+      Loop* loop = loop_info.getLoopFor(bb);
+      if(loop && !loop->contains(inst_bb))
+        continue;
 
+      Instruction* use_point = getMetadataUsePoint(inst, bb);
+      if(inst->mayReadFromMemory() && 
+         pathHasOpaqueCalls(inst, use_point, true))
+        continue;
+
+      inst->moveBefore(use_point);
+      if(inst->mayReadFromMemory())
+        ++NumSunkMetadataLoads;
+      break;
+    }
+  }
+  m_metadata_loads.clear();
+
+  mergeMetadataLoads(func, dominator_tree);
 }
 
+//
+// Method: mergeMetadataLoads
+//
+// Description: This function replaces a metadata load with an earlier
+// load of the metadata of the same location that dominates it, when
+// no metadata store or opaque call can execute in between. The loads
+// moved to their uses often meet such a load, e.g. when the pointer
+// loaded from a hash table bucket is checked again in a later block.
+//
+
+void SoftBoundCETSPass::mergeMetadataLoads(Function* func, 
+                                           DominatorTree& dominator_tree) {
+
+  // Earlier loads by the metadata function and the location
+  std::map<std::pair<Function*, Value*>, std::vector<CallInst*> > available;
+  std::vector<Instruction*> dead_insts;
+
+  for(df_iterator<DomTreeNode*> di = df_begin(dominator_tree.getRootNode()), 
+        de = df_end(dominator_tree.getRootNode()); di != de; ++di){
+
+    BasicBlock* bb = di->getBlock();
+    for(BasicBlock::iterator i = bb->begin(), ie = bb->end(); i != ie; ++i){
+
+      CallInst* call_inst = dyn_cast<CallInst>(i);
+      if(!call_inst || call_inst->getNumArgOperands() != 1)
+        continue;
+
+      Function* callee = call_inst->getCalledFunction();
+      if(!callee || !callee->onlyReadsMemory() || 
+         !callee->getName().startswith("__softboundcets_metadata_"))
+        continue;
+
+      Value* location = call_inst->getArgOperand(0)->stripPointerCasts();
+      std::vector<CallInst*>& loads = 
+        available[std::make_pair(callee, location)];
+
+      CallInst* earlier = NULL;
+      for(std::vector<CallInst*>::iterator li = loads.begin(), 
+            le = loads.end(); li != le; ++li){
+        if(dominator_tree.dominates(*li, call_inst) && 
+           !pathHasOpaqueCalls(*li, call_inst, true)){
+          earlier = *li;
+          break;
+        }
+      }
+
+      if(!earlier){
+        loads.push_back(call_inst);
+        continue;
+      }
+
+      call_inst->replaceAllUsesWith(earlier);
+      dead_insts.push_back(call_inst);
+      ++NumMergedMetadataLoads;
+    }
+  }
+
+  for(std::vector<Instruction*>::iterator i = dead_insts.begin(), 
+        e = dead_insts.end(); i != e; ++i){
+    Instruction* operand = dyn_cast<Instruction>((*i)->getOperand(0));
+    (*i)->eraseFromParent();
+    if(operand && isa<CastInst>(operand) && operand->use_empty())
+      operand->eraseFromParent();
+  }
+}
 
 /* handleLoad Takes a load_inst If the load is through a pointer
  * which is a global then inserts base and bound for that global
@@ -4699,6 +6553,10 @@ void SoftBoundCETSPass::insertMetadataLoad(LoadInst* load_inst){
 
 void SoftBoundCETSPass::handleLoad(LoadInst* load_inst) { 
 
+  if(load_inst->isAtomic() && isPointerValuedAtomic(load_inst)){
+    handleAtomicLoad(load_inst);
+    return;
+  }
 
   if(!isa<VectorType>(load_inst->getType()) && !isa<PointerType>(load_inst->getType())){
     return;
@@ -4852,6 +6710,88 @@ void SoftBoundCETSPass::identifyInitialGlobals(Module& module) {
   }
 }
 
+//
+// Method: addGlobalMetadataStore
+//
+// Description: Records the metadata of the pointer at addr_of_ptr
+// that a global is initialized with in the metadata table of the
+// module. Without the table, or when the base or bound is not a
+// constant, it stores the metadata in the global init function
+// instead. Pointers in initializers have the key and lock of globals.
+
+void SoftBoundCETSPass::addGlobalMetadataStore(Module& module,
+                                               Constant* addr_of_ptr,
+                                               Value* base,
+                                               Value* bound,
+                                               Value* initializer,
+                                               Instruction* insert_at){
+
+  Constant* base_const = m_void_null_ptr;
+  Constant* bound_const = m_void_null_ptr;
+  if(spatial_safety){
+    base_const = dyn_cast<Constant>(base);
+    bound_const = dyn_cast<Constant>(bound);
+  }
+
+  if(!STATICGLOBALMETADATA || !base_const || !bound_const){
+    Value* key = NULL;
+    Value* lock = NULL;
+    if(temporal_safety){
+      key = m_constantint_one;
+      lock = introduceGlobalLockFunction(insert_at);
+    }
+    addStoreBaseBoundFunc(addr_of_ptr, base, bound, key, lock, initializer,
+                          getSizeOfType(initializer->getType()), insert_at);
+    return;
+  }
+
+  Constant* fields[3] = {
+    ConstantExpr::getPointerCast(addr_of_ptr, m_void_ptr_type),
+    ConstantExpr::getPointerCast(base_const, m_void_ptr_type),
+    ConstantExpr::getPointerCast(bound_const, m_void_ptr_type)
+  };
+  m_global_metadata_records.push_back(ConstantStruct::getAnon(fields));
+}
+
+//
+// Method: emitGlobalMetadataTable
+//
+// Description: Emits the records collected by addGlobalMetadataStore
+// as one constant array, in the softboundcets_globals section on ELF
+// targets, and a single call in the global init function that has the
+// runtime install them. This replaces a metadata store per pointer in
+// the global initializers, which made the init function of modules
+// with large tables of pointers slow to compile and to run.
+
+void SoftBoundCETSPass::emitGlobalMetadataTable(Module& module){
+
+  if(m_global_metadata_records.empty())
+    return;
+
+  ArrayType* table_type =
+    ArrayType::get(m_global_metadata_records[0]->getType(),
+                   m_global_metadata_records.size());
+  GlobalVariable* table =
+    new GlobalVariable(module, table_type, true,
+                       GlobalValue::PrivateLinkage,
+                       ConstantArray::get(table_type,
+                                          m_global_metadata_records),
+                       "__softboundcets_global_metadata");
+  table->setAlignment(8);
+  if(Triple(module.getTargetTriple()).isOSBinFormatELF()){
+    table->setSection("softboundcets_globals");
+  }
+
+  SmallVector<Value*, 8> args;
+  args.push_back(ConstantExpr::getBitCast(table, m_void_ptr_type));
+  args.push_back(ConstantInt::get(Type::getInt64Ty(module.getContext()),
+                                  m_global_metadata_records.size()));
+  CallInst::Create(m_install_global_metadata_func, args, "",
+                   getGlobalInitInstruction(module));
+
+  m_global_metadata_records.clear();
+}
+
 void SoftBoundCETSPass::addBaseBoundGlobals(Module& M){
   /* iterate over the globals here */
 
@@ -4927,22 +6867,12 @@ void SoftBoundCETSPass::addBaseBoundGlobals(Module& M){
       indices_addr_ptr.push_back(index2);
 
       Constant* addr_of_ptr = ConstantExpr::getGetElementPtr(gv, indices_addr_ptr);
-      Type* initializer_type = initializer_opd->getType();
-      Value* initializer_size = getSizeOfType(initializer_type);
-      
-      Value* operand_key = NULL;
-      Value* operand_lock = NULL;
-
-      if(temporal_safety){
-        operand_key = m_constantint_one;
-        operand_lock = introduceGlobalLockFunction(first);
-      }
-      
-      addStoreBaseBoundFunc(addr_of_ptr, operand_base, operand_bound, operand_key, operand_lock, initializer_opd, initializer_size, first);
-      
+      addGlobalMetadataStore(M, addr_of_ptr, operand_base, operand_bound, 
+                             initializer_opd, first);
     }
   }
 
+  emitGlobalMetadataTable(M);
 }
 void SoftBoundCETSPass::identifyOriginalInst (Function * func) {
 
@@ -4999,6 +6929,7 @@ bool SoftBoundCETSPass::runOnModule(Module& module) {
     return false;
   }  
   
+  TD = &DLP->getDataLayout();
   int LongSize = DLP->getDataLayout().getPointerSizeInBits();
  
   if (LongSize  == 64) {
@@ -5027,7 +6958,17 @@ bool SoftBoundCETSPass::runOnModule(Module& module) {
       
     if (!checkIfFunctionOfInterest(func_ptr)) {
       continue;
-    }  
+    }
+
+    //
+    // The instrumented function accesses the shadow stack and the
+    // metadata, so the memory attributes that the optimizer inferred
+    // before the instrumentation no longer hold
+    //
+
+    func_ptr->removeFnAttr(Attribute::ReadNone);
+    func_ptr->removeFnAttr(Attribute::ReadOnly);
+
     //
     // Iterating over the instructions in the function to identify IR
     // instructions in the original program In this pass, the pointers
@@ -5051,6 +6992,11 @@ bool SoftBoundCETSPass::runOnModule(Module& module) {
     gatherBaseBoundPass1(func_ptr);
     gatherBaseBoundPass2(func_ptr);
     addDereferenceChecks(func_ptr);            
+    eraseReplacedAtomicLoads();
+    optimizeLoopChecks(func_ptr);
+    sinkMetadataLoads(func_ptr);
+    introduceCheckIntrinsics(func_ptr);
+    inlineDereferenceChecks(func_ptr);
   }
 
 
@@ -38,8 +38,12 @@
 
 char SoftBoundCETSMPXPass:: ID = 0;
 
-static RegisterPass<SoftBoundCETSMPXPass> P ("SoftBoundCETSMPXPass",
-                                          "SoftBound Pass for Spatial Safety");
+INITIALIZE_PASS_BEGIN(SoftBoundCETSMPXPass, "SoftBoundCETSMPXPass",
+                      "SoftBound Pass for Spatial Safety", false, false)
+INITIALIZE_PASS_DEPENDENCY(LoopInfo)
+INITIALIZE_PASS_DEPENDENCY(TargetLibraryInfo)
+INITIALIZE_PASS_END(SoftBoundCETSMPXPass, "SoftBoundCETSMPXPass",
+                    "SoftBound Pass for Spatial Safety", false, false)
 
 
 //
@@ -0,0 +1,33 @@
+//===-- SoftBoundCETSPasses.cpp - SoftBoundCETS Infrastructure ------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines the common initialization infrastructure for the
+// SoftBoundCETS library.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/InitializePasses.h"
+#include "llvm/PassRegistry.h"
+
+using namespace llvm;
+
+/// initializeSoftBoundCETS - Initialize all passes in the SoftBoundCETS
+/// library, so that tools such as opt can run them by name.
+void llvm::initializeSoftBoundCETS(PassRegistry &Registry) {
+  initializeFixByValAttributesPassPass(Registry);
+  initializeInitializeSoftBoundCETSPass(Registry);
+  initializeSoftBoundCETSPassPass(Registry);
+  initializeSpatialCheckOptPass(Registry);
+  initializeShadowStackOptPass(Registry);
+  initializeStripSBCETSIntrinsicsPass(Registry);
+  initializeInitializeSoftBoundMPXPass(Registry);
+  initializeSoftBoundMPXPassPass(Registry);
+  initializeInitializeSoftBoundCETSMPXPass(Registry);
+  initializeSoftBoundCETSMPXPassPass(Registry);
+}
@@ -76,8 +76,12 @@ MPXINDIRECTCALLCHECKS
 
 char SoftBoundMPXPass:: ID = 0;
 
-static RegisterPass<SoftBoundMPXPass> P ("SoftBoundMPXPass",
-                                          "SoftBound Pass for Spatial Safety similar to Intel MPX");
+INITIALIZE_PASS_BEGIN(SoftBoundMPXPass, "SoftBoundMPXPass",
+                      "SoftBound Pass for Spatial Safety similar to Intel MPX", false, false)
+INITIALIZE_PASS_DEPENDENCY(LoopInfo)
+INITIALIZE_PASS_DEPENDENCY(TargetLibraryInfo)
+INITIALIZE_PASS_END(SoftBoundMPXPass, "SoftBoundMPXPass",
+                    "SoftBound Pass for Spatial Safety similar to Intel MPX", false, false)
 
 
 
@@ -66,8 +66,11 @@ bool SpatialCheckOpt::isSpatialCheckInstruction(Instruction* I){
 
 char SpatialCheckOpt::ID = 0;
 
-static RegisterPass<SpatialCheckOpt> P ("SpatialCheckOpt", 
-					"Spatial Check Optimizations");
+INITIALIZE_PASS_BEGIN(SpatialCheckOpt, "SpatialCheckOpt",
+                      "Spatial Check Optimizations", false, false)
+INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
+INITIALIZE_PASS_END(SpatialCheckOpt, "SpatialCheckOpt",
+                    "Spatial Check Optimizations", false, false)
 
 
 void SpatialCheckOpt::EliminateChecks(){
@@ -0,0 +1,309 @@
+//=== SoftBoundCETS/StripSBCETSIntrinsics.cpp --*- C++ -*=====///
+// Lowering of the SoftBoundCETS check intrinsics
+// Copyright (c) 2014 Santosh Nagarakatte, Milo M. K. Martin. All rights reserved.
+//
+// Developed by: Santosh Nagarakatte,
+//               Department of Computer Science,
+//               Rutgers University
+//               http://www.cs.rutgers.edu/~santosh.nagarakatte/softbound/
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal with the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+//   1. Redistributions of source code must retain the above copyright notice,
+//      this list of conditions and the following disclaimers.
+
+//   2. Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimers in the
+//      documentation and/or other materials provided with the distribution.
+
+//   3. Neither the names of Santosh Nagarakatte,
+//      Rutgers University, nor the names of its contributors may be
+//      used to endorse or promote products derived from this Software
+//      without specific prior written permission.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// WITH THE SOFTWARE.
+//===---------------------------------------------------------------------===//
+
+#include "llvm/Transforms/SoftBoundCETS/StripSBCETSIntrinsics.h"
+
+#include <set>
+
+static cl::opt<bool>
+softboundcets_inline_check_intrinsics
+("softboundcets_inline_check_intrinsics",
+ cl::desc("lower the check intrinsics to inline compare and branch instead of runtime calls"),
+ cl::init(false));
+
+char StripSBCETSIntrinsics::ID = 0;
+
+INITIALIZE_PASS(StripSBCETSIntrinsics, "StripSBCETSIntrinsics",
+                "Lower SoftBoundCETS check intrinsics", false, false)
+
+bool StripSBCETSIntrinsics::doInitialization(Module& module) {
+
+  m_spatial_load_dereference_check =
+    module.getFunction("__softboundcets_spatial_load_dereference_check");
+  m_spatial_store_dereference_check =
+    module.getFunction("__softboundcets_spatial_store_dereference_check");
+  m_temporal_load_dereference_check =
+    module.getFunction("__softboundcets_temporal_load_dereference_check");
+  m_temporal_store_dereference_check =
+    module.getFunction("__softboundcets_temporal_store_dereference_check");
+  m_abort_func = module.getFunction("__softboundcets_abort");
+  return false;
+}
+
+//
+// Method: isStoreCheck
+//
+// Description: This function returns true if memory is written
+// through the pointer returned by the check. The intrinsics do not
+// distinguish loads from stores, so that a load and a store of the
+// same location share a check, and the handler is chosen from the
+// accesses here.
+//
+
+bool StripSBCETSIntrinsics::isStoreCheck(IntrinsicInst* check) {
+
+  std::vector<Value*> worklist;
+  std::set<Value*> visited;
+  worklist.push_back(check);
+
+  while(!worklist.empty()){
+    Value* ptr = worklist.back();
+    worklist.pop_back();
+    if(visited.count(ptr))
+      continue;
+    visited.insert(ptr);
+
+    for(Value::user_iterator ui = ptr->user_begin(), ue = ptr->user_end();
+        ui != ue; ++ui){
+      User* user = *ui;
+
+      if(StoreInst* store_inst = dyn_cast<StoreInst>(user)){
+        if(store_inst->getPointerOperand() == ptr)
+          return true;
+        continue;
+      }
+
+      if(isa<AtomicCmpXchgInst>(user) || isa<AtomicRMWInst>(user)){
+        if(user->getOperand(0) == ptr)
+          return true;
+        continue;
+      }
+
+      // A temporal check of the spatially checked pointer
+      if(IntrinsicInst* intrinsic = dyn_cast<IntrinsicInst>(user)){
+        if(intrinsic->getIntrinsicID() == Intrinsic::sbcets_temporal_check &&
+           intrinsic->getArgOperand(0) == ptr)
+          worklist.push_back(intrinsic);
+        continue;
+      }
+
+      if(isa<BitCastInst>(user) || isa<GetElementPtrInst>(user) ||
+         isa<PHINode>(user) || isa<SelectInst>(user))
+        worklist.push_back(user);
+    }
+  }
+  return false;
+}
+
+//
+// Method: lowerToCall
+//
+// Description: This function replaces the check intrinsic with a call
+// to the runtime dereference check handler.
+//
+
+void StripSBCETSIntrinsics::lowerToCall(IntrinsicInst* check) {
+
+  bool is_store = isStoreCheck(check);
+  IRBuilder<> builder(check);
+  Function* handler = NULL;
+  SmallVector<Value*, 4> args;
+
+  if(check->getIntrinsicID() == Intrinsic::sbcets_spatial_check){
+    handler = is_store ? m_spatial_store_dereference_check :
+      m_spatial_load_dereference_check;
+    assert(handler && "spatial dereference check handler null?");
+
+    // base, bound, ptr, size
+    args.push_back(check->getArgOperand(1));
+    args.push_back(check->getArgOperand(2));
+    args.push_back(check->getArgOperand(0));
+    args.push_back(check->getArgOperand(3));
+  } else {
+    handler = is_store ? m_temporal_store_dereference_check :
+      m_temporal_load_dereference_check;
+    assert(handler && "temporal dereference check handler null?");
+
+    // lock, key and the base and bound that the handler does not use
+    // with spatial safety
+    args.push_back(check->getArgOperand(1));
+    args.push_back(check->getArgOperand(2));
+    if(handler->arg_size() == 4){
+      Type* void_ptr_type = check->getArgOperand(1)->getType();
+      args.push_back(Constant::getNullValue(void_ptr_type));
+      args.push_back(Constant::getNullValue(void_ptr_type));
+    }
+  }
+
+  FunctionType* handler_type = handler->getFunctionType();
+  assert(handler_type->getNumParams() == args.size() &&
+         "dereference check handler with unexpected arguments?");
+  for(unsigned i = 0; i < args.size(); ++i){
+    if(args[i]->getType() != handler_type->getParamType(i)){
+      args[i] = builder.CreateZExtOrTrunc(args[i],
+                                          handler_type->getParamType(i));
+    }
+  }
+
+  CallInst* call_inst = builder.CreateCall(handler, args);
+  call_inst->setDebugLoc(check->getDebugLoc());
+}
+
+//
+// Method: getAbortBlock
+//
+// Description: This function returns the cold block of the function
+// that calls __softboundcets_abort, created on first use.
+//
+
+BasicBlock*
+StripSBCETSIntrinsics::getAbortBlock(Function* func, BasicBlock* & abort_bb) {
+
+  if(abort_bb)
+    return abort_bb;
+
+  assert(m_abort_func && "__softboundcets_abort function null?");
+  abort_bb = BasicBlock::Create(func->getContext(),
+                                "softboundcets.abort", func);
+  CallInst* abort_call = CallInst::Create(m_abort_func, "", abort_bb);
+  abort_call->setDoesNotReturn();
+  abort_call->setDoesNotThrow();
+  new UnreachableInst(func->getContext(), abort_bb);
+  return abort_bb;
+}
+
+//
+// Method: lowerToCompare
+//
+// Description: This function replaces the check intrinsic with the
+// compare and a branch to the abort block on failure, as
+// SoftBoundCETSPass does with -softboundcets_inline_checks.
+//
+
+void StripSBCETSIntrinsics::lowerToCompare(IntrinsicInst* check,
+                                           BasicBlock* & abort_bb) {
+
+  Function* func = check->getParent()->getParent();
+  LLVMContext& context = func->getContext();
+  Type* int64_ty = Type::getInt64Ty(context);
+  IRBuilder<> builder(check);
+  Value* cond = NULL;
+
+  if(check->getIntrinsicID() == Intrinsic::sbcets_spatial_check){
+
+    // (ptr < base) || (ptr + size > bound)
+    Value* ptr = builder.CreatePtrToInt(check->getArgOperand(0), int64_ty,
+                                        "ptr.int");
+    Value* base = builder.CreatePtrToInt(check->getArgOperand(1), int64_ty,
+                                         "base.int");
+    Value* bound = builder.CreatePtrToInt(check->getArgOperand(2), int64_ty,
+                                          "bound.int");
+    Value* ptr_end = builder.CreateAdd(ptr, check->getArgOperand(3),
+                                       "ptr.end");
+    Value* below = builder.CreateICmpULT(ptr, base, "ptr.below");
+    Value* above = builder.CreateICmpUGT(ptr_end, bound, "ptr.above");
+    cond = builder.CreateOr(below, above, "spatial.fail");
+  } else {
+
+    // *lock != key, with the lock holding a size_t key
+    Value* key = check->getArgOperand(2);
+    Type* key_type = key->getType();
+    if(m_temporal_load_dereference_check){
+      key_type = m_temporal_load_dereference_check->getFunctionType()->
+        getParamType(1);
+      key = builder.CreateZExtOrTrunc(key, key_type);
+    }
+    Value* lock = builder.CreateBitCast(check->getArgOperand(1),
+                                        PointerType::getUnqual(key_type),
+                                        "lock.ptr");
+    Value* lock_value = builder.CreateLoad(lock, "lock.value");
+    cond = builder.CreateICmpNE(lock_value, key, "temporal.fail");
+  }
+
+  BasicBlock* bb = check->getParent();
+  BasicBlock* cont_bb = bb->splitBasicBlock(check, "softboundcets.cont");
+  TerminatorInst* old_br = bb->getTerminator();
+  BranchInst* br = BranchInst::Create(getAbortBlock(func, abort_bb), cont_bb,
+                                      cond, old_br);
+  br->setMetadata(LLVMContext::MD_prof,
+                  MDBuilder(context).createBranchWeights(1, 1 << 20));
+  br->setDebugLoc(check->getDebugLoc());
+  old_br->eraseFromParent();
+}
+
+//
+// Method: runOnFunction
+//
+// Description: This pass lowers the llvm.sbcets.spatial.check and
+// llvm.sbcets.temporal.check intrinsics introduced by SoftBoundCETSPass
+// with -softboundcets_chk_intrinsic. It runs after the passes that
+// merge and hoist the checks and before code generation, which cannot
+// handle the intrinsics. Each check becomes a call to the runtime
+// handler, or an inline compare and branch with
+// -softboundcets_inline_check_intrinsics, and the accesses use the
+// checked pointer again.
+//
+
+bool StripSBCETSIntrinsics::runOnFunction(Function& func) {
+
+  std::vector<IntrinsicInst*> checks;
+  for(inst_iterator i = inst_begin(func), e = inst_end(func); i != e; ++i){
+    IntrinsicInst* intrinsic = dyn_cast<IntrinsicInst>(&*i);
+    if(!intrinsic)
+      continue;
+
+    if(intrinsic->getIntrinsicID() == Intrinsic::sbcets_spatial_check ||
+       intrinsic->getIntrinsicID() == Intrinsic::sbcets_temporal_check)
+      checks.push_back(intrinsic);
+  }
+
+  if(checks.empty())
+    return false;
+
+  BasicBlock* abort_bb = NULL;
+  for(std::vector<IntrinsicInst*>::iterator i = checks.begin(),
+        e = checks.end(); i != e; ++i){
+
+    IntrinsicInst* check = *i;
+    if(softboundcets_inline_check_intrinsics)
+      lowerToCompare(check, abort_bb);
+    else
+      lowerToCall(check);
+  }
+
+  // isStoreCheck follows the uses through the later checks, so the
+  // pointers are put back once all the checks are lowered
+  for(std::vector<IntrinsicInst*>::iterator i = checks.begin(),
+        e = checks.end(); i != e; ++i){
+
+    IntrinsicInst* check = *i;
+    check->replaceAllUsesWith(check->getArgOperand(0));
+    check->eraseFromParent();
+  }
+  return true;
+}
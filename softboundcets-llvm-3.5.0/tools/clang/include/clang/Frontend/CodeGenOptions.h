@@ -93,6 +93,13 @@ public:
     SRCK_InRegs    // Small structs in registers (-freg-struct-return).
   };
 
+  enum SoftBoundCETSPlacementKind {
+    SBCETS_OptimizerLast,        // After the optimizer (-fsoftboundcets-ep=last).
+    SBCETS_ScalarOptimizerLate,  // Checks lowered before the vectorizers (scalar-late).
+    SBCETS_LoopOptimizerEnd,     // Checks lowered after the loop optimizer (loop-end).
+    SBCETS_ModuleOptimizerEarly  // Before inlining (module-early).
+  };
+
   /// The code model to use (-mcmodel).
   std::string CodeModel;
 
@@ -51,10 +51,14 @@
 #include "llvm/Transforms/SoftBoundCETS/SoftBoundCETSMPXPass.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/Transforms/SoftBoundCETS/SpatialCheck.h"
+#include "llvm/Transforms/SoftBoundCETS/ShadowStackOpt.h"
+#include "llvm/Transforms/SoftBoundCETS/StripSBCETSIntrinsics.h"
 
 using namespace clang;
 using namespace llvm;
 
+extern cl::opt<bool> chk_intrinsic;
+
 namespace {
 
 class EmitAssemblyHelper {
@@ -259,6 +263,35 @@ static void addSoftBoundCETSMPXPasses(const PassManagerBuilder &Builder,
   PM.add(new SpatialCheckOpt());
 }
 				  
+// scalar-late and loop-end are in the function pipeline that runs
+// interleaved with the inliner, where a module pass would end that
+// pipeline early.
+static bool isSoftBoundCETSFunctionPoint(const CodeGenOptions &CGOpts) {
+  return CGOpts.getSoftBoundCETSPlacement() == 
+    CodeGenOptions::SBCETS_ScalarOptimizerLate ||
+    CGOpts.getSoftBoundCETSPlacement() == 
+    CodeGenOptions::SBCETS_LoopOptimizerEnd;
+}
+
+static void addSoftBoundCETSCheckPasses(const PassManagerBuilder &Builder, 
+					PassManagerBase &PM) {
+
+  PM.add(new DominatorTreeWrapperPass());
+  PM.add(new SpatialCheckOpt());
+
+  // With -mllvm -softboundcets_chk_intrinsic the checks are
+  // intrinsics. Merge and hoist them before lowering them to the
+  // runtime handlers, which code generation needs at every level.
+  // Without it there are no intrinsics for these passes to merge.
+  if (Builder.OptLevel > 0 && chk_intrinsic) {
+    PM.add(createEarlyCSEPass());
+    PM.add(createGVNPass());
+    PM.add(createLICMPass());
+    PM.add(createCFGSimplificationPass());
+  }
+  PM.add(new StripSBCETSIntrinsics());
+}
+
 static void addSoftBoundCETSPasses(const PassManagerBuilder &Builder, 
 				   PassManagerBase &PM) {
   
@@ -271,8 +304,30 @@ static void addSoftBoundCETSPasses(const PassManagerBuilder &Builder,
   PM.add(new FixByValAttributesPass());
   PM.add(new InitializeSoftBoundCETS());
   PM.add(new SoftBoundCETSPass(CGOpts.SanitizerBlacklistFile));
-  PM.add(new DominatorTreeWrapperPass());
-  PM.add(new SpatialCheckOpt());
+  PM.add(new ShadowStackOpt());
+
+  // The rest of the pipeline, the inliner included, runs after
+  // module-early
+  if (Builder.OptLevel > 0 && isSoftBoundCETSFunctionPoint(CGOpts))
+    return;
+
+  addSoftBoundCETSCheckPasses(Builder, PM);
+
+  // The checks and metadata accesses are calls to always inline
+  // runtime helpers. When the runtime bitcode is linked into the
+  // module (-fsoftboundcets-rt-bitcode), inline them and clean up the
+  // inlined code. The inliner of the regular pipeline has already run
+  // at every extension point -fsoftboundcets-ep selects but
+  // module-early. Without the bitcode the helpers are external calls
+  // and there is nothing to inline.
+  if (Builder.OptLevel > 0 && !CGOpts.LinkBitcodeFile.empty()) {
+    PM.add(createAlwaysInlinerPass());
+    PM.add(createInstructionCombiningPass());
+    PM.add(createGVNPass());
+    PM.add(createLICMPass());
+    PM.add(createCFGSimplificationPass());
+    PM.add(createGlobalDCEPass());
+  }
 }
 
 
@@ -353,10 +408,36 @@ void EmitAssemblyHelper::CreatePasses() {
   }
 
   if (CodeGenOpts.SoftBoundCETS){
-    PMBuilder.addExtension(PassManagerBuilder::EP_OptimizerLast,
-			   addSoftBoundCETSPasses);
-    PMBuilder.addExtension(PassManagerBuilder::EP_EnabledOnOptLevel0,
+    // The instrumentation is a module pass and runs at last or
+    // module-early. At scalar-late and loop-end it runs at module-early
+    // and the function passes that optimize and lower the checks run
+    // at the selected point, after the regular function pipeline has
+    // optimized the inlined, instrumented code.
+    PassManagerBuilder::ExtensionPointTy SoftBoundCETSExtensionPoint =
+      PassManagerBuilder::EP_OptimizerLast;
+    switch (CodeGenOpts.getSoftBoundCETSPlacement()) {
+    case CodeGenOptions::SBCETS_OptimizerLast:
+      SoftBoundCETSExtensionPoint = PassManagerBuilder::EP_OptimizerLast;
+      break;
+    case CodeGenOptions::SBCETS_ScalarOptimizerLate:
+      PMBuilder.addExtension(PassManagerBuilder::EP_ScalarOptimizerLate,
+			     addSoftBoundCETSCheckPasses);
+      SoftBoundCETSExtensionPoint = PassManagerBuilder::EP_ModuleOptimizerEarly;
+      break;
+    case CodeGenOptions::SBCETS_LoopOptimizerEnd:
+      PMBuilder.addExtension(PassManagerBuilder::EP_LoopOptimizerEnd,
+			     addSoftBoundCETSCheckPasses);
+      SoftBoundCETSExtensionPoint = PassManagerBuilder::EP_ModuleOptimizerEarly;
+      break;
+    case CodeGenOptions::SBCETS_ModuleOptimizerEarly:
+      SoftBoundCETSExtensionPoint = PassManagerBuilder::EP_ModuleOptimizerEarly;
+      break;
+    }
+    PMBuilder.addExtension(SoftBoundCETSExtensionPoint,
 			   addSoftBoundCETSPasses);
+    if (CodeGenOpts.SoftBoundCETSAtO0)
+      PMBuilder.addExtension(PassManagerBuilder::EP_EnabledOnOptLevel0,
+			     addSoftBoundCETSPasses);
   }
 
   if (CodeGenOpts.SoftBoundMPX){
@@ -3620,6 +3620,16 @@ void Clang::ConstructJob(Compilation &C, const JobAction &JA,
 
   if(Args.getLastArg(options::OPT_fsoftboundcets)){
     CmdArgs.push_back("-fsoftboundcets");
+
+    // The runtime helpers are linked before the instrumentation, so
+    // the calls it inserts are inlined without LTO
+    if(Arg* A = Args.getLastArg(options::OPT_fsoftboundcets_rt_bitcode_EQ)){
+      CmdArgs.push_back("-mlink-bitcode-file");
+      CmdArgs.push_back(A->getValue());
+    }
+
+    Args.AddLastArg(CmdArgs, options::OPT_fsoftboundcets_ep_EQ);
+    Args.AddLastArg(CmdArgs, options::OPT_fno_softboundcets_O0);
   }
 
   if(Args.getLastArg(options::OPT_fsoftboundmpx)){
@@ -484,6 +484,20 @@ static bool ParseCodeGenArgs(CodeGenOptions &Opts, ArgList &Args, InputKind IK,
       Args.hasArg(OPT_fsanitize_undefined_trap_on_error);
 
   Opts.SoftBoundCETS = Args.hasArg(OPT_fsoftboundcets);
+  if (Arg *A = Args.getLastArg(OPT_fsoftboundcets_ep_EQ)) {
+    StringRef Val = A->getValue();
+    if (Val == "last")
+      Opts.setSoftBoundCETSPlacement(CodeGenOptions::SBCETS_OptimizerLast);
+    else if (Val == "scalar-late")
+      Opts.setSoftBoundCETSPlacement(CodeGenOptions::SBCETS_ScalarOptimizerLate);
+    else if (Val == "loop-end")
+      Opts.setSoftBoundCETSPlacement(CodeGenOptions::SBCETS_LoopOptimizerEnd);
+    else if (Val == "module-early")
+      Opts.setSoftBoundCETSPlacement(CodeGenOptions::SBCETS_ModuleOptimizerEarly);
+    else
+      Diags.Report(diag::err_drv_invalid_value) << A->getAsString(Args) << Val;
+  }
+  Opts.SoftBoundCETSAtO0 = !Args.hasArg(OPT_fno_softboundcets_O0);
   Opts.SoftBoundCETSMPX = Args.hasArg(OPT_fsoftboundcetsmpx);
   Opts.SoftBoundMPX = Args.hasArg(OPT_fsoftboundmpx);
 
@@ -1648,6 +1662,11 @@ static void ParsePreprocessorArgs(PreprocessorOptions &Opts, ArgList &Args,
     }
   }
 
+  // Lets code that registers memory with the SoftBoundCETS runtime
+  // (softboundcets-arena.h) build without it when not instrumented.
+  if (Args.hasArg(OPT_fsoftboundcets))
+    Opts.addMacroDef("__SOFTBOUNDCETS__");
+
   // Add macros from the command line.
   for (arg_iterator it = Args.filtered_begin(OPT_D, OPT_U),
          ie = Args.filtered_end(); it != ie; ++it) {
@@ -88,6 +88,7 @@ using namespace llvm;
 
 #include "llvm/Transforms/SoftBoundCETS/SpatialCheck.h"
 #include "llvm/Transforms/SoftBoundCETS/ShadowStackOpt.h"
+#include "llvm/Transforms/SoftBoundCETS/StripSBCETSIntrinsics.h"
 
 #include <memory>
 #include <algorithm>
@@ -204,7 +205,7 @@ main (int argc, char ** argv)
   bool normal_mode = true;
 
   if(XMMMode || YMMMode|| strip_intrinsic_mode 
-     || fix_byval_attributes || llvm_stat_counter || softboundmpx || softboundcetsmpx || shadowstackopt){
+     || fix_byval_attributes || llvm_stat_counter || softboundmpx || softboundcetsmpx){
     normal_mode = false;
   }
 
@@ -224,12 +225,8 @@ main (int argc, char ** argv)
     Passes.add(new InitializeSoftBoundCETS());
     Passes.add(new SoftBoundCETSPass());
     Passes.add(new SpatialCheckOpt());
-    //    Passes.add(new ShadowStackOpt());
-  }
-
-  if(shadowstackopt){
-
-    Passes.add(new ShadowStackOpt());
+    Passes.add(new ShadowStackOpt(shadowstackopt));
+    Passes.add(new StripSBCETSIntrinsics());
   }
 
   if (softboundmpx){
@@ -263,12 +260,12 @@ main (int argc, char ** argv)
     Passes.add(new SoftBoundCETSYMMPass());
   }
 
+#endif
+
   if(strip_intrinsic_mode){
     Passes.add(new StripSBCETSIntrinsics());
   }
 
-#endif
-
   if(fix_byval_attributes){
     Passes.add(new FixByValAttributesPass());
   }
@@ -0,0 +1,76 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include "timing.h"
+
+/* Measures the cost of calls that pass and return pointers, which
+ * SoftBoundCETS pays for with a shadow stack frame holding their
+ * metadata, or with extra arguments with -mllvm
+ * -softboundcets_shadow_stack_opt. See timing.h; the argument is the
+ * number of calls.
+ */
+
+struct node {
+  struct node* next;
+  long value;
+};
+
+/* one pointer argument, returns a pointer */
+__attribute__((noinline))
+static struct node* advance(struct node* node){
+
+  return node->next;
+}
+
+/* three pointer arguments */
+__attribute__((noinline))
+static long combine(struct node* a, struct node* b, long* total){
+
+  *total += a->value - b->value;
+  return *total;
+}
+
+/* calls the others, so it also pushes frames from inside a frame */
+__attribute__((noinline))
+static struct node* step(struct node* node, long* total){
+
+  struct node* next = advance(node);
+  combine(node, next, total);
+  return next;
+}
+
+int main(int argc, char** argv){
+
+  size_t calls = 100000000;
+  size_t i;
+
+  if(argc > 1)
+    calls = strtoul(argv[1], NULL, 10);
+
+  struct node* ring = malloc(16 * sizeof(struct node));
+  if(ring == NULL){
+    printf("malloc failed\n");
+    return 1;
+  }
+
+  for(i = 0; i < 16; i++){
+    ring[i].next = &ring[(i + 1) % 16];
+    ring[i].value = (long) i;
+  }
+
+  struct timespec start, end;
+  struct node* node = ring;
+  long total = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(i = 0; i < calls; i++){
+    node = step(node, &total);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  /* step makes three calls */
+  printf("%.2f ns per call (%ld)\n",
+         elapsed(&start, &end) * 1e9 / (3 * (double) calls), total);
+
+  free(ring);
+  return 0;
+}
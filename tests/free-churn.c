@@ -0,0 +1,64 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include "timing.h"
+
+/* Keeps a working set of live objects and replaces random ones for a
+ * number of rounds, printing the cost of a malloc/free pair in each
+ * round. The runtime finds the free map entry of an object from its
+ * lock location, so the cost should stay flat across rounds instead
+ * of growing as a probed table fills up with freed entries. See
+ * timing.h; the arguments are the live objects, the rounds and the
+ * replacements per round.
+ */
+
+int main(int argc, char** argv){
+
+  size_t live = 100000;
+  size_t rounds = 20;
+  size_t replacements = 2000000;
+  size_t i, round;
+
+  if(argc > 1)
+    live = strtoul(argv[1], NULL, 10);
+  if(argc > 2)
+    rounds = strtoul(argv[2], NULL, 10);
+  if(argc > 3)
+    replacements = strtoul(argv[3], NULL, 10);
+
+  char** objects = malloc(live * sizeof(char*));
+  if(objects == NULL){
+    printf("malloc failed\n");
+    return 1;
+  }
+
+  for(i = 0; i < live; i++){
+    objects[i] = malloc(16 + (i % 64));
+    objects[i][0] = 0;
+  }
+
+  size_t result = 0;
+  for(round = 0; round < rounds; round++){
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(i = 0; i < replacements; i++){
+      size_t index = (size_t) rand() % live;
+      free(objects[index]);
+      objects[index] = malloc(16 + (i % 64));
+      objects[index][0] = (char) i;
+      result += objects[(i * 7) % live][0];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("round %zu: %.1f ns per malloc/free pair\n", round,
+           elapsed(&start, &end) * 1e9 / replacements);
+  }
+
+  for(i = 0; i < live; i++){
+    free(objects[i]);
+  }
+  free(objects);
+
+  printf("done (%zu)\n", result);
+  return 0;
+}
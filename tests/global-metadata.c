@@ -0,0 +1,55 @@
+#include<stdio.h>
+#include<stdlib.h>
+
+/* A global table initialized with 2^20 pointers, like the generated
+ * dispatch and string tables of large programs. SoftBoundCETS sets up
+ * the metadata of these pointers before main, so the run time of the
+ * program is mostly that startup cost. Build it as in timing.h, with
+ * and without -mllvm -softboundcets_static_global_metadata=0, and time
+ * the compiles and the runs to compare the metadata installed from
+ * the table the instrumentation emits with a metadata store per
+ * pointer in the global init function. The program reads through some
+ * of the pointers, which fails the bounds checks if their metadata was
+ * not set up.
+ */
+
+static char names[16][16] = {
+  "zero", "one", "two", "three", "four", "five", "six", "seven",
+  "eight", "nine", "ten", "eleven", "twelve", "thirteen", "fourteen",
+  "fifteen"
+};
+
+#define ROW(i) names[i], names[(i) ^ 1], names[(i) ^ 2], names[(i) ^ 3], \
+    names[(i) ^ 4], names[(i) ^ 5], names[(i) ^ 6], names[(i) ^ 7],     \
+    names[(i) ^ 8], names[(i) ^ 9], names[(i) ^ 10], names[(i) ^ 11],   \
+    names[(i) ^ 12], names[(i) ^ 13], names[(i) ^ 14], names[(i) ^ 15]
+#define X16(x) ROW(0), ROW(1), ROW(2), ROW(3), ROW(4), ROW(5), ROW(6), \
+    ROW(7), ROW(8), ROW(9), ROW(10), ROW(11), ROW(12), ROW(13),       \
+    ROW(14), ROW(15)
+#define X256 X16(0)
+#define X4K X256, X256, X256, X256, X256, X256, X256, X256, \
+    X256, X256, X256, X256, X256, X256, X256, X256
+#define X64K X4K, X4K, X4K, X4K, X4K, X4K, X4K, X4K, \
+    X4K, X4K, X4K, X4K, X4K, X4K, X4K, X4K
+#define X1M X64K, X64K, X64K, X64K, X64K, X64K, X64K, X64K, \
+    X64K, X64K, X64K, X64K, X64K, X64K, X64K, X64K
+
+char* table[] = { X1M };
+
+int main(int argc, char** argv){
+
+  size_t n = sizeof(table) / sizeof(table[0]);
+  size_t stride = 4099;
+  size_t i;
+  long sum = 0;
+
+  if(argc > 1)
+    stride = strtoul(argv[1], NULL, 10);
+
+  for(i = 0; i < n; i += stride){
+    sum += table[i][0];
+  }
+
+  printf("%zu pointers, %ld\n", n, sum);
+  return 0;
+}
@@ -0,0 +1,24 @@
+#include<stdio.h>
+
+/* Reads through pointers a global initializer sets up. Passes with
+ * SoftBoundCETS when their metadata is installed before main. */
+
+static char first[4] = "abc";
+static char second[8] = "defghij";
+static int numbers[4] = {1, 2, 3, 4};
+
+struct entry {
+  char* name;
+  int* value;
+};
+
+static struct entry table[2] = {{first, &numbers[0]}, {second, &numbers[3]}};
+static char* names[3] = {first, second, second + 4};
+
+int main(){
+
+  int sum = table[0].value[0] + table[1].value[0];
+
+  printf("%c%c%s %d\n", table[0].name[2], table[1].name[6], names[2], sum);
+  return 0;
+}
@@ -0,0 +1,81 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include "timing.h"
+
+/* Looks up keys in a sparse chained hash table. Most lookups load an
+ * empty bucket and only compare the loaded pointer against NULL, so
+ * with lazy metadata loads they do not read its metadata, which is
+ * needed only on the path that walks the chain. Compare it with
+ * -mllvm -softboundcets_lazy_metadata_loads=0. See timing.h; the
+ * arguments are the entries and the lookups.
+ */
+
+struct entry {
+  struct entry* next;
+  size_t key;
+  size_t value;
+};
+
+__attribute__((noinline))
+static size_t lookup(struct entry** buckets, size_t num_buckets, size_t key){
+
+  struct entry* entry = buckets[key % num_buckets];
+  if(entry == NULL)
+    return 0;
+
+  if(entry->key == key)
+    return entry->value;
+
+  for(entry = entry->next; entry != NULL; entry = entry->next){
+    if(entry->key == key)
+      return entry->value;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv){
+
+  size_t entries = 1000000;
+  size_t lookups = 20000000;
+  size_t i;
+
+  if(argc > 1)
+    entries = strtoul(argv[1], NULL, 10);
+  if(argc > 2)
+    lookups = strtoul(argv[2], NULL, 10);
+
+  size_t num_buckets = 4 * entries + 1;
+  struct entry** buckets = calloc(num_buckets, sizeof(struct entry*));
+  struct entry* pool = malloc(entries * sizeof(struct entry));
+  if(buckets == NULL || pool == NULL){
+    printf("malloc failed\n");
+    return 1;
+  }
+
+  for(i = 0; i < entries; i++){
+    size_t key = i * 2654435761u;
+    pool[i].key = key;
+    pool[i].value = i;
+    pool[i].next = buckets[key % num_buckets];
+    buckets[key % num_buckets] = &pool[i];
+  }
+
+  struct timespec start, end;
+  size_t found = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(i = 0; i < lookups; i++){
+    /* every other key misses */
+    size_t j = i % (2 * entries);
+    size_t key = (j / 2) * 2654435761u + (j & 1);
+    found += lookup(buckets, num_buckets, key);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("%.1f ns per lookup (%zu)\n",
+         elapsed(&start, &end) * 1e9 / lookups, found);
+
+  free(pool);
+  free(buckets);
+  return 0;
+}
@@ -0,0 +1,9 @@
+#include <stdlib.h>
+
+/* Frees a pointer into the middle of an object. Aborts with
+ * SoftBoundCETS. */
+
+int main() {
+  char *x = malloc(20);
+  free(x + 4);
+}
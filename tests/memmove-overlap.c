@@ -0,0 +1,27 @@
+#include<stdlib.h>
+#include<string.h>
+
+/* Shifts an array of pointers by one slot with an overlapping memmove
+ * in both directions. Passes with SoftBoundCETS when the metadata moves
+ * with the pointers; an access through a pointer with the metadata of
+ * its neighbour aborts.
+ */
+
+int main(){
+
+  char* ptrs[8];
+  int i;
+
+  for(i = 0; i < 8; i++)
+    ptrs[i] = malloc(i + 1);
+
+  memmove(&ptrs[1], &ptrs[0], 7 * sizeof(char*));
+  for(i = 1; i < 8; i++)
+    ptrs[i][i - 1] = 'a';
+
+  memmove(&ptrs[0], &ptrs[1], 7 * sizeof(char*));
+  for(i = 0; i < 7; i++)
+    ptrs[i][i] = 'b';
+
+  return 0;
+}
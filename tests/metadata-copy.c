@@ -0,0 +1,77 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include "timing.h"
+
+/* Measures memcpy and memmove of arrays of pointers, for which
+ * SoftBoundCETS also copies the metadata of every pointer with
+ * __softboundcets_copy_metadata, at 64 B, 4 KB and 64 MB. The memmove
+ * shifts the array by one pointer, so its metadata copy overlaps.
+ * See timing.h; the argument is the number of bytes copied per size.
+ */
+
+__attribute__((noinline))
+static void copy(void** dest, void** from, size_t size){
+
+  memcpy(dest, from, size);
+}
+
+__attribute__((noinline))
+static void move(void** dest, void** from, size_t size){
+
+  memmove(dest, from, size);
+}
+
+int main(int argc, char** argv){
+
+  size_t sizes[] = { 64, 4096, (size_t) 64 * 1024 * 1024 };
+  size_t total = (size_t) 4 * 1024 * 1024 * 1024;
+  size_t s, i;
+
+  if(argc > 1)
+    total = strtoul(argv[1], NULL, 10);
+
+  size_t max_size = sizes[2];
+  size_t n_pointers = max_size / sizeof(void*);
+  void** from = malloc(max_size + sizeof(void*));
+  void** dest = malloc(max_size);
+  if(from == NULL || dest == NULL){
+    printf("malloc failed\n");
+    return 1;
+  }
+
+  for(i = 0; i <= n_pointers; i++){
+    from[i] = &from[i];
+  }
+
+  for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+    size_t size = sizes[s];
+    size_t iterations = total / size;
+    struct timespec start, end;
+
+    if(iterations == 0)
+      iterations = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < iterations; i++){
+      copy(dest, from, size);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double copy_time = elapsed(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < iterations; i++){
+      move(&from[i & 1], &from[(i + 1) & 1], size);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double move_time = elapsed(&start, &end);
+
+    printf("%10zu bytes: memcpy %.2f GB/s, overlapping memmove %.2f GB/s (%p)\n",
+           size, (double) (size * iterations) / copy_time / 1e9,
+           (double) (size * iterations) / move_time / 1e9, dest[size / sizeof(void*) - 1]);
+  }
+
+  free(from);
+  free(dest);
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include "timing.h"
+
+/* Sorts records that contain a pointer, with glibc qsort or, with
+ * -fsoftboundcets, the runtime's qsort wrapper, which also moves the
+ * metadata of the pointers. See timing.h; the argument is the number
+ * of records.
+ */
+
+struct record {
+  long key;
+  char* name;
+};
+
+static int compare_records(const void* a, const void* b){
+
+  long key_a = ((const struct record*) a)->key;
+  long key_b = ((const struct record*) b)->key;
+
+  if(key_a < key_b)
+    return -1;
+  return key_a > key_b;
+}
+
+int main(int argc, char** argv){
+
+  size_t num = 1000000;
+  size_t i;
+  char names[16];
+
+  if(argc > 1){
+    num = strtoul(argv[1], NULL, 10);
+  }
+
+  struct record* records = malloc(num * sizeof(struct record));
+  if(records == NULL){
+    printf("malloc failed\n");
+    return 1;
+  }
+
+  for(i = 0; i < 16; i++){
+    names[i] = (char) i;
+  }
+
+  for(i = 0; i < num; i++){
+    records[i].key = rand();
+    records[i].name = &names[i % 16];
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  qsort(records, num, sizeof(struct record), compare_records);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for(i = 1; i < num; i++){
+    if(records[i-1].key > records[i].key){
+      printf("records not sorted at %zu\n", i);
+      return 1;
+    }
+  }
+
+  /* dereferences the moved pointers, which checks their metadata */
+  size_t result = 0;
+  for(i = 0; i < num; i++){
+    result += *records[i].name;
+  }
+
+  printf("sorted %zu records in %.3f seconds (%zu)\n", num,
+         elapsed(&start, &end), result);
+
+  free(records);
+  return 0;
+}
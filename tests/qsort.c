@@ -0,0 +1,44 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+/* qsort moves records that contain pointers. Passes with SoftBoundCETS
+ * when the records are sorted and their pointers still carry their
+ * metadata; exits with 1 when the order is wrong.
+ */
+
+struct record {
+  long key;
+  char* name;
+};
+
+static int compare_records(const void* a, const void* b){
+
+  long key_a = ((const struct record*) a)->key;
+  long key_b = ((const struct record*) b)->key;
+
+  if(key_a < key_b)
+    return -1;
+  return key_a > key_b;
+}
+
+int main(){
+
+  struct record records[100];
+  size_t i;
+
+  for(i = 0; i < 100; i++){
+    records[i].key = (long)((i * 37) % 100);
+    records[i].name = malloc(8);
+    snprintf(records[i].name, 8, "%ld", records[i].key);
+  }
+
+  qsort(records, 100, sizeof(struct record), compare_records);
+
+  for(i = 0; i < 100; i++){
+    if(records[i].key != (long) i || atol(records[i].name) != (long) i)
+      return 1;
+    free(records[i].name);
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+/* The shadow stack optimization passes the metadata of pick and
+ * advance as arguments at the direct calls. The calls through the
+ * function pointers go through the thunks that keep the shadow stack
+ * convention, and pick stays visible outside the module. The metadata
+ * of the returned pointers has to be right on both paths. With an
+ * argument, the program reads past the small object through a pointer
+ * returned by a thunk and aborts with SoftBoundCETS.
+ */
+
+__attribute__((noinline))
+char* pick(char* a, char* b, int first){
+
+  return first ? a : b;
+}
+
+__attribute__((noinline))
+static char* advance(char* p, int n){
+
+  return p + n;
+}
+
+char* (*volatile pick_ptr)(char*, char*, int) = pick;
+
+int main(int argc, char** argv){
+
+  char* (*volatile advance_ptr)(char*, int) = advance;
+  char* small = malloc(2);
+  char* large = malloc(32);
+  char* p;
+  char* q;
+
+  memset(small, 's', 2);
+  memset(large, 'l', 32);
+
+  p = advance(pick(small, large, 0), 31);
+  q = advance_ptr(pick_ptr(small, large, 0), 31);
+  printf("%c %c\n", *p, *q);
+
+  p = pick(small, large, 1);
+  q = pick_ptr(small, large, 1);
+  printf("%c %c\n", p[1], q[1]);
+
+  if(argc > 1){
+    q = advance_ptr(pick_ptr(small, large, 1), 2);
+    printf("%c\n", *q);
+  }
+
+  free(large);
+  free(small);
+  return 0;
+}
@@ -0,0 +1,52 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+/* A generic swap copies the objects through a char array, which keeps
+ * the pointers in them. The metadata of the pointers moves with them
+ * through the fixed size and the variable length temporary. The
+ * program passes its checks when compiled with -fsoftboundcets. The
+ * size is read from a volatile so that the optimizer, which runs
+ * before the instrumentation by default, keeps the memcopies.
+ */
+
+static volatile size_t ptr_size = sizeof(char*);
+
+static void swap(void* a, void* b, size_t size){
+
+  char tmp[64];
+
+  memcpy(tmp, a, size);
+  memcpy(a, b, size);
+  memcpy(b, tmp, size);
+}
+
+static void swap_vla(void* a, void* b, size_t size){
+
+  char tmp[size];
+
+  memcpy(tmp, a, size);
+  memcpy(a, b, size);
+  memcpy(b, tmp, size);
+}
+
+int main(int argc, char** argv){
+
+  char* small = malloc(2);
+  char* large = malloc(32);
+  char* p = small;
+  char* q = large;
+
+  memset(small, 's', 2);
+  memset(large, 'l', 32);
+
+  swap(&p, &q, ptr_size);
+  printf("%c %c\n", p[31], q[1]);
+
+  swap_vla(&p, &q, ptr_size);
+  printf("%c %c\n", p[1], q[31]);
+
+  free(large);
+  free(small);
+  return 0;
+}
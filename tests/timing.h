@@ -0,0 +1,25 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include<time.h>
+
+/* Timing for the benchmarks in this directory, which print their own
+ * cost per operation. Build a benchmark X.c without and with
+ * SoftBoundCETS and compare the two, or compare runtimes built before
+ * and after a change:
+ *
+ *   clang -O2 X.c -o X
+ *   clang -O2 -fsoftboundcets X.c -o X-sbcets -L<git_repo>/softboundcets-lib -lm -lrt -lsoftboundcets_rt
+ *   ./X-sbcets [arguments]
+ *
+ * The -mllvm options a benchmark mentions are added to the second
+ * command.
+ */
+
+static double elapsed(struct timespec* start, struct timespec* end){
+
+  return (double)(end->tv_sec - start->tv_sec) +
+    (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+#endif
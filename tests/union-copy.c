@@ -0,0 +1,52 @@
+#include<stdio.h>
+#include<stdlib.h>
+
+/* Assigning a union that holds a pointer copies its metadata. clang
+ * lowers these unions to { i64 } and { double }, so their types do
+ * not show the pointer. The program passes its checks when compiled
+ * with -fsoftboundcets.
+ */
+
+union number_or_name {
+  long number;
+  char* name;
+};
+
+union real_or_name {
+  double real;
+  char* name;
+};
+
+struct tagged {
+  int tag;
+  union real_or_name value;
+};
+
+int main(int argc, char** argv){
+
+  char* name = malloc(16);
+  union number_or_name a, b;
+  union real_or_name c, d;
+  struct tagged* e = malloc(sizeof(struct tagged));
+  struct tagged* f = malloc(sizeof(struct tagged));
+
+  name[0] = 'x';
+  name[1] = '\0';
+
+  a.name = name;
+  b = a;
+
+  c.name = name;
+  d = c;
+
+  e->tag = 1;
+  e->value.name = name;
+  *f = *e;
+
+  printf("%s %s %s\n", b.name, d.name, f->value.name);
+
+  free(f);
+  free(e);
+  free(name);
+  return 0;
+}